@@ -46,12 +46,17 @@
 #include <grp.h>
 #include <ftw.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "acltool.h"
 #include "range.h"
+#include "ident.h"
+#include "snapshot.h"
 
 
-static size_t w_c = 0;
+/* One line per object styles - no blank line between the objects */
+#define ACLCMD_ONE_LINE_STYLE(s) ((s) == GACL_STYLE_JSON || (s) == GACL_STYLE_FINGERPRINT)
+
 
 
 int
@@ -60,7 +65,7 @@ _acl_filter_file(gacl_t ap) {
   int i;
   
 
-  for (i = 0; gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+  for (i = 0; _gacl_get_entry(ap, i, &ae) == 1; i++) {
     gacl_flagset_t fs;
     int fi;
 
@@ -250,37 +255,34 @@ walker_find(const char *path,
 	    size_t level,
 	    void *vp) {
   gacl_t ap, map = (gacl_t) vp;
-  int i, j, rc;
-  gacl_entry_t ae, mae;
+  int rc;
 
 
+  /* Verbose output shows the owner - resolve it while the ACL is read */
+  if (config.f_verbose)
+    prefetch_acl_ids(NULL, sp);
+  
   rc = get_acl(path, sp, &ap);
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
   if (rc == 0)
     return 0;
 
-  for (i = 0; gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
-    for (j = 0; gacl_get_entry(map, j == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &mae) == 1; j++) {
-      int rc;
-      
-      rc = gacl_entry_match(ae, mae);
-      if (rc < 0)
-	return -1;
+  rc = gacl_match_any_np(ap, map, 0);
+  if (rc < 0) {
+    gacl_free(ap);
+    return -1;
+  }
 
-      if (rc > 0) {
-	/* Found a match */
-	if (config.f_verbose)
-	  print_acl(stdout, ap, path, sp);
-	else
-	  puts(path);
-	
-	w_c++;
-	return 0;
-      }
-    }
+  if (rc > 0) {
+    /* Found a match */
+    if (config.f_verbose)
+      print_acl(stdout, ap, path, sp);
+    else
+      aclcmd_puts(stdout, path);
   }
 
+  gacl_free(ap);
   return 0;
 }
 
@@ -292,36 +294,390 @@ walker_print(const char *path,
 	     void *vp) {
   gacl_t ap = NULL;
   FILE *fp;
-  int *np = (int *) vp;
   int rc;
   
   
   fp = stdout;
 
+  /* Resolve the owner while the ACL is read */
+  prefetch_acl_ids(NULL, sp);
+  
   rc = get_acl(path, sp, &ap);
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
+  if (ap)
+    prefetch_acl_ids(ap, NULL);
 
-  if (np && ++*np > 1)
-    putchar('\n');
+  /* JSON & fingerprint output is one object per line, without separators */
+  if (aclcmd_index() > 0 && !ACLCMD_ONE_LINE_STYLE(config.f_style))
+    aclcmd_write(fp, "\n", 1);
   
   print_acl(fp, ap, path, sp);
 
   if (ap)
     gacl_free(ap);
   
-  ++w_c;
+  return 0;
+}
+
+
+
+/*
+ * Queries against a dump-access snapshot instead of the live filesystem.
+ *
+ * The snapshot is memory mapped and its file records are scanned in the
+ * order they were written. Every distinct ACL is rebuilt (and, for
+ * find-access, matched) at most once - the result is cached by ACL id
+ * and reused for all the files that share it. who-access uses the
+ * snapshot index to go from the principal to its ACLs and from there
+ * to the file blocks to decode.
+ */
+static char *snapshot_input = NULL;
+
+
+/*
+ * dump-access stores the paths below absolute, cleaned roots and queries
+ * clean their path arguments the same way, so "dir", "./dir/" and
+ * "/cwd/dir" all select the same records.
+ */
+static char *
+snapshot_path(const char *path,
+	      char *buf,
+	      size_t bufsize) {
+  char *sp, *dp;
+
+  
+  if (!vfs_fullpath(path, buf, bufsize))
+    return NULL;
+
+  /* Squeeze "//" (but not the one in "smb://") */
+  if ((sp = strstr(buf, "://")) != NULL)
+    sp = dp = sp+3;
+  else
+    sp = dp = buf;
+  while (*sp) {
+    if (*sp == '/' && dp > buf && dp[-1] == '/')
+      ++sp;
+    else
+      *dp++ = *sp++;
+  }
+  *dp = '\0';
+
+  /* No trailing '/', except for the root itself */
+  while (dp > buf+1 && dp[-1] == '/')
+    *--dp = '\0';
+  if (!*buf && bufsize > 1)
+    s_cpy(buf, bufsize, "/");
+  
+  return buf;
+}
+
+
+/* A NULL terminated copy of the arguments, cleaned by snapshot_path() */
+static char **
+snapshot_paths(int argc,
+	       char **argv) {
+  char buf[PATH_MAX+1], **rv;
+  int i;
+
+
+  rv = calloc(argc+1, sizeof(char *));
+  if (!rv)
+    return NULL;
+
+  for (i = 0; i < argc; i++) {
+    if (!snapshot_path(argv[i], buf, sizeof(buf)) ||
+	(rv[i] = s_dup(buf)) == NULL) {
+      argv_destroy(rv);
+      return NULL;
+    }
+  }
   
+  return rv;
+}
+
+
+static OPTION snapshot_options[] =
+  {
+   { "snapshot", 0, OPTS_TYPE_STR, NULL, &snapshot_input, "Read ACLs from a dump-access snapshot" },
+   { NULL, 0, 0, NULL, NULL, NULL },
+  };
+
+
+typedef struct {
+  SNAPSHOT *snap;
+  int argc;
+  char **argv;         /* Cleaned roots */
+  size_t *rlen;
+  unsigned char *found; /* Roots that matched a record */
+  long maxlevel;
+  gacl_t map;          /* find-access pattern */
+  gacl_t *acls;        /* Rebuilt ACLs, by id */
+  signed char *hits;   /* Match result by id (-1 = not tested yet), NULL for list-access */
+  unsigned long n;
+} SNAPQUERY;
+
+
+/* Check if a path is one of the given roots (or below one, within the max depth) */
+static int
+snapshot_selected(SNAPQUERY *qp,
+		  const char *path) {
+  const char *cp;
+  long level;
+  size_t rl;
+  int i, sel = 0;
+
+
+  if (qp->argc == 0)
+    return 1;
+  
+  /* Check all the roots, so overlapping ones all get marked as found */
+  for (i = 0; i < qp->argc; i++) {
+    rl = qp->rlen[i];
+    if (strncmp(path, qp->argv[i], rl) != 0)
+      continue;
+
+    cp = path+rl;
+    if (*cp == '/')
+      ++cp;
+    else if (*cp && qp->argv[i][rl-1] != '/')
+      continue;
+
+    qp->found[i] = 1;
+    if (sel)
+      continue;
+    
+    if (qp->maxlevel < 0 || !*cp) {
+      sel = 1;
+      continue;
+    }
+    
+    for (level = 1; *cp; ++cp)
+      if (*cp == '/')
+	++level;
+    if (level <= qp->maxlevel)
+      sel = 1;
+  }
+
+  return sel;
+}
+
+
+/* Just mark the roots that are in the snapshot */
+static int
+snapshot_find_roots(const SNAPSHOT_FILE *fp,
+		    void *vp) {
+  snapshot_selected((SNAPQUERY *) vp, fp->path);
   return 0;
 }
 
 
+static int
+snapshot_query_file(const SNAPSHOT_FILE *fp,
+		    void *vp) {
+  SNAPQUERY *qp = (SNAPQUERY *) vp;
+  gacl_t ap = NULL;
+  struct stat sb;
+  int rc;
+
+  
+  if (!snapshot_selected(qp, fp->path))
+    return 0;
+
+  if (config.f_filetype && !(fp->mode & config.f_filetype))
+    return 0;
+
+  if (fp->acl != SNAPSHOT_NOACL) {
+    /* Only rebuild the ACL if it is going to be used */
+    if (!qp->hits || qp->hits[fp->acl] != 0) {
+      ap = qp->acls[fp->acl];
+      if (!ap) {
+	ap = qp->acls[fp->acl] = snapshot_get_acl(qp->snap, fp->acl);
+	if (!ap)
+	  return error(1, errno, "%s: Reading ACL #%u from snapshot", fp->path, fp->acl);
+      }
+    }
+    
+    if (qp->hits && qp->hits[fp->acl] < 0) {
+      rc = gacl_match_any_np(ap, qp->map, 0);
+      if (rc < 0)
+	return error(1, errno, "%s: Matching ACL", fp->path);
+      qp->hits[fp->acl] = (rc > 0);
+    }
+  }
+  
+  if (qp->hits && (!ap || !qp->hits[fp->acl]))
+    return 0;
+  
+  memset(&sb, 0, sizeof(sb));
+  sb.st_ino = fp->ino;
+  sb.st_uid = fp->uid;
+  sb.st_gid = fp->gid;
+  sb.st_mode = fp->mode;
+  sb.st_ctime = fp->ctime;
+
+  if (!qp->hits) {
+    /* Same output as walker_print */
+    if (qp->n++ > 0 && !ACLCMD_ONE_LINE_STYLE(config.f_style))
+      aclcmd_write(stdout, "\n", 1);
+    print_acl(stdout, ap, fp->path, &sb);
+  } else if (config.f_verbose)
+    print_acl(stdout, ap, fp->path, &sb);
+  else
+    aclcmd_puts(stdout, fp->path);
+
+  return 0;
+}
+
+
+/* Check if a principal is the one looked for */
+static int
+who_match(const GACL_TAG *wp,
+	  GACL_TAG_TYPE type,
+	  uid_t ugid,
+	  const char *name) {
+  switch (wp->type) {
+  case GACL_TAG_TYPE_USER_OBJ:
+  case GACL_TAG_TYPE_GROUP_OBJ:
+  case GACL_TAG_TYPE_EVERYONE:
+    return type == wp->type;
+
+  case GACL_TAG_TYPE_UNKNOWN:
+    /* Unknown name or id - could be either */
+    if (type != GACL_TAG_TYPE_USER && type != GACL_TAG_TYPE_GROUP)
+      return 0;
+    break;
+
+  default:
+    if (type != wp->type)
+      return 0;
+  }
+
+  if (wp->ugid != (uid_t) -1)
+    return ugid == wp->ugid;
+  
+  return strcmp(name, wp->name) == 0;
+}
+
+
+/* List-access if 'map' and 'who' are NULL, else find-access or who-access */
+static int
+snapshot_query(int argc,
+	       char **argv,
+	       gacl_t map,
+	       GACL_TAG *who) {
+  char path[PATH_MAX+1];
+  SNAPSHOT_PRINCIPAL p;
+  jmp_buf saved_env;
+  SNAPQUERY q;
+  uint32_t i;
+  int rc;
+  
+
+  /* Take over the option value so it does not stick to the next command */
+  rc = s_cpy(path, sizeof(path), snapshot_input);
+  free(snapshot_input);
+  snapshot_input = NULL;
+  if (rc < 0)
+    return error(1, errno, "Invalid snapshot file");
+  
+  memset(&q, 0, sizeof(q));
+  q.argc = argc;
+  q.map = map;
+  q.maxlevel = config.f_recurse ? -1 : config.max_depth;
+  
+  q.snap = snapshot_open(path);
+  if (!q.snap)
+    return error(1, errno, "%s: Opening snapshot", path);
+
+  q.argv = snapshot_paths(argc, argv);
+  q.rlen = calloc(argc+1, sizeof(size_t));
+  q.found = calloc(argc+1, 1);
+  q.acls = calloc(q.snap->ac+1, sizeof(gacl_t));
+  if (map || who)
+    q.hits = malloc(q.snap->ac+1);
+  if (!q.argv || !q.rlen || !q.found || !q.acls || ((map || who) && !q.hits)) {
+    rc = errno;
+    goto End;
+  }
+  
+  if (who) {
+    /* Principal -> ACLs, via the index (if there is one) */
+    memset(q.hits, 0, q.snap->ac+1);
+    for (i = 0; i < q.snap->pc; i++) {
+      if (snapshot_get_principal(q.snap, i, &p) < 0 ||
+	  (who_match(who, p.type, (uid_t) p.ugid, p.name) &&
+	   snapshot_principal_acls(q.snap, i, (unsigned char *) q.hits) < 0)) {
+	rc = errno;
+	goto End;
+      }
+    }
+  } else if (q.hits)
+    memset(q.hits, -1, q.snap->ac+1);
+
+  for (i = 0; i < (uint32_t) argc; i++)
+    q.rlen[i] = strlen(q.argv[i]);
+  
+  rc = error_catch(saved_env);
+  if (rc) {
+    /* The file handler bailed out via error() - clean up and pass it on */
+    for (i = 0; i < q.snap->ac; i++)
+      if (q.acls[i])
+	gacl_free(q.acls[i]);
+    free(q.acls);
+    free(q.hits);
+    free(q.found);
+    free(q.rlen);
+    argv_destroy(q.argv);
+    snapshot_close(q.snap);
+    memcpy(error_env, saved_env, sizeof(jmp_buf));
+    longjmp(error_env, rc);
+  }
+  
+  if (who)
+    rc = snapshot_foreach_file_in(q.snap, (unsigned char *) q.hits, snapshot_query_file, &q);
+  else
+    rc = snapshot_foreach_file(q.snap, snapshot_query_file, &q);
+
+  /* who-access only visited the files of the matching ACLs */
+  if (rc == 0 && who && argc > 0 && memchr(q.found, 0, argc))
+    rc = snapshot_foreach_file(q.snap, snapshot_find_roots, &q);
+  
+  rc = (rc < 0) ? errno : 0;
+  memcpy(error_env, saved_env, sizeof(jmp_buf));
+
+ End:
+  if (q.acls) {
+    for (i = 0; i < q.snap->ac; i++)
+      if (q.acls[i])
+	gacl_free(q.acls[i]);
+    free(q.acls);
+  }
+  free(q.hits);
+  free(q.rlen);
+  argv_destroy(q.argv);
+  snapshot_close(q.snap);
+
+  /* A root without any record fails like a walk of a path that does not exist */
+  for (i = 0; rc == 0 && i < (uint32_t) argc && q.found[i]; i++)
+    ;
+  free(q.found);
+  
+  if (rc)
+    return error(1, rc, "%s: Reading snapshot", path);
+  if (i < (uint32_t) argc)
+    return error(1, ENOENT, "%s: Not in snapshot", argv[i]);
+  return 0;
+}
+
 
 int
 list_cmd(int argc,
 	    char **argv) {
-  int n = 0;
-  return aclcmd_foreach(argc-1, argv+1, walker_print, &n);
+  if (snapshot_input)
+    return snapshot_query(argc-1, argv+1, NULL, NULL);
+  
+  return aclcmd_foreach_parallel(argc-1, argv+1, walker_print, NULL);
 }
 
 int
@@ -487,26 +843,16 @@ typedef struct {
   } v[MAXRENAMELIST];
 } RENAMELIST;
 
+/* Rename entries in an ACL. Returns 1 if anything was changed */
 static int
-walker_rename(const char *path,
-	      const struct stat *sp,
-	      size_t base,
-	      size_t level,
-	      void *vp) {
-  int rc, i, j;
-  RENAMELIST *r = (RENAMELIST *) vp;
-  gacl_t ap;
+_acl_rename(gacl_t ap,
+	    RENAMELIST *r) {
+  int i, j;
   gacl_entry_t ae;
   int f_updated = 0;
 
   
-  rc = get_acl(path, sp, &ap);
-  if (rc < 0)
-    return error(1, errno, "%s: Getting ACL", path);
-  if (rc == 0)
-    return 0;
-
-  for (i = 0; gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+  for (i = 0; _gacl_get_entry(ap, i, &ae) == 1; i++) {
     gacl_tag_t tt;
     uid_t *oip = NULL;
     
@@ -526,8 +872,28 @@ walker_rename(const char *path,
     if (oip)
       gacl_free(oip);
   }
+
+  return f_updated;
+}
+
+static int
+walker_rename(const char *path,
+	      const struct stat *sp,
+	      size_t base,
+	      size_t level,
+	      void *vp) {
+  int rc;
+  RENAMELIST *r = (RENAMELIST *) vp;
+  gacl_t ap;
+
   
-  if (f_updated) {
+  rc = get_acl(path, sp, &ap);
+  if (rc < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+  if (rc == 0)
+    return 0;
+
+  if (_acl_rename(ap, r)) {
     rc = set_acl(path, sp, ap, NULL);
     if (rc < 0)
       return error(1, errno, "%s: Setting ACL", path);
@@ -540,13 +906,14 @@ walker_rename(const char *path,
 int
 str2renamelist(char *str,
 	       RENAMELIST *r) {
-  char *s1, *s2;
-  struct passwd *p_old, *p_new;
-  struct group *g_old, *g_new;
+  char *s1, *s2, *saved = NULL;
+  uid_t u_old, u_new;
+  gid_t g_old, g_new;
+  int pf_old, gf_old, pf_new, gf_new;
   
   r->c = 0;
 
-  str = strtok(str, ",");
+  str = strtok_r(str, ",", &saved);
   while (str) {
     s1 = s2 = NULL;
     
@@ -561,16 +928,14 @@ str2renamelist(char *str,
       if (strcmp(str, "g") == 0 ||
 	  strcmp(str, "group") == 0) {
 	
-	g_old = getgrnam(s1);
-	if (g_old)
-	  r->v[r->c].old = g_old->gr_gid;
+	if (ident_name_to_gid(s1, &g_old) > 0)
+	  r->v[r->c].old = g_old;
 	else if (sscanf(s1, "%d", &r->v[r->c].old) != 1)
 	  return -1;
 	
-	g_new = getgrnam(s2);
-	if (g_new)
-	  r->v[r->c].new = g_new->gr_gid;
-	else if (sscanf(s1, "%d", &r->v[r->c].new) != 1)
+	if (ident_name_to_gid(s2, &g_new) > 0)
+	  r->v[r->c].new = g_new;
+	else if (sscanf(s2, "%d", &r->v[r->c].new) != 1)
 	  return -1;
 	
 	r->v[r->c++].type = GACL_TAG_TYPE_GROUP;
@@ -578,16 +943,14 @@ str2renamelist(char *str,
       } else if (strcmp(str, "u") == 0 ||
 		 strcmp(str, "user") == 0) {
 	
-	p_old = getpwnam(s1);
-	if (p_old)
-	  r->v[r->c].old = p_old->pw_uid;
+	if (ident_name_to_uid(s1, &u_old) > 0)
+	  r->v[r->c].old = u_old;
 	else if (sscanf(s1, "%d", &r->v[r->c].old) != 1)
 	  return -1;
 	
-        p_new = getpwnam(s2);
-	if (!p_new)
-	  r->v[r->c].new = p_new->pw_uid;
-	else if (sscanf(s1, "%d", &r->v[r->c].new) != 1)
+	if (ident_name_to_uid(s2, &u_new) > 0)
+	  r->v[r->c].new = u_new;
+	else if (sscanf(s2, "%d", &r->v[r->c].new) != 1)
 	  return -1;
 	
 	r->v[r->c++].type = GACL_TAG_TYPE_USER;
@@ -597,38 +960,38 @@ str2renamelist(char *str,
       s1 = str;
       uid_t id;
       
-      p_old = getpwnam(s1);
-      g_old = getgrnam(s1);
-      if (p_old && g_old)
+      pf_old = (ident_name_to_uid(s1, &u_old) > 0);
+      gf_old = (ident_name_to_gid(s1, &g_old) > 0);
+      if (pf_old && gf_old)
 	return -1;
-      if (!p_old && !g_old) {
+      if (!pf_old && !gf_old) {
 	if (sscanf(s1, "%d", &id) == 1)
 	  r->v[r->c].old = id;
 	else
 	  return -1;
       } else
-	r->v[r->c].old = (p_old ? p_old->pw_uid : g_old->gr_gid);
+	r->v[r->c].old = (pf_old ? u_old : g_old);
       
-      p_new = getpwnam(s2);
-      g_new = getgrnam(s2);
-      if (p_new && g_new)
+      pf_new = (ident_name_to_uid(s2, &u_new) > 0);
+      gf_new = (ident_name_to_gid(s2, &g_new) > 0);
+      if (pf_new && gf_new)
 	return -1;
-      if (!p_new && !g_new) {
-	if ((p_old || g_old) && sscanf(s2, "%d", &id) == 1)
+      if (!pf_new && !gf_new) {
+	if ((pf_old || gf_old) && sscanf(s2, "%d", &id) == 1)
 	  r->v[r->c].new = id;
 	else
 	  return -1;
-      } else
-      
-      if ((p_old && g_new) || (g_old && p_new))
-	return -1;
+      } else {
+	if ((pf_old && gf_new) || (gf_old && pf_new))
+	  return -1;
       
-      r->v[r->c].new = (p_new ? p_new->pw_uid : g_new->gr_gid);
+	r->v[r->c].new = (pf_new ? u_new : g_new);
+      }
       
-      r->v[r->c++].type = p_old ? GACL_TAG_TYPE_USER : GACL_TAG_TYPE_GROUP;
+      r->v[r->c++].type = pf_old ? GACL_TAG_TYPE_USER : GACL_TAG_TYPE_GROUP;
     }
     
-    str = strtok(NULL, ",");
+    str = strtok_r(NULL, ",", &saved);
   }
 
   return 0;
@@ -657,6 +1020,7 @@ int
 find_cmd(int argc,
 	 char **argv) {
   gacl_t ap;
+  int rc;
 
 
   if (argc < 2)
@@ -664,7 +1028,122 @@ find_cmd(int argc,
 
   ap = gacl_from_text(argv[1]);
 
-  return aclcmd_foreach(argc-2, argv+2, walker_find, (void *) ap);
+  if (snapshot_input) {
+    if (!ap)
+      return error(1, errno, "%s: Invalid ACL", argv[1]);
+    
+    rc = snapshot_query(argc-2, argv+2, ap, NULL);
+    gacl_free(ap);
+    return rc;
+  }
+  
+  rc = aclcmd_foreach_parallel(argc-2, argv+2, walker_find, (void *) ap);
+  gacl_free(ap);
+  return rc;
+}
+
+
+static int
+walker_who(const char *path,
+	   const struct stat *sp,
+	   size_t base,
+	   size_t level,
+	   void *vp) {
+  GACL_TAG *who = (GACL_TAG *) vp;
+  GACL_ENTRY *ep;
+  gacl_t ap;
+  int i, rc;
+
+
+  /* Verbose output shows the owner - resolve it while the ACL is read */
+  if (config.f_verbose)
+    prefetch_acl_ids(NULL, sp);
+  
+  rc = get_acl(path, sp, &ap);
+  if (rc < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+  if (rc == 0)
+    return 0;
+
+  for (i = 0; _gacl_peek_entry(ap, i, &ep) == 1; i++)
+    if (who_match(who, ep->tag.type, ep->tag.ugid, ep->tag.name))
+      break;
+
+  if (i < ap->ac) {
+    if (config.f_verbose)
+      print_acl(stdout, ap, path, sp);
+    else
+      aclcmd_puts(stdout, path);
+  }
+  
+  gacl_free(ap);
+  return 0;
+}
+
+
+int
+who_cmd(int argc,
+	char **argv) {
+  char buf[GACL_TEXT_ENTRY_MAX], c;
+  unsigned int id;
+  GACL_ENTRY e;
+  uid_t uid;
+  gid_t gid;
+  int rc;
+
+  
+  if (argc < 2 || (argc < 3 && !snapshot_input))
+    return error(1, 0, "Missing required arguments (<principal> <path>)");
+
+  memset(&e, 0, sizeof(e));
+  if (!strchr(argv[1], ':') && !strchr(argv[1], '@')) {
+    /* A bare name or number - a user if there is one, else a group */
+    if (s_cpy(e.tag.name, sizeof(e.tag.name), argv[1]) < 0)
+      return error(1, errno, "%s: Invalid principal", argv[1]);
+    
+    if (sscanf(argv[1], "%u%c", &id, &c) == 1) {
+      e.tag.ugid = id;
+      rc = ident_uid_to_name((uid_t) id, NULL, 0);
+      if (rc > 0)
+	e.tag.type = GACL_TAG_TYPE_USER;
+      else if (rc == 0 && (rc = ident_gid_to_name((gid_t) id, NULL, 0)) > 0)
+	e.tag.type = GACL_TAG_TYPE_GROUP;
+    } else {
+      rc = ident_name_to_uid(argv[1], &uid);
+      if (rc > 0) {
+	e.tag.type = GACL_TAG_TYPE_USER;
+	e.tag.ugid = uid;
+      } else if (rc == 0 && (rc = ident_name_to_gid(argv[1], &gid)) > 0) {
+	e.tag.type = GACL_TAG_TYPE_GROUP;
+	e.tag.ugid = gid;
+      }
+    }
+    
+    if (rc < 0)
+      return error(1, errno, "%s: Looking up principal", argv[1]);
+    if (rc == 0)
+      return error(1, 0, "%s: No such user or group (use user:<uid> or group:<gid>)", argv[1]);
+    
+  } else {
+    /* Just the tag of an entry - user:<name|uid>, group:<name|gid>, owner@ ... */
+    rc = snprintf(buf, sizeof(buf), "%s%s", argv[1],
+		  (argv[1][strlen(argv[1])-1] == ':') ? "" : ":");
+    if (rc < 0 || rc >= sizeof(buf) ||
+	_gacl_entry_from_text(buf, &e, GACL_TEXT_RELAXED) < 0)
+      return error(1, errno, "%s: Invalid principal", argv[1]);
+    
+    /* Would otherwise silently match nothing */
+    if (e.tag.type == GACL_TAG_TYPE_UNKNOWN ||
+	((e.tag.type == GACL_TAG_TYPE_USER || e.tag.type == GACL_TAG_TYPE_GROUP) &&
+	 e.tag.ugid == (uid_t) -1))
+      return error(1, 0, "%s: No such %s", argv[1],
+		   e.tag.type == GACL_TAG_TYPE_GROUP ? "group" : (e.tag.type == GACL_TAG_TYPE_USER ? "user" : "user or group"));
+  }
+
+  if (snapshot_input)
+    return snapshot_query(argc-2, argv+2, NULL, &e.tag);
+  
+  return aclcmd_foreach_parallel(argc-2, argv+2, walker_who, (void *) &e.tag);
 }
 
 
@@ -699,7 +1178,7 @@ walker_inherit(const char *path,
     if (!a->da)
       goto Fail;
     
-    for (p = GACL_FIRST_ENTRY; gacl_get_entry(a->da, p, &ep) == 1; p = GACL_NEXT_ENTRY) {
+    for (p = 0; _gacl_get_entry(a->da, p, &ep) == 1; p++) {
       gacl_flagset_t fs;
 
       if (gacl_get_flagset_np(ep, &fs) < 0)
@@ -719,7 +1198,7 @@ walker_inherit(const char *path,
     if (set_acl(path, sp, a->da, ap) < 0)
       return error(1, errno, "%s: Setting ACL", path);
     
-    for (p = GACL_FIRST_ENTRY; gacl_get_entry(a->da, p, &ep) == 1; p = GACL_NEXT_ENTRY) {
+    for (p = 0; _gacl_get_entry(a->da, p, &ep) == 1; p++) {
       gacl_flagset_t fs;
 
       if (gacl_get_flagset_np(ep, &fs) < 0)
@@ -778,8 +1257,6 @@ inherit_cmd(int argc,
   int i, rc = 0;
 
   
-  w_c = 0;
-
   for (i = 1; i < argc; i++) {
     DACL a;
     
@@ -816,11 +1293,440 @@ check_cmd(int argc,
   return aclcmd_foreach(argc-1, argv+1, walker_check, NULL);
 }
 
+
+
+/*
+ * Pipeline of ACL transformations, all done in memory on one
+ * traversal: the ACL is read once, passed through each stage and
+ * written (at most) once at the end.
+ */
+typedef struct pipeline_stage {
+  const char *name;
+  void *(*create)(int argc, char **argv);
+  int (*run)(void *xp, const char *path, const struct stat *sp, gacl_t *app);
+  void (*destroy)(void *xp);
+} PIPELINE_STAGE;
+
+#define MAXPIPELINE 64
+
+typedef struct pipeline {
+  int c;
+  struct {
+    PIPELINE_STAGE *stage;
+    void *xp;
+  } v[MAXPIPELINE];
+} PIPELINE;
+
+
+static void *
+rename_stage_create(int argc,
+		    char **argv) {
+  RENAMELIST *r;
+
+
+  if (argc != 2) {
+    error(1, 0, "%s: Missing or extra arguments (<change>)", argv[0]);
+    return NULL;
+  }
+  
+  r = malloc(sizeof(*r));
+  if (!r)
+    return NULL;
+  
+  if (str2renamelist(argv[1], r) < 0) {
+    free(r);
+    error(1, 0, "%s: Invalid renamelist", argv[1]);
+    return NULL;
+  }
+
+  return r;
+}
+
+static int
+rename_stage_run(void *xp,
+		 const char *path,
+		 const struct stat *sp,
+		 gacl_t *app) {
+  _acl_rename(*app, (RENAMELIST *) xp);
+  return 0;
+}
+
+
+/* No state needed - just something that is not NULL */
+static int strip_stage_dummy;
+
+static void *
+strip_stage_create(int argc,
+		   char **argv) {
+  if (argc != 1) {
+    error(1, 0, "%s: Invalid argument", argv[1]);
+    return NULL;
+  }
+
+  return (void *) &strip_stage_dummy;
+}
+
+static int
+strip_stage_run(void *xp,
+		const char *path,
+		const struct stat *sp,
+		gacl_t *app) {
+  gacl_t na;
+  int tf = 0;
+
+  
+  if (gacl_is_trivial_np(*app, &tf) < 0)
+    return -1;
+  if (tf)
+    return 0;
+
+  na = gacl_strip_np(*app, 0);
+  if (!na)
+    return -1;
+
+  gacl_free(*app);
+  *app = na;
+  return 0;
+}
+
+
+typedef struct {
+  int f_merge;
+} SORT_STAGE;
+
+static void *
+sort_stage_create(int argc,
+		  char **argv) {
+  SORT_STAGE *ssp;
+  int i;
+  OPTION sort_options[] =
+    {
+     { "merge", 'm', OPTS_TYPE_NONE, NULL, NULL, "Merge redundant ACL entries" },
+     { NULL, 0, 0, NULL, NULL, NULL },
+    };
+
+  
+  ssp = calloc(1, sizeof(*ssp));
+  if (!ssp)
+    return NULL;
+  
+  sort_options[0].dvp = &ssp->f_merge;
+  i = opts_parse_argv(argc, argv, sort_options, NULL);
+  if (i < 0 || i < argc) {
+    free(ssp);
+    if (i >= 0)
+      error(1, 0, "%s: Invalid argument", argv[i]);
+    return NULL;
+  }
+  
+  return ssp;
+}
+
+static int
+sort_stage_run(void *xp,
+	       const char *path,
+	       const struct stat *sp,
+	       gacl_t *app) {
+  SORT_STAGE *ssp = (SORT_STAGE *) xp;
+
+  
+  if (gacl_sort_inplace_np(*app) < 0)
+    return -1;
+  
+  if (ssp->f_merge && gacl_merge_inplace_np(*app) < 0)
+    return -1;
+
+  return 0;
+}
+
+
+static PIPELINE_STAGE pipeline_stages[] =
+  {
+   { "rename-access", rename_stage_create, rename_stage_run, free },
+   { "strip-access",  strip_stage_create,  strip_stage_run,  NULL },
+   { "sort-access",   sort_stage_create,   sort_stage_run,   free },
+   { "edit-access",   edit_stage_create,   edit_stage_run,   edit_stage_destroy },
+   { NULL, NULL, NULL, NULL },
+  };
+
+
+/* 
+ * Stage names must be given in full, with or without the "-access" suffix,
+ * so they can't be mistaken for the paths that follow
+ */
+static PIPELINE_STAGE *
+pipeline_stage_lookup(const char *name) {
+  PIPELINE_STAGE *psp;
+  size_t len;
+
+  
+  for (psp = &pipeline_stages[0]; psp->name; psp++) {
+    len = strchr(psp->name, '-')-psp->name;
+    if (strcmp(name, psp->name) == 0 ||
+	(strncmp(name, psp->name, len) == 0 && name[len] == '\0'))
+      return psp;
+  }
+
+  return NULL;
+}
+
+static void
+pipeline_free(PIPELINE *pp) {
+  int i;
+
+  
+  for (i = 0; i < pp->c; i++)
+    if (pp->v[i].stage->destroy)
+      pp->v[i].stage->destroy(pp->v[i].xp);
+  pp->c = 0;
+}
+
+
+static int
+walker_pipeline(const char *path,
+		const struct stat *sp,
+		size_t base,
+		size_t level,
+		void *vp) {
+  PIPELINE *pp = (PIPELINE *) vp;
+  gacl_t oap, nap;
+  int rc, i;
+
+  
+  rc = get_acl(path, sp, &oap);
+  if (rc < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+  if (rc == 0)
+    return 0;
+
+  nap = gacl_dup(oap);
+  if (!nap) {
+    int ec = errno;
+    
+    gacl_free(oap);
+    return error(1, ec, "%s: Internal Fault (gacl_dup)", path);
+  }
+
+  for (i = 0; i < pp->c; i++) {
+    if ((*pp->v[i].stage->run)(pp->v[i].xp, path, sp, &nap) < 0) {
+      int ec = errno;
+
+      gacl_free(oap);
+      gacl_free(nap);
+      return error(1, ec, "%s: %s: Pipeline stage failed", path, pp->v[i].stage->name);
+    }
+  }
+
+  rc = set_acl(path, sp, nap, oap);
+
+  gacl_free(nap);
+  gacl_free(oap);
+  
+  if (rc < 0)
+    return 1;
+  
+  return 0;
+}
+
+
+int
+pipeline_cmd(int argc,
+	     char **argv) {
+  PIPELINE p;
+  PIPELINE_STAGE *psp;
+  jmp_buf saved_env;
+  int i, ac, rc;
+  char **av;
+
+  
+  p.c = 0;
+  for (i = 1; i < argc; i++) {
+    av = NULL;
+    ac = argv_create(argv[i], NULL, NULL, &av);
+    if (ac < 1 || (psp = pipeline_stage_lookup(av[0])) == NULL) {
+      if (av)
+	argv_destroy(av);
+      break;
+    }
+
+    if (p.c >= MAXPIPELINE) {
+      argv_destroy(av);
+      pipeline_free(&p);
+      return error(1, 0, "%s: Too many pipeline stages", argv[i]);
+    }
+    
+    p.v[p.c].stage = psp;
+    
+    rc = error_catch(saved_env);
+    if (rc) {
+      /* The stage rejected its arguments via error() - unwind the ones created */
+      argv_destroy(av);
+      pipeline_free(&p);
+      memcpy(error_env, saved_env, sizeof(jmp_buf));
+      longjmp(error_env, rc);
+    }
+    p.v[p.c].xp = (*psp->create)(ac, av);
+    memcpy(error_env, saved_env, sizeof(jmp_buf));
+    
+    argv_destroy(av);
+    if (!p.v[p.c].xp) {
+      pipeline_free(&p);
+      return error(1, errno, "%s: Invalid pipeline stage", argv[i]);
+    }
+    p.c++;
+  }
+
+  if (p.c == 0)
+    return error(1, 0, "Missing pipeline stages");
+  
+  if (i >= argc) {
+    pipeline_free(&p);
+    return error(1, 0, "Missing required arguments (<path>)");
+  }
+  
+  rc = error_catch(saved_env);
+  if (rc) {
+    pipeline_free(&p);
+    memcpy(error_env, saved_env, sizeof(jmp_buf));
+    longjmp(error_env, rc);
+  }
+  
+  rc = aclcmd_foreach(argc-i, argv+i, walker_pipeline, (void *) &p);
+  memcpy(error_env, saved_env, sizeof(jmp_buf));
+
+  pipeline_free(&p);
+  return rc;
+}
+
+
+static int
+walker_dump(const char *path,
+	    const struct stat *sp,
+	    size_t base,
+	    size_t level,
+	    void *vp) {
+  SNAPSHOT_WRITER *wp = (SNAPSHOT_WRITER *) vp;
+  gacl_t ap = NULL;
+  int rc;
+
+
+  rc = get_acl(path, sp, &ap);
+  if (rc < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+
+  /* Below the root "/" the walker gives us "//dir" */
+  rc = snapshot_writer_add(wp, (path[0] == '/' && path[1] == '/') ? path+1 : path, sp, ap);
+  if (ap)
+    gacl_free(ap);
+  
+  if (rc < 0)
+    return error(1, errno, "%s: Writing snapshot", path);
+
+  return 0;
+}
+
+
+static char *dump_output = NULL;
+
+static OPTION dump_options[] =
+  {
+   { "output", 'o', OPTS_TYPE_STR, NULL, &dump_output, "Snapshot file (default stdout)" },
+   { NULL, 0, 0, NULL, NULL, NULL },
+  };
+
+
+int
+dump_cmd(int argc,
+	 char **argv) {
+  SNAPSHOT_WRITER *wp;
+  char path[PATH_MAX+1], **rv = NULL;
+  jmp_buf saved_env;
+  FILE *fp = stdout;
+  int rc, ec;
+
+  
+  /* Take over the option value so it does not stick to the next command */
+  rc = s_cpy(path, sizeof(path), dump_output ? dump_output : "-");
+  free(dump_output);
+  dump_output = NULL;
+  if (rc < 0)
+    return error(1, errno, "Invalid output file");
+
+  if (argc < 2)
+    return error(1, 0, "Missing required arguments (<path>)");
+
+  /* Store absolute, cleaned paths - that is what snapshot queries match against */
+  rv = snapshot_paths(argc-1, argv+1);
+  if (!rv)
+    return error(1, errno, "Invalid path");
+  
+  if (strcmp(path, "-") == 0) {
+    if (isatty(fileno(stdout))) {
+      argv_destroy(rv);
+      return error(1, 0, "Will not write a binary snapshot to a terminal (use -o <file>)");
+    }
+  } else {
+    fp = fopen(path, "w");
+    if (!fp) {
+      ec = errno;
+      argv_destroy(rv);
+      return error(1, ec, "%s: Creating snapshot", path);
+    }
+  }
+  
+  wp = snapshot_writer_open(fp);
+  if (!wp) {
+    ec = errno;
+    goto Fail;
+  }
+  
+  rc = error_catch(saved_env);
+  if (rc) {
+    /* A walker bailed out - do not leave a valid looking partial snapshot */
+    snapshot_writer_abort(wp);
+    if (fp != stdout) {
+      fclose(fp);
+      unlink(path);
+    }
+    argv_destroy(rv);
+    memcpy(error_env, saved_env, sizeof(jmp_buf));
+    longjmp(error_env, rc);
+  }
+  
+  rc = aclcmd_foreach(argc-1, rv, walker_dump, (void *) wp);
+  memcpy(error_env, saved_env, sizeof(jmp_buf));
+  argv_destroy(rv);
+  rv = NULL;
+  
+  if (snapshot_writer_close(wp) < 0) {
+    ec = errno;
+    goto Fail;
+  }
+
+  if (fp != stdout && fclose(fp) != 0) {
+    ec = errno;
+    fp = stdout;
+    goto Fail;
+  }
+  
+  return rc;
+
+ Fail:
+  argv_destroy(rv);
+  if (fp != stdout)
+    fclose(fp);
+  if (strcmp(path, "-") != 0)
+    unlink(path);
+  return error(1, ec, "%s: Writing snapshot", path);
+}
+
+
 extern COMMAND edit_command;
+extern COMMAND restore_command;
 
 
 COMMAND list_command =
-  { "list-access", 	list_cmd,	NULL, "<path>+",		"List ACL(s)" };
+  { "list-access", 	list_cmd,	snapshot_options, "<path>+",		"List ACL(s)" };
 
 COMMAND set_command =
   { "set-access",  	set_cmd,	NULL, "<acl> <path>+",		"Set ACL(s)" };
@@ -847,7 +1753,10 @@ COMMAND delete_command =
   { "delete-access",    delete_cmd,	NULL, "<path>+",		"Delete ACL(s)" };
 
 COMMAND find_command =
-  { "find-access",      find_cmd,	NULL, "<acl> <path>+",		"Search ACL(s)" };
+  { "find-access",      find_cmd,	snapshot_options, "<acl> <path>+",		"Search ACL(s)" };
+
+COMMAND who_command =
+  { "who-access",       who_cmd,	snapshot_options, "<principal> <path>*",	"Find objects with ACL entries for a principal" };
 
 COMMAND rename_command =
   { "rename-access",    rename_cmd,     NULL, "<change> <path>+", 	"Rename ACL entries" };
@@ -855,6 +1764,12 @@ COMMAND rename_command =
 COMMAND inherit_command =
   { "inherit-access",   inherit_cmd,	NULL, "<path>+",		"Propage ACL(s) inheritance" };
 
+COMMAND dump_command =
+  { "dump-access",      dump_cmd,	dump_options, "<path>+",	"Dump ACL(s) to a binary snapshot" };
+
+COMMAND pipeline_command =
+  { "pipeline",         pipeline_cmd,	NULL, "<stage>+ <path>+",	"Run rename/strip/sort/edit stages in one pass" };
+
 
 COMMAND *acl_commands[] =
   {
@@ -870,7 +1785,11 @@ COMMAND *acl_commands[] =
    &copy_command,
    &delete_command,
    &find_command,
+   &who_command,
    &rename_command,
    &inherit_command,
+   &pipeline_command,
+   &dump_command,
+   &restore_command,
    NULL,
   };
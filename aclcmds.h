@@ -34,10 +34,28 @@
 #ifndef ACLCMDS_H
 #define ACLCMDS_H 1
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include "commands.h"
+#include "gacl.h"
 
 extern COMMAND *acl_commands[];
 
+/* Edit stage for the 'pipeline' command (cmd_edit.c) */
+extern void *
+edit_stage_create(int argc,
+		  char **argv);
+
+extern int
+edit_stage_run(void *xp,
+	       const char *path,
+	       const struct stat *sp,
+	       gacl_t *app);
+
+extern void
+edit_stage_destroy(void *xp);
+
 
 
 #endif
@@ -57,6 +57,8 @@
 #endif
 
 #include "acltool.h"
+#include "ident.h"
+#include "progress.h"
 
 #if HAVE_LIBSMBCLIENT
 #include "smb.h"
@@ -72,7 +74,7 @@ char *version = PACKAGE_VERSION;
 COMMANDS commands = { 0 };
 
 CONFIG default_config = { 0, 0, 0, 0, 0, 0 };
-CONFIG config = { 0, 0, 0, 0, 0, 0 };
+THREAD_LOCAL CONFIG config = { 0, 0, 0, 0, 0, 0 };
 
 int f_interactive = 0;
 
@@ -245,6 +247,45 @@ set_style(const char *name,
   return 0;
 }
 
+int
+set_jobs(const char *name,
+	 const char *value,
+	 unsigned int type,
+	 const void *svp,
+	 void *dvp,
+	 const char *a0) {
+  if (!svp)
+    return -1;
+  
+  config.f_jobs = * (int *) svp;
+  return 0;
+}
+
+int
+set_unordered(const char *name,
+	      const char *value,
+	      unsigned int type,
+	      const void *svp,
+	      void *dvp,
+	      const char *a0) {
+  config.f_unordered++;
+  
+  return 0;
+}
+
+int
+set_progress(const char *name,
+	     const char *value,
+	     unsigned int type,
+	     const void *svp,
+	     void *dvp,
+	     const char *a0) {
+  config.f_progress = 1;
+  config.progress_interval = svp ? * (int *) svp : PROGRESS_INTERVAL_DEFAULT;
+  
+  return 0;
+}
+
 int
 set_filetype(const char *name,
 	     const char *value,
@@ -283,6 +324,34 @@ set_no_prefix(const char *name,
   return 0;
 }
 
+int
+set_id_ttl(const char *name,
+	   const char *value,
+	   unsigned int type,
+	   const void *svp,
+	   void *dvp,
+	   const char *a0) {
+  if (!svp)
+    return -1;
+  
+  ident_cache_set_ttl(* (int *) svp, -1);
+  return 0;
+}
+
+int
+set_id_negative_ttl(const char *name,
+		    const char *value,
+		    unsigned int type,
+		    const void *svp,
+		    void *dvp,
+		    const char *a0) {
+  if (!svp)
+    return -1;
+  
+  ident_cache_set_ttl(-1, * (int *) svp);
+  return 0;
+}
+
 extern OPTION global_options[];
 
 
@@ -298,6 +367,70 @@ show_help(const char *name,
 }
 
 
+int
+set_preload_ids(const char *name,
+		const char *value,
+		unsigned int type,
+		const void *svp,
+		void *dvp,
+		const char *a0) {
+  char *buf = NULL, *gfile = NULL;
+  int rc;
+
+  
+  /* Optional value: PASSWD-FILE[,GROUP-FILE] ("getent passwd/group" output) */
+  if (value) {
+    buf = s_dup(value);
+    gfile = strchr(buf, ',');
+    if (gfile)
+      *gfile++ = '\0';
+  }
+  
+  rc = ident_preload(buf && *buf ? buf : NULL, gfile && *gfile ? gfile : NULL);
+  if (rc < 0)
+    error(1, errno, "%s: Loading user & group databases", value ? value : "NSS");
+  
+  free(buf);
+  return rc;
+}
+
+int
+set_id_cache_file(const char *name,
+		  const char *value,
+		  unsigned int type,
+		  const void *svp,
+		  void *dvp,
+		  const char *a0) {
+  int n;
+
+  
+  if (!value)
+    return -1;
+
+  n = ident_cache_file_open(value);
+  if (n < 0)
+    error(1, errno, "%s: Opening identity cache file", value);
+  
+  if (config.f_verbose)
+    printf("%s: %d identity cache entries loaded\n", value, n);
+  
+  return 0;
+}
+
+int
+set_id_resolvers(const char *name,
+		 const char *value,
+		 unsigned int type,
+		 const void *svp,
+		 void *dvp,
+		 const char *a0) {
+  if (!svp)
+    return -1;
+  
+  ident_set_resolvers(* (int *) svp);
+  return 0;
+}
+
 
 OPTION global_options[] =
   {
@@ -313,11 +446,19 @@ OPTION global_options[] =
    { "depth",     	'd', OPTS_TYPE_INT|OPTS_TYPE_OPT,  set_depth,     NULL, "Increase/decrease max depth" },
    { "style",     	'S', OPTS_TYPE_STR,                set_style,     NULL, "Select ACL print style" },
    { "type",      	't', OPTS_TYPE_STR,                set_filetype,  NULL, "File types to operate on" },
+   { "jobs",      	'j', OPTS_TYPE_UINT,               set_jobs,      NULL, "Worker threads for list/find/restore (0-1 = sequential)" },
+   { "unordered", 	0,   OPTS_TYPE_NONE,               set_unordered, NULL, "Parallel output in completion order" },
+   { "progress",  	0,   OPTS_TYPE_UINT|OPTS_TYPE_OPT, set_progress,  NULL, "Report progress to stderr [every N seconds, 0 = on SIGUSR1 only]" },
 #if HAVE_LIBSMBCLIENT
    { "password",      	'P', OPTS_TYPE_NONE,               set_password,  NULL, "Prompt for user password (SMB)" },
 #endif
    { "no-update", 	'n', OPTS_TYPE_NONE,               set_no_update, NULL, "Disable modification" },
    { "no-prefix", 	'N', OPTS_TYPE_NONE,               set_no_prefix, NULL, "Do not prefix filenames" }, 
+   { "id-ttl",          0,   OPTS_TYPE_UINT,               set_id_ttl,    NULL, "Identity cache TTL (seconds, 0 = disable)" },
+   { "id-negative-ttl", 0,   OPTS_TYPE_UINT,               set_id_negative_ttl, NULL, "Identity cache TTL for unknown ids (seconds)" },
+   { "id-resolvers",    0,   OPTS_TYPE_UINT,               set_id_resolvers, NULL, "Background identity resolver threads (0 = disable)" },
+   { "id-cache-file",   0,   OPTS_TYPE_STR,                set_id_cache_file, NULL, "Persistent (shared) identity cache file" },
+   { "preload-ids",     0,   OPTS_TYPE_STR|OPTS_TYPE_OPT,  set_preload_ids, NULL, "Preload all users & groups [PASSWD[,GROUP] files]" },
    { NULL,        	-1,  0,                            NULL,          NULL, NULL },
   };
 
@@ -364,7 +505,9 @@ version_cmd(int argc,
 int
 config_cmd(int argc,
 	   char **argv) {
-  int rc = 0;
+  int rc = 0, ttl, nttl;
+  IDENT_CACHE_STATS ics;
+  size_t nusers, ngroups;
 
   
   if (argc == 1) {
@@ -384,6 +527,19 @@ config_cmd(int argc,
     printf("  Update:             %s\n", config.f_noupdate ? "No" : "Yes");
     printf("  Prefix:             %s\n", config.f_noprefix ? "No" : "Yes");
     printf("  Style:              %s\n", style2str(config.f_style));
+    printf("  Jobs:               %d%s\n", config.f_jobs > 1 ? config.f_jobs : 1,
+	   config.f_jobs > 1 && config.f_unordered ? " (unordered)" : "");
+
+    ident_cache_get_ttl(&ttl, &nttl);
+    ident_cache_get_stats(&ics);
+    printf("  Identity Cache TTL: %ds (unknown: %ds)\n", ttl, nttl);
+    printf("  Identity Cache:     %llu entries, %llu hits, %llu negative hits, %llu misses, %llu expired\n",
+	   ics.entries, ics.hits, ics.negative_hits, ics.misses, ics.expired);
+    printf("  Identity Resolvers: %d (%llu prefetched, %llu waits)\n",
+	   ident_get_resolvers(), ics.prefetches, ics.waits);
+    if (ident_preload_get_counts(&nusers, &ngroups))
+      printf("  Preloaded Ids:      %lu users, %lu groups\n",
+	     (unsigned long) nusers, (unsigned long) ngroups);
   } else {
     int i;
 
@@ -423,7 +579,8 @@ help_cmd(int argc,
     puts("  If invoked without a command the tool will enter an interactive mode.");
     puts("  All commands take the same options and they can also be used in the interactive mode.");
     putchar('\n');
-    puts("  ACL styles supported: default, csv, brief, verbose, samba, icacls, solaris, primos");
+    puts("  ACL styles supported: default, csv, brief, verbose, samba, icacls, solaris, primos, fingerprint, json");
+    puts("  (json writes bytes of file names that are not valid UTF-8 as \\u00XX escapes)");
     putchar('\n');
     puts("  You may access environment variables using ${NAME}.");
 
@@ -592,6 +749,10 @@ main(int argc,
   argv0 = s_dup(argv[0]);
   error_argv0 = s_dup(error_argv0);
 
+  /* Listing big trees to a file or pipe - use large writes */
+  if (!isatty(fileno(stdout)))
+    setvbuf(stdout, NULL, _IOFBF, 256*1024);
+
   cmd_register(&commands, basic_commands);
   cmd_register(&commands, acltool_commands);
   cmd_register(&commands, acl_commands);
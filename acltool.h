@@ -65,8 +65,12 @@ typedef struct config {
   int f_noprefix;
   mode_t f_filetype;
   GACL_STYLE f_style;
+  int f_jobs;
+  int f_unordered;
+  int f_progress;
   
   int max_depth;
+  int progress_interval;
 } CONFIG;
 
 
@@ -78,7 +82,7 @@ extern OPTION global_options[];
 extern CONFIG default_config;
 
 /* Per-command active configuration */
-extern CONFIG config;
+extern THREAD_LOCAL CONFIG config;
 
 extern int
 error(int rc, int ec, const char *msg, ...);
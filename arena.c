@@ -0,0 +1,218 @@
+/*
+ * arena.c - Arena (bump) memory allocator
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "arena.h"
+
+
+/* All allocations are aligned to this */
+#define ARENA_ALIGN 16
+#define ARENA_ROUNDUP(s) (((s)+ARENA_ALIGN-1) & ~((size_t) ARENA_ALIGN-1))
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+} ARENA_BLOCK;
+
+#define ARENA_BLOCK_HDRSIZE ARENA_ROUNDUP(sizeof(ARENA_BLOCK))
+
+struct arena {
+  ARENA_BLOCK *head;   /* Blocks in use - the first one is the current one */
+  ARENA_BLOCK *spare;  /* Normal sized blocks available for reuse */
+  size_t bsize;
+};
+
+
+
+static ARENA_BLOCK *
+_arena_block_new(size_t size) {
+  ARENA_BLOCK *bp;
+
+  
+  bp = malloc(ARENA_BLOCK_HDRSIZE + size);
+  if (!bp)
+    return NULL;
+
+  bp->next = NULL;
+  bp->size = size;
+  bp->used = 0;
+  return bp;
+}
+
+
+ARENA *
+arena_create(size_t bsize) {
+  ARENA *ap;
+
+
+  ap = malloc(sizeof(*ap));
+  if (!ap)
+    return NULL;
+
+  ap->head = NULL;
+  ap->spare = NULL;
+  ap->bsize = ARENA_ROUNDUP(bsize > 0 ? bsize : ARENA_BLOCK_SIZE);
+  return ap;
+}
+
+
+/*
+ * Allocate 'size' bytes from the arena. The memory is released
+ * all at once by arena_reset() or arena_destroy().
+ */
+void *
+arena_alloc(ARENA *ap,
+	    size_t size) {
+  ARENA_BLOCK *bp;
+  void *p;
+
+  
+  if (!ap) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  size = ARENA_ROUNDUP(size > 0 ? size : 1);
+  
+  bp = ap->head;
+  if (bp && bp->size - bp->used >= size) {
+    p = (char *) bp + ARENA_BLOCK_HDRSIZE + bp->used;
+    bp->used += size;
+    return p;
+  }
+
+  if (size > ap->bsize/4) {
+    /* Big allocation - give it a block of its own behind the current one */
+    bp = _arena_block_new(size);
+    if (!bp)
+      return NULL;
+
+    bp->used = size;
+    if (ap->head) {
+      bp->next = ap->head->next;
+      ap->head->next = bp;
+    } else
+      ap->head = bp;
+    
+    return (char *) bp + ARENA_BLOCK_HDRSIZE;
+  }
+
+  if (ap->spare) {
+    bp = ap->spare;
+    ap->spare = bp->next;
+  } else {
+    bp = _arena_block_new(ap->bsize);
+    if (!bp)
+      return NULL;
+  }
+  
+  bp->next = ap->head;
+  ap->head = bp;
+
+  bp->used = size;
+  return (char *) bp + ARENA_BLOCK_HDRSIZE;
+}
+
+
+char *
+arena_strdup(ARENA *ap,
+	     const char *s) {
+  size_t len;
+  char *ns;
+
+  
+  if (!s)
+    return NULL;
+
+  len = strlen(s)+1;
+  ns = arena_alloc(ap, len);
+  if (!ns)
+    return NULL;
+  
+  memcpy(ns, s, len);
+  return ns;
+}
+
+
+/*
+ * Release everything allocated from the arena. Normal sized blocks
+ * are kept for reuse, big ones are returned to the system.
+ */
+void
+arena_reset(ARENA *ap) {
+  ARENA_BLOCK *bp, *nbp;
+
+  
+  if (!ap)
+    return;
+  
+  for (bp = ap->head; bp; bp = nbp) {
+    nbp = bp->next;
+    
+    if (bp->size == ap->bsize) {
+      bp->used = 0;
+      bp->next = ap->spare;
+      ap->spare = bp;
+    } else
+      free(bp);
+  }
+  
+  ap->head = NULL;
+}
+
+
+void
+arena_destroy(ARENA *ap) {
+  ARENA_BLOCK *bp, *nbp;
+
+  
+  if (!ap)
+    return;
+
+  arena_reset(ap);
+  
+  for (bp = ap->spare; bp; bp = nbp) {
+    nbp = bp->next;
+    free(bp);
+  }
+  
+  free(ap);
+}
@@ -31,6 +31,8 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -332,7 +334,7 @@ strnlen(const char *s,
 #endif
 
 
-static int xattr_flags = 0;
+static THREAD_LOCAL int xattr_flags = 0;
 
 
 static int
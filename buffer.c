@@ -34,6 +34,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -117,6 +118,84 @@ buf_puts(BUFFER *bp,
 
 
 
+/*
+ * Make sure there is room for at least 'n' more characters (plus
+ * a terminating NUL). Grows geometrically.
+ */
+int
+buf_reserve(BUFFER *bp,
+	    int n)
+{
+    int nsize;
+    char *nbuf;
+
+    
+    if (bp->len + n <= bp->size)
+	return 0;
+
+    nsize = bp->size ? bp->size : 256;
+    while (nsize < bp->len + n)
+	nsize *= 2;
+
+    nbuf = realloc(bp->buf, nsize+1);
+    if (!nbuf)
+	return -1;
+
+    memset(nbuf+bp->len, 0, nsize+1-bp->len);
+    bp->buf = nbuf;
+    bp->size = nsize;
+    return 0;
+}
+
+
+int
+buf_putn(BUFFER *bp,
+	 const char *s,
+	 int n)
+{
+    if (buf_reserve(bp, n) < 0)
+	return -1;
+
+    memcpy(bp->buf+bp->len, s, n);
+    bp->len += n;
+    bp->buf[bp->len] = '\0';
+    return bp->len;
+}
+
+
+int
+buf_printf(BUFFER *bp,
+	   const char *fmt,
+	   ...)
+{
+    va_list ap;
+    int n, avail;
+
+
+    avail = bp->buf ? bp->size - bp->len : 0;
+    
+    va_start(ap, fmt);
+    n = vsnprintf(bp->buf ? bp->buf+bp->len : NULL, bp->buf ? avail+1 : 0, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+	return -1;
+
+    if (n > avail)
+    {
+	if (buf_reserve(bp, n) < 0)
+	    return -1;
+	
+	va_start(ap, fmt);
+	n = vsnprintf(bp->buf+bp->len, n+1, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+	    return -1;
+    }
+
+    bp->len += n;
+    return bp->len;
+}
+
 
 char *
 buf_getall(BUFFER *bp)
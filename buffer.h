@@ -62,6 +62,20 @@ extern int
 buf_puts(BUFFER *bp,
 	 const char *s);
 
+extern int
+buf_reserve(BUFFER *bp,
+	    int n);
+
+extern int
+buf_putn(BUFFER *bp,
+	 const char *s,
+	 int n);
+
+extern int
+buf_printf(BUFFER *bp,
+	   const char *fmt,
+	   ...);
+
 
 extern char *
 buf_getall(BUFFER *bp);
@@ -31,6 +31,8 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +47,7 @@
 #include <ftw.h>
 #include <limits.h>
 #include <regex.h>
+#include <pthread.h>
 
 #include "acltool.h"
 #include "range.h"
@@ -52,6 +55,28 @@
 
 
 
+/*
+ * Results of a regex filter for each distinct ACE seen, so the ACE only
+ * has to be rendered & matched once and not once per file
+ */
+#define ACE_RCACHE_BUCKETS 1024
+#define ACE_RCACHE_MAX     65536
+
+typedef struct ace_rcent {
+  struct ace_rcent *next;
+  GACL_ENTRY_KEY key;
+  int tflags;        /* Text format flags */
+  int rc;            /* regexec() result */
+  char name[1];
+} ACE_RCENT;
+
+typedef struct ace_rcache {
+  pthread_mutex_t mtx;
+  unsigned int n;
+  ACE_RCENT *bv[ACE_RCACHE_BUCKETS];
+} ACE_RCACHE;
+
+
 /* 
  * ACL change request list 
  */
@@ -64,6 +89,9 @@ typedef struct ace_cr {
     /* Regex style */
     int avail;
     regex_t preg;
+    GACL_TAG_TYPE s_type;  /* Equivalent structured match (if s_name is set) */
+    char *s_name;
+    ACE_RCACHE *rcache;
 
     /* Simple style */
     gacl_entry_t ep;
@@ -87,6 +115,146 @@ typedef struct script {
 } SCRIPT;
 
 
+static void
+acecr_regfree(ACECR *cr) {
+  ACE_RCENT *rp, *next;
+  int i;
+
+  
+  regfree(&cr->filter.preg);
+  
+  if (cr->filter.s_name) {
+    free(cr->filter.s_name);
+    cr->filter.s_name = NULL;
+  }
+  
+  if (cr->filter.rcache) {
+    for (i = 0; i < ACE_RCACHE_BUCKETS; i++)
+      for (rp = cr->filter.rcache->bv[i]; rp; rp = next) {
+	next = rp->next;
+	free(rp);
+      }
+    pthread_mutex_destroy(&cr->filter.rcache->mtx);
+    free(cr->filter.rcache);
+    cr->filter.rcache = NULL;
+  }
+}
+
+
+/*
+ * Check if a regex is just a test for a specific user or group, ie
+ * "[^](user|group):<name>:[.*[$]]" with a plain <name>. Such a regex
+ * matches the text form of an ACE ("user:<name>:<perms>:<flags>:<type>")
+ * exactly when the ACE has that tag type & name - as long as the ACE
+ * name has no ':' in it and <name> could not also match the permissions
+ * field (14 permission characters).
+ */
+static int
+regex_to_structured(const char *re,
+		    GACL_TAG_TYPE *typep,
+		    char **namep) {
+  const char *cp, *np;
+  size_t len;
+
+  
+  cp = re;
+  if (*cp == '^')
+    ++cp;
+
+  if (strncmp(cp, "user:", 5) == 0) {
+    *typep = GACL_TAG_TYPE_USER;
+    cp += 5;
+  } else if (strncmp(cp, "group:", 6) == 0) {
+    *typep = GACL_TAG_TYPE_GROUP;
+    cp += 6;
+  } else
+    return 0;
+
+  for (np = cp; isalnum((unsigned char) *cp) || *cp == '_' || *cp == '-' || *cp == '@'; ++cp)
+    ;
+  len = cp-np;
+  if (len == 0 || *cp++ != ':')
+    return 0;
+
+  if (*cp && strcmp(cp, ".*") != 0 && strcmp(cp, ".*$") != 0)
+    return 0;
+  
+  if (len == 14 && strspn(np, "rwxpdDaARWcCos-") >= len)
+    return 0;
+
+  *namep = strndup(np, len);
+  return *namep ? 1 : -1;
+}
+
+
+/*
+ * Match an ACE against the regex filter of a change request.
+ * Returns 0 (match), REG_NOMATCH or another regexec() error code
+ */
+static int
+acecr_regexec(ACECR *cr,
+	      gacl_entry_t ae,
+	      int tflags,
+	      char *buf,
+	      size_t bufsize) {
+  ACE_RCACHE *rcp = cr->filter.rcache;
+  ACE_RCENT *rp;
+  GACL_ENTRY_KEY key;
+  unsigned int h;
+  const char *cp;
+  int rc;
+
+  
+  if (cr->filter.s_name && !strchr(ae->tag.name, ':'))
+    return (ae->tag.type == cr->filter.s_type &&
+	    strcmp(ae->tag.name, cr->filter.s_name) == 0) ? 0 : REG_NOMATCH;
+
+  gacl_entry_key_np(ae, &key);
+  h = key.tag * 2654435761U ^ key.ugid * 40503U ^ key.perms * 97U ^ key.flags ^ tflags;
+  for (cp = ae->tag.name; *cp; cp++)
+    h = h * 31 + (unsigned char) *cp;
+  h %= ACE_RCACHE_BUCKETS;
+  
+  if (rcp) {
+    pthread_mutex_lock(&rcp->mtx);
+    for (rp = rcp->bv[h]; rp; rp = rp->next)
+      if (memcmp(&rp->key, &key, sizeof(key)) == 0 && rp->tflags == tflags &&
+	  strcmp(rp->name, ae->tag.name) == 0)
+	break;
+    rc = rp ? rp->rc : -1;
+    pthread_mutex_unlock(&rcp->mtx);
+    if (rc >= 0)
+      return rc;
+  }
+  
+  if (gacl_entry_to_text(ae, buf, bufsize, tflags) < 0)
+    return -1;
+  
+  rc = regexec(&cr->filter.preg, buf, 0, NULL, 0);
+  if (rc != 0 && rc != REG_NOMATCH)
+    return rc;
+  
+  if (rcp && (rp = malloc(sizeof(*rp) + strlen(ae->tag.name))) != NULL) {
+    rp->key = key;
+    rp->tflags = tflags;
+    rp->rc = rc;
+    strcpy(rp->name, ae->tag.name);
+    
+    pthread_mutex_lock(&rcp->mtx);
+    if (rcp->n < ACE_RCACHE_MAX) {
+      rp->next = rcp->bv[h];
+      rcp->bv[h] = rp;
+      rcp->n++;
+      rp = NULL;
+    }
+    pthread_mutex_unlock(&rcp->mtx);
+    free(rp);
+  }
+  
+  return rc;
+}
+
+
 /* 
  * acl    = <who>:<perms>[:<flags>][:<type>]
  * match  = acl
@@ -130,7 +298,7 @@ acecr_from_text(ACECR **head,
 	if (cur->filter.ep)
 	  free(cur->filter.ep);
 	else
-	  regfree(&cur->filter.preg);
+	  acecr_regfree(cur);
       }
       if (cur->change.data)
 	free(cur->change.data);
@@ -146,7 +314,7 @@ acecr_from_text(ACECR **head,
   
   bp = tbuf = s_dup(buf);
   if (!tbuf)
-    return -1;
+    error_return(-1, saved_error_env);
 
   /* Locate end of program list */
   next = head;
@@ -219,6 +387,13 @@ acecr_from_text(ACECR **head,
 	  regerror(ec, &cur->filter.preg, errbuf, sizeof(errbuf));
 	  return error(1, 0, "%s: Regex: %s", es, errbuf);
 	}
+
+	if (regex_to_structured(es, &cur->filter.s_type, &cur->filter.s_name) == 0) {
+	  cur->filter.rcache = calloc(1, sizeof(ACE_RCACHE));
+	  if (!cur->filter.rcache)
+	    return error(1, errno, "Malloc");
+	  pthread_mutex_init(&cur->filter.rcache->mtx, NULL);
+	}
       } else {
 	cur->filter.ep = malloc(sizeof(*(cur->filter.ep)));
 	if (!cur->filter.ep) {
@@ -241,7 +416,7 @@ acecr_from_text(ACECR **head,
       ++es;
     
     if (!isalpha(*es)) {
-      return error(1, 0, "%s: Invalid ACL Entry");
+      return error(1, 0, "%s: Invalid ACL Entry", es);
       goto Fail;
     }
     
@@ -277,13 +452,16 @@ acecr_from_text(ACECR **head,
 	goto Fail;
       }
     }
+
+    if (!cur->change.ep && strchr("ai=sS", cur->cmd))
+      return error(1, 0, "%c: Missing ACL Entry", cur->cmd);
     
     *next = cur;
     next = &cur->next;
   }
 
   free(tbuf);
-  return 0;
+  error_return(0, saved_error_env);
 
  Fail:
   if (tbuf)
@@ -293,7 +471,7 @@ acecr_from_text(ACECR **head,
       if (cur->filter.ep)
 	free(cur->filter.ep);
       else
-	regfree(&cur->filter.preg);
+	acecr_regfree(cur);
     }
     if (cur->change.data)
       free(cur->change.data);
@@ -305,7 +483,7 @@ acecr_from_text(ACECR **head,
   }
   
   errno = EINVAL;
-  return -1;
+  error_return(-1, saved_error_env);
 }
 
 
@@ -426,7 +604,7 @@ acecr_from_simple_text(ACECR **head,
       if (cur->filter.ep)
 	free(cur->filter.ep);
       else
-	regfree(&cur->filter.preg);
+	acecr_regfree(cur);
     }
     if (cur->change.data)
       free(cur->change.data);
@@ -599,6 +777,69 @@ cmd_edit_crace(ACECR *cr,
   return cmd_edit_ace(oae, cr->change.ep);
   
 }
+
+/* Check if cmd_edit_ace() would modify the old ACE */
+static int
+cmd_edit_ace_changes(gacl_entry_t oae,
+		     gacl_entry_t nae) {
+  if (oae->tag.type != nae->tag.type)
+    return 1;
+  
+  if ((nae->tag.type == GACL_TAG_TYPE_USER || nae->tag.type == GACL_TAG_TYPE_GROUP) &&
+      oae->tag.ugid != nae->tag.ugid)
+    return 1;
+
+  return (oae->perms != nae->perms ||
+	  oae->flags != nae->flags ||
+	  oae->type != nae->type);
+}
+
+/* 
+ * Apply a change request to the ACE at position 'p'. The ACL is only
+ * written to (and hence copied if shared) if the ACE actually changes.
+ */
+static int
+cmd_edit_crace_at(ACECR *cr,
+		  gacl_t ap,
+		  int p) {
+  gacl_entry_t ae;
+  int rc;
+
+
+  rc = _gacl_peek_entry(ap, p, &ae);
+  if (rc <= 0)
+    return rc;
+
+  if (!cmd_edit_ace_changes(ae, cr->change.ep))
+    return 1;
+
+  if (_gacl_get_entry(ap, p, &ae) < 0)
+    return -1;
+
+  return cmd_edit_crace(cr, ae);
+}
+/* 
+ * Get the positions to check for a filter as a bitset. Returns the
+ * number of positions
+ */
+static int
+range_filter_select(RANGE *old,
+		    gacl_t ap,
+		    uint64_t *bv) {
+  int i, nw = RANGE_BITS_WORDS(ap->ac);
+
+  
+  if (old)
+    return range_to_bits(old, bv, ap->ac);
+
+  /* Whole ACL */
+  for (i = 0; i < nw; i++)
+    bv[i] = ~(uint64_t) 0;
+  if (ap->ac%64)
+    bv[nw-1] = ((uint64_t) 1 << (ap->ac%64))-1;
+  return ap->ac;
+}
+
 RANGE *
 range_filter(RANGE *old, gacl_entry_t fae, int flags, gacl_t ap) {
   RANGE *new = NULL;
@@ -606,6 +847,23 @@ range_filter(RANGE *old, gacl_entry_t fae, int flags, gacl_t ap) {
   int p;
   
 
+  if (ap->ac <= RANGE_BITS_MAX) {
+    /* Small ACL - collect matches in a bitset */
+    uint64_t sel[RANGE_BITS_WORDS(RANGE_BITS_MAX)];
+    uint64_t res[RANGE_BITS_WORDS(RANGE_BITS_MAX)];
+
+    if (range_filter_select(old, ap, sel) < 1)
+      return NULL;
+
+    memset(res, 0, sizeof(res));
+    p = -1;
+    while ((p = range_bits_next(sel, ap->ac, p)) >= 0)
+      if (_gacl_peek_entry(ap, p, &ae) == 1 && ace_match(ae, fae, flags) == 1)
+	RANGE_BITS_SET(res, p);
+
+    return range_from_bits(res, ap->ac);
+  }
+  
   if (old) {
     /* Just check selected entries */
     
@@ -617,7 +875,7 @@ range_filter(RANGE *old, gacl_entry_t fae, int flags, gacl_t ap) {
       if (p == RANGE_END)
 	p = ap->ac-1;
       
-      if (_gacl_get_entry(ap, p, &ae) < 0)
+      if (_gacl_peek_entry(ap, p, &ae) < 0)
 	continue;
   
       if (ace_match(ae, fae, flags) == 1)
@@ -628,7 +886,7 @@ range_filter(RANGE *old, gacl_entry_t fae, int flags, gacl_t ap) {
     }
   } else {
     /* Scan whole ACL */
-    for (p = 0; gacl_get_entry(ap, p == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; p++) {
+    for (p = 0; _gacl_peek_entry(ap, p, &ae) == 1; p++) {
       if (ace_match(ae, fae, flags) == 1) {
 	range_add(&new, p, p);
       }
@@ -641,8 +899,7 @@ range_filter(RANGE *old, gacl_entry_t fae, int flags, gacl_t ap) {
 
 RANGE *
 range_filter_regex(RANGE *old,
-		   regex_t *preg,
-		   int flags,
+		   ACECR *cr,
 		   gacl_t ap) {
   RANGE *new = NULL;
   gacl_entry_t ae;
@@ -650,6 +907,38 @@ range_filter_regex(RANGE *old,
   char buf[1024], errbuf[1024];
   int rc;
 
+  if (ap->ac <= RANGE_BITS_MAX) {
+    /* Small ACL - collect matches in a bitset */
+    uint64_t sel[RANGE_BITS_WORDS(RANGE_BITS_MAX)];
+    uint64_t res[RANGE_BITS_WORDS(RANGE_BITS_MAX)];
+
+    if (range_filter_select(old, ap, sel) < 1)
+      return NULL;
+
+    memset(res, 0, sizeof(res));
+    p = -1;
+    while ((p = range_bits_next(sel, ap->ac, p)) >= 0) {
+      if (_gacl_peek_entry(ap, p, &ae) != 1)
+	continue;
+      
+      rc = acecr_regexec(cr, ae, old ? 0 : GACL_TEXT_STANDARD, buf, sizeof(buf));
+      switch (rc) {
+      case -1:
+	break;
+      case 0:
+	RANGE_BITS_SET(res, p);
+      case REG_NOMATCH:
+	break;
+      default:
+	regerror(rc, &cr->filter.preg, errbuf, sizeof(errbuf));
+	error(1, 0, "%s: Regex: %s", buf, errbuf);
+	return NULL;
+      }
+    }
+
+    return range_from_bits(res, ap->ac);
+  }
+  
   if (old) {
     /* Just check selected entries */
     
@@ -661,20 +950,19 @@ range_filter_regex(RANGE *old,
       if (p == RANGE_END)
 	p = ap->ac-1;
       
-      if (_gacl_get_entry(ap, p, &ae) < 0)
+      if (_gacl_peek_entry(ap, p, &ae) < 0)
 	continue;
 
-      if (gacl_entry_to_text(ae, buf, sizeof(buf), 0) < 0)
-	continue;
-      
-      rc = regexec(preg, buf, 0, NULL, 0);
+      rc = acecr_regexec(cr, ae, 0, buf, sizeof(buf));
       switch (rc) {
+      case -1:
+	break;
       case 0:
 	range_add(&new, p, p);
       case REG_NOMATCH:
 	break;
       default:
-	regerror(rc, preg, errbuf, sizeof(errbuf));
+	regerror(rc, &cr->filter.preg, errbuf, sizeof(errbuf));
 	error(1, 0, "%s: Regex: %s", buf, errbuf);
 	return NULL;
       }
@@ -684,18 +972,17 @@ range_filter_regex(RANGE *old,
     }
   } else {
     /* Scan whole ACL */
-    for (p = 0; gacl_get_entry(ap, p == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; p++) {
-      if (gacl_entry_to_text(ae, buf, sizeof(buf), GACL_TEXT_STANDARD) < 0)
-	continue;
-
-      rc = regexec(preg, buf, 0, NULL, 0);
+    for (p = 0; _gacl_peek_entry(ap, p, &ae) == 1; p++) {
+      rc = acecr_regexec(cr, ae, GACL_TEXT_STANDARD, buf, sizeof(buf));
       switch (rc) {
+      case -1:
+	break;
       case 0:
 	range_add(&new, p, p);
       case REG_NOMATCH:
 	break;
       default:
-	regerror(rc, preg, errbuf, sizeof(errbuf));
+	regerror(rc, &cr->filter.preg, errbuf, sizeof(errbuf));
 	error(1, 0, "%s: Regex: %s", buf, errbuf);
 	return NULL;
       }
@@ -707,7 +994,7 @@ range_filter_regex(RANGE *old,
 
 
 
-static SCRIPT *edit_script = NULL;
+static THREAD_LOCAL SCRIPT *edit_script = NULL;
 
 static int
 script_add(SCRIPT **spp,
@@ -742,7 +1029,7 @@ acecr_free(ACECR *cr) {
       if (cr->filter.ep)
 	free(cr->filter.ep);
       else
-	regfree(&cr->filter.preg);
+	acecr_regfree(cr);
     }
     if (cr->change.data)
       free(cr->change.data);
@@ -773,265 +1060,601 @@ script_free(SCRIPT **spp) {
 }
   
 
+/*
+ * Compiled form of the edit script. Built once per edit-access command
+ * and then shared (read-only) by all files being processed.
+ */
+typedef struct edit_step {
+  ACECR *cr;
+  int chain;        /* Script chain this step belongs to */
+  int nblock;       /* Block head: number of steps with the same file types */
+  int rlen;         /* range_len(cr->range) */
+  int rlast_rc;     /* range_last(cr->range) */
+  int rlast;
+  int first_only;   /* Substitute: stop at first match (no 'g' modifier) */
+} EDIT_STEP;
+
+/*
+ * Memo of script results. Trees usually contain only a handful of
+ * distinct ACLs so the result of running the script (after sort/merge)
+ * is remembered per input ACL and file type.
+ */
+#define EDIT_MEMO_BUCKETS 1024
+#define EDIT_MEMO_MAX     4096
+
+typedef struct edit_memo_entry {
+  struct edit_memo_entry *next;
+  GACL_FINGERPRINT fp;
+  mode_t ftype;
+  gacl_t iap;       /* Input ACL */
+  gacl_t rap;       /* Resulting (prepared) ACL */
+} EDIT_MEMO_ENTRY;
+
+typedef struct edit_memo {
+  pthread_mutex_t mtx;
+  unsigned int n;
+  EDIT_MEMO_ENTRY *bv[EDIT_MEMO_BUCKETS];
+} EDIT_MEMO;
+
+typedef struct edit_plan {
+  EDIT_STEP *sv;
+  int sc;
+  mode_t ftypes;    /* File types any step applies to (0 = all) */
+  int readonly;     /* Only print commands */
+  EDIT_MEMO *memo;  /* NULL if the script has side effects (printing) */
+} EDIT_PLAN;
+
+
+static void
+edit_memo_free(EDIT_MEMO *mp) {
+  EDIT_MEMO_ENTRY *ep;
+  int i;
+
+  
+  if (!mp)
+    return;
+  
+  for (i = 0; i < EDIT_MEMO_BUCKETS; i++) {
+    while ((ep = mp->bv[i]) != NULL) {
+      mp->bv[i] = ep->next;
+      gacl_free(ep->iap);
+      gacl_free(ep->rap);
+      free(ep);
+    }
+  }
+  pthread_mutex_destroy(&mp->mtx);
+  free(mp);
+}
+
+/*
+ * Private copy of an ACL, not sharing anything with the source and
+ * not allocated from the per-file arena so it survives until the
+ * memo is freed.
+ */
+static gacl_t
+edit_memo_acl_copy(gacl_t ap) {
+  void *(*allocf)(void *ctx, size_t size);
+  void *ctx;
+  gacl_t nap;
+  int i;
+
+  
+  gacl_get_allocator_np(&allocf, &ctx);
+  gacl_set_allocator_np(NULL, NULL);
+  
+  /* Memo copies never grow - no need for the default spare entries */
+  nap = gacl_init_exact_np(ap->ac);
+  if (nap) {
+    nap->type = ap->type;
+    strcpy(nap->owner, ap->owner);
+    strcpy(nap->group, ap->group);
+    for (i = 0; i < ap->ac; i++)
+      nap->av[i] = ap->av[i];
+    nap->ac = ap->ac;
+  }
+  
+  gacl_set_allocator_np(allocf, ctx);
+  return nap;
+}
+
+static unsigned int
+edit_memo_hash(GACL_FINGERPRINT *fp,
+	       mode_t ftype) {
+  return (unsigned int) ((fp->h[0] ^ (uint64_t) ftype) % EDIT_MEMO_BUCKETS);
+}
+
+/* The fingerprint ignores names, but regex filters look at them */
 static int
-walker_edit(const char *path,
-	    const struct stat *sp,
-	    size_t base,
-	    size_t level,
-	    void *vp) {
-  gacl_t oap = NULL;
-  gacl_t nap = NULL;
-  SCRIPT *script = NULL;
-  int rc = 0;
-  int pos = 0;
-  int p_line = 0;
-  jmp_buf saved_error_env;
+edit_memo_same_acl(gacl_t ap,
+		   gacl_t mp) {
+  int i;
 
+  
+  if (gacl_match(ap, mp) != 1)
+    return 0;
+  
+  for (i = 0; i < ap->ac; i++)
+    if (strcmp(ap->av[i].tag.name, mp->av[i].tag.name) != 0)
+      return 0;
+  
+  return 1;
+}
 
-  if ((rc = error_catch(saved_error_env)) != 0) {
-    if (oap)
-      gacl_free(oap);
-    if(nap)
-      gacl_free(nap);
+/* Entries are never modified or removed once added so no lock is held on return */
+static EDIT_MEMO_ENTRY *
+edit_memo_get(EDIT_MEMO *mp,
+	      GACL_FINGERPRINT *fp,
+	      mode_t ftype,
+	      gacl_t ap) {
+  EDIT_MEMO_ENTRY *ep;
+  unsigned int h = edit_memo_hash(fp, ftype);
 
-    error_return(rc, saved_error_env);
+  
+  pthread_mutex_lock(&mp->mtx);
+  for (ep = mp->bv[h]; ep; ep = ep->next)
+    if (ep->ftype == ftype &&
+	memcmp(&ep->fp, fp, sizeof(*fp)) == 0 &&
+	edit_memo_same_acl(ap, ep->iap))
+      break;
+  pthread_mutex_unlock(&mp->mtx);
+  
+  return ep;
+}
+
+static void
+edit_memo_add(EDIT_MEMO *mp,
+	      GACL_FINGERPRINT *fp,
+	      mode_t ftype,
+	      gacl_t iap,
+	      gacl_t rap) {
+  EDIT_MEMO_ENTRY *ep;
+  unsigned int h = edit_memo_hash(fp, ftype);
+
+  
+  if (mp->n >= EDIT_MEMO_MAX)
+    return;
+  
+  ep = malloc(sizeof(*ep));
+  if (!ep)
+    return;
+
+  ep->fp = *fp;
+  ep->ftype = ftype;
+  ep->iap = edit_memo_acl_copy(iap);
+  ep->rap = edit_memo_acl_copy(rap);
+  if (!ep->iap || !ep->rap) {
+    if (ep->iap)
+      gacl_free(ep->iap);
+    if (ep->rap)
+      gacl_free(ep->rap);
+    free(ep);
+    return;
   }
   
-  rc = get_acl(path, sp, &oap);  
-  if (rc < 0)
-    return error(1, errno, "%s: Getting ACL", path);
-  if (rc == 0)
-    error_return(0, saved_error_env);
+  pthread_mutex_lock(&mp->mtx);
+  if (mp->n < EDIT_MEMO_MAX) {
+    ep->next = mp->bv[h];
+    mp->bv[h] = ep;
+    mp->n++;
+    ep = NULL;
+  }
+  pthread_mutex_unlock(&mp->mtx);
 
-  nap = gacl_dup(oap);
-  if (!nap) {
-    int ec = errno;
-    
-    gacl_free(oap);
-    return error(1, ec, "%s: Internal Fault (gacl_dup)", path);
+  if (ep) {
+    gacl_free(ep->iap);
+    gacl_free(ep->rap);
+    free(ep);
   }
+}
 
-  /* Execute script - all registered CR chains in sequence */
-  for (script = (SCRIPT *) vp; script; script = script->next) {
-    ACECR *cr = script->cr;
 
-    /* Loop around executing each CR until end or one gives an error */
-    for (rc = 0; rc == 0 && cr; cr = cr->next) {
-      gacl_entry_t nae;
-      int p1, p;
-      int nm = 0;
-      RANGE *range = NULL;
+static void
+edit_plan_free(EDIT_PLAN *pp) {
+  free(pp->sv);
+  pp->sv = NULL;
+  pp->sc = 0;
+  edit_memo_free(pp->memo);
+  pp->memo = NULL;
+}
 
-      
-      /* Make sure this change request is valid for this file type */
-      if (cr->ftypes && (sp->st_mode & cr->ftypes) == 0)
-	continue;
+static int
+edit_plan_compile(EDIT_PLAN *pp,
+		  SCRIPT *script) {
+  SCRIPT *sp;
+  ACECR *cr;
+  EDIT_STEP *stp;
+  int n, chain, all_types = 0, has_print = 0, head = -1;
 
-      if (cr->filter.avail) {
-	if (cr->filter.ep)
-	  range = range_filter(cr->range, cr->filter.ep, cr->filter.type, nap);
-	else
-	  range = range_filter_regex(cr->range, &cr->filter.preg, cr->filter.type, nap);
-	if (!range && cr->cmd != 'S')
-	  continue;
+  
+  memset(pp, 0, sizeof(*pp));
+  pp->readonly = 1;
+  
+  n = 0;
+  for (sp = script; sp; sp = sp->next)
+    for (cr = sp->cr; cr; cr = cr->next)
+      ++n;
+  
+  pp->sv = calloc(n ? n : 1, sizeof(EDIT_STEP));
+  if (!pp->sv)
+    return -1;
+
+  for (chain = 0, sp = script; sp; sp = sp->next, chain++) {
+    for (cr = sp->cr; cr; cr = cr->next) {
+      stp = &pp->sv[pp->sc];
+      
+      stp->cr = cr;
+      stp->chain = chain;
+      stp->rlen = range_len(cr->range);
+      stp->rlast_rc = range_last(cr->range, &stp->rlast);
+      stp->first_only = (cr->modifiers && !strchr(cr->modifiers, 'g'));
+
+      /* Fuse consecutive steps of a chain with the same file types into one block */
+      if (head >= 0 && pp->sv[head].chain == chain && pp->sv[head].cr->ftypes == cr->ftypes)
+	pp->sv[head].nblock++;
+      else {
+	head = pp->sc;
+	stp->nblock = 1;
       }
+      
+      if (cr->ftypes)
+	pp->ftypes |= cr->ftypes;
       else
-	range = cr->range;
-
-      switch (cr->cmd) {
-      case 'd': /* Delete ACEs - do it backwards */
-	if (range_len(range) > 0) {
-	  p = RANGE_NONE;
-	  while (range_prev(range, &p) == 1) {
-	    if (p == RANGE_END)
-	      p = nap->ac-1;
-	    if (gacl_delete_entry_np(nap, p) < 0) {
-	      rc = -1;
-	      break;
-	    }
-	  }
-	  pos = p;
-	} else {
-	  if (gacl_delete_entry_np(nap, pos) < 0) {
+	all_types = 1;
+
+      if (cr->cmd != 'p' && cr->cmd != 'n')
+	pp->readonly = 0;
+      else
+	has_print = 1;
+      
+      pp->sc++;
+    }
+  }
+
+  if (all_types)
+    pp->ftypes = 0;
+
+  /* Scripts that print need to run for every file */
+  if (!pp->readonly && !has_print) {
+    pp->memo = calloc(1, sizeof(*pp->memo));
+    if (!pp->memo)
+      return -1;
+    pthread_mutex_init(&pp->memo->mtx, NULL);
+  }
+  
+  return 0;
+}
+
+
+/*
+ * Run the compiled script on 'nap' (modified in place). Errors in
+ * a step skip the rest of that chain, fatal errors longjmp via error()
+ */
+static int
+edit_plan_exec(EDIT_PLAN *plan,
+	       const char *path,
+	       const struct stat *sp,
+	       gacl_t nap) {
+  int rc = 0;
+  int pos = 0;
+  int p_line = 0;
+  int i;
+
+
+  for (i = 0; i < plan->sc; i++) {
+    EDIT_STEP *stp = &plan->sv[i];
+    ACECR *cr = stp->cr;
+    gacl_entry_t nae;
+    int p1, p;
+    int nm = 0;
+    RANGE *range = NULL;
+    int rlen, lrc;
+
+    
+    if (i == 0 || stp->chain != plan->sv[i-1].chain)
+      rc = 0;
+    else if (rc != 0)
+      continue;
+
+    /* Make sure this block of change requests is valid for this file type */
+    if (stp->nblock && cr->ftypes && (sp->st_mode & cr->ftypes) == 0) {
+      i += stp->nblock-1;
+      continue;
+    }
+    
+    if (cr->filter.avail) {
+      if (cr->filter.ep)
+	range = range_filter(cr->range, cr->filter.ep, cr->filter.type, nap);
+      else
+	range = range_filter_regex(cr->range, cr, nap);
+      if (!range && cr->cmd != 'S')
+	continue;
+      rlen = range_len(range);
+    } else {
+      range = cr->range;
+      rlen = stp->rlen;
+    }
+
+    switch (cr->cmd) {
+    case 'd': /* Delete ACEs - do it backwards */
+      if (rlen > 0) {
+	p = RANGE_NONE;
+	while (range_prev(range, &p) == 1) {
+	  if (p == RANGE_END)
+	    p = nap->ac-1;
+	  if (gacl_delete_entry_np(nap, p) < 0) {
 	    rc = -1;
 	    break;
 	  }
 	}
-	break;
+	pos = p;
+      } else {
+	if (gacl_delete_entry_np(nap, pos) < 0) {
+	  rc = -1;
+	  break;
+	}
+      }
+      break;
 	
-      case 'n': /* Print ACE(s), with line numbers */
-	p_line = 1;
-      case 'p': /* Print ACE(s) */
-	if (range_len(range) > 0) {
-	  p = RANGE_NONE;
-	  while (range_next(range, &p) == 1) {
-	    if (p == RANGE_END)
-	      p = nap->ac-1;
-
-	    if (!config.f_noprefix)
-	      printf("%-20s\t", path);
-	    if (p_line)
-	      printf("%-4d\t", p);
-	    if (print_ace(nap, p, GACL_TEXT_STANDARD) < 0) {
-	      rc = -1;
-	      break;
-	    }
-	    
-	    if (p >= nap->ac-1)
-	      break;
-	  }
-	  pos = p;
-	} else {
+    case 'n': /* Print ACE(s), with line numbers */
+      p_line = 1;
+    case 'p': /* Print ACE(s) */
+      if (rlen > 0) {
+	p = RANGE_NONE;
+	while (range_next(range, &p) == 1) {
+	  if (p == RANGE_END)
+	    p = nap->ac-1;
+
 	  if (!config.f_noprefix)
 	    printf("%-20s\t", path);
 	  if (p_line)
-	    printf("%-4d\t", pos);
-	  if (print_ace(nap, pos, GACL_TEXT_STANDARD) < 0) {
+	    printf("%-4d\t", p);
+	  if (print_ace(nap, p, GACL_TEXT_STANDARD) < 0) {
 	    rc = -1;
 	    break;
 	  }
+	    
+	  if (p >= nap->ac-1)
+	    break;
 	}
-	break;
-	
-      case 'a': /* Append ACE after position */
-      case 'i': /* Insert ACE at position */
-	if (range_last(range, &p1) != 1)
-	  p1 = pos;
-	if (cr->cmd == 'a')
-	  ++p1;
-	if (gacl_create_entry_np(&nap, &nae, p1) < 0)
-	  return error(1, errno, "Creating ACL Entry @ %d", p1);
-	else if (gacl_copy_entry(nae, cr->change.ep) < 0)
-	  return error(1, errno, "Copying ACL Entry");
-	break;
-	
-      case '=': /* Replace ACE at position */
-	if (range_last(range, &p1) != 1)
-	  p1 = pos;
-	if (_gacl_get_entry(nap, p1, &nae) < 0)
-	  rc = -1;
-	else if (gacl_copy_entry(nae, cr->change.ep) < 0)
+	pos = p;
+      } else {
+	if (!config.f_noprefix)
+	  printf("%-20s\t", path);
+	if (p_line)
+	  printf("%-4d\t", pos);
+	if (print_ace(nap, pos, GACL_TEXT_STANDARD) < 0) {
 	  rc = -1;
-	break;
+	  break;
+	}
+      }
+      break;
 	
-      case 'x': /* eXchange ACEs p1<->p2 */
+    case 'a': /* Append ACE after position */
+    case 'i': /* Insert ACE at position */
+      if (range == cr->range) {
+	p1 = stp->rlast;
+	lrc = stp->rlast_rc;
+      } else
+	lrc = range_last(range, &p1);
+      if (lrc != 1)
+	p1 = pos;
+      if (cr->cmd == 'a')
+	++p1;
+      if (gacl_create_entry_np(&nap, &nae, p1) < 0)
+	return error(1, errno, "Creating ACL Entry @ %d", p1);
+      else if (gacl_copy_entry(nae, cr->change.ep) < 0)
+	return error(1, errno, "Copying ACL Entry");
+      break;
+	
+    case '=': /* Replace ACE at position */
+      if (range == cr->range) {
+	p1 = stp->rlast;
+	lrc = stp->rlast_rc;
+      } else
+	lrc = range_last(range, &p1);
+      if (lrc != 1)
+	p1 = pos;
+      if (_gacl_get_entry(nap, p1, &nae) < 0)
 	rc = -1;
-	errno = ENOSYS;
-	break;
+      else if (gacl_copy_entry(nae, cr->change.ep) < 0)
+	rc = -1;
+      break;
 	
-      case 's': /* Substitue ACEs */
-      case 'S': /* Substitue ACEs (simple-change) */
-	if (!range && cr->cmd == 'S') {
-	  GACL_ENTRY *oep = cr->change.ep;
-
-	  /* 
-	   * Try to find optimal insertion point for a new ACE. This code assumes the 
-	   * ACL is sorted where users < groups < everyone and with deny < allow.
-	   */
-	  for (pos = 0; pos < nap->ac; ++pos) {
-	    GACL_ENTRY *nep = &nap->av[pos];
+    case 'x': /* eXchange ACEs p1<->p2 */
+      rc = -1;
+      errno = ENOSYS;
+      break;
+	
+    case 's': /* Substitue ACEs */
+    case 'S': /* Substitue ACEs (simple-change) */
+      if (!range && cr->cmd == 'S') {
+	GACL_ENTRY *oep = cr->change.ep;
+
+	/* 
+	 * Try to find optimal insertion point for a new ACE. This code assumes the 
+	 * ACL is sorted where users < groups < everyone and with deny < allow.
+	 */
+	for (pos = 0; pos < nap->ac; ++pos) {
+	  GACL_ENTRY *nep = &nap->av[pos];
 	    
-	    if (oep->tag.type < nep->tag.type)
+	  if (oep->tag.type < nep->tag.type)
+	    break;
+	  if (oep->tag.type > nep->tag.type)
+	    continue;
+	  if (oep->tag.type == GACL_TAG_TYPE_USER || oep->tag.type == GACL_TAG_TYPE_GROUP) {
+	    if (oep->tag.ugid < nep->tag.ugid)
 	      break;
-	    if (oep->tag.type > nep->tag.type)
-	      continue;
-	    if (oep->tag.type == GACL_TAG_TYPE_USER || oep->tag.type == GACL_TAG_TYPE_GROUP) {
-	      if (oep->tag.ugid < nep->tag.ugid)
-		break;
-	      if (oep->tag.ugid > nep->tag.ugid)
-		break;
-	    }
-	    if (oep->type > nep->type)
+	    if (oep->tag.ugid > nep->tag.ugid)
 	      break;
 	  }
-	  goto AddACE;
+	  if (oep->type > nep->type)
+	    break;
 	}
+	goto AddACE;
+      }
 	
-	if (range_len(range) > 0) {
-	  gacl_entry_t ae;
-	  int p = RANGE_NONE;
+      if (rlen > 0) {
+	int p = RANGE_NONE;
 
-	  while (range_next(range, &p) == 1) {
-	    if (p == RANGE_END)
-	      p = nap->ac-1;
-	    
-	    pos = p;
+	while (range_next(range, &p) == 1) {
+	  if (p == RANGE_END)
+	    p = nap->ac-1;
 	    
-	    if (_gacl_get_entry(nap, p, &ae) < 0) {
-	      rc = -1;
-	      break;
-	    }
+	  pos = p;
 	    
-	    rc = cmd_edit_crace(cr, ae);
-	    if (rc < 0) {
-	      rc = -1;
-	      break;
-	    }
-	    if (rc == 1)
-	      ++nm;
-
-	    if (p >= nap->ac-1)
-	      break;
+	  rc = cmd_edit_crace_at(cr, nap, p);
+	  if (rc < 0) {
+	    rc = -1;
+	    break;
 	  }
-	} else {
-	  gacl_entry_t ae;
+	  if (rc == 1)
+	    ++nm;
 
-	  p = 0;
-	  while (_gacl_get_entry(nap, p, &ae) == 1) {
-	    pos = p;
+	  if (p >= nap->ac-1)
+	    break;
+	}
+      } else {
+	p = 0;
+	while (p < nap->ac) {
+	  pos = p;
 	    
-	    rc = cmd_edit_crace(cr, ae);
-	    if (rc < 0) {
-	      rc = -1;
-	      break;
-	    }
-
-	    if (rc == 1) {
-	      ++nm;
+	  rc = cmd_edit_crace_at(cr, nap, p);
+	  if (rc < 0) {
+	    rc = -1;
+	    break;
+	  }
 
-	      /* 'Global' search & replace or stop at first match? */
-	      if (cr->modifiers && !strchr(cr->modifiers, 'g'))
-		break;
-	    }
+	  if (rc == 1) {
+	    ++nm;
 
-	    ++p;
+	    /* 'Global' search & replace or stop at first match? */
+	    if (stp->first_only)
+	      break;
 	  }
-	  if (rc > 0)
-	    rc = 0;
+
+	  ++p;
 	}
+	if (rc > 0)
+	  rc = 0;
+      }
 
-	if (nm == 0) {
-	AddACE:
-	  /* Add ACE entry if no match found */
-	  if (gacl_create_entry_np(&nap, &nae, pos) < 0)
-	    return error(1, errno, "Creating ACL Entry @ %d", pos);
+      if (nm == 0) {
+      AddACE:
+	/* Add ACE entry if no match found */
+	if (gacl_create_entry_np(&nap, &nae, pos) < 0)
+	  return error(1, errno, "Creating ACL Entry @ %d", pos);
 
-	  if (gacl_copy_entry(nae, cr->change.ep) < 0)
-	    return error(1, errno, "Copying ACL Entry");
-	}
-	break;
-	
-      default:
-	errno = ENOSYS;
-	rc = -1;
+	if (gacl_copy_entry(nae, cr->change.ep) < 0)
+	  return error(1, errno, "Copying ACL Entry");
       }
+      break;
+	
+    default:
+      errno = ENOSYS;
+      rc = -1;
+    }
       
-      if (range != cr->range)
-	range_free(&range);
+    if (range != cr->range)
+      range_free(&range);
+  }
+
+  return 0;
+}
+
+
+static int
+walker_edit(const char *path,
+	    const struct stat *sp,
+	    size_t base,
+	    size_t level,
+	    void *vp) {
+  EDIT_PLAN *plan = (EDIT_PLAN *) vp;
+  gacl_t oap = NULL;
+  gacl_t nap = NULL;
+  int rc = 0;
+  int no_set, have_fp = 0;
+  GACL_FINGERPRINT fp;
+  EDIT_MEMO_ENTRY *mep;
+  jmp_buf saved_error_env;
+
+
+  /* 
+   * Unless sort/merge/force/print-all is in effect set_acl() would not
+   * do anything for an unchanged ACL, so files that no step applies to
+   * need not be read at all, and print-only scripts never write
+   */
+  no_set = !(config.f_sort || config.f_merge || config.f_force || config.f_print > 1);
+  
+  if (no_set && plan->ftypes && (sp->st_mode & plan->ftypes) == 0)
+    return 0;
+  
+  if ((rc = error_catch(saved_error_env)) != 0) {
+    if (oap)
+      gacl_free(oap);
+    if(nap)
+      gacl_free(nap);
+
+    error_return(rc, saved_error_env);
+  }
+  
+  rc = get_acl(path, sp, &oap);  
+  if (rc < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+  if (rc == 0)
+    error_return(0, saved_error_env);
+
+  if (plan->memo) {
+    have_fp = (gacl_fingerprint(oap, &fp) == 0);
+    if (have_fp && (mep = edit_memo_get(plan->memo, &fp, sp->st_mode & S_IFMT, oap)) != NULL) {
+      /* Same input ACL seen before - just write the remembered result */
+      nap = gacl_dup(mep->rap);
+      if (!nap)
+	return error(1, errno, "%s: Internal Fault (gacl_dup)", path);
+      
+      rc = set_prepared_acl(path, sp, nap, oap);
+      if (rc < 0)
+	error(1, errno, "%s: Setting ACL", path);
+      
+      gacl_free(oap);
+      gacl_free(nap);
+      error_return(0, saved_error_env);
     }
   }
+  
+  nap = gacl_dup(oap);
+  if (!nap) {
+    int ec = errno;
+    
+    gacl_free(oap);
+    oap = NULL;
+    return error(1, ec, "%s: Internal Fault (gacl_dup)", path);
+  }
+
+  edit_plan_exec(plan, path, sp, nap);
 
 #if 0  
   gacl_clean(nap);
 #endif
 
-  rc = set_acl(path, sp, nap, oap);
-  if (rc < 0)
-    error(1, errno, "%s: Setting ACL", path);
+  if (have_fp) {
+    gacl_t pap = prepare_acl(path, nap);
 
+    gacl_free(nap);
+    nap = pap;
+    edit_memo_add(plan->memo, &fp, sp->st_mode & S_IFMT, oap, nap);
+    
+    rc = set_prepared_acl(path, sp, nap, oap);
+    if (rc < 0)
+      error(1, errno, "%s: Setting ACL", path);
+  } else if (!plan->readonly || !no_set) {
+    rc = set_acl(path, sp, nap, oap);
+    if (rc < 0)
+      error(1, errno, "%s: Setting ACL", path);
+  }
+  
   gacl_free(oap);
   gacl_free(nap);
-  return 0;
+  error_return(0, saved_error_env);
 }
 
 static int
@@ -1096,6 +1719,7 @@ edit_cmd(int argc,
 	 char **argv) {
   int rc, i;
   ACECR *cr;
+  EDIT_PLAN plan;
   
 
   if (argc < 2) {
@@ -1118,13 +1742,108 @@ edit_cmd(int argc,
     return 1;
   }
 
-  rc = aclcmd_foreach(argc-i, argv+i, walker_edit, edit_script);
+  if (edit_plan_compile(&plan, edit_script) < 0) {
+    script_free(&edit_script);
+    error(1, errno, "Compiling change requests");
+  }
+  
+  rc = aclcmd_foreach(argc-i, argv+i, walker_edit, &plan);
 
+  edit_plan_free(&plan);
   script_free(&edit_script);
   return rc;
 }
 
 
+/*
+ * Edit stage for the 'pipeline' command: "edit [-e <cmds>] [-E <file>] [<change>]"
+ */
+typedef struct edit_stage {
+  SCRIPT *script;
+  EDIT_PLAN plan;
+} EDIT_STAGE;
+
+
+void *
+edit_stage_create(int argc,
+		  char **argv) {
+  EDIT_STAGE *esp;
+  ACECR *cr;
+  int i;
+
+  
+  i = opts_parse_argv(argc, argv, edit_options, NULL);
+  if (i < 0) {
+    script_free(&edit_script);
+    return NULL;
+  }
+  
+  if (!edit_script && i < argc) {
+    cr = NULL;
+    if (acecr_from_simple_text(&cr, argv[i]) < 0)
+      error(1, 0, "%s: Invalid simple change request", argv[i]);
+    if (script_add(&edit_script, cr) < 0)
+      error(1, 0, "%s: Unable to add simple change request", argv[i]);
+    ++i;
+  }
+
+  if (i < argc) {
+    script_free(&edit_script);
+    error(1, 0, "%s: Invalid argument", argv[i]);
+  }
+  
+  if (!edit_script)
+    error(1, 0, "Invalid or no change request");
+  
+  esp = malloc(sizeof(*esp));
+  if (!esp) {
+    script_free(&edit_script);
+    return NULL;
+  }
+
+  esp->script = edit_script;
+  edit_script = NULL;
+  
+  if (edit_plan_compile(&esp->plan, esp->script) < 0) {
+    script_free(&esp->script);
+    free(esp);
+    return NULL;
+  }
+
+  /* The stage sees intermediate ACLs so the result memo does not apply */
+  edit_memo_free(esp->plan.memo);
+  esp->plan.memo = NULL;
+  return esp;
+}
+
+int
+edit_stage_run(void *xp,
+	       const char *path,
+	       const struct stat *sp,
+	       gacl_t *app) {
+  EDIT_STAGE *esp = (EDIT_STAGE *) xp;
+
+  
+  if (esp->plan.ftypes && (sp->st_mode & esp->plan.ftypes) == 0)
+    return 0;
+  
+  return edit_plan_exec(&esp->plan, path, sp, *app);
+}
+
+void
+edit_stage_destroy(void *xp) {
+  EDIT_STAGE *esp = (EDIT_STAGE *) xp;
+
+  
+  if (!esp)
+    return;
+  
+  edit_plan_free(&esp->plan);
+  script_free(&esp->script);
+  free(esp);
+}
+
+
 /* Command definition */
 COMMAND edit_command =
   { "edit-access",  edit_cmd,  edit_options,  "[<change>] <path>+",  "Edit ACL(s)"  };
@@ -0,0 +1,715 @@
+/*
+ * cmd_restore.c - ACL command restore-access
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "acltool.h"
+#include "progress.h"
+
+
+
+/*
+ * Restore ACLs from "list-access" output in the default or CSV style.
+ *
+ * The dump is read a chunk at a time. Each distinct ACL text is parsed
+ * (and converted to the native form, where the OS has one) only once.
+ * The files of a chunk are grouped by ACL and handed out in slices to
+ * 'config.f_jobs' writers (the reading thread being one of them). A
+ * file whose stored ACL is byte-for-byte the native form of the new
+ * one is left alone without decoding it.
+ */
+#define RESTORE_CHUNK    (4*1024*1024)
+#define RESTORE_SLICE    64
+#define RESTORE_ACL_MAX  65536
+
+typedef struct restore_acl {
+  struct restore_acl *next;   /* Hash chain */
+  struct restore_acl *used;   /* ACLs used in the current chunk */
+  uint64_t h;
+  gacl_t ap;                  /* NULL if invalid */
+  char *native;
+  ssize_t nlen;               /* -1 if no native form */
+  size_t first;               /* Files in the current chunk */
+  size_t n;
+  size_t len;
+  char text[1];
+} RESTORE_ACL;
+
+typedef struct restore_rec {
+  const char *path;
+  RESTORE_ACL *ra;
+} RESTORE_REC;
+
+typedef struct restore {
+  RESTORE_ACL **bv;           /* ACL cache */
+  size_t bs;
+  size_t n;
+  RESTORE_ACL *used;
+  
+  RESTORE_REC *rv;            /* Files in the current chunk, in dump order */
+  size_t rc;
+  size_t rs;
+  RESTORE_REC **wv;           /* ... and grouped by ACL */
+  size_t ws;
+  size_t next;                /* Next file to handle (atomic) */
+  
+  pthread_mutex_t mtx;
+  pthread_cond_t work_cv;
+  pthread_cond_t done_cv;
+  unsigned long gen;
+  int busy;
+  int stop;
+  CONFIG config;
+  char *error_argv0;
+
+  unsigned long long files;
+  unsigned long long acls;
+  unsigned long long changed;     /* Atomic */
+  unsigned long long unchanged;   /* Atomic */
+  unsigned long long failed;      /* Atomic */
+  unsigned long long invalid;
+  unsigned long long noacl;
+} RESTORE;
+
+
+
+/* Report a problem with one object and carry on */
+static void
+restore_warn(const char *path,
+	     int ec,
+	     const char *msg) {
+  if (error_argv0)
+    fprintf(stderr, "%s: ", error_argv0);
+  
+  fprintf(stderr, "Warning: %s: %s", path, msg);
+  if (ec)
+    fprintf(stderr, ": %s", strerror(ec));
+  putc('\n', stderr);
+  
+  progress_add(PROGRESS_ERRORS, 1);
+}
+
+
+static uint64_t
+restore_hash(const char *buf,
+	     size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) buf[i];
+    h *= 1099511628211ULL;
+  }
+  
+  return h;
+}
+
+
+static void
+restore_acl_free(RESTORE *rp) {
+  RESTORE_ACL *ra;
+  size_t i;
+
+  
+  for (i = 0; i < rp->bs; i++)
+    while ((ra = rp->bv[i]) != NULL) {
+      rp->bv[i] = ra->next;
+      if (ra->ap)
+	gacl_free(ra->ap);
+      free(ra->native);
+      free(ra);
+    }
+  free(rp->bv);
+  rp->bv = NULL;
+  rp->bs = 0;
+  rp->n = 0;
+}
+
+
+/* Parse an ACL text, or find it in the cache if it has been seen before */
+static RESTORE_ACL *
+restore_acl_get(RESTORE *rp,
+		const char *text,
+		size_t len,
+		const char *path) {
+  RESTORE_ACL *ra, **nbv;
+  char buf[GACL_NATIVE_MAX], msg[80];
+  size_t i, j, ns, erroff;
+  uint64_t h;
+  
+
+  h = restore_hash(text, len);
+  if (rp->bs) {
+    for (ra = rp->bv[h & (rp->bs-1)]; ra; ra = ra->next)
+      if (ra->h == h && ra->len == len && memcmp(ra->text, text, len) == 0)
+	return ra;
+  }
+
+  if (rp->n >= rp->bs) {
+    ns = rp->bs ? rp->bs*2 : 1024;
+    nbv = calloc(ns, sizeof(*nbv));
+    if (!nbv)
+      return NULL;
+    
+    for (i = 0; i < rp->bs; i++)
+      while ((ra = rp->bv[i]) != NULL) {
+	rp->bv[i] = ra->next;
+	j = ra->h & (ns-1);
+	ra->next = nbv[j];
+	nbv[j] = ra;
+      }
+    free(rp->bv);
+    rp->bv = nbv;
+    rp->bs = ns;
+  }
+  
+  ra = calloc(1, sizeof(*ra) + len);
+  if (!ra)
+    return NULL;
+
+  ra->h = h;
+  ra->len = len;
+  memcpy(ra->text, text, len);
+  ra->nlen = -1;
+  
+  /* Listings from Linux NFSv4 ACLs have "user:name@domain" principals */
+  ra->ap = gacl_from_text_n_np(text, len, GACL_TEXT_NFS4_IDS|(config.f_relaxed ? GACL_TEXT_RELAXED : 0), &erroff);
+  if (!ra->ap) {
+    for (i = erroff; i < len && text[i] != '\n' && text[i] != ','; i++)
+      ;
+    snprintf(msg, sizeof(msg), "Invalid ACL (at \"%.*s\")",
+	     (int) (i-erroff > 40 ? 40 : i-erroff), text+erroff);
+    restore_warn(path, errno, msg);
+  } else {
+    if ((config.f_sort && gacl_sort_inplace_np(ra->ap) < 0) ||
+	(config.f_merge && gacl_merge_inplace_np(ra->ap) < 0)) {
+      gacl_free(ra->ap);
+      free(ra);
+      return NULL;
+    }
+    
+    ra->nlen = gacl_to_native_np(ra->ap, buf, sizeof(buf));
+    if (ra->nlen > 0) {
+      ra->native = malloc(ra->nlen);
+      if (ra->native)
+	memcpy(ra->native, buf, ra->nlen);
+      else
+	ra->nlen = -1;
+    }
+    rp->acls++;
+  }
+
+  i = h & (rp->bs-1);
+  ra->next = rp->bv[i];
+  rp->bv[i] = ra;
+  rp->n++;
+  
+  return ra;
+}
+
+
+/* Write the ACL of one file */
+static void
+restore_one(RESTORE *rp,
+	    RESTORE_REC *rr) {
+  RESTORE_ACL *ra = rr->ra;
+  char buf[GACL_NATIVE_MAX];
+  struct stat sb;
+  gacl_t oap = NULL;
+  ssize_t len;
+  int rc;
+
+  
+  if (vfs_lstat(rr->path, &sb) < 0) {
+    restore_warn(rr->path, errno, "Accessing");
+    goto Fail;
+  }
+  progress_add(PROGRESS_VISITED, 1);
+
+  if (ra->nlen > 0 && !S_ISLNK(sb.st_mode) && vfs_get_type(rr->path) == VFS_TYPE_SYS) {
+    len = gacl_get_native_file_np(rr->path, buf, sizeof(buf));
+    if (len >= 0)
+      progress_add(PROGRESS_READ, 1);
+    
+    if (config.f_print > 1)
+      print_acl(stdout, ra->ap, rr->path, &sb);
+    
+    if (len == ra->nlen && memcmp(buf, ra->native, len) == 0 && !config.f_force) {
+      progress_add(PROGRESS_SKIPPED, 1);
+      __atomic_add_fetch(&rp->unchanged, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    if (!config.f_noupdate && gacl_set_native_file_np(rr->path, ra->native, ra->nlen) < 0) {
+      restore_warn(rr->path, errno, "Setting ACL");
+      goto Fail;
+    }
+    progress_add(config.f_noupdate ? PROGRESS_SKIPPED : PROGRESS_WRITTEN, 1);
+    
+    if (config.f_print == 1)
+      print_acl(stdout, ra->ap, rr->path, &sb);
+    if (config.f_verbose)
+      printf("%s: ACL Updated%s\n", rr->path, (config.f_noupdate ? " (NOT)" : ""));
+    
+    __atomic_add_fetch(&rp->changed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  /* No native form (or a symlink or SMB) - compare the decoded ACLs */
+  if (get_acl(rr->path, &sb, &oap) < 0)
+    oap = NULL;
+  
+  rc = set_prepared_acl(rr->path, &sb, ra->ap, oap);
+  if (oap)
+    gacl_free(oap);
+  
+  if (rc < 0) {
+    restore_warn(rr->path, errno, "Setting ACL");
+    goto Fail;
+  }
+  
+  __atomic_add_fetch(rc > 0 ? &rp->changed : &rp->unchanged, 1, __ATOMIC_RELAXED);
+  return;
+
+ Fail:
+  __atomic_add_fetch(&rp->failed, 1, __ATOMIC_RELAXED);
+}
+
+
+static void
+restore_run(RESTORE *rp) {
+  size_t i, end;
+
+  
+  while ((i = __atomic_fetch_add(&rp->next, RESTORE_SLICE, __ATOMIC_RELAXED)) < rp->rc) {
+    end = i + RESTORE_SLICE;
+    if (end > rp->rc)
+      end = rp->rc;
+    
+    for (; i < end; i++)
+      restore_one(rp, rp->wv[i]);
+  }
+}
+
+
+static void *
+restore_worker(void *vp) {
+  RESTORE *rp = (RESTORE *) vp;
+  unsigned long gen = 0;
+
+  
+  config = rp->config;
+  error_argv0 = rp->error_argv0;
+  
+  pthread_mutex_lock(&rp->mtx);
+  while (1) {
+    while (rp->gen == gen && !rp->stop)
+      pthread_cond_wait(&rp->work_cv, &rp->mtx);
+    if (rp->stop)
+      break;
+    
+    gen = rp->gen;
+    pthread_mutex_unlock(&rp->mtx);
+    
+    restore_run(rp);
+    
+    pthread_mutex_lock(&rp->mtx);
+    if (--rp->busy == 0)
+      pthread_cond_signal(&rp->done_cv);
+  }
+  pthread_mutex_unlock(&rp->mtx);
+
+  aclcmd_thread_exit();
+  return NULL;
+}
+
+
+/* Write the ACLs of all files in the current chunk */
+static int
+restore_flush(RESTORE *rp,
+	      int nt) {
+  RESTORE_ACL *ra;
+  size_t i, n;
+
+  
+  if (rp->rc > rp->ws) {
+    RESTORE_REC **nwv = realloc(rp->wv, rp->rc * sizeof(*nwv));
+    
+    if (!nwv)
+      return -1;
+    rp->wv = nwv;
+    rp->ws = rp->rc;
+  }
+  
+  /* Group the files by ACL */
+  for (n = 0, ra = rp->used; ra; ra = ra->used) {
+    ra->first = n;
+    n += ra->n;
+    ra->n = 0;
+  }
+  for (i = 0; i < rp->rc; i++) {
+    ra = rp->rv[i].ra;
+    rp->wv[ra->first + ra->n++] = &rp->rv[i];
+  }
+
+  rp->next = 0;
+  if (nt > 0) {
+    pthread_mutex_lock(&rp->mtx);
+    rp->busy = nt;
+    rp->gen++;
+    pthread_cond_broadcast(&rp->work_cv);
+    pthread_mutex_unlock(&rp->mtx);
+  }
+  
+  restore_run(rp);
+
+  if (nt > 0) {
+    pthread_mutex_lock(&rp->mtx);
+    while (rp->busy > 0)
+      pthread_cond_wait(&rp->done_cv, &rp->mtx);
+    pthread_mutex_unlock(&rp->mtx);
+  }
+  
+  while ((ra = rp->used) != NULL) {
+    rp->used = ra->used;
+    ra->used = NULL;
+    ra->n = 0;
+  }
+  rp->rc = 0;
+
+  /* Lots of different ACLs - start over instead of growing without bounds */
+  if (rp->n > RESTORE_ACL_MAX)
+    restore_acl_free(rp);
+  
+  return 0;
+}
+
+
+/* Queue one file. 'pend' is where the path ends */
+static int
+restore_add(RESTORE *rp,
+	    char *path,
+	    char *pend,
+	    const char *text,
+	    size_t len) {
+  RESTORE_ACL *ra;
+
+  
+  rp->files++;
+  *pend = '\0';
+  
+  if (!text) {
+    rp->noacl++;
+    return 0;
+  }
+
+  ra = restore_acl_get(rp, text, len, path);
+  if (!ra)
+    return -1;
+  
+  if (!ra->ap) {
+    rp->invalid++;
+    return 0;
+  }
+
+  if (rp->rc >= rp->rs) {
+    size_t ns = rp->rs ? rp->rs*2 : 4096;
+    RESTORE_REC *nrv = realloc(rp->rv, ns * sizeof(*nrv));
+
+    if (!nrv)
+      return -1;
+    rp->rv = nrv;
+    rp->rs = ns;
+  }
+
+  if (ra->n++ == 0) {
+    ra->used = rp->used;
+    rp->used = ra;
+  }
+  
+  rp->rv[rp->rc].path = path;
+  rp->rv[rp->rc].ra = ra;
+  rp->rc++;
+  return 0;
+}
+
+
+/* A "<path>;<acl>;<uid>;<gid>;<user>;<group>" line. The path may contain ';' */
+static int
+restore_csv(RESTORE *rp,
+	    char *cp,
+	    char *end) {
+  char *sv[5], *p;
+  int k = 0;
+
+  
+  for (p = end; p > cp && k < 5; )
+    if (*--p == ';')
+      sv[k++] = p;
+  
+  if (k < 5) {
+    *end = '\0';
+    rp->invalid++;
+    restore_warn(cp, 0, "Unrecognized line");
+    return 0;
+  }
+
+  return restore_add(rp, cp, sv[4], sv[4]+1, sv[3]-(sv[4]+1));
+}
+
+
+/*
+ * Queue all complete records in the buffer. Returns the number of
+ * bytes used, the rest has to be parsed again with more data
+ */
+static ssize_t
+restore_parse(RESTORE *rp,
+	      char *buf,
+	      size_t len,
+	      int eof) {
+  char *cp, *end, *eol, *le;
+  char *rec = NULL, *path = NULL, *pend = NULL;
+  char *as = NULL, *ae = NULL;
+  int rc = 0;
+
+  
+  end = buf+len;
+  for (cp = buf; rc == 0 && cp < end; cp = eol+1) {
+    eol = memchr(cp, '\n', end-cp);
+    if (!eol) {
+      if (!eof)
+	break;
+      eol = end;
+    }
+    
+    le = eol;
+    if (le > cp && le[-1] == '\r')
+      --le;
+
+    if (le == cp) {
+      /* A blank line ends a record */
+      if (rec)
+	rc = restore_add(rp, path, pend, as, ae-as);
+      rec = NULL;
+    } else if (le-cp >= 8 && memcmp(cp, "# file: ", 8) == 0) {
+      if (rec)
+	rc = restore_add(rp, path, pend, as, ae-as);
+      rec = cp;
+      path = cp+8;
+      pend = le;
+      as = ae = NULL;
+    } else if (rec) {
+      /* Owner, group & type comments are skipped, the rest is the ACL */
+      if (*cp != '#') {
+	if (!as)
+	  as = cp;
+	ae = le;
+      }
+    } else if (*cp != '#')
+      rc = restore_csv(rp, cp, le);
+  }
+  
+  if (rc < 0)
+    return -1;
+  
+  if (rec) {
+    if (!eof)
+      return rec-buf;
+    
+    if (restore_add(rp, path, pend, as, ae-as) < 0)
+      return -1;
+  }
+  
+  return cp < end ? cp-buf : len;
+}
+
+
+static int
+restore_fd(RESTORE *rp,
+	   int fd,
+	   int nt) {
+  char *buf, *nbuf;
+  size_t size, len;
+  ssize_t n, used;
+  int eof = 0;
+
+  
+  size = RESTORE_CHUNK;
+  buf = malloc(size+1);
+  if (!buf)
+    return -1;
+
+  len = 0;
+  while (!eof) {
+    n = read(fd, buf+len, size-len);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      goto Fail;
+    }
+    
+    if (n == 0)
+      eof = 1;
+    len += n;
+    if (!eof && len < size)
+      continue;
+
+    used = restore_parse(rp, buf, len, eof);
+    if (used < 0 || restore_flush(rp, nt) < 0)
+      goto Fail;
+
+    len -= used;
+    memmove(buf, buf+used, len);
+    
+    /* A record larger than the buffer */
+    if (len == size) {
+      nbuf = realloc(buf, size*2+1);
+      if (!nbuf)
+	goto Fail;
+      buf = nbuf;
+      size *= 2;
+    }
+  }
+
+  free(buf);
+  return 0;
+
+ Fail:
+  free(buf);
+  return -1;
+}
+
+
+static int
+restore_cmd(int argc,
+	    char **argv) {
+  RESTORE r;
+  pthread_t *tv = NULL;
+  int i, fd, nt = 0, rc = 0, ec = 0;
+  const char *name = "<stdin>";
+
+  
+  memset(&r, 0, sizeof(r));
+  pthread_mutex_init(&r.mtx, NULL);
+  pthread_cond_init(&r.work_cv, NULL);
+  pthread_cond_init(&r.done_cv, NULL);
+  r.config = config;
+  r.error_argv0 = error_argv0;
+
+  /* The calling thread is one of the writers */
+  if (config.f_jobs > 1) {
+    tv = calloc(config.f_jobs-1, sizeof(pthread_t));
+    if (tv)
+      for (; nt < config.f_jobs-1; nt++)
+	if (pthread_create(&tv[nt], NULL, restore_worker, &r) != 0)
+	  break;
+  }
+  
+  if (config.f_progress)
+    progress_start(config.progress_interval);
+  
+  for (i = 1; rc == 0 && i <= argc; i++) {
+    if (i == argc) {
+      if (argc > 1)
+	break;
+      fd = 0;
+    } else if (strcmp(argv[i], "-") == 0) {
+      fd = 0;
+    } else {
+      name = argv[i];
+      fd = open(name, O_RDONLY);
+      if (fd < 0) {
+	ec = errno;
+	rc = -1;
+	break;
+      }
+    }
+
+    rc = restore_fd(&r, fd, nt);
+    ec = errno;
+    if (fd > 0)
+      close(fd);
+  }
+
+  pthread_mutex_lock(&r.mtx);
+  r.stop = 1;
+  pthread_cond_broadcast(&r.work_cv);
+  pthread_mutex_unlock(&r.mtx);
+  
+  while (nt > 0)
+    pthread_join(tv[--nt], NULL);
+  free(tv);
+
+  if (config.f_progress)
+    progress_stop();
+  
+  restore_acl_free(&r);
+  free(r.rv);
+  free(r.wv);
+  pthread_cond_destroy(&r.done_cv);
+  pthread_cond_destroy(&r.work_cv);
+  pthread_mutex_destroy(&r.mtx);
+
+  if (rc < 0)
+    return error(1, ec, "%s: Restoring ACLs", name);
+
+  printf("%llu objects, %llu distinct ACLs: %llu updated%s, %llu unchanged, %llu failed",
+	 r.files, r.acls, r.changed, (config.f_noupdate ? " (NOT)" : ""), r.unchanged, r.failed);
+  if (r.invalid)
+    printf(", %llu invalid", r.invalid);
+  if (r.noacl)
+    printf(", %llu without ACL", r.noacl);
+  putchar('\n');
+  
+  if (r.failed || r.invalid) {
+    fflush(stdout);
+    return error(1, 0, "Not restored: %llu failed, %llu invalid", r.failed, r.invalid);
+  }
+  return 0;
+}
+
+
+/* Command definition */
+COMMAND restore_command =
+  { "restore-access",  restore_cmd,  NULL,  "[<dump>|-]*",  "Restore ACL(s) from a list-access dump"  };
@@ -31,6 +31,8 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,9 +46,14 @@
 #include <grp.h>
 #include <ftw.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "acltool.h"
 #include "common.h"
+#include "arena.h"
+#include "ident.h"
+#include "buffer.h"
+#include "progress.h"
 
 
 int
@@ -78,11 +85,53 @@ get_acl(const char *path,
       return -1;
   }
 
+  progress_add(PROGRESS_READ, 1);
+  
   *app = ap;
   return 1;
 }
 
 
+/*
+ * Start resolving the names that print_acl() is going to need in the
+ * background: the owner & group in 'sp' and the users & groups of 'ap'
+ * that the ACL does not already carry the name of (on Linux the NFSv4
+ * xattr has them all). Only for code that prints - the lookups are
+ * wasted on anything else.
+ */
+void
+prefetch_acl_ids(gacl_t ap,
+		 const struct stat *sp) {
+  gacl_entry_t ae;
+  int i;
+
+
+  if (sp) {
+    ident_prefetch_uid(sp->st_uid);
+    ident_prefetch_gid(sp->st_gid);
+  }
+
+  if (!ap)
+    return;
+  
+  for (i = 0; _gacl_peek_entry(ap, i, &ae) == 1; i++) {
+    if (ae->tag.name[0])
+      continue;
+    
+    switch (ae->tag.type) {
+    case GACL_TAG_TYPE_USER:
+      ident_prefetch_uid(ae->tag.ugid);
+      break;
+    case GACL_TAG_TYPE_GROUP:
+      ident_prefetch_gid(ae->tag.ugid);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+
 int
 print_ace(gacl_t ap,
 	  int p,
@@ -91,7 +140,7 @@ print_ace(gacl_t ap,
   char buf[1024];
 
   
-  if (_gacl_get_entry(ap, p, &ae) < 0)
+  if (_gacl_peek_entry(ap, p, &ae) < 0)
     return -1;
   
   if (gacl_entry_to_text(ae, buf, sizeof(buf), flags) < 0)
@@ -102,47 +151,61 @@ print_ace(gacl_t ap,
 }
 
 
-int
-set_acl(const char *path,
-	const struct stat *sp,
-	gacl_t nap,
-	gacl_t oap) {
-  int rc, s_errno;
-  gacl_t ap = nap;
+/*
+ * Apply the configured sort/merge options to an ACL. Returns a new
+ * reference (a copy-on-write duplicate) that the caller must free.
+ */
+gacl_t
+prepare_acl(const char *path,
+	    gacl_t nap) {
+  int s_errno;
+  gacl_t ap;
 
   
-  if (config.f_sort) {
-    gacl_t sap = gacl_sort(ap);
-
-    if (!sap) {
-      error(1, errno, "%s: Sorting ACL", path);
-      return -1;
-    }
-    ap = sap;
+  /* Work on a copy-on-write duplicate - it is only copied if something changes */
+  ap = gacl_dup(nap);
+  if (!ap) {
+    error(1, errno, "%s: Duplicating ACL", path);
+    return NULL;
   }
-
-  if (config.f_merge) {
-    gacl_t map = gacl_merge(ap);
     
-    if (!map) {
-      s_errno = errno;
-      if (ap != nap)
-	gacl_free(ap);
-      error(1, s_errno, "%s: Merging ACL", path);
-      return -1;
-    }
-    if (ap != nap)
-      gacl_free(ap);
-    ap = map;
+  if (config.f_sort && gacl_sort_inplace_np(ap) < 0) {
+    s_errno = errno;
+    gacl_free(ap);
+    error(1, s_errno, "%s: Sorting ACL", path);
+    return NULL;
+  }
+
+  if (config.f_merge && gacl_merge_inplace_np(ap) < 0) {
+    s_errno = errno;
+    gacl_free(ap);
+    error(1, s_errno, "%s: Merging ACL", path);
+    return NULL;
   }
 
+  return ap;
+}
+
+
+/*
+ * Write an ACL that has already been through prepare_acl(), unless it
+ * is the same as the old one. Returns 1 if written, 0 if not needed
+ * and -1 (with errno set) if the write failed
+ */
+int
+set_prepared_acl(const char *path,
+		 const struct stat *sp,
+		 gacl_t ap,
+		 gacl_t oap) {
+  int rc;
+
+  
   if (config.f_print > 1)
     print_acl(stdout, ap, path, sp);
   
   /* Skip set operation if old and new acl is the same (and force flag not in use) */
   if (oap && gacl_match(ap, oap) == 1 && !config.f_force) {
-    if (ap != nap)
-      gacl_free(ap);
+    progress_add(PROGRESS_SKIPPED, 1);
     return 0;
   }
 
@@ -154,27 +217,45 @@ set_acl(const char *path,
       rc = vfs_acl_set_file(path, GACL_TYPE_NFS4, ap);
   }
 
-  if (rc < 0) {
-    s_errno = errno;
-    if (ap != nap)
-      gacl_free(ap);
-    error(1, s_errno, "%s: Setting ACL", path);
+  if (rc < 0)
     return rc;
-  }
 
+  progress_add(config.f_noupdate ? PROGRESS_SKIPPED : PROGRESS_WRITTEN, 1);
+  
   if (config.f_print == 1)
     print_acl(stdout, ap, path, sp);
   
   if (config.f_verbose)
     printf("%s: ACL Updated%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
   
-  if (ap != nap)
-    gacl_free(ap);
-
   return 1;
 }
 
 
+int
+set_acl(const char *path,
+	const struct stat *sp,
+	gacl_t nap,
+	gacl_t oap) {
+  gacl_t ap;
+  int rc, s_errno;
+
+  
+  ap = prepare_acl(path, nap);
+  if (!ap)
+    return -1;
+
+  rc = set_prepared_acl(path, sp, ap, oap);
+  s_errno = errno;
+  gacl_free(ap);
+  
+  if (rc < 0)
+    error(1, s_errno, "%s: Setting ACL", path);
+  
+  return rc;
+}
+
+
 #define UPDATE(v,t) if (f_add) {*v |= t;} else { *v &= ~t; }
 
 int
@@ -236,8 +317,8 @@ str2filetype(const char *str,
 }
 
 
-static int
-primos_print_perms(FILE *fp,
+static void
+primos_print_perms(BUFFER *ob,
 		   const char *s) {
   int c;
   int ns = 0;
@@ -247,17 +328,16 @@ primos_print_perms(FILE *fp,
     if (c == '-')
       ++ns;
     else
-      putc(c, fp);
+      buf_putc(ob, c);
   }
 
   while (ns-- > 0)
-    putc(' ', fp);
-  return 0;
+    buf_putc(ob, ' ');
 }
 
 
-static int
-primos_print_flags(FILE *fp,
+static void
+primos_print_flags(BUFFER *ob,
 		   const char *s) {
   int c;
   int ns = 0;
@@ -268,185 +348,558 @@ primos_print_flags(FILE *fp,
       ++ns;
     else {
       if (np++ == 0)
-	putc('(', fp);
-      putc(c, fp);
+	buf_putc(ob, '(');
+      buf_putc(ob, c);
     }
   }
 
   if (np == 0)
     ns += 2;
   else
-    putc(')', fp);
+    buf_putc(ob, ')');
   while (ns-- > 0)
-    putc(' ', fp);
+    buf_putc(ob, ' ');
+}
+
+
+/*
+ * localtime_r() with a one-entry cache. Files in a tree tend to have
+ * timestamps close to each other (and mtime/ctime/atime are often the
+ * same), so most calls only need to adjust the seconds.
+ */
+static struct tm *
+print_localtime(time_t t,
+		struct tm *tp) {
+  static THREAD_LOCAL time_t c_t = 0;
+  static THREAD_LOCAL struct tm c_tm;
+  static THREAD_LOCAL int c_valid = 0;
+  time_t d;
+
+  
+  if (c_valid) {
+    d = t - c_t;
+    if (d > -60 && d < 60 && c_tm.tm_sec + d >= 0 && c_tm.tm_sec + d < 60) {
+      *tp = c_tm;
+      tp->tm_sec += (int) d;
+      return tp;
+    }
+  }
+
+  if (!localtime_r(&t, tp))
+    return NULL;
+  
+  c_t = t;
+  c_tm = *tp;
+  c_valid = 1;
+  return tp;
+}
+
+/* Append a timestamp in ctime() format */
+static void
+print_ctime(BUFFER *ob,
+	    time_t t) {
+  static const char *wday[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char *mon[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  struct tm tmb;
+  char cbuf[32];
+  
+
+  if (!print_localtime(t, &tmb) ||
+      tmb.tm_wday < 0 || tmb.tm_wday > 6 || tmb.tm_mon < 0 || tmb.tm_mon > 11) {
+    /* Let the C library deal with anything odd */
+    if (ctime_r(&t, cbuf))
+      buf_puts(ob, cbuf);
+    return;
+  }
+  
+  buf_printf(ob, "%.3s %.3s%3d %.2d:%.2d:%.2d %d\n",
+	     wday[tmb.tm_wday], mon[tmb.tm_mon], tmb.tm_mday,
+	     tmb.tm_hour, tmb.tm_min, tmb.tm_sec,
+	     1900 + tmb.tm_year);
+}
+
+
+/* Append the text form of an ACL */
+static int
+print_acl_text(BUFFER *ob,
+	       gacl_t a,
+	       int flags) {
+  ssize_t len;
+
+  
+  if (buf_reserve(ob, a->ac*GACL_TEXT_ENTRY_MAX+1) < 0)
+    return -1;
+
+  len = gacl_to_text_buf_np(a, ob->buf+ob->len, ob->size-ob->len+1, flags);
+  if (len < 0)
+    return -1;
+
+  ob->len += len;
   return 0;
 }
 
+static void
+print_acl_header(BUFFER *ob,
+		 const char *us,
+		 const char *gs,
+		 const struct stat *sp) {
+  if (us) {
+    if (config.f_verbose)
+      buf_printf(ob, "# owner: %s (%d)\n", us, sp->st_uid);
+    else
+      buf_printf(ob, "# owner: %s\n", us);
+  }
+    
+  if (gs) {
+    if (config.f_verbose)
+      buf_printf(ob, "# group: %s (%d)\n", gs, sp->st_gid);
+    else
+      buf_printf(ob, "# group: %s\n", gs);
+  }
+    
+  if (config.f_verbose)
+    buf_printf(ob, "# type: %s\n", mode2typestr(sp->st_mode));
+  if (config.f_verbose > 1) {
+    buf_printf(ob, "# size: %llu\n", (long long unsigned) sp->st_size);
+    buf_puts(ob, "# modified: ");
+    print_ctime(ob, sp->st_mtime);
+    buf_puts(ob, "# changed:  ");
+    print_ctime(ob, sp->st_ctime);
+    buf_puts(ob, "# accessed: ");
+    print_ctime(ob, sp->st_atime);
+#ifdef st_birthtime
+    if (sp->st_birthtime) {
+      buf_puts(ob, "# created:  ");
+      print_ctime(ob, sp->st_birthtime);
+    }
+#endif
+  }
+}
+
+
+/*
+ * JSON output (one object per line)
+ */
+static struct json_perm {
+  GACL_PERM p;
+  const char *s;
+} json_perms[] = {
+  { GACL_PERM_READ_DATA,         "read_data" },
+  { GACL_PERM_WRITE_DATA,        "write_data" },
+  { GACL_PERM_EXECUTE,           "execute" },
+  { GACL_PERM_APPEND_DATA,       "append_data" },
+  { GACL_PERM_DELETE_CHILD,      "delete_child" },
+  { GACL_PERM_DELETE,            "delete" },
+  { GACL_PERM_READ_ATTRIBUTES,   "read_attributes" },
+  { GACL_PERM_WRITE_ATTRIBUTES,  "write_attributes" },
+  { GACL_PERM_READ_NAMED_ATTRS,  "read_xattrs" },
+  { GACL_PERM_WRITE_NAMED_ATTRS, "write_xattrs" },
+  { GACL_PERM_READ_ACL,          "read_acl" },
+  { GACL_PERM_WRITE_ACL,         "write_acl" },
+  { GACL_PERM_WRITE_OWNER,       "write_owner" },
+  { GACL_PERM_SYNCHRONIZE,       "synchronize" },
+  { 0, NULL }
+};
+
+static struct json_flag {
+  GACL_FLAG f;
+  const char *s;
+} json_flags[] = {
+  { GACL_FLAG_FILE_INHERIT,          "file_inherit" },
+  { GACL_FLAG_DIRECTORY_INHERIT,     "dir_inherit" },
+  { GACL_FLAG_INHERIT_ONLY,          "inherit_only" },
+  { GACL_FLAG_NO_PROPAGATE_INHERIT,  "no_propagate" },
+  { GACL_FLAG_SUCCESSFUL_ACCESS,     "successful_access" },
+  { GACL_FLAG_FAILED_ACCESS,         "failed_access" },
+  { GACL_FLAG_INHERITED,             "inherited" },
+  { 0, NULL }
+};
+
+static const char json_hex[] = "0123456789abcdef";
+
+
+/* Length of the valid UTF-8 sequence at 's', or 0 if invalid */
+static int
+json_utf8_len(const unsigned char *s) {
+  unsigned char lo = 0x80, hi = 0xBF;
+  int i, n;
+
+  
+  if (*s >= 0xC2 && *s <= 0xDF)
+    n = 2;
+  else if (*s >= 0xE0 && *s <= 0xEF) {
+    n = 3;
+    if (*s == 0xE0)
+      lo = 0xA0;        /* Overlong */
+    else if (*s == 0xED)
+      hi = 0x9F;        /* Surrogates */
+  } else if (*s >= 0xF0 && *s <= 0xF4) {
+    n = 4;
+    if (*s == 0xF0)
+      lo = 0x90;        /* Overlong */
+    else if (*s == 0xF4)
+      hi = 0x8F;        /* Above U+10FFFF */
+  } else
+    return 0;
+
+  if (s[1] < lo || s[1] > hi)
+    return 0;
+  for (i = 2; i < n; i++)
+    if (s[i] < 0x80 || s[i] > 0xBF)
+      return 0;
+  
+  return n;
+}
+
+/*
+ * Append a quoted JSON string, copying runs that need no escaping as-is.
+ * Bytes that are not part of valid UTF-8 (file names are just bytes)
+ * are written as \u00XX, one per byte, so the output is always valid
+ */
+static void
+json_put_str(BUFFER *ob,
+	     const char *s) {
+  const char *r;
+  unsigned char c;
+  char eb[6];
+  int n;
+
+  
+  buf_putc(ob, '"');
+  for (r = s; (c = (unsigned char) *s) != '\0'; s++) {
+    if (c >= 0x80 && (n = json_utf8_len((const unsigned char *) s)) > 0) {
+      s += n-1;
+      continue;
+    }
+    
+    if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\')
+      continue;
+
+    if (s > r)
+      buf_putn(ob, r, s-r);
+    r = s+1;
+
+    switch (c) {
+    case '"':
+      buf_putn(ob, "\\\"", 2);
+      break;
+    case '\\':
+      buf_putn(ob, "\\\\", 2);
+      break;
+    case '\n':
+      buf_putn(ob, "\\n", 2);
+      break;
+    case '\t':
+      buf_putn(ob, "\\t", 2);
+      break;
+    case '\r':
+      buf_putn(ob, "\\r", 2);
+      break;
+    default:
+      eb[0] = '\\';
+      eb[1] = 'u';
+      eb[2] = '0';
+      eb[3] = '0';
+      eb[4] = json_hex[c >> 4];
+      eb[5] = json_hex[c & 0x0F];
+      buf_putn(ob, eb, 6);
+    }
+  }
+  if (s > r)
+    buf_putn(ob, r, s-r);
+  buf_putc(ob, '"');
+}
+
+/* Append an unsigned decimal number */
+static void
+json_put_uint(BUFFER *ob,
+	      unsigned long long v) {
+  char nb[24], *cp = nb+sizeof(nb);
+
+  
+  do {
+    *--cp = '0' + (v % 10);
+    v /= 10;
+  } while (v);
+  buf_putn(ob, cp, nb+sizeof(nb)-cp);
+}
+
+/* Append ',"key":' (or without the comma for the first member) */
+static void
+json_put_key(BUFFER *ob,
+	     const char *key,
+	     int first) {
+  if (!first)
+    buf_putc(ob, ',');
+  buf_putc(ob, '"');
+  buf_puts(ob, key);
+  buf_putn(ob, "\":", 2);
+}
+
+static const char *
+json_filetype(mode_t m) {
+  switch (m & S_IFMT) {
+  case S_IFIFO:
+    return "fifo";
+  case S_IFCHR:
+    return "char-device";
+  case S_IFBLK:
+    return "block-device";
+  case S_IFDIR:
+    return "directory";
+  case S_IFREG:
+    return "file";
+  case S_IFLNK:
+    return "link";
+  case S_IFSOCK:
+    return "socket";
+#ifdef S_IFWHT
+  case S_IFWHT:
+    return "whiteout";
+#endif
+  default:
+    return "unknown";
+  }
+}
+
+static void
+json_put_ace(BUFFER *ob,
+	     GACL_ENTRY *ep) {
+  const char *s;
+  int i, n;
+
+  
+  buf_putc(ob, '{');
+  json_put_key(ob, "tag", 1);
+  switch (ep->tag.type) {
+  case GACL_TAG_TYPE_USER:
+    buf_puts(ob, "\"user\"");
+    break;
+  case GACL_TAG_TYPE_GROUP:
+    buf_puts(ob, "\"group\"");
+    break;
+  default:
+    json_put_str(ob, ep->tag.name);
+    break;
+  }
+  
+  if (ep->tag.type == GACL_TAG_TYPE_USER || ep->tag.type == GACL_TAG_TYPE_GROUP) {
+    json_put_key(ob, "name", 0);
+    json_put_str(ob, ep->tag.name);
+    json_put_key(ob, "id", 0);
+    json_put_uint(ob, ep->tag.ugid);
+  }
+
+  json_put_key(ob, "type", 0);
+  s = aet2str(ep->type);
+  if (s) {
+    buf_putc(ob, '"');
+    buf_puts(ob, s);
+    buf_putc(ob, '"');
+  } else
+    buf_puts(ob, "null");
+  
+  json_put_key(ob, "perms", 0);
+  json_put_uint(ob, ep->perms);
+  json_put_key(ob, "perm_names", 0);
+  buf_putc(ob, '[');
+  for (i = n = 0; json_perms[i].s; i++)
+    if (ep->perms & json_perms[i].p) {
+      if (n++)
+	buf_putc(ob, ',');
+      buf_putc(ob, '"');
+      buf_puts(ob, json_perms[i].s);
+      buf_putc(ob, '"');
+    }
+  buf_putc(ob, ']');
+  
+  json_put_key(ob, "flags", 0);
+  json_put_uint(ob, ep->flags);
+  json_put_key(ob, "flag_names", 0);
+  buf_putc(ob, '[');
+  for (i = n = 0; json_flags[i].s; i++)
+    if (ep->flags & json_flags[i].f) {
+      if (n++)
+	buf_putc(ob, ',');
+      buf_putc(ob, '"');
+      buf_puts(ob, json_flags[i].s);
+      buf_putc(ob, '"');
+    }
+  buf_putc(ob, ']');
+  
+  buf_putc(ob, '}');
+}
+
+static void
+print_acl_json(BUFFER *ob,
+	       gacl_t a,
+	       const char *path,
+	       const struct stat *sp,
+	       const char *us,
+	       const char *gs) {
+  GACL_ENTRY *ep;
+  int i;
+
+  
+  buf_putc(ob, '{');
+  json_put_key(ob, "path", 1);
+  json_put_str(ob, path);
+  
+  if (sp) {
+    json_put_key(ob, "type", 0);
+    buf_putc(ob, '"');
+    buf_puts(ob, json_filetype(sp->st_mode));
+    buf_putc(ob, '"');
+    json_put_key(ob, "uid", 0);
+    json_put_uint(ob, sp->st_uid);
+    json_put_key(ob, "gid", 0);
+    json_put_uint(ob, sp->st_gid);
+  }
+  
+  json_put_key(ob, "owner", 0);
+  if (us)
+    json_put_str(ob, us);
+  else
+    buf_puts(ob, "null");
+  
+  json_put_key(ob, "group", 0);
+  if (gs)
+    json_put_str(ob, gs);
+  else
+    buf_puts(ob, "null");
+
+  json_put_key(ob, "acl", 0);
+  if (a) {
+    buf_putc(ob, '[');
+    for (i = 0; _gacl_peek_entry(a, i, &ep) == 1; i++) {
+      if (i)
+	buf_putc(ob, ',');
+      json_put_ace(ob, ep);
+    }
+    buf_putc(ob, ']');
+  } else
+    buf_puts(ob, "null");
+  
+  buf_putn(ob, "}\n", 2);
+}
+
+
+/*
+ * Everything for one ACL is rendered into a per-thread buffer and
+ * then written with a single call.
+ */
+static THREAD_LOCAL BUFFER print_buf = { NULL, 0, 0 };
 
 int
 print_acl(FILE *fp,
 	  gacl_t a,
 	  const char *path,
 	  const struct stat *sp) {
+  BUFFER *ob = &print_buf;
   gacl_entry_t ae;
-  int i, is_trivial, len;
+  int i, is_trivial, len, rc = 0;
   uid_t *idp;
-  char *as = NULL;
-  char acebuf[2048], ubuf[64], gbuf[64], tbuf[80];
-  char *us = NULL;
-  char *gs = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
-  struct tm *tp;
+  char acebuf[2048], ubuf[256], gbuf[256], tbuf[80];
+  char fpbuf[GACL_FINGERPRINT_TEXT_SIZE];
+  GACL_FINGERPRINT fpr;
+  const char *us = NULL;
+  const char *gs = NULL;
+  struct tm *tp, tmb;
+  int pf = 0, gf = 0;
   
 
+  ob->len = 0;
+  
   if (strncmp(path, "./", 2) == 0)
     path += 2;
 
   if (sp) {
-    pp = getpwuid(sp->st_uid);
-    gp = getgrgid(sp->st_gid);
+    pf = (ident_uid_to_name(sp->st_uid, ubuf, sizeof(ubuf)) > 0);
+    gf = (ident_gid_to_name(sp->st_gid, gbuf, sizeof(gbuf)) > 0);
   }
 
   if (a && a->owner[0])
-    us = s_dup(a->owner);
-  else {
-    if (!pp) {
-      if (sp->st_uid != -1) {
-	snprintf(ubuf, sizeof(ubuf), "%u", sp->st_uid);
-	us = s_dup(ubuf);
-      }
-    } else
-      us = s_dup(pp->pw_name);
+    us = a->owner;
+  else if (pf)
+    us = ubuf;
+  else if (sp && sp->st_uid != -1) {
+    snprintf(ubuf, sizeof(ubuf), "%u", sp->st_uid);
+    us = ubuf;
   }
   
   if (a && a->group[0])
-    gs = s_dup(a->group);
-  else {
-    if (!gp) {
-      if (sp->st_gid != -1) {
-	snprintf(gbuf, sizeof(gbuf), "%u", sp->st_gid);
-	gs = s_dup(gbuf);
-      }
-    } else
-      gs = s_dup(gp->gr_name);
+    gs = a->group;
+  else if (gf)
+    gs = gbuf;
+  else if (sp && sp->st_gid != -1) {
+    snprintf(gbuf, sizeof(gbuf), "%u", sp->st_gid);
+    gs = gbuf;
   }
 
+  if (config.f_style == GACL_STYLE_JSON) {
+    print_acl_json(ob, a, path, sp, us, gs);
+    goto End;
+  }
+  
   if (!a) {
-    fprintf(fp, "# file: %s\n", path);
-    if (us) {
-      if (config.f_verbose)
-	fprintf(fp, "# owner: %s (%d)\n", us, sp->st_uid);
-      else
-	fprintf(fp, "# owner: %s\n", us);
-    }
-    
-    if (gs) {
-      if (config.f_verbose)
-	fprintf(fp, "# group: %s (%d)\n", gs, sp->st_gid);
-      else
-	fprintf(fp, "# group: %s\n", gs);
-    }
-    
-    if (config.f_verbose)
-      fprintf(fp, "# type: %s\n", mode2typestr(sp->st_mode));
-    if (config.f_verbose > 1) {
-      fprintf(fp, "# size: %llu\n", (long long unsigned) sp->st_size);
-      fprintf(fp, "# modified: %s", ctime(&sp->st_mtime));
-      fprintf(fp, "# changed:  %s", ctime(&sp->st_ctime));
-      fprintf(fp, "# accessed: %s", ctime(&sp->st_atime));
-#ifdef st_birthtime
-      if (sp->st_birthtime)
-	fprintf(fp, "# created:  %s", ctime(&sp->st_birthtime));
-#endif
-    }
+    buf_printf(ob, "# file: %s\n", path);
+    print_acl_header(ob, us, gs, sp);
     goto End;
   }
 
   
   switch (config.f_style) {
   case GACL_STYLE_DEFAULT:
-    as = gacl_to_text_np(a, NULL, (config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0));
-    if (!as) {
+    buf_printf(ob, "# file: %s\n", path);
+    print_acl_header(ob, us, gs, sp);
+    
+    if (print_acl_text(ob, a, (config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0)) < 0) {
+      ob->len = 0;
       fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
       return 1;
     }
-    
-    fprintf(fp, "# file: %s\n", path);
-    
-    if (us) {
-      if (config.f_verbose)
-	fprintf(fp, "# owner: %s (%d)\n", us, sp->st_uid);
-      else
-	fprintf(fp, "# owner: %s\n", us);
-    }
-    
-    if (gs) {
-      if (config.f_verbose)
-	fprintf(fp, "# group: %s (%d)\n", gs, sp->st_gid);
-      else
-	fprintf(fp, "# group: %s\n", gs);
-    }
-    
-    if (config.f_verbose)
-      fprintf(fp, "# type: %s\n", mode2typestr(sp->st_mode));
-    if (config.f_verbose > 1) {
-      fprintf(fp, "# size: %llu\n", (long long unsigned) sp->st_size);
-      fprintf(fp, "# modified: %s", ctime(&sp->st_mtime));
-      fprintf(fp, "# changed:  %s", ctime(&sp->st_ctime));
-      fprintf(fp, "# accessed: %s", ctime(&sp->st_atime));
-#ifdef st_birthtime
-      if (sp->st_birthtime)
-	fprintf(fp, "# created:  %s", ctime(&sp->st_birthtime));
-#endif
-    }
-    
-    fputs(as, fp);
-    gacl_free(as);
     break;
     
   case GACL_STYLE_STANDARD:
-    as = gacl_to_text_np(a, NULL, GACL_TEXT_STANDARD|(config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0));
-    if (!as) {
+    buf_printf(ob, "# file: %s\n", path);
+    buf_printf(ob, "# owner: %s\n", us);
+    buf_printf(ob, "# group: %s\n", gs);
+    
+    if (print_acl_text(ob, a, GACL_TEXT_STANDARD|(config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0)) < 0) {
+      ob->len = 0;
       fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
       return 1;
     }
-    
-    fprintf(fp, "# file: %s\n", path);
-    fprintf(fp, "# owner: %s\n", us);
-    fprintf(fp, "# group: %s\n", gs);
-    fputs(as, fp);
-    gacl_free(as);
     break;
     
   case GACL_STYLE_CSV:
     /* One-liner, CSV-style */
     
-    as = gacl_to_text_np(a, NULL, GACL_TEXT_COMPACT);
-    if (!as) {
+    buf_printf(ob, "%s;", path);
+    if (print_acl_text(ob, a, GACL_TEXT_COMPACT) < 0) {
+      ob->len = 0;
       fprintf(stderr, "%s: Error: %s: Unable to display ACL: %s\n", argv0, path, strerror(errno));
       return 1;
     }
-    fprintf(fp, "%s;%s;%d;%d;%s;%s\n", path, as, sp->st_uid, sp->st_gid, us ? us : "-", gs ? gs : "-");
-    gacl_free(as);
+    buf_printf(ob, ";%d;%d;%s;%s\n", sp->st_uid, sp->st_gid, us ? us : "-", gs ? gs : "-");
     break;
 
   case GACL_STYLE_BRIEF:
     /* One-liner */
 
-    as = gacl_to_text_np(a, NULL, GACL_TEXT_COMPACT);
-    if (!as) {
+    buf_printf(ob, "%-24s  ", path);
+    if (print_acl_text(ob, a, GACL_TEXT_COMPACT) < 0) {
+      ob->len = 0;
       fprintf(stderr, "%s: Error: %s: Unable to display ACL: %s\n", argv0, path, strerror(errno));
       return 1;
     }
-    
-    fprintf(fp, "%-24s  %s\n", path, as);
-    gacl_free(as);
+    buf_putc(ob, '\n');
     break;
 
   case GACL_STYLE_VERBOSE:
-    fprintf(fp, "# file: %s\n", path);
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+    buf_printf(ob, "# file: %s\n", path);
+    for (i = 0; _gacl_peek_entry(a, i, &ae) == 1; i++) {
       char *cp;
       int len;
       gacl_tag_t tt;
@@ -465,26 +918,26 @@ print_acl(FILE *fp,
       } else
 	len = 0;
 
-      fprintf(fp, "%*s%s", (18-len), "", acebuf);
+      buf_printf(ob, "%*s%s", (18-len), "", acebuf);
       switch (tt) {
       case GACL_TAG_TYPE_USER_OBJ:
 	if (us) {
 	  if (config.f_verbose)
-	    fprintf(fp, "\t# %s (%d)", us, sp->st_uid);
+	    buf_printf(ob, "\t# %s (%d)", us, sp->st_uid);
 	  else
-	    fprintf(fp, "\t# %s", us);
+	    buf_printf(ob, "\t# %s", us);
 	} else
-	  fprintf(fp, "\t# (%d)", sp->st_uid);
+	  buf_printf(ob, "\t# (%d)", sp->st_uid);
 	break;
 
       case GACL_TAG_TYPE_GROUP_OBJ:
 	if (gs) {
 	  if (config.f_verbose)
-	    fprintf(fp, "\t# %s (%d)", gs, sp->st_gid);
+	    buf_printf(ob, "\t# %s (%d)", gs, sp->st_gid);
 	  else
-	    fprintf(fp, "\t# %s", gs);
+	    buf_printf(ob, "\t# %s", gs);
 	} else
-	  fprintf(fp, "\t# (%d)", sp->st_gid);
+	  buf_printf(ob, "\t# (%d)", sp->st_gid);
 	break;
 
       case GACL_TAG_TYPE_USER:
@@ -492,45 +945,41 @@ print_acl(FILE *fp,
 	if (config.f_verbose) {
 	  idp = (uid_t *) gacl_get_qualifier(ae);
 	  if (idp)
-	    fprintf(fp, "\t# (%d)", *idp);
+	    buf_printf(ob, "\t# (%d)", *idp);
 	}
 	break;
 
       default:
 	break;
       }
-      putc('\n', fp);
+      buf_putc(ob, '\n');
     }
     break;
     
   case GACL_STYLE_SOLARIS:
-    tp = localtime(&sp->st_mtime);
+    tp = print_localtime(sp->st_mtime, &tmb);
     strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %R", tp);
 
     is_trivial = 0;
     gacl_is_trivial_np(a, &is_trivial);
     
-    printf("%s%s %2lu %8s %8s %8llu %16s %s\n",
-	   mode2str(sp->st_mode), is_trivial ? " " : "+",
-	   (unsigned long) sp->st_nlink,
-	   us, gs,
-	   (unsigned long long) sp->st_size,
-	   tbuf, path);
+    buf_printf(ob, "%s%s %2lu %8s %8s %8llu %16s %s\n",
+	       mode2str(sp->st_mode), is_trivial ? " " : "+",
+	       (unsigned long) sp->st_nlink,
+	       us, gs,
+	       (unsigned long long) sp->st_size,
+	       tbuf, path);
 	   
-    as = gacl_to_text_np(a, NULL, (config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0));
-    if (!as) {
+    if (print_acl_text(ob, a, (config.f_verbose ? GACL_TEXT_VERBOSE|GACL_TEXT_APPEND_ID : 0)) < 0) {
       fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
-      return 1;
+      rc = 1;
     }
-
-    fputs(as, fp);
-    gacl_free(as);
     break;
 
   case GACL_STYLE_PRIMOS:
-    printf("ACL protecting \"%s\":\n", path);
+    buf_printf(ob, "ACL protecting \"%s\":\n", path);
     
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+    for (i = 0; _gacl_peek_entry(a, i, &ae) == 1; i++) {
       char *perms, *flags, *type;
       gacl_tag_t tt;
 
@@ -540,7 +989,8 @@ print_acl(FILE *fp,
       perms = strchr(acebuf, ':');
       if (!perms) {
 	fprintf(stderr, "%s: Error: %s: Unable to display ACL\n", argv0, path);
-	return 1;
+	rc = 1;
+	goto End;
       }
       
       if (tt == GACL_TAG_TYPE_USER || tt == GACL_TAG_TYPE_GROUP)
@@ -553,31 +1003,31 @@ print_acl(FILE *fp,
       type  = strchr(flags, ':');
       *type++ = '\0';
 
-      fprintf(fp, "\t%30s:  ", acebuf);
-      primos_print_perms(fp, perms);
-      fprintf(fp, "  ");
-      primos_print_flags(fp, flags);
+      buf_printf(ob, "\t%30s:  ", acebuf);
+      primos_print_perms(ob, perms);
+      buf_puts(ob, "  ");
+      primos_print_flags(ob, flags);
       if (strcmp(type, "allow") != 0)
-	fprintf(fp, "  %-5s", type);
+	buf_printf(ob, "  %-5s", type);
       switch (tt) {
       case GACL_TAG_TYPE_USER_OBJ:
 	if (us) {
 	  if (config.f_verbose)
-	    fprintf(fp, "  # %s (%d)", us, sp->st_uid);
+	    buf_printf(ob, "  # %s (%d)", us, sp->st_uid);
 	  else 
-	    fprintf(fp, "  # %s", us);
+	    buf_printf(ob, "  # %s", us);
 	} else
-	  fprintf(fp, "  # (%d)", sp->st_uid);
+	  buf_printf(ob, "  # (%d)", sp->st_uid);
 	break;
 
       case GACL_TAG_TYPE_GROUP_OBJ:
 	if (gs) {
 	  if (config.f_verbose)
-	    fprintf(fp, "  # %s (%d)", gs, sp->st_gid);
+	    buf_printf(ob, "  # %s (%d)", gs, sp->st_gid);
 	  else
-	    fprintf(fp, "  # %s", gs);
+	    buf_printf(ob, "  # %s", gs);
 	} else
-	  fprintf(fp, "  # (%d)", sp->st_gid);
+	  buf_printf(ob, "  # (%d)", sp->st_gid);
 	break;
 
       case GACL_TAG_TYPE_USER:
@@ -585,7 +1035,7 @@ print_acl(FILE *fp,
 	if (config.f_verbose) {
 	  idp = (uid_t *) gacl_get_qualifier(ae);
 	  if (idp)
-	    fprintf(fp, "  # (%d)", *idp);
+	    buf_printf(ob, "  # (%d)", *idp);
 	}
 	break;
 
@@ -593,47 +1043,57 @@ print_acl(FILE *fp,
 	break;
       }
 
-      putc('\n', fp);
+      buf_putc(ob, '\n');
     }
     break;
     
   case GACL_STYLE_SAMBA:
-    fprintf(fp, "FILENAME:%s\n", path);
-    fprintf(fp, "REVISION:1\n");
-    fprintf(fp, "CONTROL:SR|DP\n");
+    buf_printf(ob, "FILENAME:%s\n", path);
+    buf_puts(ob, "REVISION:1\n");
+    buf_puts(ob, "CONTROL:SR|DP\n");
 
-    if (pp)
-      fprintf(fp, "OWNER:%s\n", us);
+    if (pf)
+      buf_printf(ob, "OWNER:%s\n", us);
     else
-      fprintf(fp, "OWNER:%d\n", sp->st_uid);
+      buf_printf(ob, "OWNER:%d\n", sp->st_uid);
 
-    if (gp)
-      fprintf(fp, "GROUP:%s\n", gs);
+    if (gf)
+      buf_printf(ob, "GROUP:%s\n", gs);
     else
-      fprintf(fp, "GROUP:%d\n", sp->st_gid);
+      buf_printf(ob, "GROUP:%d\n", sp->st_gid);
 
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+    for (i = 0; _gacl_peek_entry(a, i, &ae) == 1; i++) {
       char *cp;
       ace2str_samba(ae, acebuf, sizeof(acebuf), sp);
 
       cp = strrchr(acebuf, '\t');
       if (*cp) {
 	*cp++ = '\0';
-	fprintf(fp, "%-60s\t# %s\n", acebuf, cp);
+	buf_printf(ob, "%-60s\t# %s\n", acebuf, cp);
       } else
-	fprintf(fp, "%s\n", acebuf);
+	buf_printf(ob, "%s\n", acebuf);
     }
     break;
     
   case GACL_STYLE_ICACLS:
     len = strlen(path);
 
-    fprintf(fp, "%s", path);
+    buf_puts(ob, path);
 
-    for (i = 0; gacl_get_entry(a, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+    for (i = 0; _gacl_peek_entry(a, i, &ae) == 1; i++) {
       ace2str_icacls(ae, acebuf, sizeof(acebuf), sp);
-      fprintf(fp, "%*s %s\n", i ? len : 0, "", acebuf);
+      buf_printf(ob, "%*s %s\n", i ? len : 0, "", acebuf);
+    }
+    break;
+
+  case GACL_STYLE_FINGERPRINT:
+    /* One-liner, same layout as the sha*sum tools (so it can be sorted and grouped) */
+    if (gacl_fingerprint(a, &fpr) < 0 ||
+	gacl_fingerprint_to_text(&fpr, fpbuf, sizeof(fpbuf)) < 0) {
+      fprintf(stderr, "%s: Error: %s: Unable to fingerprint ACL: %s\n", argv0, path, strerror(errno));
+      return 1;
     }
+    buf_printf(ob, "%s  %s\n", fpbuf, path);
     break;
     
   default:
@@ -641,9 +1101,9 @@ print_acl(FILE *fp,
   }
 
  End:
-  free(us);
-  free(gs);
-  return 0;
+  if (ob->len > 0)
+    aclcmd_write(fp, ob->buf, ob->len);
+  return rc;
 }
 
 
@@ -671,6 +1131,10 @@ str2style(const char *str,
     *sp = GACL_STYLE_SOLARIS;
   else if (strcmp(str, "primos") == 0)
     *sp = GACL_STYLE_PRIMOS;
+  else if (strcmp(str, "fingerprint") == 0)
+    *sp = GACL_STYLE_FINGERPRINT;
+  else if (strcmp(str, "json") == 0)
+    *sp = GACL_STYLE_JSON;
   else
     return -1;
 
@@ -698,6 +1162,10 @@ style2str(GACL_STYLE s) {
     return "Solaris";
   case GACL_STYLE_PRIMOS:
     return "PRIMOS";
+  case GACL_STYLE_FINGERPRINT:
+    return "Fingerprint";
+  case GACL_STYLE_JSON:
+    return "JSON";
   }
 
   return NULL;
@@ -731,7 +1199,7 @@ mode2typestr(mode_t m) {
 
 char *
 mode2str(mode_t m) {
-  static char buf[11];
+  static THREAD_LOCAL char buf[11];
 
   switch (m & S_IFMT) {
   case S_IFIFO:
@@ -780,6 +1248,94 @@ mode2str(mode_t m) {
   return buf;
 }
 
+/*
+ * Temporary objects (ACLs, texts, buffers...) created while handling a
+ * file are taken from an arena that is reset after each file
+ */
+static THREAD_LOCAL ARENA *aclcmd_arena = NULL;
+
+typedef struct aclcmd_walker {
+  int (*handler)(const char *path,
+		 const struct stat *sp,
+		 size_t base,
+		 size_t level,
+		 void *vp);
+  void *vp;
+  unsigned long n;      /* Objects visited so far */
+} ACLCMD_WALKER;
+
+/* Position of the object being handled in the current walk */
+static THREAD_LOCAL unsigned long aclcmd_seq = 0;
+
+/* Output of the object being handled is collected here (parallel walks) */
+static THREAD_LOCAL BUFFER *aclcmd_obuf = NULL;
+
+
+unsigned long
+aclcmd_index(void) {
+  return aclcmd_seq;
+}
+
+/*
+ * Write handler output to 'fp'. In a parallel walk standard output is
+ * collected per object so it can be written out in traversal order.
+ */
+int
+aclcmd_write(FILE *fp,
+	     const char *buf,
+	     size_t len) {
+  if (aclcmd_obuf && fp == stdout)
+    return buf_putn(aclcmd_obuf, buf, len);
+
+  return fwrite(buf, 1, len, fp) == len ? 0 : -1;
+}
+
+int
+aclcmd_puts(FILE *fp,
+	    const char *s) {
+  if (aclcmd_write(fp, s, strlen(s)) < 0)
+    return -1;
+  return aclcmd_write(fp, "\n", 1);
+}
+
+
+static void *
+_aclcmd_arena_alloc(void *ctx,
+		    size_t size) {
+  return arena_alloc((ARENA *) ctx, size);
+}
+
+static int
+_aclcmd_call(ACLCMD_WALKER *wp,
+	     const char *path,
+	     const struct stat *sp,
+	     size_t base,
+	     size_t level) {
+  int rc;
+
+  
+  gacl_set_allocator_np(_aclcmd_arena_alloc, aclcmd_arena);
+  rc = wp->handler(path, sp, base, level, wp->vp);
+  gacl_set_allocator_np(NULL, NULL);
+  
+  arena_reset(aclcmd_arena);
+  return rc;
+}
+
+static int
+_aclcmd_walker(const char *path,
+	       const struct stat *sp,
+	       size_t base,
+	       size_t level,
+	       void *vp) {
+  ACLCMD_WALKER *wp = (ACLCMD_WALKER *) vp;
+
+  
+  aclcmd_seq = wp->n++;
+  return _aclcmd_call(wp, path, sp, base, level);
+}
+
+
 int
 aclcmd_foreach(int argc,
 	       char **argv,
@@ -790,13 +1346,40 @@ aclcmd_foreach(int argc,
 			      void *vp),
 	       void *vp) {
   int i, rc = 0;
+  ACLCMD_WALKER w;
+  jmp_buf saved_env;
   
 
+  if (!aclcmd_arena) {
+    aclcmd_arena = arena_create(ARENA_BLOCK_SIZE);
+    if (!aclcmd_arena)
+      return error(1, errno, "Creating memory arena");
+  }
+
+  w.handler = handler;
+  w.vp = vp;
+  w.n = 0;
+
+  rc = error_catch(saved_env);
+  if (rc) {
+    /* A handler bailed out via error() - drop whatever it left in the arena */
+    gacl_set_allocator_np(NULL, NULL);
+    arena_reset(aclcmd_arena);
+    if (config.f_progress)
+      progress_stop();
+    memcpy(error_env, saved_env, sizeof(jmp_buf));
+    longjmp(error_env, rc);
+  }
+  
+  if (config.f_progress)
+    progress_start(config.progress_interval);
+  
   for (i = 0; rc == 0 && i < argc; i++) {
-    rc = ft_foreach(argv[i], handler, vp,
+    rc = ft_foreach(argv[i], _aclcmd_walker, &w,
 		    config.f_recurse ? -1 : config.max_depth, config.f_filetype);
     if (rc) {
 #if 1
+      memcpy(error_env, saved_env, sizeof(jmp_buf));
       error(1, errno, "%s: Accessing", argv[i]);
 #else
       if (rc < 0) {
@@ -809,5 +1392,321 @@ aclcmd_foreach(int argc,
     }
   }
 
-  return rc;
+  if (config.f_progress)
+    progress_stop();
+  error_return(rc, saved_env);
+}
+
+
+/* Free the per-thread state of a worker thread */
+void
+aclcmd_thread_exit(void) {
+  if (aclcmd_arena) {
+    arena_destroy(aclcmd_arena);
+    aclcmd_arena = NULL;
+  }
+  
+  free(print_buf.buf);
+  print_buf.buf = NULL;
+}
+
+
+/*
+ * Parallel walks. The tree is still traversed by the calling thread,
+ * but the handler for each object runs in one of 'config.f_jobs'
+ * worker threads. Standard output from a handler is collected per
+ * object and written in traversal order as soon as all earlier objects
+ * are done (or directly when it is complete with --unordered), so the
+ * output is the same as for a sequential walk. At most ACLCMD_WINDOW
+ * objects per worker are in flight at any time.
+ *
+ * Handlers must not modify shared state and must write their output
+ * via print_acl() / aclcmd_write().
+ */
+#define ACLCMD_WINDOW 64
+
+typedef struct aclcmd_task {
+  struct aclcmd_task *next;
+  unsigned long seq;
+  int argi;
+  char *path;
+  struct stat stat;
+  size_t base;
+  size_t level;
+  int done;
+  int rc;
+  int ec;
+  BUFFER out;
+} ACLCMD_TASK;
+
+typedef struct aclcmd_pool {
+  pthread_mutex_t mtx;
+  pthread_cond_t work_cv;	/* Signalled when a task is queued (or at the end) */
+  pthread_cond_t done_cv;	/* Signalled when a task has been retired */
+  ACLCMD_TASK *head;		/* Work queue */
+  ACLCMD_TASK **lastp;
+  ACLCMD_TASK **wv;		/* Tasks in flight, indexed by seq % ws */
+  unsigned long ws;
+  unsigned long n;		/* Tasks dispatched */
+  unsigned long emitted;	/* Tasks retired */
+  int argi;
+  int stop;
+  int rc;			/* Status of the first failed task */
+  int ec;
+  int jumped;			/* Failed task bailed out via error() */
+  unsigned long fail_seq;
+  int fail_argi;
+  int unordered;
+  ACLCMD_WALKER w;
+  CONFIG config;
+  char *error_argv0;
+} ACLCMD_POOL;
+
+
+static void
+_aclcmd_task_free(ACLCMD_TASK *tp) {
+  free(tp->out.buf);
+  free(tp->path);
+  free(tp);
+}
+
+/* Write out and free tasks that are done, in order. Called with the mutex held */
+static void
+_aclcmd_retire(ACLCMD_POOL *pp) {
+  ACLCMD_TASK *tp;
+
+  
+  while ((tp = pp->wv[pp->emitted % pp->ws]) != NULL && tp->done) {
+    if ((!pp->rc || tp->seq <= pp->fail_seq) && tp->out.len > 0)
+      fwrite(tp->out.buf, 1, tp->out.len, stdout);
+    
+    pp->wv[pp->emitted % pp->ws] = NULL;
+    pp->emitted++;
+    _aclcmd_task_free(tp);
+    pthread_cond_broadcast(&pp->done_cv);
+  }
+}
+
+static void
+_aclcmd_task_run(ACLCMD_POOL *pp,
+		 ACLCMD_TASK *tp) {
+  int rc;
+  
+  
+  aclcmd_seq = tp->seq;
+  aclcmd_obuf = &tp->out;
+  
+  rc = setjmp(error_env);
+  if (rc) {
+    /* error() has already printed a message */
+    gacl_set_allocator_np(NULL, NULL);
+    arena_reset(aclcmd_arena);
+    tp->rc = rc;
+    tp->ec = -1;
+  } else {
+    tp->rc = _aclcmd_call(&pp->w, tp->path, &tp->stat, tp->base, tp->level);
+    tp->ec = errno;
+  }
+  
+  aclcmd_obuf = NULL;
+}
+
+static void *
+_aclcmd_worker(void *vp) {
+  ACLCMD_POOL *pp = (ACLCMD_POOL *) vp;
+  ACLCMD_TASK *tp;
+
+  
+  config = pp->config;
+  error_argv0 = pp->error_argv0;
+  aclcmd_arena = arena_create(ARENA_BLOCK_SIZE);
+  
+  pthread_mutex_lock(&pp->mtx);
+  while (1) {
+    while (!pp->head && !pp->stop)
+      pthread_cond_wait(&pp->work_cv, &pp->mtx);
+    
+    tp = pp->head;
+    if (!tp)
+      break;
+    
+    pp->head = tp->next;
+    if (!pp->head)
+      pp->lastp = &pp->head;
+    
+    /* Nothing after a failed object would have been handled sequentially */
+    if (!pp->rc || tp->seq < pp->fail_seq) {
+      pthread_mutex_unlock(&pp->mtx);
+      if (aclcmd_arena)
+	_aclcmd_task_run(pp, tp);
+      else {
+	tp->rc = -1;
+	tp->ec = ENOMEM;
+      }
+      pthread_mutex_lock(&pp->mtx);
+      
+      if (tp->rc && (!pp->rc || tp->seq < pp->fail_seq)) {
+	pp->rc = tp->rc;
+	pp->ec = tp->ec;
+	pp->jumped = (tp->ec == -1);
+	pp->fail_seq = tp->seq;
+	pp->fail_argi = tp->argi;
+      }
+    }
+    
+    tp->done = 1;
+    if (pp->unordered) {
+      if (!pp->rc && tp->out.len > 0)
+	fwrite(tp->out.buf, 1, tp->out.len, stdout);
+      _aclcmd_task_free(tp);
+      pp->emitted++;
+      pthread_cond_broadcast(&pp->done_cv);
+    } else
+      _aclcmd_retire(pp);
+  }
+  pthread_mutex_unlock(&pp->mtx);
+
+  aclcmd_thread_exit();
+  return NULL;
+}
+
+static int
+_aclcmd_dispatch(const char *path,
+		 const struct stat *sp,
+		 size_t base,
+		 size_t level,
+		 void *vp) {
+  ACLCMD_POOL *pp = (ACLCMD_POOL *) vp;
+  ACLCMD_TASK *tp;
+
+  
+  tp = calloc(1, sizeof(*tp));
+  if (!tp)
+    return -1;
+  
+  tp->path = strdup(path);
+  if (!tp->path) {
+    free(tp);
+    return -1;
+  }
+  
+  tp->stat = *sp;
+  tp->base = base;
+  tp->level = level;
+  tp->argi = pp->argi;
+  
+  pthread_mutex_lock(&pp->mtx);
+  while (!pp->rc && pp->n - pp->emitted >= pp->ws)
+    pthread_cond_wait(&pp->done_cv, &pp->mtx);
+  
+  if (pp->rc) {
+    /* Stop the walk, the failure is reported by aclcmd_foreach_parallel() */
+    pthread_mutex_unlock(&pp->mtx);
+    _aclcmd_task_free(tp);
+    return 1;
+  }
+  
+  tp->seq = pp->n++;
+  if (!pp->unordered)
+    pp->wv[tp->seq % pp->ws] = tp;
+  *(pp->lastp) = tp;
+  pp->lastp = &tp->next;
+  pthread_cond_signal(&pp->work_cv);
+  pthread_mutex_unlock(&pp->mtx);
+  
+  return 0;
+}
+
+
+int
+aclcmd_foreach_parallel(int argc,
+			char **argv,
+			int (*handler)(const char *path,
+				       const struct stat *sp,
+				       size_t base,
+				       size_t level,
+				       void *vp),
+			void *vp) {
+  ACLCMD_POOL pool;
+  pthread_t *tv;
+  int i, nt, ec, rc = 0;
+  
+
+  if (config.f_jobs <= 1)
+    return aclcmd_foreach(argc, argv, handler, vp);
+  
+  for (i = 0; i < argc; i++)
+    if (vfs_get_type(argv[i]) != VFS_TYPE_SYS)
+      return aclcmd_foreach(argc, argv, handler, vp);
+  
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.mtx, NULL);
+  pthread_cond_init(&pool.work_cv, NULL);
+  pthread_cond_init(&pool.done_cv, NULL);
+  pool.lastp = &pool.head;
+  pool.ws = (unsigned long) config.f_jobs * ACLCMD_WINDOW;
+  pool.unordered = config.f_unordered;
+  pool.w.handler = handler;
+  pool.w.vp = vp;
+  pool.config = config;
+  pool.error_argv0 = error_argv0;
+
+  pool.wv = calloc(pool.ws, sizeof(ACLCMD_TASK *));
+  tv = calloc(config.f_jobs, sizeof(pthread_t));
+  if (!pool.wv || !tv) {
+    free(pool.wv);
+    free(tv);
+    return error(1, errno, "Creating worker threads");
+  }
+
+  /* Anything still buffered must come before the workers' output */
+  fflush(stdout);
+  
+  for (nt = 0; nt < config.f_jobs; nt++)
+    if (pthread_create(&tv[nt], NULL, _aclcmd_worker, &pool) != 0)
+      break;
+
+  if (nt == 0) {
+    free(pool.wv);
+    free(tv);
+    return aclcmd_foreach(argc, argv, handler, vp);
+  }
+  
+  if (config.f_progress)
+    progress_start(config.progress_interval);
+  
+  for (i = 0; rc == 0 && i < argc; i++) {
+    pool.argi = i;
+    rc = ft_foreach(argv[i], _aclcmd_dispatch, &pool,
+		    config.f_recurse ? -1 : config.max_depth, config.f_filetype);
+  }
+  ec = errno;
+  
+  pthread_mutex_lock(&pool.mtx);
+  pool.stop = 1;
+  pthread_cond_broadcast(&pool.work_cv);
+  pthread_mutex_unlock(&pool.mtx);
+  
+  while (nt > 0)
+    pthread_join(tv[--nt], NULL);
+  
+  free(pool.wv);
+  free(tv);
+  pthread_cond_destroy(&pool.done_cv);
+  pthread_cond_destroy(&pool.work_cv);
+  pthread_mutex_destroy(&pool.mtx);
+
+  if (config.f_progress)
+    progress_stop();
+  
+  if (pool.rc) {
+    if (pool.jumped)
+      longjmp(error_env, pool.rc);
+    return error(1, pool.ec, "%s: Accessing", argv[pool.fail_argi]);
+  }
+  
+  if (rc)
+    return error(1, ec, "%s: Accessing", argv[i-1]);
+
+  return 0;
 }
@@ -45,6 +45,8 @@ typedef enum gacl_style
    GACL_STYLE_ICACLS   = 0x30,
    GACL_STYLE_SOLARIS  = 0x40,
    GACL_STYLE_PRIMOS   = 0x50,
+   GACL_STYLE_FINGERPRINT = 0x60,
+   GACL_STYLE_JSON     = 0x70,
   } GACL_STYLE;
 
 
@@ -53,11 +55,25 @@ get_acl(const char *path,
 	const struct stat *sp,
 	gacl_t *app);
 
+extern void
+prefetch_acl_ids(gacl_t ap,
+		 const struct stat *sp);
+
 extern int
 print_ace(gacl_t ap,
 	  int p,
 	  int verbose);
 
+extern gacl_t
+prepare_acl(const char *path,
+	    gacl_t nap);
+
+extern int
+set_prepared_acl(const char *path,
+		 const struct stat *sp,
+		 gacl_t ap,
+		 gacl_t oap);
+
 extern int
 set_acl(const char *path,
 	const struct stat *sp,
@@ -96,6 +112,31 @@ aclcmd_foreach(int argc,
 			      void *vp),
 	       void *vp);
 
+extern int
+aclcmd_foreach_parallel(int argc,
+			char **argv,
+			int (*handler)(const char *path,
+				       const struct stat *sp,
+				       size_t base,
+				       size_t level,
+				       void *vp),
+			void *vp);
+
+extern unsigned long
+aclcmd_index(void);
+
+extern int
+aclcmd_write(FILE *fp,
+	     const char *buf,
+	     size_t len);
+
+extern int
+aclcmd_puts(FILE *fp,
+	    const char *s);
+
+extern void
+aclcmd_thread_exit(void);
+
 extern char *
 mode2typestr(mode_t m);
 
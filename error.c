@@ -39,10 +39,11 @@
 #include <errno.h>
 
 #include "error.h"
+#include "progress.h"
 
-char *error_argv0 = NULL;
+THREAD_LOCAL char *error_argv0 = NULL;
 
-jmp_buf error_env;
+THREAD_LOCAL jmp_buf error_env;
 
 
 int
@@ -66,8 +67,10 @@ error(int rc,
 
   va_end(ap);
   
-  if (rc)
+  if (rc) {
+    progress_add(PROGRESS_ERRORS, 1);
     longjmp(error_env, rc);
+  }
 
   return rc;
 }
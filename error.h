@@ -36,8 +36,8 @@
 
 #include <setjmp.h>
 
-extern char *error_argv0;
-extern jmp_buf error_env;
+extern THREAD_LOCAL char *error_argv0;
+extern THREAD_LOCAL jmp_buf error_env;
 
 #define error_catch(save_env)		(memcpy(save_env, error_env, sizeof(jmp_buf)), setjmp(error_env))
 #define error_return(rc, save_env) 	do { memcpy(error_env, save_env, sizeof(jmp_buf)); return rc; } while(0)
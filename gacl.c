@@ -41,12 +41,20 @@
 #include <grp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "gacl.h"
 #include "gacl_impl.h"
 
 #include "vfs.h"
 #include "strings.h"
+#include "ident.h"
 
 
 static struct gace_perm2c {
@@ -88,38 +96,169 @@ static struct gace_flag2c {
 
 
 
+/*
+ * Allocation header - the union keeps the objects after it properly aligned
+ */
+typedef union gacl_alloc_hdr {
+  struct {
+    GACL_MAGIC m;
+    int f;            /* GACL_ALLOC_F_* */
+  } h;
+  void *p;
+  double d;
+  uint64_t u;
+} GACL_ALLOC_HDR;
+
+#define GACL_ALLOC_F_ARENA    0x0001  /* Object allocated via the allocator hook */
+#define GACL_ALLOC_F_ARENA_AV 0x0002  /* Private entries (av) allocated via the hook */
+
+
+/* Allocator for short-lived objects, see gacl_set_allocator_np() */
+static THREAD_LOCAL void *(*_gacl_allocf)(void *ctx, size_t size) = NULL;
+static THREAD_LOCAL void *_gacl_alloc_ctx = NULL;
+
+
+/*
+ * Install (or remove, with allocf == NULL) an allocator that all
+ * following objects are taken from. Memory taken from it is never
+ * passed to free() - gacl_free() only marks such objects as freed
+ * and the owner of the allocator releases them all at once (for
+ * example an arena that is reset between files).
+ */
+int
+gacl_set_allocator_np(void *(*allocf)(void *ctx, size_t size),
+		      void *ctx) {
+  _gacl_allocf = allocf;
+  _gacl_alloc_ctx = allocf ? ctx : NULL;
+  return 0;
+}
+
+/* Get the currently installed allocator (so it can be restored later) */
+int
+gacl_get_allocator_np(void *(**allocfp)(void *ctx, size_t size),
+		      void **ctxp) {
+  *allocfp = _gacl_allocf;
+  *ctxp = _gacl_alloc_ctx;
+  return _gacl_allocf ? 1 : 0;
+}
+
+
 /*
  * Allocate an object + 's' extra bytes and tag it with the MAGIC number
  */
 static void *
 _gacl_alloc(GACL_MAGIC m,
 	    size_t s) {
-  GACL_MAGIC *p;
+  GACL_ALLOC_HDR *p = NULL;
+  size_t z;
+  int f = 0;
   
 
   switch (m) {
   case GACL_MAGIC_ACL:
+    /* Entries are initialized when created so only clear the ACL header */
+    z = sizeof(GACL);
     s += sizeof(GACL);
     break;
     
   case GACL_MAGIC_TEXT:
   case GACL_MAGIC_QUALIFIER:
+    z = s;
+    break;
+
+  case GACL_MAGIC_BUFFER:
+    /* Caller fills it in */
+    z = 0;
     break;
     
   default:
     abort();
   }
 
-  s += sizeof(GACL_MAGIC);
+  if (_gacl_allocf) {
+    p = (GACL_ALLOC_HDR *) (*_gacl_allocf)(_gacl_alloc_ctx, sizeof(*p) + s);
+    if (p)
+      f = GACL_ALLOC_F_ARENA;
+  }
+  if (!p) {
+    p = (GACL_ALLOC_HDR *) malloc(sizeof(*p) + s);
+    if (!p)
+      return NULL;
+  }
+
+  memset(p+1, 0, z);
+  p->h.m = m;
+  p->h.f = f;
+
+  return p+1;
+}
+
+
+/*
+ * Allocate a temporary buffer (released with gacl_free())
+ */
+void *
+_gacl_buffer_alloc(size_t size) {
+  return _gacl_alloc(GACL_MAGIC_BUFFER, size);
+}
+
+
+/*
+ * Drop a reference to an ACL object. The memory is released when the last
+ * ACL sharing its entries (see gacl_dup()) is gone.
+ */
+static void
+_gacl_release(GACL *ap) {
+  GACL_ALLOC_HDR *hp = ((GACL_ALLOC_HDR *) ap)-1;
+
   
-  p = (GACL_MAGIC *) malloc(s);
-  if (!p)
-    return NULL;
+  if (__atomic_sub_fetch(&ap->nr, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  if (!(hp->h.f & GACL_ALLOC_F_ARENA))
+    free(hp);
+}
+
+
+/*
+ * Make sure an ACL has entries of its own before it is modified.
+ *
+ * Either the entries are shared from another ACL, or another ACL shares
+ * the entries inside this one. In both cases they are copied to a private
+ * array first.
+ */
+static int
+_gacl_modify(GACL *ap) {
+  GACL_ALLOC_HDR *hp = ((GACL_ALLOC_HDR *) ap)-1;
+  GACL_ENTRY *av = NULL;
+  size_t s;
+  
+
+  if (!ap->sp && (ap->av != ap->ab || __atomic_load_n(&ap->nr, __ATOMIC_ACQUIRE) == 1))
+    return 0;
+
+  s = (ap->as > 0 ? ap->as : 1) * sizeof(*av);
+  
+  if ((hp->h.f & GACL_ALLOC_F_ARENA) && _gacl_allocf) {
+    av = (*_gacl_allocf)(_gacl_alloc_ctx, s);
+    if (av)
+      hp->h.f |= GACL_ALLOC_F_ARENA_AV;
+  }
+  if (!av) {
+    av = malloc(s);
+    if (!av)
+      return -1;
+  }
 
-  memset(p, 0, s);
-  *p++ = m;
+  memcpy(av, ap->av, ap->ac * sizeof(*av));
 
-  return p;
+  if (ap->sp) {
+    _gacl_release(ap->sp);
+    ap->sp = NULL;
+  }
+  
+  ap->av = av;
+  return 0;
 }
 
 
@@ -129,20 +268,35 @@ _gacl_alloc(GACL_MAGIC m,
  */
 int
 gacl_free(void *op) {
-  GACL_MAGIC *mp;
+  GACL_ALLOC_HDR *hp;
+  GACL *ap;
 
   if (!op)
     return 0;
 
-  mp = (GACL_MAGIC *) op;
-  --mp;
+  hp = ((GACL_ALLOC_HDR *) op)-1;
   
-  switch (*mp) {
+  switch (hp->h.m) {
   case GACL_MAGIC_ACL:
+    hp->h.m = GACL_MAGIC_FREED;
+
+    ap = (GACL *) op;
+    if (ap->sp) {
+      _gacl_release(ap->sp);
+      ap->sp = NULL;
+    } else if (ap->av != ap->ab && !(hp->h.f & GACL_ALLOC_F_ARENA_AV))
+      free(ap->av);
+    ap->av = ap->ab;
+    
+    _gacl_release(ap);
+    return 0;
+
   case GACL_MAGIC_TEXT:
   case GACL_MAGIC_QUALIFIER:
-    *mp = GACL_MAGIC_FREED;
-    free(mp);
+  case GACL_MAGIC_BUFFER:
+    hp->h.m = GACL_MAGIC_FREED;
+    if (!(hp->h.f & GACL_ALLOC_F_ARENA))
+      free(hp);
     return 0;
 
   case GACL_MAGIC_FREED:
@@ -309,19 +463,29 @@ gacl_merge_flagset(GACL_FLAGSET *d,
 
 GACL *
 gacl_init(int count) {
+  if (count < GACL_MIN_ENTRIES)
+    count = GACL_DEFAULT_ENTRIES;
+
+  return gacl_init_exact_np(count);
+}
+
+
+/* Room for exactly 'count' entries - for ACLs that will not grow */
+GACL *
+gacl_init_exact_np(int count) {
   GACL *ap;
 #if 0
   size_t s;
 #endif
 
   
-  if (count < GACL_MIN_ENTRIES)
-    count = GACL_DEFAULT_ENTRIES;
+  if (count < 1)
+    count = 1;
 
 #if 1
-  ap = _gacl_alloc(GACL_MAGIC_ACL, count*sizeof(ap->av[0]));
+  ap = _gacl_alloc(GACL_MAGIC_ACL, count*sizeof(ap->ab[0]));
 #else
-  s = sizeof(*ap) + count*sizeof(ap->av[0]);
+  s = sizeof(*ap) + count*sizeof(ap->ab[0]);
   ap = malloc(s);
 #endif
   if (!ap)
@@ -333,6 +497,9 @@ gacl_init(int count) {
   ap->ac = 0;
   ap->ap = 0;
   ap->as = count;
+  ap->av = ap->ab;
+  ap->sp = NULL;
+  ap->nr = 1;
 
   return ap;
 }
@@ -367,6 +534,10 @@ _gacl_entries(GACL *ap) {
   return ap->ac;
 }
 
+/*
+ * Positional access. Does not use (or change) the iteration cursor in
+ * the ACL so it is safe for concurrent readers.
+ */
 int
 _gacl_get_entry(GACL *ap,
 		int pos,
@@ -376,36 +547,113 @@ _gacl_get_entry(GACL *ap,
     return -1;
   }
   
-  ap->ap = pos;
-
-  if (ap->ap >= ap->ac) {
+  if (pos >= ap->ac) {
     return 0;
   }
 
-  *epp = &ap->av[ap->ap++];
+  /* The entry may be modified by the caller */
+  if (_gacl_modify(ap) < 0)
+    return -1;
+  
+  *epp = &ap->av[pos];
   return 1;
 }
 
+/*
+ * Iterate with a caller supplied cursor
+ */
+int
+gacl_get_entry_r(GACL *ap,
+		 int eid,
+		 GACL_ENTRY **epp,
+		 int *cursor) {
+  int rc;
+
+  
+  if (!ap || !cursor || !(eid == GACL_FIRST_ENTRY || eid == GACL_NEXT_ENTRY)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (eid == GACL_FIRST_ENTRY)
+    *cursor = 0;
+
+  rc = _gacl_get_entry(ap, *cursor, epp);
+  if (rc > 0)
+    ++*cursor;
+  
+  return rc;
+}
+
 int
 gacl_get_entry(GACL *ap,
 	       int eid,
 	       GACL_ENTRY **epp) {
-  if (!ap || !(eid == GACL_FIRST_ENTRY || eid == GACL_NEXT_ENTRY)) {
+  if (!ap) {
     errno = EINVAL;
     return -1;
   }
 
-  if (eid == GACL_FIRST_ENTRY)
-    ap->ap = 0;
+  return gacl_get_entry_r(ap, eid, epp, &ap->ap);
+}
 
-  if (ap->ap >= ap->ac) {
+/*
+ * Like the functions above but for read-only access.
+ * The entry must not be modified via the returned pointer (it may
+ * be shared with other ACLs).
+ */
+int
+_gacl_peek_entry(GACL *ap,
+		 int pos,
+		 GACL_ENTRY **epp) {
+  if (!ap || pos < 0 || pos > ap->ac) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  if (pos >= ap->ac) {
     return 0;
   }
 
-  *epp = &ap->av[ap->ap++];
+  *epp = &ap->av[pos];
   return 1;
 }
 
+int
+gacl_peek_entry_r(GACL *ap,
+		  int eid,
+		  GACL_ENTRY **epp,
+		  int *cursor) {
+  int rc;
+
+  
+  if (!ap || !cursor || !(eid == GACL_FIRST_ENTRY || eid == GACL_NEXT_ENTRY)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (eid == GACL_FIRST_ENTRY)
+    *cursor = 0;
+
+  rc = _gacl_peek_entry(ap, *cursor, epp);
+  if (rc > 0)
+    ++*cursor;
+  
+  return rc;
+}
+
+int
+gacl_peek_entry_np(GACL *ap,
+		   int eid,
+		   GACL_ENTRY **epp) {
+  if (!ap) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return gacl_peek_entry_r(ap, eid, epp, &ap->ap);
+}
+
 /* If index < 0 or index > last -> append */
 /* TODO: Realloc() GACL if need to extent to make room for more GACL_ENTRYs */
 int
@@ -427,6 +675,9 @@ gacl_create_entry_np(GACL **app,
     return -1;
   }
 
+  if (_gacl_modify(ap) < 0)
+    return -1;
+
   if (index < 0 || index > ap->ac)
       index = ap->ac;
 
@@ -471,6 +722,9 @@ gacl_delete_entry_np(GACL *ap,
     errno = EINVAL;
     return -1;
   }
+
+  if (_gacl_modify(ap) < 0)
+    return -1;
   
   for (; index < ap->ac-1; index++)
     gacl_copy_entry(&ap->av[index], &ap->av[index+1]);
@@ -526,11 +780,40 @@ gacl_get_brand_np(GACL *ap,
 
 
 
+/*
+ * Duplicate an ACL.
+ *
+ * The new ACL shares the entries of the old one (copy-on-write) until
+ * either of them is modified - see _gacl_modify(). An ACL that has
+ * already been given a private entry array is copied right away.
+ */
 GACL *
 gacl_dup(GACL *ap) {
-  GACL *nap;
+  GACL *nap, *rap;
   int i;
 
+
+  if (!ap) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  rap = ap->sp ? ap->sp : (ap->av == ap->ab ? ap : NULL);
+  if (rap) {
+    nap = _gacl_alloc(GACL_MAGIC_ACL, 0);
+    if (!nap)
+      return NULL;
+
+    nap->type = ap->type;
+    nap->ac = ap->ac;
+    nap->as = ap->as;
+    nap->ap = 0;
+    nap->av = ap->av;
+    nap->sp = rap;
+    nap->nr = 1;
+    __atomic_add_fetch(&rap->nr, 1, __ATOMIC_RELAXED);
+    return nap;
+  }
   
   nap = gacl_init(ap->as);
   if (!nap)
@@ -560,7 +843,7 @@ gacl_clean(GACL *ap) {
 
 
  RESTART:
-  for (i = 0; (rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_get_entry(ap, i, &ep)) == 1; i++) {
     GACL_PERMSET *ps = NULL;
     GACL_FLAGSET *fs = NULL;
 
@@ -583,94 +866,185 @@ gacl_clean(GACL *ap) {
 }
 
 
-/* Compare two ACL Entries */
-static int
-_gacl_entry_compare(const void *va,
-		    const void *vb) {
-  GACL_ENTRY *a = (GACL_ENTRY *) va;
-  GACL_ENTRY *b = (GACL_ENTRY *) vb;
-  GACL_ENTRY_TYPE aet_a, aet_b;
-  GACL_TAG_TYPE ta, tb;
-  GACL_FLAGSET *afs, *bfs;
-  int v;
-  int inherited_a, inherited_b;
-  int inherit_only_a, inherit_only_b;
-  uid_t *qa, *qb;
-  
+/*
+ * Packed 64 bit sort key for an ACE, most significant bits first:
+ *
+ *   63     Inherited flag (explicit entries goes before inherited ones)
+ *   62     Inherit-only flag
+ *   55-61  Tag type (owner@ - user - group@ - group - everyone@)
+ *   23-54  User/group id (signed, like the comparator above)
+ *   20-22  Entry type (deny entries goes before allow ones)
+ *    0-19  Original position
+ *
+ * Inherit-only entries compare equal to every entry of their class, like
+ * they always have. That is not a total order, so the result depends on
+ * the sort algorithm. The keys are sorted with the top-down merge sort
+ * that glibc's qsort() uses, so on Linux ACLs keep the order they were
+ * always sorted to. The order now follows glibc on every platform: where
+ * qsort() is a quicksort (FreeBSD, macOS, Solaris) ACLs with inherit-only
+ * or equal entries may be sorted differently than before, once.
+ */
+#define GACL_SORTKEY_POS_BITS  20
+#define GACL_SORTKEY_POS_MASK  ((1ULL << GACL_SORTKEY_POS_BITS)-1)
+#define GACL_SORTKEY_MAX_ACES  (1 << GACL_SORTKEY_POS_BITS)
+#define GACL_SORTKEY_INHERITED (1ULL << 63)
+#define GACL_SORTKEY_IONLY     (1ULL << 62)
 
-  afs = bfs = NULL;
-  gacl_get_flagset_np(a, &afs);
-  gacl_get_flagset_np(b, &bfs);
-  
-  inherited_a = gacl_get_flag_np(afs, GACL_FLAG_INHERITED);
-  inherited_b = gacl_get_flag_np(bfs, GACL_FLAG_INHERITED);
+/* Number of keys (and as many temporary ones) sorted in a stack buffer */
+#define GACL_SORTKEY_STACK     512
 
-  /* Explicit entries goes before inherited ones */
-  v = inherited_a-inherited_b;
-  if (v)
-    return v;
+static inline uint64_t
+_gacl_entry_sortkey(const GACL_ENTRY *ep,
+		    int pos) {
+  uint64_t k;
+  uint32_t id;
+  int et;
 
-  
-  inherit_only_a = gacl_get_flag_np(afs, GACL_FLAG_INHERIT_ONLY);
-  inherit_only_b = gacl_get_flag_np(bfs, GACL_FLAG_INHERIT_ONLY);
 
-  /* Ignore this entry if the 'inherit_only' flag is set on one of them */
-  if (inherit_only_a || inherit_only_b)
-    return 0;
+  k = (ep->flags & GACL_FLAG_INHERITED) ? 1 : 0;
+  k = (k << 1) | ((ep->flags & GACL_FLAG_INHERIT_ONLY) ? 1 : 0);
+  k = (k << 7) | ((uint64_t) ep->tag.type & 0x7F);
+
+  switch (ep->tag.type) {
+  case GACL_TAG_TYPE_USER:
+  case GACL_TAG_TYPE_GROUP:
+    id = ((uint32_t) ep->tag.ugid) ^ 0x80000000U;
+    break;
+  default:
+    id = 0;
+  }
+  k = (k << 32) | id;
 
+  et = ep->type;
+  if (et < GACL_ENTRY_TYPE_UNDEFINED)
+    et = GACL_ENTRY_TYPE_UNDEFINED;
+  else if (et > GACL_ENTRY_TYPE_ALARM)
+    et = GACL_ENTRY_TYPE_ALARM;
+  k = (k << 3) | (uint64_t) (GACL_ENTRY_TYPE_ALARM - et);
+
+  return (k << GACL_SORTKEY_POS_BITS) | (uint64_t) pos;
+}
+
+/* True if key 'a' may stay before 'b' (the comparator above returns <= 0) */
+static inline int
+_gacl_sortkey_le(uint64_t a,
+		 uint64_t b) {
+  if ((a ^ b) & GACL_SORTKEY_INHERITED)
+    return a < b;
   
-  /* order: owner@ - user - group@ - group - everyone@ */
-  ta = tb = 0;
+  if ((a | b) & GACL_SORTKEY_IONLY)
+    return 1;
   
-  if (gacl_get_tag_type(a, &ta) < 0)
-    return -1;
+  return (a & ~GACL_SORTKEY_POS_MASK) <= (b & ~GACL_SORTKEY_POS_MASK);
+}
+
+/* Stable top-down merge sort, 'tv' has room for 'n' keys */
+static void
+_gacl_sortkeys(uint64_t *kv,
+	       int n,
+	       uint64_t *tv) {
+  uint64_t *b1, *b2, *tp;
+  int n1, n2;
+
+
+  if (n <= 1)
+    return;
+
+  n1 = n/2;
+  n2 = n-n1;
+  b1 = kv;
+  b2 = kv+n1;
   
-  if (gacl_get_tag_type(b, &tb) < 0)
-    return 1;
+  _gacl_sortkeys(b1, n1, tv);
+  _gacl_sortkeys(b2, n2, tv);
 
-  v = ta-tb;
-  if (v)
-    return v;
+  tp = tv;
+  while (n1 > 0 && n2 > 0) {
+    if (_gacl_sortkey_le(*b1, *b2)) {
+      *tp++ = *b1++;
+      --n1;
+    } else {
+      *tp++ = *b2++;
+      --n2;
+    }
+  }
+  if (n1 > 0)
+    memcpy(tp, b1, n1 * sizeof(*tp));
+  memcpy(kv, tv, (n-n2) * sizeof(*kv));
+}
 
-  switch (ta) {
-  case GACL_TAG_TYPE_USER:
-    qa = (uid_t *) gacl_get_qualifier(a);
-    qb = (uid_t *) gacl_get_qualifier(b);
-    v = (*qa-*qb);
-    gacl_free((void *) qa);
-    gacl_free((void *) qb);
-    if (v)
-      return v;
-    break;
-    
-  case GACL_TAG_TYPE_GROUP:
-    qa = (uid_t *) gacl_get_qualifier(a);
-    qb = (uid_t *) gacl_get_qualifier(b);
-    v = (*qa-*qb);
-    gacl_free((void *) qa);
-    gacl_free((void *) qb);
-    if (v)
-      return v;
-    break;
 
-  default:
-    break;
+/*
+ * Sort the entries of an ACL in place.
+ * Returns 1 if the order was changed and 0 if already sorted.
+ */
+int
+gacl_sort_inplace_np(GACL *ap) {
+  uint64_t kbuf[2*GACL_SORTKEY_STACK], *kv, k;
+  GACL_ENTRY tmp;
+  int i, j, p, rc, sorted;
+
+
+  if (!ap) {
+    errno = EINVAL;
+    return -1;
   }
 
-  aet_a = aet_b = 0;
-  
-  /* Deny entries goes before allow ones */
-  if (gacl_get_entry_type_np(a, &aet_a) < 0)
+  if (ap->ac > GACL_SORTKEY_MAX_ACES) {
+    errno = E2BIG;
     return -1;
+  }
+
+  kv = kbuf;
+  if (ap->ac > GACL_SORTKEY_STACK) {
+    kv = malloc(2 * ap->ac * sizeof(kv[0]));
+    if (!kv)
+      return -1;
+  }
+
+  /* Strictly ascending keys without inherit-only entries are already sorted */
+  sorted = 1;
+  for (i = 0; i < ap->ac; i++) {
+    kv[i] = _gacl_entry_sortkey(&ap->av[i], i);
+    if ((kv[i] & GACL_SORTKEY_IONLY) || (i > 0 && kv[i] < kv[i-1]))
+      sorted = 0;
+  }
+
+  rc = 0;
+  if (sorted)
+    goto End;
+
+  _gacl_sortkeys(kv, ap->ac, kv+ap->ac);
+
+  for (i = 0; i < ap->ac && (int) (kv[i] & GACL_SORTKEY_POS_MASK) == i; i++)
+    ;
+  if (i == ap->ac)
+    goto End;
   
-  if (gacl_get_entry_type_np(b, &aet_b) < 0)
-    return 1;
+  rc = -1;
+  if (_gacl_modify(ap) < 0)
+    goto End;
 
-  v = aet_b - aet_a;
-  if (v)
-    return v;
+  /* Move the entries in place by following the cycles of the permutation */
+  for (i = 0; i < ap->ac; i++) {
+    if ((int) (kv[i] & GACL_SORTKEY_POS_MASK) == i)
+      continue;
 
-  return 0;
+    tmp = ap->av[i];
+    for (j = i; (p = (int) (kv[j] & GACL_SORTKEY_POS_MASK)) != i; j = p) {
+      ap->av[j] = ap->av[p];
+      k = (kv[j] & ~GACL_SORTKEY_POS_MASK) | (uint64_t) j;
+      kv[j] = k;
+    }
+    ap->av[j] = tmp;
+    kv[j] = (kv[j] & ~GACL_SORTKEY_POS_MASK) | (uint64_t) j;
+  }
+  rc = 1;
+
+ End:
+  if (kv != kbuf)
+    free(kv);
+  return rc;
 }
 
 
@@ -689,86 +1063,301 @@ gacl_sort(GACL *ap) {
   if (!nap)
     return NULL;
 
-  qsort(&nap->av[0], nap->ac, sizeof(nap->av[0]), _gacl_entry_compare);
+  if (gacl_sort_inplace_np(nap) < 0) {
+    gacl_free(nap);
+    return NULL;
+  }
+
   return nap;
 }
 
 
+/*
+ * Merging of ACL entries.
+ *
+ * Two entries are merged if they belong to the same class (explicit or
+ * inherited) and either have the same merge key (tag type, user/group id and
+ * entry type) or one of them has the 'inherit_only' flag set. The first
+ * entry absorbs the permissions and flags of the later one and becomes an
+ * explicit entry.
+ *
+ * Entries are visited in order. An inherited entry absorbs the first
+ * matching inherited entry after it (after which it is explicit). An explicit
+ * entry then absorbs every later explicit entry with the same key - or all of
+ * them if it (or any of them) is 'inherit_only'.
+ *
+ * Entries with the same class and key, the 'inherit_only' entries and all
+ * entries of each class are linked in index order. Each chain has a cursor
+ * that is only moved forward past entries already visited or merged away so
+ * the whole thing runs in linear time.
+ */
 
-GACL *
-gacl_merge(GACL *ap) {
-  GACL *nap;
-  int i, j, n;
-  
-
-  nap = gacl_dup(ap);
-  if (!nap)
-    return NULL;
+#define GACL_MERGE_STACK 256
 
-  n = 0;
-  for (i = 0; i < nap->ac; i++) {
-  AGAIN:
-    for (j = i+1; j < nap->ac && _gacl_entry_compare(&nap->av[i], &nap->av[j]) != 0; j++)
-      ;
+#define GACL_MERGE_FLAGS (GACL_FLAG_FILE_INHERIT |	    \
+			  GACL_FLAG_DIRECTORY_INHERIT |	    \
+			  GACL_FLAG_NO_PROPAGATE_INHERIT |  \
+			  GACL_FLAG_INHERIT_ONLY |	    \
+			  GACL_FLAG_SUCCESSFUL_ACCESS |	    \
+			  GACL_FLAG_FAILED_ACCESS |	    \
+			  GACL_FLAG_INHERITED)
 
-    if (j < nap->ac) {
-      /* Match found - merge ACE */
-      GACL_PERMSET *ps_a, *ps_b;
-      GACL_FLAGSET *fs_a, *fs_b;
-      
-      if (gacl_get_permset(&nap->av[i], &ps_a) < 0 ||
-	  gacl_get_permset(&nap->av[j], &ps_b) < 0)
-	goto Fail;
-      
-      if (gacl_get_flagset_np(&nap->av[i], &fs_a) < 0 ||
-	  gacl_get_flagset_np(&nap->av[j], &fs_b) < 0)
-	goto Fail;
+typedef struct gacl_merge_slot {
+  uint64_t key;
+  int head;
+} GACL_MERGE_SLOT;
 
-      if (gacl_merge_permset(ps_a, ps_b, +1) < 0)
-	goto Fail;
+static inline uint64_t
+_gacl_entry_mergekey(const GACL_ENTRY *ep,
+		     int inherited) {
+  uint64_t k;
 
-      if (gacl_merge_flagset(fs_a, fs_b, +1) < 0)
-	goto Fail;
 
-      gacl_delete_flag_np(fs_a, GACL_FLAG_INHERITED);
-      
-      if (gacl_set_permset(&nap->av[i], ps_a) < 0)
-	goto Fail;
-      
-      if (gacl_set_flagset_np(&nap->av[i], fs_a) < 0)
-	goto Fail;
-      
-      if (gacl_delete_entry_np(nap, j) < 0)
-	goto Fail;
+  k = inherited ? 1 : 0;
+  k = (k << 8) | ((uint64_t) ep->tag.type & 0xFF);
+  k = (k << 8) | ((uint64_t) ep->type & 0xFF);
+  k <<= 32;
 
-      ++n;
-      goto AGAIN;
-    }
+  switch (ep->tag.type) {
+  case GACL_TAG_TYPE_USER:
+  case GACL_TAG_TYPE_GROUP:
+    k |= (uint32_t) ep->tag.ugid;
+    break;
+  default:
+    break;
   }
 
-  return nap;
+  return k;
+}
 
- Fail:
-  gacl_free(nap);
-  return NULL;
+static inline int
+_gacl_merge_slot(const GACL_MERGE_SLOT *sv,
+		 int smask,
+		 uint64_t k) {
+  int h = (int) (((k * 0x9E3779B97F4A7C15ULL) >> 32) & smask);
+
+
+  while (sv[h].head != -2 && sv[h].key != k)
+    h = (h+1) & smask;
+
+  return h;
 }
 
+static inline int
+_gacl_merge_cursor(int *hp,
+		   const int *next,
+		   const char *dead,
+		   int pos) {
+  int h = *hp;
 
-int
-gacl_is_trivial_np(GACL *ap,
-		   int *trivialp) {
-  GACL_ENTRY *ep;
-  GACL_TAG_TYPE t;
-  int i, rc, tf;
 
-  
+  while (h >= 0 && (h <= pos || dead[h]))
+    h = next[h];
+
+  return *hp = h;
+}
+
+static inline void
+_gacl_merge_absorb(GACL_ENTRY *dep,
+		   const GACL_ENTRY *sep) {
+  dep->perms |= (sep->perms & GACL_PERM_FULL_SET);
+  dep->flags |= (sep->flags & GACL_MERGE_FLAGS);
+  dep->flags &= ~GACL_FLAG_INHERITED;
+}
+
+/*
+ * Merge the entries of an ACL in place.
+ * Returns the number of entries merged away (0 if nothing was changed).
+ */
+int
+gacl_merge_inplace_np(GACL *ap) {
+  int n = ap->ac;
+  int ibuf[4*GACL_MERGE_STACK];
+  char dbuf[GACL_MERGE_STACK];
+  GACL_MERGE_SLOT sbuf[2*GACL_MERGE_STACK];
+  GACL_MERGE_SLOT *sv = sbuf;
+  int *next, *nextio, *nextcl, *grp;
+  int ioh[2], clh[2], nio[2], ncl[2];
+  char *dead = dbuf;
+  void *mem = NULL;
+  int i, j, k, w, c, ns, nm;
+  GACL_ENTRY *ep;
+
+
+  if (!ap) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  if (n < 2)
+    return 0;
+
+  for (ns = 4; ns < 2*n; ns <<= 1)
+    ;
+
+  if (n > GACL_MERGE_STACK) {
+    mem = malloc(ns*sizeof(*sv) + 4*n*sizeof(int) + n);
+    if (!mem)
+      return -1;
+    sv = (GACL_MERGE_SLOT *) mem;
+    next = (int *) (sv+ns);
+    dead = (char *) (next+4*n);
+  } else
+    next = ibuf;
+
+  nextio = next+n;
+  nextcl = nextio+n;
+  grp = nextcl+n;
+
+  for (i = 0; i < ns; i++)
+    sv[i].head = -2;
+
+  ioh[0] = ioh[1] = clh[0] = clh[1] = -1;
+  nio[0] = nio[1] = ncl[0] = ncl[1] = 0;
+  nm = 0;
+
+  /* Build the chains backwards so they end up in index order */
+  for (i = n-1; i >= 0; i--) {
+    uint64_t mk;
+
+    ep = &ap->av[i];
+    c = (ep->flags & GACL_FLAG_INHERITED) ? 1 : 0;
+
+    mk = _gacl_entry_mergekey(ep, c);
+    k = _gacl_merge_slot(sv, ns-1, mk);
+    if (sv[k].head == -2) {
+      sv[k].key = mk;
+      sv[k].head = -1;
+    } else
+      nm = 1;
+    grp[i] = k;
+    next[i] = sv[k].head;
+    sv[k].head = i;
+
+    nextio[i] = -1;
+    if (ep->flags & GACL_FLAG_INHERIT_ONLY) {
+      nextio[i] = ioh[c];
+      ioh[c] = i;
+      ++nio[c];
+    }
+
+    nextcl[i] = clh[c];
+    clh[c] = i;
+    ++ncl[c];
+
+    dead[i] = 0;
+  }
+
+  /* Nothing to merge unless some entries share a key or there are inherit-only ones */
+  for (c = 0; c < 2; c++)
+    if (nio[c] > 0 && ncl[c] > 1)
+      nm = 1;
+  
+  if (!nm)
+    goto End;
+
+  nm = -1;
+  if (_gacl_modify(ap) < 0)
+    goto End;
+  
+  nm = 0;
+  for (i = 0; i < n; i++) {
+    if (dead[i])
+      continue;
+
+    ep = &ap->av[i];
+    k = grp[i];
+
+    if (ep->flags & GACL_FLAG_INHERITED) {
+      /* Absorb the first matching inherited entry - then we are an explicit entry */
+      if (ep->flags & GACL_FLAG_INHERIT_ONLY)
+	j = _gacl_merge_cursor(&clh[1], nextcl, dead, i);
+      else {
+	j = _gacl_merge_cursor(&sv[k].head, next, dead, i);
+	w = _gacl_merge_cursor(&ioh[1], nextio, dead, i);
+	if (j < 0 || (w >= 0 && w < j))
+	  j = w;
+      }
+
+      if (j < 0)
+	continue;
+
+      _gacl_merge_absorb(ep, &ap->av[j]);
+      dead[j] = 1;
+      ++nm;
+
+      k = _gacl_merge_slot(sv, ns-1, _gacl_entry_mergekey(ep, 0));
+      if (sv[k].head == -2)
+	k = -1;
+    }
+
+    if ((ep->flags & GACL_FLAG_INHERIT_ONLY) || _gacl_merge_cursor(&ioh[0], nextio, dead, i) >= 0) {
+      /* Absorb all later explicit entries */
+      while ((j = _gacl_merge_cursor(&clh[0], nextcl, dead, i)) >= 0) {
+	_gacl_merge_absorb(ep, &ap->av[j]);
+	dead[j] = 1;
+	++nm;
+      }
+    } else if (k >= 0) {
+      /* Absorb all later explicit entries with the same key */
+      while ((j = _gacl_merge_cursor(&sv[k].head, next, dead, i)) >= 0) {
+	_gacl_merge_absorb(ep, &ap->av[j]);
+	dead[j] = 1;
+	++nm;
+      }
+    }
+  }
+
+  if (nm > 0) {
+    for (i = w = 0; i < n; i++)
+      if (!dead[i]) {
+	if (w != i)
+	  ap->av[w] = ap->av[i];
+	++w;
+      }
+    ap->ac = w;
+  }
+
+ End:
+  if (mem)
+    free(mem);
+  return nm;
+}
+
+
+GACL *
+gacl_merge(GACL *ap) {
+  GACL *nap;
+
+
+  nap = gacl_dup(ap);
+  if (!nap)
+    return NULL;
+
+  if (gacl_merge_inplace_np(nap) < 0) {
+    gacl_free(nap);
+    return NULL;
+  }
+
+  return nap;
+}
+
+
+int
+gacl_is_trivial_np(GACL *ap,
+		   int *trivialp) {
+  GACL_ENTRY *ep;
+  GACL_TAG_TYPE t;
+  int i, rc, tf;
+
+  
   if (!ap || !trivialp) {
     errno = EINVAL;
     return -1;
   }
   
   tf = 1;
-  for (i = 0; (rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_peek_entry(ap, i, &ep)) == 1; i++) {
     t = GACL_TAG_TYPE_UNKNOWN;
     
     if (gacl_get_tag_type(ep, &t) < 0)
@@ -797,157 +1386,323 @@ gacl_is_trivial_np(GACL *ap,
   return 0;
 }
 
-/* TODO: Handle recalculate_mask */
-GACL *
-gacl_strip_np(GACL *ap,
-	      int recalculate_mask) {
-  GACL *nap;
-  GACL_ENTRY *ep;
-  GACL_TAG_TYPE t;
-  int i, rc;
-  
-  
-  nap = gacl_init(ap->as);
-  if (!nap)
-    return NULL;
-  
-  for (i = 0; (rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1; i++) {
-    t = GACL_TAG_TYPE_UNKNOWN;
-    
-    if (gacl_get_tag_type(ep, &t) < 0)
-      return NULL;
+/*
+ * Remove all entries except owner@, group@ & everyone@ in place.
+ * Returns the number of entries removed.
+ *
+ * TODO: Handle recalculate_mask
+ */
+int
+gacl_strip_inplace_np(GACL *ap,
+		      int recalculate_mask) {
+  int i, w, n;
+
+
+  if (!ap) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = n = 0; i < ap->ac; i++)
+    switch (ap->av[i].tag.type) {
+    case GACL_TAG_TYPE_USER_OBJ:
+    case GACL_TAG_TYPE_GROUP_OBJ:
+    case GACL_TAG_TYPE_EVERYONE:
+      break;
+    default:
+      ++n;
+    }
+
+  if (n == 0)
+    return 0;
+
+  if (_gacl_modify(ap) < 0)
+    return -1;
 
-    switch (t) {
+  for (i = w = 0; i < ap->ac; i++)
+    switch (ap->av[i].tag.type) {
     case GACL_TAG_TYPE_USER_OBJ:
     case GACL_TAG_TYPE_GROUP_OBJ:
     case GACL_TAG_TYPE_EVERYONE:
-      gacl_add_entry_np(&nap, ep, -1);
+      if (w != i)
+	ap->av[w] = ap->av[i];
+      ++w;
       break;
     default:
       break;
     }
+  
+  ap->ac = w;
+  return n;
+}
+
+GACL *
+gacl_strip_np(GACL *ap,
+	      int recalculate_mask) {
+  GACL *nap;
 
+
+  nap = gacl_dup(ap);
+  if (!nap)
+    return NULL;
+
+  if (gacl_strip_inplace_np(nap, recalculate_mask) < 0) {
+    gacl_free(nap);
+    return NULL;
   }
 
   return nap;
 }
 
 
-int
-_gacl_entry_match(GACL_ENTRY *aep,
-		  GACL_ENTRY *mep,
-		  int how) {
-  GACL_TAG_TYPE att, mtt;
-  GACL_PERMSET *apsp, *mpsp;
-  GACL_FLAGSET *afsp, *mfsp;
-  GACL_ENTRY_TYPE aet, met;
-  
-  
-  if (!aep || !mep) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  
-  /* 1. ACE tag type (owner@, group@, everyone@, user:xx, group:xxx) */
-  if (gacl_get_tag_type(aep, &att) < 0)
-    return -1;
-  
-  if (gacl_get_tag_type(mep, &mtt) < 0)
-    return -1;
+/*
+ * Packed ACE comparison keys.
+ *
+ * Each ACE is packed into a 16 byte key (tag & entry type, user/group id,
+ * permissions and flags) and every match mode becomes the same test on it:
+ *
+ *   (key & mask) == target
+ *
+ * '=' uses an all-ones mask and the other key as target, '+' masks the
+ * permissions and flags with the ones wanted and '-' masks them and expects
+ * zero. That test is done with SSE2 (one ACE at a time) or AVX2 (two at a
+ * time) when the compiler targets them, else with plain integer code.
+ */
 
-  if (att != mtt)
-    return 0;
+void
+gacl_entry_key_np(const GACL_ENTRY *ep,
+		  GACL_ENTRY_KEY *kp) {
+  kp->tag = ((uint32_t) ep->tag.type & 0xFFFF) | ((uint32_t) (uint16_t) ep->type << 16);
 
-  if (att == GACL_TAG_TYPE_USER || att == GACL_TAG_TYPE_GROUP) {
-    uid_t *qa = (uid_t *) gacl_get_qualifier(aep);
-    uid_t *qb = (uid_t *) gacl_get_qualifier(mep);
-    
-    if ((!qa && qb) || (qa && !qb) || (*qa != *qb)) {
-      if (qa)
-	gacl_free(qa);
-      if (qb)
-	gacl_free(qb);
-      return 0;
-    }
-    if (qa)
-      gacl_free(qa);
-    if (qb)
-      gacl_free(qb);
+  switch (ep->tag.type) {
+  case GACL_TAG_TYPE_USER:
+  case GACL_TAG_TYPE_GROUP:
+    kp->ugid = (uint32_t) ep->tag.ugid;
+    break;
+  default:
+    kp->ugid = 0;
   }
-  
-  /* 2. ACE entry type (allow, deny, audit, alarm) */
-  if (gacl_get_entry_type_np(aep, &aet) < 0)
-    return -1;
-  
-  if (gacl_get_entry_type_np(mep, &met) < 0)
-    return -1;
-  
-  if (aet != met)
-    return 0;
 
-  
-  /* 3. ACE permissions */
-  if (gacl_get_permset(aep, &apsp) < 0)
-    return -1;
-  
-  if (gacl_get_permset(mep, &mpsp) < 0)
-    return -1;
+  kp->perms = ep->perms;
+  kp->flags = ep->flags;
+}
+
+/* Convert a key to match against into a mask & target pair */
+static int
+_gacl_key_pattern(const GACL_ENTRY_KEY *kp,
+		  int how,
+		  GACL_ENTRY_KEY *mkp,
+		  GACL_ENTRY_KEY *tkp) {
+  mkp->tag = mkp->ugid = 0xFFFFFFFF;
+  *tkp = *kp;
 
   switch (how) {
   case 0:
   case '=':
   case '^':
-    if (*apsp != *mpsp)
-      return 0;
-    break;
-    
+    mkp->perms = mkp->flags = 0xFFFFFFFF;
+    return 0;
+
   case '+': /* Match if all permissions in B is set in A */
-    if ((*apsp & *mpsp) != *mpsp)
-      return 0;
-    break;
+    mkp->perms = kp->perms;
+    mkp->flags = kp->flags;
+    return 0;
 
   case '-': /* Match if all permissions in B is unset in A */
-    if ((*apsp & *mpsp) != 0)
-      return 0;
-    break;
+    mkp->perms = kp->perms;
+    mkp->flags = kp->flags;
+    tkp->perms = tkp->flags = 0;
+    return 0;
 
   default:
     errno = EINVAL;
     return -1;
   }
-  
-  /* 4. ACE flags */
-  if (gacl_get_flagset_np(aep, &afsp) < 0)
-    return -1;
-  
-  if (gacl_get_flagset_np(mep, &mfsp) < 0)
-    return -1;
-  
-  switch (how) {
-  case 0:
-  case '=':
-  case '^':
-    if (*afsp != *mfsp)
+}
+
+#if defined(__AVX2__)
+
+static inline int
+_gacl_key_test(const GACL_ENTRY_KEY *kp,
+	       const GACL_ENTRY_KEY *mkp,
+	       const GACL_ENTRY_KEY *tkp) {
+  __m128i k = _mm_loadu_si128((const __m128i *) kp);
+  __m128i m = _mm_loadu_si128((const __m128i *) mkp);
+  __m128i t = _mm_loadu_si128((const __m128i *) tkp);
+
+  return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(k, m), t)) == 0xFFFF;
+}
+
+/* Compare n keys pairwise, two at a time */
+static int
+_gacl_keys_equal(const GACL_ENTRY_KEY *av,
+		 const GACL_ENTRY_KEY *bv,
+		 int n) {
+  int i;
+
+
+  for (i = 0; i+1 < n; i += 2) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) &av[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *) &bv[i]);
+
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, b)) != -1)
       return 0;
-    break;
+  }
 
-  case '+':
-    if ((*afsp & *mfsp) != *mfsp)
+  if (i < n) {
+    __m128i a = _mm_loadu_si128((const __m128i *) &av[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &bv[i]);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) != 0xFFFF)
       return 0;
-    break;
+  }
 
-  case '-':
-    if ((*afsp & *mfsp) != 0)
+  return 1;
+}
+
+/* Test one key against n mask/target pairs, two at a time */
+static int
+_gacl_key_test_any(const GACL_ENTRY_KEY *kp,
+		   const GACL_ENTRY_KEY *mv,
+		   const GACL_ENTRY_KEY *tv,
+		   int n) {
+  __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) kp));
+  int i, r;
+
+
+  for (i = 0; i+1 < n; i += 2) {
+    __m256i m = _mm256_loadu_si256((const __m256i *) &mv[i]);
+    __m256i t = _mm256_loadu_si256((const __m256i *) &tv[i]);
+
+    r = _mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(k, m), t));
+    if ((r & 0xFFFF) == 0xFFFF || ((unsigned) r >> 16) == 0xFFFF)
+      return 1;
+  }
+
+  if (i < n && _gacl_key_test(kp, &mv[i], &tv[i]))
+    return 1;
+
+  return 0;
+}
+
+#elif defined(__SSE2__)
+
+static inline int
+_gacl_key_test(const GACL_ENTRY_KEY *kp,
+	       const GACL_ENTRY_KEY *mkp,
+	       const GACL_ENTRY_KEY *tkp) {
+  __m128i k = _mm_loadu_si128((const __m128i *) kp);
+  __m128i m = _mm_loadu_si128((const __m128i *) mkp);
+  __m128i t = _mm_loadu_si128((const __m128i *) tkp);
+
+  return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(k, m), t)) == 0xFFFF;
+}
+
+static int
+_gacl_keys_equal(const GACL_ENTRY_KEY *av,
+		 const GACL_ENTRY_KEY *bv,
+		 int n) {
+  int i;
+
+
+  for (i = 0; i < n; i++) {
+    __m128i a = _mm_loadu_si128((const __m128i *) &av[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &bv[i]);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) != 0xFFFF)
       return 0;
-    break;
+  }
 
-  default:
+  return 1;
+}
+
+static int
+_gacl_key_test_any(const GACL_ENTRY_KEY *kp,
+		   const GACL_ENTRY_KEY *mv,
+		   const GACL_ENTRY_KEY *tv,
+		   int n) {
+  __m128i k = _mm_loadu_si128((const __m128i *) kp);
+  int i;
+
+
+  for (i = 0; i < n; i++) {
+    __m128i m = _mm_loadu_si128((const __m128i *) &mv[i]);
+    __m128i t = _mm_loadu_si128((const __m128i *) &tv[i]);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(k, m), t)) == 0xFFFF)
+      return 1;
+  }
+
+  return 0;
+}
+
+#else
+
+static inline int
+_gacl_key_test(const GACL_ENTRY_KEY *kp,
+	       const GACL_ENTRY_KEY *mkp,
+	       const GACL_ENTRY_KEY *tkp) {
+  return (((kp->tag & mkp->tag) ^ tkp->tag) |
+	  ((kp->ugid & mkp->ugid) ^ tkp->ugid) |
+	  ((kp->perms & mkp->perms) ^ tkp->perms) |
+	  ((kp->flags & mkp->flags) ^ tkp->flags)) == 0;
+}
+
+static int
+_gacl_keys_equal(const GACL_ENTRY_KEY *av,
+		 const GACL_ENTRY_KEY *bv,
+		 int n) {
+  int i;
+
+
+  for (i = 0; i < n; i++)
+    if (((av[i].tag ^ bv[i].tag) | (av[i].ugid ^ bv[i].ugid) |
+	 (av[i].perms ^ bv[i].perms) | (av[i].flags ^ bv[i].flags)) != 0)
+      return 0;
+
+  return 1;
+}
+
+static int
+_gacl_key_test_any(const GACL_ENTRY_KEY *kp,
+		   const GACL_ENTRY_KEY *mv,
+		   const GACL_ENTRY_KEY *tv,
+		   int n) {
+  int i;
+
+
+  for (i = 0; i < n; i++)
+    if (_gacl_key_test(kp, &mv[i], &tv[i]))
+      return 1;
+
+  return 0;
+}
+
+#endif
+
+
+/* Number of keys packed per block on the stack */
+#define GACL_KEY_BLOCK 64
+
+
+int
+_gacl_entry_match(GACL_ENTRY *aep,
+		  GACL_ENTRY *mep,
+		  int how) {
+  GACL_ENTRY_KEY ak, mk, mask, target;
+
+
+  if (!aep || !mep) {
     errno = EINVAL;
     return -1;
   }
-  
-  return 1;
+
+  gacl_entry_key_np(mep, &mk);
+  if (_gacl_key_pattern(&mk, how, &mask, &target) < 0)
+    return -1;
+
+  gacl_entry_key_np(aep, &ak);
+  return _gacl_key_test(&ak, &mask, &target);
 }
 
 int
@@ -960,31 +1715,195 @@ gacl_entry_match(GACL_ENTRY *aep,
 int
 gacl_match(GACL *ap,
 	   GACL *mp) {
-  GACL_ENTRY *aep, *mep;
-  int p, arc, mrc;
+  GACL_ENTRY_KEY akv[GACL_KEY_BLOCK], mkv[GACL_KEY_BLOCK];
+  int i, j, n;
+
+
+  if (!ap || !mp) {
+    errno = EINVAL;
+    return -1;
+  }
 
-  
   if (ap->ac != mp->ac)
     return 0;
 
   if (ap->type != mp->type)
     return 0;
-  
-  p = GACL_FIRST_ENTRY;
-  while ((arc = gacl_get_entry(ap, p, &aep)) == 1 && (mrc = gacl_get_entry(mp, p, &mep)) == 1) {
-    int rc;
 
-    p = GACL_NEXT_ENTRY;
+  for (i = 0; i < ap->ac; i += n) {
+    n = ap->ac-i;
+    if (n > GACL_KEY_BLOCK)
+      n = GACL_KEY_BLOCK;
+
+    for (j = 0; j < n; j++) {
+      gacl_entry_key_np(&ap->av[i+j], &akv[j]);
+      gacl_entry_key_np(&mp->av[i+j], &mkv[j]);
+    }
 
-    rc = gacl_entry_match(aep, mep);
-    if (rc != 1)
-      return rc;
+    if (!_gacl_keys_equal(akv, mkv, n))
+      return 0;
   }
-  
+
   return 1;
 }
 
 
+/*
+ * Check if any entry in ACL 'ap' matches any entry in ACL 'mp'
+ * (using match mode 'how' - see _gacl_entry_match())
+ */
+int
+gacl_match_any_np(GACL *ap,
+		  GACL *mp,
+		  int how) {
+  GACL_ENTRY_KEY mbuf[GACL_KEY_BLOCK], tbuf[GACL_KEY_BLOCK];
+  GACL_ENTRY_KEY *mv = mbuf, *tv = tbuf;
+  GACL_ENTRY_KEY k;
+  int i, rc = 0;
+
+
+  if (!ap || !mp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (mp->ac > GACL_KEY_BLOCK) {
+    mv = malloc(2 * mp->ac * sizeof(*mv));
+    if (!mv)
+      return -1;
+    tv = mv+mp->ac;
+  }
+
+  for (i = 0; i < mp->ac; i++) {
+    gacl_entry_key_np(&mp->av[i], &k);
+    if (_gacl_key_pattern(&k, how, &mv[i], &tv[i]) < 0) {
+      rc = -1;
+      goto End;
+    }
+  }
+
+  for (i = 0; i < ap->ac && !rc; i++) {
+    gacl_entry_key_np(&ap->av[i], &k);
+    rc = _gacl_key_test_any(&k, mv, tv, mp->ac);
+  }
+
+ End:
+  if (mv != mbuf)
+    free(mv);
+  return rc;
+}
+
+
+
+/*
+ * 128 bit fingerprint of an ACL
+ *
+ * Only the canonical fields of each ACE (tag type, numeric user/group id,
+ * permissions, flags & entry type) are hashed - never the principal names -
+ * so an ACL decoded with names and one decoded with numeric ids gives the
+ * same fingerprint. The order of the ACEs is significant.
+ */
+
+#define GACL_FP_C1 0x87c37b91114253d5ULL
+#define GACL_FP_C2 0x4cf5ad432745937fULL
+
+static inline uint64_t
+_gacl_fp_rotl(uint64_t x,
+	      int r) {
+  return (x << r) | (x >> (64-r));
+}
+
+static inline uint64_t
+_gacl_fp_fmix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+int
+gacl_fingerprint(GACL *ap,
+		 GACL_FINGERPRINT *fp) {
+  uint64_t h1, h2, k1, k2;
+  GACL_ENTRY *ep;
+  uint32_t ugid;
+  int i;
+
+
+  if (!ap || !fp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  h1 = h2 = (uint64_t) ap->type;
+
+  for (i = 0; i < ap->ac; i++) {
+    ep = &ap->av[i];
+
+    switch (ep->tag.type) {
+    case GACL_TAG_TYPE_USER:
+    case GACL_TAG_TYPE_GROUP:
+      ugid = (uint32_t) ep->tag.ugid;
+      break;
+    default:
+      /* The id of owner@, group@ & everyone@ is not part of the ACL */
+      ugid = 0;
+    }
+
+    k1 = ((uint64_t) ep->tag.type << 32) | ugid;
+    k2 = ((uint64_t) ep->perms << 32) | ((uint64_t) ep->flags << 16) | ((uint16_t) ep->type);
+
+    k1 *= GACL_FP_C1; k1 = _gacl_fp_rotl(k1, 31); k1 *= GACL_FP_C2; h1 ^= k1;
+    h1 = _gacl_fp_rotl(h1, 27); h1 += h2; h1 = h1*5+0x52dce729;
+
+    k2 *= GACL_FP_C2; k2 = _gacl_fp_rotl(k2, 33); k2 *= GACL_FP_C1; h2 ^= k2;
+    h2 = _gacl_fp_rotl(h2, 31); h2 += h1; h2 = h2*5+0x38495ab5;
+  }
+
+  h1 ^= (uint64_t) ap->ac;
+  h2 ^= (uint64_t) ap->ac;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = _gacl_fp_fmix(h1);
+  h2 = _gacl_fp_fmix(h2);
+
+  h1 += h2;
+  h2 += h1;
+
+  fp->h[0] = h1;
+  fp->h[1] = h2;
+  return 0;
+}
+
+
+ssize_t
+gacl_fingerprint_to_text(const GACL_FINGERPRINT *fp,
+			 char *buf,
+			 size_t bufsize) {
+  int rc;
+
+
+  if (!fp || !buf) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  rc = snprintf(buf, bufsize, "%016llx%016llx",
+		(unsigned long long) fp->h[0],
+		(unsigned long long) fp->h[1]);
+  if (rc < 0 || (size_t) rc >= bufsize) {
+    errno = ERANGE;
+    return -1;
+  }
+
+  return rc;
+}
+
+
 
 
 GACL *
@@ -1043,6 +1962,30 @@ gacl_set_fd(int fd,
 }
 
 
+ssize_t
+gacl_to_native_np(GACL *ap,
+		  char *buf,
+		  size_t bufsize) {
+  return _gacl_to_native(ap, buf, bufsize);
+}
+
+
+ssize_t
+gacl_get_native_file_np(const char *path,
+			char *buf,
+			size_t bufsize) {
+  return _gacl_get_native_fd_file(-1, path, buf, bufsize, 0);
+}
+
+
+int
+gacl_set_native_file_np(const char *path,
+			const char *buf,
+			size_t len) {
+  return _gacl_set_native_fd_file(-1, path, buf, len, 0);
+}
+
+
 int
 _gacl_get_tag(GACL_ENTRY *ep,
 	      GACL_TAG *etp) {
@@ -1074,101 +2017,214 @@ _gacl_set_tag(GACL_ENTRY *ep,
 }
 
 
-/* 
- * Get ACE tag (user:xxx, group:xxx, owner@, group@, everyone@ )
- *
- * Format: 
- * [{user|group}:]<name>[:]
+/*
+ * Text parser keywords. They are looked up with a perfect hash on the
+ * length and the first and last characters, and the permission & flag
+ * letters through direct lookup tables, all built once from the tables
+ * at the top of this file.
  */
-int
-_gacl_entry_tag_from_text(GACL_ENTRY *ep,
-			  char **bufp,
-			  int flags) {
-  struct passwd *pp;
-  struct group *gp;
-  char *np, *cp = *bufp;
-  GACL_TAG *etp = &ep->tag;
-  size_t len;
+typedef enum gacl_kw_class {
+  GACL_KW_PERMSET = 1,
+  GACL_KW_TYPE,
+  GACL_KW_TAG,
+  GACL_KW_TAGPREFIX,
+} GACL_KW_CLASS;
+
+typedef struct gacl_keyword {
+  const char *s;
+  GACL_KW_CLASS c;
+  int v;
+} GACL_KEYWORD;
+
+static GACL_KEYWORD gacl_keywords[] = {
+  { "full_set",   GACL_KW_PERMSET,   GACL_PERM_FULL_SET },
+  { "all",        GACL_KW_PERMSET,   GACL_PERM_FULL_SET },
+  { "modify_set", GACL_KW_PERMSET,   GACL_PERM_MODIFY_SET },
+  { "modify",     GACL_KW_PERMSET,   GACL_PERM_MODIFY_SET },
+  { "write_set",  GACL_KW_PERMSET,   GACL_PERM_WRITE_SET },
+  { "write",      GACL_KW_PERMSET,   GACL_PERM_WRITE_SET },
+  { "read_set",   GACL_KW_PERMSET,   GACL_PERM_READ_SET },
+  { "read",       GACL_KW_PERMSET,   GACL_PERM_READ_SET },
+  { "empty_set",  GACL_KW_PERMSET,   0 },
+  { "empty",      GACL_KW_PERMSET,   0 },
+  { "none",       GACL_KW_PERMSET,   0 }, /* XXX: Remove, but handle the magic 'none' case for edit-access */
+  { "allow",      GACL_KW_TYPE,      GACL_ENTRY_TYPE_ALLOW },
+  { "deny",       GACL_KW_TYPE,      GACL_ENTRY_TYPE_DENY },
+  { "audit",      GACL_KW_TYPE,      GACL_ENTRY_TYPE_AUDIT },
+  { "alarm",      GACL_KW_TYPE,      GACL_ENTRY_TYPE_ALARM },
+  { "owner@",     GACL_KW_TAG,       GACL_TAG_TYPE_USER_OBJ },
+  { "group@",     GACL_KW_TAG,       GACL_TAG_TYPE_GROUP_OBJ },
+  { "everyone@",  GACL_KW_TAG,       GACL_TAG_TYPE_EVERYONE },
+  { "user",       GACL_KW_TAGPREFIX, GACL_TAG_TYPE_USER },
+  { "u",          GACL_KW_TAGPREFIX, GACL_TAG_TYPE_USER },
+  { "group",      GACL_KW_TAGPREFIX, GACL_TAG_TYPE_GROUP },
+  { "g",          GACL_KW_TAGPREFIX, GACL_TAG_TYPE_GROUP },
+  { NULL, 0, 0 }
+};
+
+#define GACL_KW_HASH(s,len) ((2*(len) + (unsigned char) (s)[0] + (unsigned char) (s)[(len)-1]) & 63)
+
+static GACL_KEYWORD *gacl_kw_tab[64];
+static GACL_PERMSET gacl_c2p[256];
+static GACL_FLAGSET gacl_c2f[256];
+static pthread_once_t gacl_text_once = PTHREAD_ONCE_INIT;
+
+
+static void
+_gacl_text_init(void) {
+  int i, h;
+
   
+  for (i = 0; gacl_keywords[i].s; i++) {
+    h = GACL_KW_HASH(gacl_keywords[i].s, strlen(gacl_keywords[i].s));
+    if (gacl_kw_tab[h]) {
+      /* Not perfect anymore - fix GACL_KW_HASH() */
+      fprintf(stderr, "gacl: %s: Keyword hash collision with %s\n",
+	      gacl_keywords[i].s, gacl_kw_tab[h]->s);
+      abort();
+    }
+    gacl_kw_tab[h] = &gacl_keywords[i];
+  }
   
-  if (strncmp(cp, "user:", 5) == 0 || strncmp(cp, "u:", 2) == 0) {
-    etp->type = GACL_TAG_TYPE_USER;
+  for (i = 0; gace_p2c[i].c; i++)
+    gacl_c2p[(unsigned char) gace_p2c[i].c] = gace_p2c[i].p;
+  for (i = 0; gace_f2c[i].c; i++)
+    gacl_c2f[(unsigned char) gace_f2c[i].c] = gace_f2c[i].f;
+}
 
-    cp = strchr(cp, ':')+1;
-    
-    /* Locate end of tag */
-    np = cp;
-    while (*np && *np != ':')
-      ++np;
-    
-    if (sscanf(cp, "%d", &etp->ugid) == 1) {
-      
-      pp = getpwuid(etp->ugid);
-      if (pp) {
-	if (s_cpy(etp->name, sizeof(etp->name), pp->pw_name) < 0)
-	  return -1;
-      } else {
-	if (flags & GACL_TEXT_RELAXED) {
-	  int rc = snprintf(etp->name, sizeof(etp->name), "user:%d", etp->ugid);
+static inline GACL_KEYWORD *
+_gacl_keyword(const char *s,
+	      size_t len) {
+  GACL_KEYWORD *kp;
 
-	  if (rc < 0)
-	    return -1;
-	  if (rc >= sizeof(etp->name)) {
-	    errno = ENOMEM;
-	    return -1;
-	  }
-	} else {
-	  errno = EINVAL;
-	  return -1;
-	}
-      }
-      
-    } else {
-      len = np-cp;
-      
-      if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
-	return -1;
-      
-      if ((pp = getpwnam(etp->name)) != NULL)
-	etp->ugid = pp->pw_uid;
-      else {
-	if (flags & GACL_TEXT_RELAXED)	
-	  etp->ugid = -1;
-	else {
-	  errno = EINVAL;
-	  return -1;
-	}
-      }
-      
-    } 
-    
-    if (*np)
-      ++np;
-    
-    *bufp = np;
+  
+  if (len == 0)
+    return NULL;
+  
+  kp = gacl_kw_tab[GACL_KW_HASH(s, len)];
+  if (kp && strncmp(kp->s, s, len) == 0 && kp->s[len] == '\0')
+    return kp;
+
+  return NULL;
+}
+
+/* Like sscanf(s, "%d", vp) == 1, but limited to [s, e) */
+static int
+_gacl_scan_int(const char *s,
+	       const char *e,
+	       int *vp) {
+  int neg = 0;
+  long v = 0;
+
+  
+  while (s < e && (*s == ' ' || (*s >= '\t' && *s <= '\r')))
+    ++s;
+  if (s < e && (*s == '-' || *s == '+'))
+    neg = (*s++ == '-');
+  if (s >= e || *s < '0' || *s > '9')
+    return 0;
+  
+  while (s < e && *s >= '0' && *s <= '9')
+    v = v*10 + (*s++ - '0');
+  
+  *vp = (int) (neg ? -v : v);
+  return 1;
+}
+
+
+/*
+ * Look up a user or group name. Linux NFSv4 ACLs name principals as
+ * "name@domain" (or "name@" without an idmapd domain) and that is what
+ * gets listed, so with GACL_TEXT_NFS4_IDS an unknown "name@" or
+ * "name@<our nfs4 domain>" is looked up as "name". Other domains are
+ * not ours, and stay unknown.
+ */
+static int
+_gacl_name_to_ugid(GACL_TAG_TYPE type,
+		   const char *name,
+		   uid_t *ugidp,
+		   int flags) {
+  char buf[256];
+  const char *cp, *idd;
+  gid_t gid;
+  int rc;
+
+  
+  if (type == GACL_TAG_TYPE_USER)
+    rc = ident_name_to_uid(name, ugidp);
+  else {
+    rc = ident_name_to_gid(name, &gid);
+    if (rc > 0)
+      *ugidp = gid;
+  }
+  if (rc != 0)
+    return rc;
+
+  if (!(flags & GACL_TEXT_NFS4_IDS))
+    return 0;
+  
+  cp = strchr(name, '@');
+  if (!cp || cp == name)
+    return 0;
+  
+  idd = _gacl_nfs4_id_domain();
+  if (cp[1] && (!idd || strcmp(cp+1, idd) != 0))
     return 0;
+  
+  if (s_ncpy(buf, sizeof(buf), name, cp-name) < 0)
+    return 0;
+  
+  return _gacl_name_to_ugid(type, buf, ugidp, 0);
+}
+
+
+/* 
+ * Get ACE tag (user:xxx, group:xxx, owner@, group@, everyone@ )
+ *
+ * Format: 
+ * [{user|group}:]<name>[:]
+ *
+ * Parses [*bufp, e) and leaves *bufp after the tag.
+ */
+static int
+_gacl_entry_tag_from_text(GACL_ENTRY *ep,
+			  const char **bufp,
+			  const char *e,
+			  int flags) {
+  int pf, gf, rc;
+  uid_t uid;
+  gid_t gid;
+  const char *np, *cp = *bufp;
+  GACL_TAG *etp = &ep->tag;
+  GACL_KEYWORD *kp;
+  
+  
+  np = memchr(cp, ':', e-cp);
+  if (!np) {
+    errno = EINVAL;
+    return -1;
   }
 
-  if (strncmp(cp, "group:", 6) == 0 || strncmp(cp, "g:", 2) == 0) {
-    etp->type = GACL_TAG_TYPE_GROUP;
-    
-    cp = strchr(cp, ':')+1;
+  kp = _gacl_keyword(cp, np-cp);
+  if (kp && kp->c == GACL_KW_TAGPREFIX) {
+    etp->type = kp->v;
     
     /* Locate end of tag */
-    np = cp;
-    while (*np && *np != ':')
-      ++np;
+    cp = np+1;
+    np = memchr(cp, ':', e-cp);
+    if (!np)
+      np = e;
     
-    if (sscanf(cp, "%d", &etp->ugid) == 1) {
+    if (_gacl_scan_int(cp, e, (int *) &etp->ugid)) {
+      if (etp->type == GACL_TAG_TYPE_USER)
+	rc = ident_uid_to_name(etp->ugid, etp->name, sizeof(etp->name));
+      else
+	rc = ident_gid_to_name(etp->ugid, etp->name, sizeof(etp->name));
       
-      gp = getgrgid(etp->ugid);
-      if (gp) {
-	if (s_cpy(etp->name, sizeof(etp->name), gp->gr_name) < 0)
-	  return -1;
-      } else {
+      if (rc <= 0) {
 	if (flags & GACL_TEXT_RELAXED) {
-	  int rc = snprintf(etp->name, sizeof(etp->name), "group:%d", etp->ugid);
-
+	  rc = snprintf(etp->name, sizeof(etp->name), "%s:%d",
+			etp->type == GACL_TAG_TYPE_USER ? "user" : "group", etp->ugid);
 	  if (rc < 0)
 	    return -1;
 	  if (rc >= sizeof(etp->name)) {
@@ -1182,14 +2238,13 @@ _gacl_entry_tag_from_text(GACL_ENTRY *ep,
       }
       
     } else {
-      len = np-cp;
-
-      if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
+      if (s_ncpy(etp->name, sizeof(etp->name), cp, np-cp) < 0)
 	return -1;
+
+      if ((rc = _gacl_name_to_ugid(etp->type, etp->name, &uid, flags)) > 0)
+	etp->ugid = uid;
       
-      if ((gp = getgrnam(etp->name)) != NULL)
-	etp->ugid = gp->gr_gid;
-      else {
+      if (rc <= 0) {
 	if (flags & GACL_TEXT_RELAXED)	
 	  etp->ugid = -1;
 	else {
@@ -1197,80 +2252,52 @@ _gacl_entry_tag_from_text(GACL_ENTRY *ep,
 	  return -1;
 	}
       }
-      
     }
     
-    if (*np)
+    if (np < e)
       ++np;
     
     *bufp = np;
     return 0;
   }
 
-
-  /* Locate end of tag */
-  np = strchr(cp, ':');
-  if (!np) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  len = np-cp;
-		
-  if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
+  if (s_ncpy(etp->name, sizeof(etp->name), cp, np-cp) < 0)
     return -1;
-
-  if (np)
-    ++np;
+  ++np;
   
-  if (strcmp(etp->name, "owner@") == 0) {
-    etp->type = GACL_TAG_TYPE_USER_OBJ;
+  if (kp && kp->c == GACL_KW_TAG) {
+    etp->type = kp->v;
     etp->ugid = -1;
 
     *bufp = np;
     return 0;
   }
 
-  if (strcmp(etp->name, "group@") == 0) {
-    etp->type = GACL_TAG_TYPE_GROUP_OBJ;
-    etp->ugid = -1;
-    
-    *bufp = np;
-    return 0;
-  }
-
-  if (strcmp(etp->name, "everyone@") == 0) {
-    etp->type = GACL_TAG_TYPE_EVERYONE;
-    etp->ugid = -1;
-
-    *bufp = np;
-    return 0;
-  } 
-
   /* 
    * Attempt to autodetect user/group - must be unique 
    * user/group name or uid/gid to work!
    */
   etp->ugid = -1;
-  if (sscanf(etp->name, "%d", &etp->ugid) == 1) {
-    pp = getpwuid(etp->ugid);
-    gp = getgrgid(etp->ugid);
+  if (_gacl_scan_int(etp->name, etp->name+strlen(etp->name), (int *) &etp->ugid)) {
+    uid = gid = etp->ugid;
+    pf = (ident_uid_to_name(uid, NULL, 0) > 0);
+    gf = (ident_gid_to_name(gid, NULL, 0) > 0);
   } else {
-    pp = getpwnam(etp->name);
-    gp = getgrnam(etp->name);
+    pf = (ident_name_to_uid(etp->name, &uid) > 0);
+    gf = (ident_name_to_gid(etp->name, &gid) > 0);
   }
   
-  if (pp && gp) {
+  if (pf && gf) {
     errno = EINVAL;
     return -1;
   }
   
-  if (pp) {
+  if (pf) {
     etp->type = GACL_TAG_TYPE_USER;
-    etp->ugid = pp->pw_uid;
-  } else if (gp) {
+    etp->ugid = uid;
+  } else if (gf) {
     etp->type = GACL_TAG_TYPE_GROUP;
-    etp->ugid = gp->gr_gid;
+    etp->ugid = gid;
   } else {
     if (flags & GACL_TEXT_RELAXED)
       etp->type = GACL_TAG_TYPE_UNKNOWN;
@@ -1685,7 +2712,8 @@ gacl_entry_to_text(GACL_ENTRY *ep,
   bp += rc;
   bufsize -= rc;
 
-  if ((ep->flags && ep->type != GACL_ENTRY_TYPE_ALLOW) ||
+  /* The compact form drops empty flags and "allow" - but never the type of other entries */
+  if (ep->type != GACL_ENTRY_TYPE_ALLOW ||
       !(flags & GACL_TEXT_COMPACT) ||
       (gacl_get_flagset_np(ep, &efsp) == 0 && !gacl_empty_flagset(efsp))) {
     if (bufsize <= 1) {
@@ -1709,7 +2737,7 @@ gacl_entry_to_text(GACL_ENTRY *ep,
     if (bufsize <= 1)
       return -1;
     
-    if ((ep->flags && ep->type != GACL_ENTRY_TYPE_ALLOW) || !(flags & GACL_TEXT_COMPACT)) {
+    if (ep->type != GACL_ENTRY_TYPE_ALLOW || !(flags & GACL_TEXT_COMPACT)) {
       *bp++ = ':';
       *bp = '\0';
       bufsize--;
@@ -1796,68 +2824,227 @@ _gacl_max_tagwidth(GACL *ap) {
 }
 
 
+/* Width of the tag part of an ACE as seen by the column alignment */
+static int
+_gacl_entry_tagwidth(GACL_ENTRY *ep) {
+  switch (ep->tag.type) {
+  case GACL_TAG_TYPE_USER:
+    return sizeof(GACL_TAG_TYPE_USER_TEXT)-1 + strcspn(ep->tag.name, ":");
+  case GACL_TAG_TYPE_GROUP:
+    return sizeof(GACL_TAG_TYPE_GROUP_TEXT)-1 + strcspn(ep->tag.name, ":");
+  default:
+    return strcspn(ep->tag.name, ":");
+  }
+}
+
+static char *
+_gacl_put_int(char *bp,
+	      int v) {
+  char tmp[16];
+  unsigned int u = (v < 0 ? -(unsigned int) v : (unsigned int) v);
+  int n = 0;
+
+  
+  do {
+    tmp[n++] = '0' + u%10;
+    u /= 10;
+  } while (u);
+  
+  if (v < 0)
+    *bp++ = '-';
+  while (n > 0)
+    *bp++ = tmp[--n];
+  return bp;
+}
+
+/*
+ * Render an ACE the same way as gacl_entry_to_text(), but without
+ * any intermediate buffers. 'bp' must have room for GACL_TEXT_ENTRY_MAX
+ * bytes. Returns the new end of the text, or NULL for invalid entries.
+ */
+static char *
+_gacl_entry_render(GACL_ENTRY *ep,
+		   char *bp,
+		   int flags) {
+  const char *s;
+  int i, fl;
+
+  
+  switch (ep->tag.type) {
+  case GACL_TAG_TYPE_USER:
+    memcpy(bp, GACL_TAG_TYPE_USER_TEXT, sizeof(GACL_TAG_TYPE_USER_TEXT)-1);
+    bp += sizeof(GACL_TAG_TYPE_USER_TEXT)-1;
+    break;
+  case GACL_TAG_TYPE_GROUP:
+    memcpy(bp, GACL_TAG_TYPE_GROUP_TEXT, sizeof(GACL_TAG_TYPE_GROUP_TEXT)-1);
+    bp += sizeof(GACL_TAG_TYPE_GROUP_TEXT)-1;
+    break;
+  default:
+    break;
+  }
+  for (s = ep->tag.name; *s; )
+    *bp++ = *s++;
+  *bp++ = ':';
+
+  for (i = 0; gace_p2c[i].c; i++)
+    if (ep->perms & gace_p2c[i].p)
+      *bp++ = gace_p2c[i].c;
+    else if (!(flags & GACL_TEXT_COMPACT))
+      *bp++ = '-';
+
+  fl = 0;
+  for (i = 0; gace_f2c[i].c; i++)
+    fl |= (ep->flags & gace_f2c[i].f);
+  
+  if (ep->type != GACL_ENTRY_TYPE_ALLOW ||
+      !(flags & GACL_TEXT_COMPACT) || fl) {
+    *bp++ = ':';
+    for (i = 0; gace_f2c[i].c; i++)
+      if (ep->flags & gace_f2c[i].f)
+	*bp++ = gace_f2c[i].c;
+      else if (!(flags & GACL_TEXT_COMPACT))
+	*bp++ = '-';
+    
+    if (ep->type != GACL_ENTRY_TYPE_ALLOW || !(flags & GACL_TEXT_COMPACT)) {
+      *bp++ = ':';
+      
+      if (ep->type != GACL_ENTRY_TYPE_ALLOW || !(flags & GACL_TEXT_COMPACT)) {
+	switch (ep->type) {
+	case GACL_ENTRY_TYPE_UNDEFINED:
+	  s = "";
+	  break;
+	case GACL_ENTRY_TYPE_ALLOW:
+	  s = "allow";
+	  break;
+	case GACL_ENTRY_TYPE_DENY:
+	  s = "deny";
+	  break;
+	case GACL_ENTRY_TYPE_ALARM:
+	  s = "alarm";
+	  break;
+	case GACL_ENTRY_TYPE_AUDIT:
+	  s = "audit";
+	  break;
+	default:
+	  errno = EINVAL;
+	  return NULL;
+	}
+	while (*s)
+	  *bp++ = *s++;
+      }
+    }
+  }
+
+  if (flags & GACL_TEXT_APPEND_ID) {
+    switch (ep->tag.type) {
+    case GACL_TAG_TYPE_USER:
+      memcpy(bp, "\t# uid=", 7);
+      bp = _gacl_put_int(bp+7, ep->tag.ugid);
+      break;
+    case GACL_TAG_TYPE_GROUP:
+      memcpy(bp, "\t# gid=", 7);
+      bp = _gacl_put_int(bp+7, ep->tag.ugid);
+      break;
+    default:
+      break;
+    }
+  }
+  
+  return bp;
+}
+
+
+/*
+ * Render an ACL as text (same output as gacl_to_text_np()) directly
+ * into a caller supplied buffer, in one pass over the entries after
+ * the column width has been determined. The buffer needs room for
+ * GACL_TEXT_ENTRY_MAX bytes per entry (plus a terminating NUL).
+ * Returns the length of the text, or -1 (errno = ERANGE if it does not fit)
+ */
+ssize_t
+gacl_to_text_buf_np(GACL *ap,
+		    char *buf,
+		    size_t bufsize,
+		    int flags) {
+  char *bp, *end;
+  int i, len, tagwidth;
+  GACL_ENTRY *ep;
+
+
+  if (!ap || !buf || bufsize < 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  tagwidth = ((flags & GACL_TEXT_STANDARD) ? 18 : _gacl_max_tagwidth(ap)+8);
+  flags |= GACL_TEXT_STANDARD;
+  
+  bp = buf;
+  end = buf+bufsize;
+  for (i = 0; i < ap->ac; i++) {
+    ep = &ap->av[i];
+    
+    if (end-bp <= GACL_TEXT_ENTRY_MAX) {
+      *bp = '\0';
+      errno = ERANGE;
+      return -1;
+    }
+    
+    if (flags & GACL_TEXT_COMPACT) {
+      if (i > 0)
+	*bp++ = ',';
+    } else {
+      len = _gacl_entry_tagwidth(ep);
+      if (tagwidth > len) {
+	memset(bp, ' ', tagwidth-len);
+	bp += tagwidth-len;
+      }
+    }
+
+    bp = _gacl_entry_render(ep, bp, flags);
+    if (!bp) {
+      *buf = '\0';
+      return -1;
+    }
+    
+    if (!(flags & GACL_TEXT_COMPACT))
+      *bp++ = '\n';
+  }
+
+  *bp = '\0';
+  return bp-buf;
+}
+
+
 char *
 gacl_to_text_np(GACL *ap,
 		ssize_t *bsp,
 		int flags) {
-  char *buf, *bp;
-  size_t bufsize = 2048;
-  int i, rc;
-  GACL_ENTRY *ep;
-  int tagwidth = ((flags & GACL_TEXT_STANDARD) ? 18 : _gacl_max_tagwidth(ap)+8);
+  char *buf;
+  size_t bufsize;
+  ssize_t len;
 
   
-  bp = buf = _gacl_alloc(GACL_MAGIC_TEXT, bufsize);
+  if (!ap) {
+    errno = EINVAL;
+    return NULL;
+  }
+  
+  bufsize = ap->ac*GACL_TEXT_ENTRY_MAX+1;
+  buf = _gacl_alloc(GACL_MAGIC_TEXT, bufsize);
   if (!buf)
     return NULL;
 
-  for (i = 0;
-       bufsize > 1 && ((rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1);
-       i++) {
-    char es[1024], *cp;
-    ssize_t rc, len;
-    GACL_TAG_TYPE et = GACL_TAG_TYPE_UNKNOWN;
-    
-    if (gacl_get_tag_type(ep, &et) < 0)
-      goto Fail;
-    
-    rc = gacl_entry_to_text(ep, es, sizeof(es), flags|GACL_TEXT_STANDARD);
-    if (rc < 0)
-      goto Fail;
-
-    cp = strchr(es, ':');
-    if (cp) {
-      len = cp-es;
-      if (len > 0 && (et == GACL_TAG_TYPE_USER || et == GACL_TAG_TYPE_GROUP)) {
-	cp = strchr(cp+1, ':');
-	if (cp)
-	  len = cp-es;
-      }
-    } else
-      len = 0;
-
-    if (flags & GACL_TEXT_COMPACT) 
-      rc = snprintf(bp, bufsize, "%s%s", (i > 0 ? "," : ""), es);
-    else
-      if (tagwidth > len)
-	rc = snprintf(bp, bufsize, "%*s%s\n", (int) (tagwidth-len), "", es);
-      else
-	rc = snprintf(bp, bufsize, "%s\n", es);
-    if (rc < 0)
-      goto Fail;
-
-    bp += rc;
-    bufsize -= rc;
+  len = gacl_to_text_buf_np(ap, buf, bufsize, flags);
+  if (len < 0) {
+    gacl_free(buf);
+    return NULL;
   }
 
   if (bsp)
-    *bsp = (bp-buf);
+    *bsp = len;
   
   return buf;
-
- Fail:
-  gacl_free(buf);
-  return NULL;
 }
 
 
@@ -1947,53 +3134,34 @@ gacl_delete_fd_np(int fd,
 
 
 
-int
-_gacl_permset_from_text(const char *buf,
-			GACL_PERMSET *psp,
-			int flags) {
-  int i;
-  char c;
-  GACL_PERMSET nps = 0;
-
+/* Parse a permission set in [s, e). Returns 0 (and leaves *psp) if empty */
+static int
+_gacl_permset_from_text(const char *s,
+			const char *e,
+			GACL_PERMSET *psp) {
+  GACL_KEYWORD *kp;
+  GACL_PERMSET p, nps = 0;
+  unsigned char c;
 
-  if (!buf) {
-    errno = EINVAL;
-    return -1;
-  }
 
-  if (!*buf)
+  if (s == e)
     return 0;
 
-  if (strcmp(buf, "full_set") == 0 ||
-      strcmp(buf, "all") == 0)
-    nps = GACL_PERM_FULL_SET;
-  else if (strcmp(buf, "modify_set") == 0 ||
-	   strcmp(buf, "modify") == 0)
-    nps = GACL_PERM_MODIFY_SET;
-  else if (strcmp(buf, "write_set") == 0 ||
-	   strcmp(buf, "write") == 0)
-    nps = GACL_PERM_WRITE_SET;
-  else if (strcmp(buf, "read_set") == 0 ||
-	   strcmp(buf, "read") == 0)
-    nps = GACL_PERM_READ_SET;
-  else if (strcmp(buf, "empty_set") == 0 ||
-	   strcmp(buf, "empty") == 0 ||
-	   strcmp(buf, "none") == 0) /* XXX: Remove, but handle the magic 'none' case for edit-access */
-    nps = 0;
+  kp = _gacl_keyword(s, e-s);
+  if (kp && kp->c == GACL_KW_PERMSET)
+    nps = kp->v;
   else {
-    while ((c = *buf++) != '\0') {
+    while (s < e) {
+      c = *s++;
       if (c == '-')
 	continue;
-      for (i = 0; gace_p2c[i].c && gace_p2c[i].c != c; i++)
-	;
-      if (!gace_p2c[i].c) {
+      p = gacl_c2p[c];
+      if (!p) {
 	errno = EINVAL;
 	return -1;
       }
-      
-      nps |= gace_p2c[i].p;
+      nps |= p;
     }
-    
   }
 
   *psp = nps;
@@ -2001,34 +3169,28 @@ _gacl_permset_from_text(const char *buf,
 }
 
 
-int
-_gacl_flagset_from_text(const char *buf,
-			GACL_FLAGSET *fsp,
-			int flags) {
-  int i;
-  char c;
-  GACL_FLAGSET nfs = 0;
-
+/* Parse a flag set in [s, e). Returns 0 (and leaves *fsp) if empty */
+static int
+_gacl_flagset_from_text(const char *s,
+			const char *e,
+			GACL_FLAGSET *fsp) {
+  GACL_FLAGSET f, nfs = 0;
+  unsigned char c;
 
-  if (!buf) {
-    errno = EINVAL;
-    return -1;
-  }
 
-  if (!*buf)
+  if (s == e)
     return 0;
 
-  while ((c = *buf++) != '\0') {
+  while (s < e) {
+    c = *s++;
     if (c == '-')
       continue;
-    for (i = 0; gace_f2c[i].c && gace_f2c[i].c != c; i++)
-      ;
-    if (!gace_f2c[i].c) {
+    f = gacl_c2f[c];
+    if (!f) {
       errno = EINVAL;
       return -1;
     }
-
-    nfs |= gace_f2c[i].f;
+    nfs |= f;
   }
 
   *fsp = nfs;
@@ -2036,70 +3198,55 @@ _gacl_flagset_from_text(const char *buf,
 }
 
 
-
+/*
+ * Parse one ACE from 'len' bytes of text (no NUL needed)
+ *
+ * Format:
+ * <tag>:<perms>[:[<flags>][:<type>]]
+ */
 int
-_gacl_entry_from_text(char *cp,
-		      GACL_ENTRY *ep,
-		      int flags) {
-  char *np;
+_gacl_entry_from_text_n(const char *buf,
+			size_t len,
+			GACL_ENTRY *ep,
+			int flags) {
+  const char *e = buf+len, *cp = buf, *np;
+  GACL_KEYWORD *kp;
   int f_none;
 
   
-  /* 1. Get tag */
+  pthread_once(&gacl_text_once, _gacl_text_init);
   
-  if (_gacl_entry_tag_from_text(ep, &cp, flags) < 0)
+  /* 1. Get tag */
+  if (_gacl_entry_tag_from_text(ep, &cp, e, flags) < 0)
     return -1;
 
-  if (!cp)
-    return -1;
-  
   /* 2. Get permset */
-  np = strchr(cp, ':');
-  if (np)
-    *np++ = '\0';
+  np = memchr(cp, ':', e-cp);
   
-  f_none = (strcmp(cp, "none") == 0);
-
-  if (_gacl_permset_from_text(cp, &ep->perms, flags) < 0)
+  f_none = ((np ? np : e)-cp == 4 && strncmp(cp, "none", 4) == 0);
+  if (_gacl_permset_from_text(cp, np ? np : e, &ep->perms) < 0)
     return -1;
-  cp = np;
+  cp = np ? np+1 : NULL;
 
 
-  /* 3. Get flagset */
-  if (cp && (strcmp(cp, "allow") != 0 &&
-	     strcmp(cp, "deny") != 0 &&
-	     strcmp(cp, "audit") != 0 &&
-	     strcmp(cp, "alarm") != 0)) {
-    np = strchr(cp, ':');
-    if (np)
-      *np++ = '\0';
-    /* Parse flags in cp */
-    if (_gacl_flagset_from_text(cp, &ep->flags, flags) < 0)
+  /* 3. Get flagset (unless only the type remains) */
+  if (cp && (!(kp = _gacl_keyword(cp, e-cp)) || kp->c != GACL_KW_TYPE)) {
+    np = memchr(cp, ':', e-cp);
+    if (_gacl_flagset_from_text(cp, np ? np : e, &ep->flags) < 0)
       return -1;
+    cp = np ? np+1 : NULL;
   } else {
     ep->flags = 0;
   }
 
-  cp = np;
   /* 4. Get type (allow, deny, alarm, audit) */
   if (cp) {
-    np = strchr(cp, ':');
-    if (np) {
-      errno = EINVAL;
-      return -1;
-    }
-    if (strcmp(cp, "allow") == 0) 
-      ep->type = GACL_ENTRY_TYPE_ALLOW;
-    else if (strcmp(cp, "deny") == 0)
-      ep->type = GACL_ENTRY_TYPE_DENY;
-    else if (strcmp(cp, "audit") == 0)
-      ep->type = GACL_ENTRY_TYPE_AUDIT;
-    else if (strcmp(cp, "alarm") == 0)
-      ep->type = GACL_ENTRY_TYPE_ALARM;
-    else {
+    kp = _gacl_keyword(cp, e-cp);
+    if (!kp || kp->c != GACL_KW_TYPE) {
       errno = EINVAL;
       return -1;
     }
+    ep->type = kp->v;
   } else {
     if (f_none) {
       ep->perms = GACL_PERM_FULL_SET;
@@ -2112,6 +3259,14 @@ _gacl_entry_from_text(char *cp,
 }
 
 
+int
+_gacl_entry_from_text(char *cp,
+		      GACL_ENTRY *ep,
+		      int flags) {
+  return _gacl_entry_from_text_n(cp, strlen(cp), ep, flags);
+}
+
+
 int
 gacl_entry_from_text(char *cp,
 		     GACL_ENTRY *ep) {
@@ -2119,59 +3274,116 @@ gacl_entry_from_text(char *cp,
 }
 
 
+#define GACL_TEXT_IS_SEP(c) ((c) == ',' || (c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/* Skip separators and '#' comments (to end of line) */
+static const char *
+_gacl_text_skip(const char *cp,
+		const char *e) {
+  while (cp < e) {
+    if (GACL_TEXT_IS_SEP(*cp))
+      ++cp;
+    else if (*cp == '#') {
+      cp = memchr(cp, '\n', e-cp);
+      if (!cp)
+	return e;
+    } else
+      break;
+  }
+  
+  return cp;
+}
+
+
+/*
+ * Parse an ACL from 'len' bytes of text, without copying it. Entries
+ * are separated by ',' or whitespace and '#' starts a comment that runs
+ * to the end of the line, so a block of list-access output can be
+ * parsed as is. On failure errno is set and, if 'erroff' is not NULL,
+ * the offset of the failing entry is stored there.
+ */
 GACL *
-gacl_from_text(const char *buf) {
+gacl_from_text_n_np(const char *buf,
+		    size_t len,
+		    int flags,
+		    size_t *erroff) {
   GACL *ap;
-  char *bp, *tbuf, *es;
-  const char *cp;
-  int ne = 0;
+  GACL_ENTRY *ep;
+  const char *cp, *np, *e = buf+len;
+  int ne;
 
   
+  if (erroff)
+    *erroff = 0;
+  
   if (!buf) {
     errno = EINVAL;
     return NULL;
   }
-    
-  /* Count the number of potential ACEs */
-  for (cp = buf; *cp; ++cp)
-    if (*cp == ',')
-      ++ne;
-  if (*buf)
+
+  /* Count the entries so the ACL can be allocated in one go */
+  ne = 0;
+  for (cp = _gacl_text_skip(buf, e); cp < e; cp = _gacl_text_skip(cp, e)) {
     ++ne;
-  
-  bp = tbuf = strdup(buf);
+    while (cp < e && !GACL_TEXT_IS_SEP(*cp))
+      ++cp;
+  }
 
+  if (ne == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  
   ap = gacl_init(ne);
-  if (!ap) {
-    free(tbuf);
+  if (!ap)
     return NULL;
+
+  for (cp = _gacl_text_skip(buf, e); cp < e; cp = _gacl_text_skip(np, e)) {
+    for (np = cp; np < e && !GACL_TEXT_IS_SEP(*np); ++np)
+      ;
+    
+    if (gacl_create_entry_np(&ap, &ep, -1) < 0 ||
+	_gacl_entry_from_text_n(cp, np-cp, ep, flags) < 0) {
+      if (erroff)
+	*erroff = cp-buf;
+      gacl_free(ap);
+      errno = EINVAL;
+      return NULL;
+    }
   }
 
-  while ((es = strsep(&bp, ", \t\n\r")) != NULL) {
-    GACL_ENTRY *ep;
+  return ap;
+}
 
-    if (gacl_create_entry_np(&ap, &ep, -1) < 0)
-      goto Fail;
 
-    if (gacl_entry_from_text(es, ep) < 0)
-      goto Fail;
-  }
+/*
+ * Stricter than gacl_from_text_n_np(), as it always was: entries are
+ * separated by exactly one ',' or white space character, with nothing
+ * before the first or after the last one, and there are no comments.
+ */
+GACL *
+gacl_from_text(const char *buf) {
+  const char *cp;
 
-  free(tbuf);
-  return ap;
+  
+  if (!buf || !*buf) {
+    errno = EINVAL;
+    return NULL;
+  }
 
- Fail:
-  if (tbuf)
-    free(tbuf);
+  for (cp = buf; *cp; ++cp)
+    if ((GACL_TEXT_IS_SEP(*cp) &&
+	 (cp == buf || !cp[1] || GACL_TEXT_IS_SEP(cp[1]))) ||
+	(*cp == '#' && (cp == buf || GACL_TEXT_IS_SEP(cp[-1])))) {
+      errno = EINVAL;
+      return NULL;
+    }
   
-  gacl_free(ap);
-  errno = EINVAL;
-  return NULL;
+  return gacl_from_text_n_np(buf, strlen(buf), 0, NULL);
 }
 
 
 
-
 /* TODO: To be implemented */
 
 int
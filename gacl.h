@@ -44,6 +44,7 @@ typedef enum gacl_magic {
   GACL_MAGIC_ACL       = (GACL_MAGIC_BASE|0x1),
   GACL_MAGIC_TEXT      = (GACL_MAGIC_BASE|0x2),
   GACL_MAGIC_QUALIFIER = (GACL_MAGIC_BASE|0x3),
+  GACL_MAGIC_BUFFER    = (GACL_MAGIC_BASE|0x4),
   GACL_MAGIC_FREED     = 0xdeadbeef,
 } GACL_MAGIC;
 
@@ -189,7 +190,10 @@ typedef struct gacl {
   int ac;
   int as;
   int ap;
-  GACL_ENTRY av[0];
+  GACL_ENTRY *av;     /* Entries - our own or shared with another ACL */
+  struct gacl *sp;    /* ACL we share the entries with (copy-on-write) */
+  int nr;             /* References to this object (including ACLs sharing our entries) - atomic */
+  GACL_ENTRY ab[0];
 } GACL;
 
 
@@ -214,9 +218,23 @@ typedef GACL_ENTRY_TYPE gacl_entry_type_t;
 extern GACL *
 gacl_init(int count);
 
+extern GACL *
+gacl_init_exact_np(int count);
+
 extern int
 gacl_free(void *op);
 
+extern int
+gacl_set_allocator_np(void *(*allocf)(void *ctx, size_t size),
+		      void *ctx);
+
+extern int
+gacl_get_allocator_np(void *(**allocfp)(void *ctx, size_t size),
+		      void **ctxp);
+
+extern void *
+_gacl_buffer_alloc(size_t size);
+
 extern int
 gacl_get_brand_np(GACL *ap,
 		  GACL_BRAND *bp);
@@ -224,10 +242,27 @@ gacl_get_brand_np(GACL *ap,
 extern GACL *
 gacl_dup(GACL *ap);
 
+/* Packed ACE comparison key */
+typedef struct gacl_entry_key {
+  uint32_t tag;   /* Tag type (low 16 bits) and entry type (high 16 bits) */
+  uint32_t ugid;  /* User/group id (0 for owner@, group@ & everyone@) */
+  uint32_t perms;
+  uint32_t flags;
+} GACL_ENTRY_KEY;
+
+extern void
+gacl_entry_key_np(const GACL_ENTRY *ep,
+		  GACL_ENTRY_KEY *kp);
+
 extern int
 gacl_match(GACL *ap,
 	   GACL *mp);
 
+extern int
+gacl_match_any_np(GACL *ap,
+		  GACL *mp,
+		  int how);
+
 extern int
 _gacl_entry_match(GACL_ENTRY *aep,
 		  GACL_ENTRY *mep,
@@ -237,12 +272,33 @@ extern int
 gacl_entry_match(GACL_ENTRY *aep,
 		 GACL_ENTRY *mep);
 
+typedef struct gacl_fingerprint {
+  uint64_t h[2];
+} GACL_FINGERPRINT;
+
+#define GACL_FINGERPRINT_TEXT_SIZE 33
+
+extern int
+gacl_fingerprint(GACL *ap,
+		 GACL_FINGERPRINT *fp);
+
+extern ssize_t
+gacl_fingerprint_to_text(const GACL_FINGERPRINT *fp,
+			 char *buf,
+			 size_t bufsize);
+
 extern GACL *
 gacl_sort(GACL *ap);
 
+extern int
+gacl_sort_inplace_np(GACL *ap);
+
 extern GACL *
 gacl_merge(GACL *ap);
 
+extern int
+gacl_merge_inplace_np(GACL *ap);
+
 extern int
 gacl_is_trivial_np(GACL *ap,
 		   int *trivialp);
@@ -251,6 +307,10 @@ extern GACL *
 gacl_strip_np(GACL *ap,
 	      int recalculate_mask);
 
+extern int
+gacl_strip_inplace_np(GACL *ap,
+		      int recalculate_mask);
+
 extern int
 gacl_init_entry(GACL_ENTRY *ep);
 
@@ -298,6 +358,30 @@ gacl_get_entry(GACL *ap,
 	       int eid,
 	       GACL_ENTRY **epp);
 
+/* Reentrant variant - the iteration cursor is kept by the caller */
+extern int
+gacl_get_entry_r(GACL *ap,
+		 int eid,
+		 GACL_ENTRY **epp,
+		 int *cursor);
+
+/* Read-only variants - the returned entry must not be modified */
+extern int
+_gacl_peek_entry(GACL *ap,
+		 int pos,
+		 GACL_ENTRY **epp);
+
+extern int
+gacl_peek_entry_np(GACL *ap,
+		   int eid,
+		   GACL_ENTRY **epp);
+
+extern int
+gacl_peek_entry_r(GACL *ap,
+		  int eid,
+		  GACL_ENTRY **epp,
+		  int *cursor);
+
 
 extern GACL *
 gacl_get_file(const char *path,
@@ -335,6 +419,27 @@ extern int
 gacl_set_fd(int fd,
 	    GACL *ap);
 
+/*
+ * ACLs in the form the OS stores them, for cheap comparisons and bulk
+ * writes of the same ACL. ENOSYS where there is no such form
+ */
+#define GACL_NATIVE_MAX 8192
+
+extern ssize_t
+gacl_to_native_np(GACL *ap,
+		  char *buf,
+		  size_t bufsize);
+
+extern ssize_t
+gacl_get_native_file_np(const char *path,
+			char *buf,
+			size_t bufsize);
+
+extern int
+gacl_set_native_file_np(const char *path,
+			const char *buf,
+			size_t len);
+
 extern int
 gacl_set_tag_type(GACL_ENTRY *ep,
 		  GACL_TAG_TYPE et);
@@ -462,6 +567,15 @@ gacl_entry_to_text(GACL_ENTRY *ep,
 		   size_t bufsize,
 		   int flags);
 
+/* Max size of one line from gacl_to_text_buf_np() (padding, ACE, ID & separator) */
+#define GACL_TEXT_ENTRY_MAX 640
+
+extern ssize_t
+gacl_to_text_buf_np(GACL *ap,
+		    char *buf,
+		    size_t bufsize,
+		    int flags);
+
 extern char *
 gacl_to_text_np(GACL *ap,
 		ssize_t *bsp,
@@ -474,12 +588,19 @@ gacl_to_text(GACL *ap,
 
 
 #define GACL_TEXT_RELAXED  0x0001 /* Do not verify user/group names */
+#define GACL_TEXT_NFS4_IDS 0x0002 /* Also take the "name@" & "name@<nfs4 domain>" names that NFSv4 ACLs list */
 
 extern int
 _gacl_entry_from_text(char *cp,
 		      GACL_ENTRY *ep,
 		      int flags);
 
+extern int
+_gacl_entry_from_text_n(const char *buf,
+			size_t len,
+			GACL_ENTRY *ep,
+			int flags);
+
 extern int
 gacl_entry_from_text(char *buf,
 		     GACL_ENTRY *ep);
@@ -487,6 +608,13 @@ gacl_entry_from_text(char *buf,
 extern GACL *
 gacl_from_text(const char *buf);
 
+extern GACL *
+gacl_from_text_n_np(const char *buf,
+		    size_t len,
+		    int flags,
+		    size_t *erroff);
+
+
 extern int
 gacl_delete_file_np(const char *path,
 		    GACL_TYPE type);
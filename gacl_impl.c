@@ -47,12 +47,14 @@
 
 #include "vfs.h"
 #include "strings.h"
+#include "ident.h"
 
 
 
 /* ----- OS-specific stuff below here -------------- */
 
 #ifdef __linux__
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/xattr.h>
 #include "nfs4.h"
@@ -77,19 +79,18 @@
  */
 
 
-static char *
-_nfs4_id_domain(void) {
-  static char *saved_domain = NULL;
+static char *saved_domain = NULL;
+static pthread_once_t saved_domain_once = PTHREAD_ONCE_INIT;
+
+static void
+_nfs4_id_domain_load(void) {
   FILE *fp;
   char buf[256];
 
 
-  if (saved_domain)
-    return saved_domain;
-
   fp = fopen("/etc/idmapd.conf","r");
   if (!fp)
-    return NULL;
+    return;
 
   while (fgets(buf, sizeof(buf), fp)) {
     char *bp, *t;
@@ -104,10 +105,8 @@ _nfs4_id_domain(void) {
       if (!t || strcmp(t, "=") != 0)
 	continue;
       t = strsep(&bp, " \t\n");
-      if (!t) {
-	fclose(fp);
-	return NULL;
-      }
+      if (!t)
+	break;
 	
       saved_domain = strdup(t);
       break;
@@ -115,6 +114,11 @@ _nfs4_id_domain(void) {
   }
 
   fclose(fp);
+}
+
+static char *
+_nfs4_id_domain(void) {
+  pthread_once(&saved_domain_once, _nfs4_id_domain_load);
   return saved_domain;
 }
 
@@ -122,17 +126,13 @@ _nfs4_id_domain(void) {
 static int
 _nfs4_id_to_uid(char *buf,
 		uid_t *uidp) {
-  struct passwd *pp;
-  int i;
+  int i, rc;
   char *idd = NULL;
 
 
   /* First we try a direct lookup (user@realm) - it might work... */
-  pp = getpwnam(buf);
-  if (pp) {
-    *uidp = pp->pw_uid;
+  if (ident_name_to_uid(buf, uidp) > 0)
     return 1;
-  }
   
   idd = _nfs4_id_domain();
 
@@ -141,12 +141,10 @@ _nfs4_id_to_uid(char *buf,
   
   if (buf[i] && (!idd || strcmp(idd, buf+i) == 0)) {
     buf[i] = '\0';
-    pp = getpwnam(buf);
+    rc = ident_name_to_uid(buf, uidp);
     buf[i] = '@';
-    if (pp) {
-      *uidp = pp->pw_uid;
+    if (rc > 0)
       return 1;
-    }
   } else if (sscanf(buf, "%d", uidp) == 1)
     return 1;
   
@@ -158,17 +156,13 @@ _nfs4_id_to_uid(char *buf,
 static int
 _nfs4_id_to_gid(char *buf,
 		gid_t *gidp) {
-  struct group *gp;
-  int i;
+  int i, rc;
   char *idd = NULL;
 
 
   /* First try a direct lookup (group@realm) - might work */
-  gp = getgrnam(buf);
-  if (gp) {
-    *gidp = gp->gr_gid;
+  if (ident_name_to_gid(buf, gidp) > 0)
     return 1;
-  }
   
   idd = _nfs4_id_domain();
 
@@ -177,12 +171,10 @@ _nfs4_id_to_gid(char *buf,
 
   if (buf[i] && (!idd || strcmp(idd, buf+1) == 0)) {
     buf[i] = '\0';
-    gp = getgrnam(buf);
+    rc = ident_name_to_gid(buf, gidp);
     buf[i] = '@';
-    if (gp) {
-      *gidp = gp->gr_gid;
+    if (rc > 0)
       return 1;
-    }
   } else if (sscanf(buf, "%d", gidp) == 1)
     return 1;
   
@@ -356,6 +348,7 @@ _gacl_get_fd_file(int fd,
 		  int flags) {
   char *buf;
   ssize_t bufsize, rc;
+  GACL *ap;
 
   
   if (path) {
@@ -365,13 +358,13 @@ _gacl_get_fd_file(int fd,
       if (bufsize < 0)
 	return NULL;
 
-      buf = malloc(bufsize);
+      buf = _gacl_buffer_alloc(bufsize);
       if (!buf)
 	return NULL;
 
       rc = lgetxattr(path, ACL_NFS4_XATTR, buf, bufsize);
       if (rc < 0) {
-	free(buf);
+	gacl_free(buf);
 	return NULL;
       }
     } else {
@@ -380,13 +373,13 @@ _gacl_get_fd_file(int fd,
       if (bufsize < 0)
 	return NULL;
       
-      buf = malloc(bufsize);
+      buf = _gacl_buffer_alloc(bufsize);
       if (!buf)
 	return NULL;
       
       rc = getxattr(path, ACL_NFS4_XATTR, buf, bufsize);
       if (rc < 0) {
-	free(buf);
+	gacl_free(buf);
 	return NULL;
       }
       
@@ -397,19 +390,21 @@ _gacl_get_fd_file(int fd,
     if (bufsize < 0)
       return NULL;
     
-    buf = malloc(bufsize);
+    buf = _gacl_buffer_alloc(bufsize);
     if (!buf)
       return NULL;
     
     rc = fgetxattr(fd, ACL_NFS4_XATTR, buf, bufsize);
     if (rc < 0) {
-      free(buf);
+      gacl_free(buf);
       return NULL;
     }
     
   }
 
-  return _gacl_init_from_nfs4(buf, bufsize);
+  ap = _gacl_init_from_nfs4(buf, bufsize);
+  gacl_free(buf);
+  return ap;
 }
 
 
@@ -433,10 +428,8 @@ _gacl_to_nfs4(GACL *ap,
   for (i = 0; i < ap->ac; i++) {
     char *idname;
     u_int32_t idlen;
-    struct passwd *pp;
-    struct group *gp;
     char *idd;
-    char tbuf[256];
+    char tbuf[256], nbuf[256];
     GACL_ENTRY *ep = &ap->av[i];
 
     if (vp >= endp) {
@@ -502,10 +495,9 @@ _gacl_to_nfs4(GACL *ap,
       idname = "EVERYONE@";
       break;
     case GACL_TAG_TYPE_USER:
-      pp = getpwuid(ep->tag.ugid);
-      if (pp) {
+      if (ident_uid_to_name(ep->tag.ugid, nbuf, sizeof(nbuf)) > 0) {
 	idd = _nfs4_id_domain();
-	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", pp->pw_name, idd ? idd : "");
+	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", nbuf, idd ? idd : "");
       } else
 	rc = snprintf(tbuf, sizeof(tbuf), "%u", ep->tag.ugid);
       if (rc < 0) {
@@ -515,10 +507,9 @@ _gacl_to_nfs4(GACL *ap,
       idname = tbuf;
       break;
     case GACL_TAG_TYPE_GROUP:
-      gp = getgrgid(ep->tag.ugid);
-      if (gp) {
+      if (ident_gid_to_name(ep->tag.ugid, nbuf, sizeof(nbuf)) > 0) {
 	idd = _nfs4_id_domain();
-	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", gp->gr_name, idd ? idd : "");
+	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", nbuf, idd ? idd : "");
       } else
 	rc = snprintf(tbuf, sizeof(tbuf), "%u", ep->tag.ugid);
       if (rc < 0) {
@@ -556,7 +547,7 @@ _gacl_set_fd_file(int fd,
 		  GACL_TYPE type,
 		  GACL *ap,
 		  int flags) {
-  char buf[8192];
+  char buf[GACL_NATIVE_MAX];
   ssize_t bufsize, rc;
 
 
@@ -588,6 +579,52 @@ _gacl_set_fd_file(int fd,
 
   return rc;
 }
+
+
+ssize_t
+_gacl_to_native(GACL *ap,
+		char *buf,
+		size_t bufsize) {
+  return _gacl_to_nfs4(ap, buf, bufsize);
+}
+
+
+ssize_t
+_gacl_get_native_fd_file(int fd,
+			 const char *path,
+			 char *buf,
+			 size_t bufsize,
+			 int flags) {
+  if (!path)
+    return fgetxattr(fd, ACL_NFS4_XATTR, buf, bufsize);
+  
+  if (flags & GACL_F_SYMLINK_NOFOLLOW)
+    return lgetxattr(path, ACL_NFS4_XATTR, buf, bufsize);
+  
+  return getxattr(path, ACL_NFS4_XATTR, buf, bufsize);
+}
+
+
+int
+_gacl_set_native_fd_file(int fd,
+			 const char *path,
+			 const char *buf,
+			 size_t len,
+			 int flags) {
+  if (!path)
+    return fsetxattr(fd, ACL_NFS4_XATTR, buf, len, 0);
+  
+  if (flags & GACL_F_SYMLINK_NOFOLLOW)
+    return lsetxattr(path, ACL_NFS4_XATTR, buf, len, 0);
+  
+  return setxattr(path, ACL_NFS4_XATTR, buf, len, 0);
+}
+
+
+const char *
+_gacl_nfs4_id_domain(void) {
+  return _nfs4_id_domain();
+}
 #endif
 
 
@@ -621,8 +658,6 @@ _gacl_set_fd_file(int fd,
 static int
 _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
 			   freebsd_acl_entry_t oep) {
-  struct passwd *pp;
-  struct group *gp;
 
 
   /* XXX TODO: Translate ae_tag - tag.type*/
@@ -650,11 +685,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     break;
     
   case GACL_TAG_TYPE_USER:
-    pp = getpwuid(nep->tag.ugid);
-    if (pp) {
-      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), pp->pw_name) < 0)
-	return -1;
-    } else {
+    if (ident_uid_to_name(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
       int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
       
       if (rc < 0)
@@ -667,11 +698,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     break;
     
   case GACL_TAG_TYPE_GROUP:
-    gp = getgrgid(nep->tag.ugid);
-    if (gp) {
-      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), gp->gr_name) < 0)
-	return -1;
-    } else {
+    if (ident_gid_to_name(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
       int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
 
       if (rc < 0)
@@ -819,7 +846,7 @@ _gacl_set_fd_file(int fd,
   
   nap = acl_init(ap->ac);
 
-  for (i = 0; (rc = gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &oep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_peek_entry(ap, i, &oep)) == 1; i++) {
     freebsd_acl_entry_t nep;
 
     if (acl_create_entry_np(&nap, &nep, i) < 0)
@@ -981,8 +1008,6 @@ _gacl_entry_to_ace(GACL_ENTRY *ep,
 static int
 _gacl_entry_from_ace(GACL_ENTRY *ep,
 		     ace_t *ap) {
-  struct passwd *pp;
-  struct group *gp;
   int i;
   
   
@@ -1017,11 +1042,7 @@ _gacl_entry_from_ace(GACL_ENTRY *ep,
     if (ap->a_flags & ACE_IDENTIFIER_GROUP) {
       ep->tag.type = GACL_TAG_TYPE_GROUP;
       ep->tag.ugid = ap->a_who;
-      gp = getgrgid(ap->a_who);
-      if (gp) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), gp->gr_name) < 0)
-	  return -1;
-      } else {
+      if (ident_gid_to_name(ap->a_who, ep->tag.name, sizeof(ep->tag.name)) <= 0) {
 	int rc = snprintf(ep->tag.name, sizeof(ep->tag.name), "%d", ap->a_who);
 
 	if (rc < 0)
@@ -1034,11 +1055,7 @@ _gacl_entry_from_ace(GACL_ENTRY *ep,
     } else {
       ep->tag.type = GACL_TAG_TYPE_USER;
       ep->tag.ugid = ap->a_who;
-      pp = getpwuid(ap->a_who);
-      if (pp) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), pp->pw_name) < 0)
-	  return -1;
-      } else {
+      if (ident_uid_to_name(ap->a_who, ep->tag.name, sizeof(ep->tag.name)) <= 0) {
 	int rc = snprintf(ep->tag.name, sizeof(ep->tag.name), "%d", ap->a_who);
 
 	if (rc < 0)
@@ -1317,8 +1334,6 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
   macos_acl_tag_t at;
   macos_acl_permset_t ops;
   macos_acl_flagset_t ofs;
-  struct passwd *pp;
-  struct group *gp;
 
   
   if (acl_get_tag_type(oep, &at) < 0)
@@ -1339,11 +1354,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     switch (ugtype) {
     case ID_TYPE_UID:
       nep->tag.type = GACL_TAG_TYPE_USER;
-      pp = getpwuid(nep->tag.ugid);
-      if (pp) {
-	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), pp->pw_name) < 0)
-	  return -1;
-      } else {
+      if (ident_uid_to_name(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
 	int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
 
 	if (rc < 0)
@@ -1357,11 +1368,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
       
     case ID_TYPE_GID:
       nep->tag.type = GACL_TAG_TYPE_GROUP;
-      gp = getgrgid(nep->tag.ugid);
-      if (gp) {
-	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), gp->gr_name) < 0)
-	  return -1;
-      } else {
+      if (ident_gid_to_name(nep->tag.ugid, nep->tag.name, sizeof(nep->tag.name)) <= 0) {
 	int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
 
 	if (rc < 0)
@@ -1571,7 +1578,7 @@ _gacl_set_fd_file(int fd,
   if (!nap)
     return -1;
 
-  for (i = 0; (rc = gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &oep)) == 1; i++) {
+  for (i = 0; (rc = _gacl_peek_entry(ap, i, &oep)) == 1; i++) {
     macos_acl_entry_t nep;
 
     if (acl_create_entry_np(&nap, &nep, i) < 0)
@@ -1600,3 +1607,49 @@ _gacl_set_fd_file(int fd,
   return -1;
 }
 #endif
+
+
+
+/*
+ * Systems where the ACL is not stored as one opaque blob have no
+ * native encoding to compare or copy
+ */
+#ifndef __linux__
+ssize_t
+_gacl_to_native(GACL *ap,
+		char *buf,
+		size_t bufsize) {
+  errno = ENOSYS;
+  return -1;
+}
+
+
+ssize_t
+_gacl_get_native_fd_file(int fd,
+			 const char *path,
+			 char *buf,
+			 size_t bufsize,
+			 int flags) {
+  errno = ENOSYS;
+  return -1;
+}
+
+
+int
+_gacl_set_native_fd_file(int fd,
+			 const char *path,
+			 const char *buf,
+			 size_t len,
+			 int flags) {
+  errno = ENOSYS;
+  return -1;
+}
+#endif
+
+
+#ifndef __linux__
+const char *
+_gacl_nfs4_id_domain(void) {
+  return NULL;
+}
+#endif
@@ -151,4 +151,33 @@ _gacl_set_fd_file(int fd,
 		  GACL *ap,
 		  int flags);
 
+/*
+ * The ACL in the form the OS stores it (the NFSv4 xattr on Linux).
+ * Fails with ENOSYS where there is no such form
+ */
+ssize_t
+_gacl_to_native(GACL *ap,
+		char *buf,
+		size_t bufsize);
+
+ssize_t
+_gacl_get_native_fd_file(int fd,
+			 const char *path,
+			 char *buf,
+			 size_t bufsize,
+			 int flags);
+
+int
+_gacl_set_native_fd_file(int fd,
+			 const char *path,
+			 const char *buf,
+			 size_t len,
+			 int flags);
+
+/*
+ * The NFSv4 id mapping domain (from /etc/idmapd.conf on Linux), or NULL
+ */
+const char *
+_gacl_nfs4_id_domain(void);
+
 #endif
@@ -0,0 +1,1397 @@
+/*
+ * ident.c - User & group identity lookups
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stddef.h>
+
+#include "ident.h"
+#include "strings.h"
+
+
+/* Initial size of the buffer for the getpw*_r() & getgr*_r() calls */
+#define IDENT_BUFSIZE 4096
+
+typedef enum {
+  IDENT_BY_UID,
+  IDENT_BY_GID,
+  IDENT_BY_USERNAME,
+  IDENT_BY_GROUPNAME,
+} IDENT_KEY;
+
+
+/*
+ * Do one lookup. Starts with a buffer on the stack and grows a heap
+ * buffer if the NSS data does not fit in it.
+ */
+static int
+_ident_lookup(IDENT_KEY k,
+	      const char *name,
+	      id_t id,
+	      char *nbuf,
+	      size_t nbufsize,
+	      id_t *idp) {
+  char sbuf[IDENT_BUFSIZE], *buf = sbuf;
+  size_t bufsize = sizeof(sbuf);
+  struct passwd pw, *pp = NULL;
+  struct group gr, *gp = NULL;
+  int ec, rc;
+
+  
+  while (1) {
+    switch (k) {
+    case IDENT_BY_UID:
+      ec = getpwuid_r((uid_t) id, &pw, buf, bufsize, &pp);
+      break;
+    case IDENT_BY_USERNAME:
+      ec = getpwnam_r(name, &pw, buf, bufsize, &pp);
+      break;
+    case IDENT_BY_GID:
+      ec = getgrgid_r((gid_t) id, &gr, buf, bufsize, &gp);
+      break;
+    case IDENT_BY_GROUPNAME:
+      ec = getgrnam_r(name, &gr, buf, bufsize, &gp);
+      break;
+    default:
+      ec = EINVAL;
+    }
+    
+    if (ec != ERANGE)
+      break;
+
+    bufsize *= 2;
+    if (buf != sbuf)
+      free(buf);
+    buf = malloc(bufsize);
+    if (!buf)
+      return -1;
+  }
+
+  rc = 0;
+  if (pp) {
+    if (nbuf && s_cpy(nbuf, nbufsize, pp->pw_name) < 0)
+      rc = -1;
+    else {
+      if (idp)
+	*idp = pp->pw_uid;
+      rc = 1;
+    }
+  } else if (gp) {
+    if (nbuf && s_cpy(nbuf, nbufsize, gp->gr_name) < 0)
+      rc = -1;
+    else {
+      if (idp)
+	*idp = gp->gr_gid;
+      rc = 1;
+    }
+  } else {
+    /* Not found is reported as 0 or one of these by the NSS backends */
+    switch (ec) {
+    case 0:
+    case ENOENT:
+    case ESRCH:
+    case EBADF:
+    case EPERM:
+      break;
+    default:
+      errno = ec;
+      rc = -1;
+    }
+  }
+  
+  if (buf != sbuf)
+    free(buf);
+  
+  return rc;
+}
+
+
+
+/*
+ * The cache keeps both positive and negative (not found) answers for all
+ * four kinds of lookups. It is split into shards with a lock each so
+ * concurrent lookups seldom contend.
+ */
+#define IDENT_CACHE_SHARDS      64
+#define IDENT_CACHE_BUCKETS     256
+#define IDENT_CACHE_SHARD_MAX   1024
+
+typedef struct ident_entry {
+  struct ident_entry *next;
+  IDENT_KEY k;
+  id_t id;
+  int found;         /* 1 = found, 0 = not found, -1 = lookup in progress */
+  time_t expires;
+  char name[1];      /* Key for name lookups, result for id lookups */
+} IDENT_ENTRY;
+
+typedef struct ident_shard {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;   /* Signalled when a lookup in progress completes */
+  unsigned int n;
+  IDENT_ENTRY *bv[IDENT_CACHE_BUCKETS];
+} IDENT_SHARD;
+
+static IDENT_SHARD ident_cache[IDENT_CACHE_SHARDS];
+static pthread_once_t ident_cache_once = PTHREAD_ONCE_INIT;
+
+static int ident_cache_ttl = IDENT_CACHE_TTL_DEFAULT;
+static int ident_cache_negative_ttl = IDENT_CACHE_NEGATIVE_TTL_DEFAULT;
+
+static IDENT_CACHE_STATS ident_cache_stats;
+
+
+
+static void
+_ident_cache_init(void) {
+  int i;
+
+  for (i = 0; i < IDENT_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&ident_cache[i].mtx, NULL);
+    pthread_cond_init(&ident_cache[i].cv, NULL);
+    ident_cache[i].n = 0;
+    memset(ident_cache[i].bv, 0, sizeof(ident_cache[i].bv));
+  }
+}
+
+
+static unsigned int
+_ident_hash(IDENT_KEY k,
+	    const char *name,
+	    id_t id) {
+  uint32_t h = 2166136261U ^ (uint32_t) k;
+
+  
+  if (name) {
+    while (*name) {
+      h ^= (unsigned char) *name++;
+      h *= 16777619U;
+    }
+  } else {
+    h ^= (uint32_t) id;
+    h *= 16777619U;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+  }
+  
+  return h;
+}
+
+
+static int
+_ident_entry_matches(IDENT_ENTRY *ep,
+		     IDENT_KEY k,
+		     const char *name,
+		     id_t id) {
+  if (ep->k != k)
+    return 0;
+  
+  if (name)
+    return strcmp(ep->name, name) == 0;
+  
+  return ep->id == id;
+}
+
+
+/*
+ * Drop all entries in a shard (or only the expired ones), except lookups
+ * in progress. Shard must be locked
+ */
+static void
+_ident_shard_purge(IDENT_SHARD *sp,
+		   time_t now) {
+  IDENT_ENTRY *ep, **epp;
+  int i;
+
+  
+  for (i = 0; i < IDENT_CACHE_BUCKETS; i++) {
+    epp = &sp->bv[i];
+    while ((ep = *epp) != NULL) {
+      if (ep->found >= 0 && (!now || ep->expires <= now)) {
+	*epp = ep->next;
+	free(ep);
+	sp->n--;
+      } else
+	epp = &ep->next;
+    }
+  }
+}
+
+
+/*
+ * Add an answer that was resolved at time 'when' to the cache.
+ * Returns 1 if added, 0 if not (caching disabled or already expired)
+ */
+static int
+_ident_cache_add(IDENT_KEY k,
+		 const char *name,
+		 id_t id,
+		 int found,
+		 const char *rname,
+		 id_t rid,
+		 time_t when) {
+  unsigned int h;
+  IDENT_SHARD *sp;
+  IDENT_ENTRY *ep, **epp;
+  const char *ename;
+  time_t now;
+  int ttl;
+
+  
+  ttl = __atomic_load_n(found ? &ident_cache_ttl : &ident_cache_negative_ttl, __ATOMIC_RELAXED);
+  if (ttl <= 0)
+    return 0;
+
+  now = time(NULL);
+  if (when + ttl <= now)
+    return 0;
+  
+  ename = name ? name : (found ? rname : "");
+  ep = malloc(sizeof(*ep) + strlen(ename));
+  if (!ep)
+    return 0;
+
+  ep->k = k;
+  ep->id = name ? rid : id;
+  ep->found = found;
+  strcpy(ep->name, ename);
+  
+  ep->expires = when + ttl;
+
+  h = _ident_hash(k, name, id);
+  sp = &ident_cache[h % IDENT_CACHE_SHARDS];
+  
+  pthread_mutex_lock(&sp->mtx);
+
+  if (sp->n >= IDENT_CACHE_SHARD_MAX) {
+    _ident_shard_purge(sp, now);
+    if (sp->n >= IDENT_CACHE_SHARD_MAX)
+      _ident_shard_purge(sp, 0);
+  }
+  
+  /* Replace an old (expired) entry for the same key */
+  for (epp = &sp->bv[(h / IDENT_CACHE_SHARDS) % IDENT_CACHE_BUCKETS]; *epp; epp = &(*epp)->next)
+    if (_ident_entry_matches(*epp, k, name, id)) {
+      IDENT_ENTRY *oep = *epp;
+      
+      *epp = oep->next;
+      free(oep);
+      sp->n--;
+      break;
+    }
+  
+  epp = &sp->bv[(h / IDENT_CACHE_SHARDS) % IDENT_CACHE_BUCKETS];
+  ep->next = *epp;
+  *epp = ep;
+  sp->n++;
+  
+  pthread_mutex_unlock(&sp->mtx);
+  return 1;
+}
+
+
+/*
+ * Look something up in the cache. If another thread is already looking
+ * up the same key we wait for its answer instead of asking NSS again.
+ * On a miss (and if 'claim' is set) a placeholder is left in the cache
+ * and the caller must resolve it and call _ident_cache_done().
+ *
+ * Returns 1 (found), 0 (cached negative answer), -1 (not in cache) or
+ * -2 (nbuf too small)
+ */
+static int
+_ident_cache_get(IDENT_KEY k,
+		 const char *name,
+		 id_t id,
+		 char *nbuf,
+		 size_t nbufsize,
+		 id_t *idp,
+		 int claim) {
+  unsigned int h;
+  IDENT_SHARD *sp;
+  IDENT_ENTRY *ep, **epp;
+  int rc = -1;
+
+  
+  h = _ident_hash(k, name, id);
+  sp = &ident_cache[h % IDENT_CACHE_SHARDS];
+
+  pthread_mutex_lock(&sp->mtx);
+
+ Again:
+  for (epp = &sp->bv[(h / IDENT_CACHE_SHARDS) % IDENT_CACHE_BUCKETS]; (ep = *epp) != NULL; epp = &ep->next)
+    if (_ident_entry_matches(ep, k, name, id))
+      break;
+
+  if (ep && ep->found < 0) {
+    __atomic_add_fetch(&ident_cache_stats.waits, 1, __ATOMIC_RELAXED);
+    pthread_cond_wait(&sp->cv, &sp->mtx);
+    goto Again;
+  }
+  
+  if (ep) {
+    if (ep->expires <= time(NULL)) {
+      __atomic_add_fetch(&ident_cache_stats.expired, 1, __ATOMIC_RELAXED);
+      *epp = ep->next;
+      free(ep);
+      sp->n--;
+      ep = NULL;
+    } else if (!ep->found) {
+      __atomic_add_fetch(&ident_cache_stats.negative_hits, 1, __ATOMIC_RELAXED);
+      rc = 0;
+    } else {
+      rc = 1;
+      if (nbuf && !name && s_cpy(nbuf, nbufsize, ep->name) < 0)
+	rc = -2;
+      else if (idp)
+	*idp = ep->id;
+      __atomic_add_fetch(&ident_cache_stats.hits, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (!ep && claim) {
+    ep = malloc(sizeof(*ep) + (name ? strlen(name) : 0));
+    if (ep) {
+      ep->k = k;
+      ep->id = id;
+      ep->found = -1;
+      ep->expires = 0;
+      strcpy(ep->name, name ? name : "");
+      
+      epp = &sp->bv[(h / IDENT_CACHE_SHARDS) % IDENT_CACHE_BUCKETS];
+      ep->next = *epp;
+      *epp = ep;
+      sp->n++;
+    }
+  }
+  
+  pthread_mutex_unlock(&sp->mtx);
+  return rc;
+}
+
+
+/*
+ * A claimed lookup has completed. Drop the placeholder if it was not
+ * replaced by an answer and wake up any waiting threads.
+ */
+static void
+_ident_cache_done(IDENT_KEY k,
+		  const char *name,
+		  id_t id) {
+  unsigned int h;
+  IDENT_SHARD *sp;
+  IDENT_ENTRY *ep, **epp;
+
+  
+  h = _ident_hash(k, name, id);
+  sp = &ident_cache[h % IDENT_CACHE_SHARDS];
+
+  pthread_mutex_lock(&sp->mtx);
+  
+  for (epp = &sp->bv[(h / IDENT_CACHE_SHARDS) % IDENT_CACHE_BUCKETS]; (ep = *epp) != NULL; epp = &ep->next)
+    if (_ident_entry_matches(ep, k, name, id)) {
+      if (ep->found < 0) {
+	*epp = ep->next;
+	free(ep);
+	sp->n--;
+      }
+      break;
+    }
+  
+  pthread_cond_broadcast(&sp->cv);
+  pthread_mutex_unlock(&sp->mtx);
+}
+
+
+/* Check if a key is known (cached or being looked up) without waiting */
+static int
+_ident_cache_known(IDENT_KEY k,
+		   const char *name,
+		   id_t id) {
+  unsigned int h;
+  IDENT_SHARD *sp;
+  IDENT_ENTRY *ep;
+
+  
+  h = _ident_hash(k, name, id);
+  sp = &ident_cache[h % IDENT_CACHE_SHARDS];
+
+  pthread_mutex_lock(&sp->mtx);
+  for (ep = sp->bv[(h / IDENT_CACHE_SHARDS) % IDENT_CACHE_BUCKETS]; ep; ep = ep->next)
+    if (_ident_entry_matches(ep, k, name, id))
+      break;
+  if (ep && ep->found >= 0 && ep->expires <= time(NULL))
+    ep = NULL;
+  pthread_mutex_unlock(&sp->mtx);
+  
+  return ep != NULL;
+}
+
+
+/*
+ * Preloaded user & group databases. Built once (at startup) from either
+ * getpwent()/getgrent() or a "getent passwd"/"getent group" dump and then
+ * never modified, so lookups need no locking. When loaded they are
+ * authoritative - anything not in them is reported as not found without
+ * calling NSS.
+ */
+typedef struct ident_rec {
+  id_t id;
+  uint32_t noff;     /* Offset of the name in the string pool */
+} IDENT_REC;
+
+typedef struct ident_table {
+  IDENT_REC *rv;
+  size_t rc, rs;
+  char *pool;
+  size_t pc, ps;
+  uint32_t *byid;    /* Open addressed hash tables of record index+1 */
+  uint32_t *byname;
+  size_t hs;         /* Size of the hash tables (power of 2) */
+} IDENT_TABLE;
+
+/* [0] = users, [1] = groups */
+static IDENT_TABLE *ident_preloaded[2];
+
+
+
+static void
+_ident_table_free(IDENT_TABLE *tp) {
+  if (!tp)
+    return;
+  
+  free(tp->rv);
+  free(tp->pool);
+  free(tp->byid);
+  free(tp->byname);
+  free(tp);
+}
+
+
+static int
+_ident_table_add(IDENT_TABLE *tp,
+		 const char *name,
+		 size_t len,
+		 id_t id) {
+  if (!len)
+    return 0;
+  
+  if (tp->rc >= tp->rs) {
+    size_t ns = tp->rs ? tp->rs * 2 : 1024;
+    IDENT_REC *nrv = realloc(tp->rv, ns * sizeof(IDENT_REC));
+    
+    if (!nrv)
+      return -1;
+    tp->rv = nrv;
+    tp->rs = ns;
+  }
+  
+  if (tp->pc + len + 1 > tp->ps) {
+    size_t ns = tp->ps ? tp->ps * 2 : 16384;
+    char *npool;
+
+    while (ns < tp->pc + len + 1)
+      ns *= 2;
+    if (ns > UINT32_MAX) {
+      errno = E2BIG;
+      return -1;
+    }
+    npool = realloc(tp->pool, ns);
+    if (!npool)
+      return -1;
+    tp->pool = npool;
+    tp->ps = ns;
+  }
+
+  tp->rv[tp->rc].id = id;
+  tp->rv[tp->rc].noff = (uint32_t) tp->pc;
+  tp->rc++;
+  
+  memcpy(tp->pool + tp->pc, name, len);
+  tp->pc += len;
+  tp->pool[tp->pc++] = '\0';
+  
+  return 1;
+}
+
+
+/* Build the hash indexes. The first entry wins for duplicate ids/names, like NSS */
+static int
+_ident_table_index(IDENT_TABLE *tp) {
+  size_t i, j, m;
+  const char *name;
+
+  
+  for (tp->hs = 64; tp->hs < tp->rc * 2; tp->hs *= 2)
+    ;
+  m = tp->hs - 1;
+  
+  tp->byid = calloc(tp->hs, sizeof(uint32_t));
+  tp->byname = calloc(tp->hs, sizeof(uint32_t));
+  if (!tp->byid || !tp->byname)
+    return -1;
+
+  for (i = 0; i < tp->rc; i++) {
+    for (j = _ident_hash(IDENT_BY_UID, NULL, tp->rv[i].id) & m;
+	 tp->byid[j] && tp->rv[tp->byid[j]-1].id != tp->rv[i].id;
+	 j = (j+1) & m)
+      ;
+    if (!tp->byid[j])
+      tp->byid[j] = (uint32_t) (i+1);
+
+    name = tp->pool + tp->rv[i].noff;
+    for (j = _ident_hash(IDENT_BY_USERNAME, name, 0) & m;
+	 tp->byname[j] && strcmp(tp->pool + tp->rv[tp->byname[j]-1].noff, name) != 0;
+	 j = (j+1) & m)
+      ;
+    if (!tp->byname[j])
+      tp->byname[j] = (uint32_t) (i+1);
+  }
+
+  return 0;
+}
+
+
+static int
+_ident_table_get(IDENT_TABLE *tp,
+		 const char *name,
+		 id_t id,
+		 char *nbuf,
+		 size_t nbufsize,
+		 id_t *idp) {
+  size_t j, m = tp->hs - 1;
+  IDENT_REC *rp = NULL;
+
+  
+  if (name) {
+    for (j = _ident_hash(IDENT_BY_USERNAME, name, 0) & m; tp->byname[j]; j = (j+1) & m)
+      if (strcmp(tp->pool + tp->rv[tp->byname[j]-1].noff, name) == 0) {
+	rp = &tp->rv[tp->byname[j]-1];
+	break;
+      }
+  } else {
+    for (j = _ident_hash(IDENT_BY_UID, NULL, id) & m; tp->byid[j]; j = (j+1) & m)
+      if (tp->rv[tp->byid[j]-1].id == id) {
+	rp = &tp->rv[tp->byid[j]-1];
+	break;
+      }
+  }
+
+  if (!rp)
+    return 0;
+
+  if (nbuf && !name && s_cpy(nbuf, nbufsize, tp->pool + rp->noff) < 0)
+    return -1;
+  if (idp)
+    *idp = rp->id;
+  
+  return 1;
+}
+
+
+/* Enumerate the passwd or group database via NSS */
+static int
+_ident_table_enumerate(IDENT_TABLE *tp,
+		       int groups) {
+  struct passwd *pp;
+  struct group *gp;
+  int rc = 0;
+
+  
+  errno = 0;
+  if (groups) {
+    setgrent();
+    while (rc >= 0 && (gp = getgrent()) != NULL)
+      rc = _ident_table_add(tp, gp->gr_name, strlen(gp->gr_name), gp->gr_gid);
+    endgrent();
+  } else {
+    setpwent();
+    while (rc >= 0 && (pp = getpwent()) != NULL)
+      rc = _ident_table_add(tp, pp->pw_name, strlen(pp->pw_name), pp->pw_uid);
+    endpwent();
+  }
+
+  return rc < 0 ? -1 : 0;
+}
+
+
+/*
+ * Load a passwd or group format file ("name:password:id:...").
+ * Comment lines and NIS compat (+/-) lines are ignored.
+ */
+static int
+_ident_table_load(IDENT_TABLE *tp,
+		  const char *path) {
+  int fd, rc = 0;
+  struct stat sb;
+  const char *buf, *cp, *end, *eol, *nend, *vp;
+  unsigned long v;
+
+  
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (sb.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    return -1;
+  
+  end = buf + sb.st_size;
+  for (cp = buf; rc >= 0 && cp < end; cp = eol+1) {
+    eol = memchr(cp, '\n', end-cp);
+    if (!eol)
+      eol = end;
+    
+    if (cp == eol || *cp == '#' || *cp == '+' || *cp == '-')
+      continue;
+
+    nend = memchr(cp, ':', eol-cp);
+    if (!nend)
+      continue;
+    
+    /* Skip the password field */
+    vp = memchr(nend+1, ':', eol-(nend+1));
+    if (!vp || ++vp >= eol || !isdigit((unsigned char) *vp))
+      continue;
+
+    /* The mapping is not NUL terminated, so no strtoul() here */
+    for (v = 0; vp < eol && isdigit((unsigned char) *vp); vp++)
+      v = v*10 + (*vp - '0');
+    if (vp < eol && *vp != ':')
+      continue;
+    
+    rc = _ident_table_add(tp, cp, nend-cp, (id_t) v);
+  }
+
+  munmap((void *) buf, sb.st_size);
+  return rc < 0 ? -1 : 0;
+}
+
+
+int
+ident_preload(const char *passwd_path,
+	      const char *group_path) {
+  IDENT_TABLE *tv[2];
+  const char *pv[2];
+  int i;
+
+  
+  pv[0] = passwd_path;
+  pv[1] = group_path;
+  
+  for (i = 0; i < 2; i++) {
+    tv[i] = calloc(1, sizeof(IDENT_TABLE));
+    if (!tv[i])
+      goto Fail;
+    
+    if ((pv[i] ? _ident_table_load(tv[i], pv[i]) : _ident_table_enumerate(tv[i], i)) < 0 ||
+	_ident_table_index(tv[i]) < 0)
+      goto Fail;
+  }
+
+  /* Only replaced from the main thread before any workers are started */
+  for (i = 0; i < 2; i++)
+    _ident_table_free(__atomic_exchange_n(&ident_preloaded[i], tv[i], __ATOMIC_ACQ_REL));
+  
+  return 0;
+
+ Fail:
+  while (i >= 0)
+    _ident_table_free(tv[i--]);
+  return -1;
+}
+
+
+int
+ident_preload_get_counts(size_t *usersp,
+			 size_t *groupsp) {
+  IDENT_TABLE *tp;
+
+  
+  tp = __atomic_load_n(&ident_preloaded[0], __ATOMIC_ACQUIRE);
+  if (usersp)
+    *usersp = tp ? tp->rc : 0;
+  
+  tp = __atomic_load_n(&ident_preloaded[1], __ATOMIC_ACQUIRE);
+  if (groupsp)
+    *groupsp = tp ? tp->rc : 0;
+  
+  return tp ? 1 : 0;
+}
+
+
+/*
+ * Persistent cache file, shared between processes.
+ *
+ * An 8 byte header followed by an append-only log of fixed-size record
+ * headers plus the name. Every new NSS answer is appended with a single
+ * O_APPEND write() so concurrent processes can add to it without
+ * locking. At open time the file is mapped and all still valid records
+ * are loaded into the in-memory cache (later records override earlier).
+ * Records that fail the checksum (e.g. a torn write) are skipped. When
+ * the file grows too large it is compacted in place (under an exclusive
+ * flock()), so other processes that have it open keep appending to it.
+ */
+#define IDENT_FILE_MAGIC     "IDCACHE1"
+#define IDENT_FILE_RECMAGIC  0x49444331U
+#define IDENT_FILE_MAXSIZE   (8*1024*1024)
+
+typedef struct ident_frec {
+  uint32_t magic;
+  uint32_t sum;      /* FNV-1a of the rest of the header and the name */
+  uint8_t k;
+  uint8_t found;
+  uint16_t nlen;
+  uint32_t id;
+  int64_t when;
+} IDENT_FREC;
+
+static int ident_file_fd = -1;
+
+
+
+static uint32_t
+_ident_frec_sum(const IDENT_FREC *rp,
+		const char *name) {
+  const unsigned char *cp;
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  
+  cp = (const unsigned char *) &rp->k;
+  for (i = 0; i < sizeof(*rp) - offsetof(IDENT_FREC, k); i++) {
+    h ^= cp[i];
+    h *= 16777619U;
+  }
+  for (i = 0; i < rp->nlen; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619U;
+  }
+  
+  return h;
+}
+
+
+static ssize_t
+_ident_frec_build(char *buf,
+		  size_t bufsize,
+		  IDENT_KEY k,
+		  const char *name,
+		  id_t id,
+		  int found,
+		  time_t when) {
+  IDENT_FREC r;
+  size_t len;
+
+  
+  len = name ? strlen(name) : 0;
+  if (len > UINT16_MAX || sizeof(r) + len > bufsize)
+    return -1;
+  
+  memset(&r, 0, sizeof(r));
+  r.magic = IDENT_FILE_RECMAGIC;
+  r.k = (uint8_t) k;
+  r.found = (uint8_t) found;
+  r.nlen = (uint16_t) len;
+  r.id = (uint32_t) id;
+  r.when = (int64_t) when;
+  r.sum = _ident_frec_sum(&r, name);
+  
+  memcpy(buf, &r, sizeof(r));
+  if (len)
+    memcpy(buf+sizeof(r), name, len);
+  
+  return sizeof(r) + len;
+}
+
+
+static void
+_ident_file_append(IDENT_KEY k,
+		   const char *name,
+		   id_t id,
+		   int found,
+		   const char *rname,
+		   id_t rid,
+		   time_t when) {
+  char buf[sizeof(IDENT_FREC) + 1024];
+  ssize_t len;
+  int fd;
+
+  
+  fd = __atomic_load_n(&ident_file_fd, __ATOMIC_ACQUIRE);
+  if (fd < 0)
+    return;
+
+  /* Name lookups store the key name, id lookups the resulting name */
+  len = _ident_frec_build(buf, sizeof(buf), k,
+			  name ? name : (found ? rname : NULL),
+			  name ? rid : id,
+			  found, when);
+  if (len > 0)
+    (void) write(fd, buf, len);
+}
+
+
+/* Walk the records of a mapped file, calling 'fun' for each valid one */
+static int
+_ident_file_foreach(const char *buf,
+		    size_t size,
+		    int (*fun)(const IDENT_FREC *rp, const char *name, void *xp),
+		    void *xp) {
+  IDENT_FREC r;
+  size_t off;
+  int n = 0;
+
+  
+  off = sizeof(IDENT_FILE_MAGIC)-1;
+  while (off + sizeof(r) <= size) {
+    memcpy(&r, buf+off, sizeof(r));
+    if (r.magic != IDENT_FILE_RECMAGIC || off + sizeof(r) + r.nlen > size ||
+	r.k > IDENT_BY_GROUPNAME) {
+      /* Garbage - records are not aligned, so resync byte by byte */
+      ++off;
+      continue;
+    }
+    
+    if (_ident_frec_sum(&r, buf+off+sizeof(r)) == r.sum) {
+      int rc = fun(&r, buf+off+sizeof(r), xp);
+
+      if (rc < 0)
+	return -1;
+      if (rc > 0)
+	++n;
+      off += sizeof(r) + r.nlen;
+    } else
+      ++off;
+  }
+
+  return n;
+}
+
+
+static int
+_ident_file_load_rec(const IDENT_FREC *rp,
+		     const char *name,
+		     void *xp) {
+  char nbuf[1024];
+  IDENT_KEY k = (IDENT_KEY) rp->k;
+  int byname = (k == IDENT_BY_USERNAME || k == IDENT_BY_GROUPNAME);
+
+  
+  if (rp->nlen >= sizeof(nbuf))
+    return 0;
+  memcpy(nbuf, name, rp->nlen);
+  nbuf[rp->nlen] = '\0';
+
+  if (byname && !rp->nlen)
+    return 0;
+  
+  return _ident_cache_add(k,
+			  byname ? nbuf : NULL,
+			  (id_t) rp->id,
+			  rp->found,
+			  nbuf,
+			  (id_t) rp->id,
+			  (time_t) rp->when);
+}
+
+
+/* Write all live cache entries to a file */
+static int
+_ident_file_dump(int fd) {
+  char buf[sizeof(IDENT_FREC) + 1024];
+  IDENT_ENTRY *ep;
+  IDENT_SHARD *sp;
+  ssize_t len;
+  int i, j, ttl, rc = 0;
+  time_t now = time(NULL);
+  
+
+  for (i = 0; rc == 0 && i < IDENT_CACHE_SHARDS; i++) {
+    sp = &ident_cache[i];
+    
+    pthread_mutex_lock(&sp->mtx);
+    for (j = 0; rc == 0 && j < IDENT_CACHE_BUCKETS; j++)
+      for (ep = sp->bv[j]; rc == 0 && ep; ep = ep->next) {
+	if (ep->found < 0 || ep->expires <= now)
+	  continue;
+	
+	ttl = __atomic_load_n(ep->found ? &ident_cache_ttl : &ident_cache_negative_ttl, __ATOMIC_RELAXED);
+	len = _ident_frec_build(buf, sizeof(buf), ep->k,
+				ep->name[0] ? ep->name : NULL, ep->id,
+				ep->found, ep->expires - ttl);
+	if (len > 0 && write(fd, buf, len) != len)
+	  rc = -1;
+      }
+    pthread_mutex_unlock(&sp->mtx);
+  }
+
+  return rc;
+}
+
+
+/*
+ * Rewrite the file with the current (non-expired) entries. File must be
+ * locked and no longer mapped. It is truncated and refilled instead of
+ * replaced, as other processes may have it open - whatever they append
+ * meanwhile are whole O_APPEND records that stay valid.
+ */
+static int
+_ident_file_compact(int fd) {
+  if (ftruncate(fd, sizeof(IDENT_FILE_MAGIC)-1) < 0)
+    return -1;
+  
+  return _ident_file_dump(fd);
+}
+
+
+int
+ident_cache_file_open(const char *path) {
+  int fd, rc = -1, rdonly = 0;
+  struct stat sb;
+  char *buf = MAP_FAILED;
+  char hbuf[sizeof(IDENT_FILE_MAGIC)-1];
+
+  
+  pthread_once(&ident_cache_once, _ident_cache_init);
+
+  fd = open(path, O_RDWR|O_APPEND|O_CREAT, 0644);
+  if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+    rdonly = 1;
+    fd = open(path, O_RDONLY);
+  }
+  if (fd < 0)
+    return -1;
+
+  if (flock(fd, rdonly ? LOCK_SH : LOCK_EX) < 0)
+    goto End;
+  
+  if (fstat(fd, &sb) < 0)
+    goto End;
+  
+  if (sb.st_size == 0) {
+    if (!rdonly && write(fd, IDENT_FILE_MAGIC, sizeof(hbuf)) != sizeof(hbuf))
+      goto End;
+    rc = 0;
+    goto End;
+  }
+  
+  if (sb.st_size < (off_t) sizeof(hbuf) ||
+      pread(fd, hbuf, sizeof(hbuf), 0) != sizeof(hbuf) ||
+      memcmp(hbuf, IDENT_FILE_MAGIC, sizeof(hbuf)) != 0) {
+    errno = EINVAL;
+    goto End;
+  }
+
+  buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (buf == MAP_FAILED)
+    goto End;
+  
+  rc = _ident_file_foreach(buf, sb.st_size, _ident_file_load_rec, NULL);
+
+  if (rc >= 0 && !rdonly && sb.st_size > IDENT_FILE_MAXSIZE) {
+    munmap(buf, sb.st_size);
+    buf = MAP_FAILED;
+    
+    (void) _ident_file_compact(fd);
+  }
+
+ End:
+  if (buf != MAP_FAILED)
+    munmap(buf, sb.st_size);
+  
+  if (rc < 0 || rdonly) {
+    if (fd >= 0)
+      close(fd);
+    return rc;
+  }
+  
+  flock(fd, LOCK_UN);
+  fd = __atomic_exchange_n(&ident_file_fd, fd, __ATOMIC_ACQ_REL);
+  if (fd >= 0)
+    close(fd);
+  
+  return rc;
+}
+
+
+void
+ident_cache_file_close(void) {
+  int fd;
+
+  
+  fd = __atomic_exchange_n(&ident_file_fd, -1, __ATOMIC_ACQ_REL);
+  if (fd >= 0)
+    close(fd);
+}
+
+
+/*
+ * Cached lookup - same return values as _ident_lookup()
+ */
+static int
+_ident_get(IDENT_KEY k,
+	   const char *name,
+	   id_t id,
+	   char *nbuf,
+	   size_t nbufsize,
+	   id_t *idp) {
+  char rbuf[1024];
+  id_t rid = 0;
+  IDENT_TABLE *tp;
+  time_t now;
+  int rc, claim;
+
+  
+  tp = __atomic_load_n(&ident_preloaded[k == IDENT_BY_GID || k == IDENT_BY_GROUPNAME],
+		       __ATOMIC_ACQUIRE);
+  if (tp)
+    return _ident_table_get(tp, name, id, nbuf, nbufsize, idp);
+  
+  pthread_once(&ident_cache_once, _ident_cache_init);
+  
+  claim = (__atomic_load_n(&ident_cache_ttl, __ATOMIC_RELAXED) > 0 ||
+	   __atomic_load_n(&ident_cache_negative_ttl, __ATOMIC_RELAXED) > 0);
+  
+  rc = _ident_cache_get(k, name, id, nbuf, nbufsize, idp, claim);
+  if (rc == -2)
+    return -1;
+  if (rc >= 0)
+    return rc;
+  
+  __atomic_add_fetch(&ident_cache_stats.misses, 1, __ATOMIC_RELAXED);
+
+  rc = _ident_lookup(k, name, id, name ? NULL : rbuf, sizeof(rbuf), &rid);
+  if (rc >= 0) {
+    now = time(NULL);
+    if (_ident_cache_add(k, name, id, rc, rbuf, rid, now) > 0)
+      _ident_file_append(k, name, id, rc, rbuf, rid, now);
+  }
+  if (claim)
+    _ident_cache_done(k, name, id);
+  if (rc < 0)
+    return rc;
+
+  if (rc > 0) {
+    if (nbuf && !name && s_cpy(nbuf, nbufsize, rbuf) < 0)
+      return -1;
+    if (idp)
+      *idp = rid;
+  }
+  
+  return rc;
+}
+
+
+/*
+ * Resolver pool. Callers that know they will need some names soon (all
+ * principals of a freshly read ACL for example) queue them here and
+ * carry on; a few threads resolve them in the background. A later
+ * ident_*() call for the same key then either finds the answer in the
+ * cache or waits for the lookup in progress.
+ */
+#define IDENT_QUEUE_SIZE  1024
+
+typedef struct ident_req {
+  IDENT_KEY k;
+  id_t id;
+  char *name;
+} IDENT_REQ;
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  IDENT_REQ qv[IDENT_QUEUE_SIZE];
+  unsigned int head, tail;
+  int nwanted;
+  int nrunning;
+} ident_pool = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  { { 0 } },
+  0, 0,
+  IDENT_RESOLVERS_DEFAULT,
+  0
+};
+
+
+
+static void *
+_ident_resolver(void *xp) {
+  IDENT_REQ r;
+
+  
+  pthread_mutex_lock(&ident_pool.mtx);
+  while (1) {
+    while (ident_pool.head == ident_pool.tail)
+      pthread_cond_wait(&ident_pool.cv, &ident_pool.mtx);
+
+    r = ident_pool.qv[ident_pool.tail++ % IDENT_QUEUE_SIZE];
+    pthread_mutex_unlock(&ident_pool.mtx);
+
+    if (!_ident_cache_known(r.k, r.name, r.id))
+      (void) _ident_get(r.k, r.name, r.id, NULL, 0, NULL);
+    free(r.name);
+    
+    pthread_mutex_lock(&ident_pool.mtx);
+  }
+
+  return NULL;
+}
+
+
+/* Queue a lookup. Returns 1 if queued, 0 if not needed (or not possible) */
+static int
+_ident_prefetch(IDENT_KEY k,
+		const char *name,
+		id_t id) {
+  pthread_t tid;
+  pthread_attr_t pa;
+  IDENT_REQ *rp;
+  int rc = 0;
+
+  
+  if (__atomic_load_n(&ident_preloaded[k == IDENT_BY_GID || k == IDENT_BY_GROUPNAME],
+		      __ATOMIC_ACQUIRE))
+    return 0;
+  
+  pthread_once(&ident_cache_once, _ident_cache_init);
+  if (_ident_cache_known(k, name, id))
+    return 0;
+
+  pthread_mutex_lock(&ident_pool.mtx);
+  
+  /* Threads are started on first use */
+  if (ident_pool.nrunning < ident_pool.nwanted) {
+    pthread_attr_init(&pa);
+    pthread_attr_setdetachstate(&pa, PTHREAD_CREATE_DETACHED);
+    while (ident_pool.nrunning < ident_pool.nwanted &&
+	   pthread_create(&tid, &pa, _ident_resolver, NULL) == 0)
+      ident_pool.nrunning++;
+    pthread_attr_destroy(&pa);
+  }
+  
+  if (ident_pool.nwanted > 0 && ident_pool.nrunning > 0 &&
+      ident_pool.head - ident_pool.tail < IDENT_QUEUE_SIZE) {
+    rp = &ident_pool.qv[ident_pool.head % IDENT_QUEUE_SIZE];
+    rp->k = k;
+    rp->id = id;
+    rp->name = NULL;
+    if (!name || (rp->name = strdup(name)) != NULL) {
+      ident_pool.head++;
+      pthread_cond_signal(&ident_pool.cv);
+      __atomic_add_fetch(&ident_cache_stats.prefetches, 1, __ATOMIC_RELAXED);
+      rc = 1;
+    }
+  }
+  
+  pthread_mutex_unlock(&ident_pool.mtx);
+  return rc;
+}
+
+
+void
+ident_set_resolvers(int n) {
+  /* Running threads are never stopped, 0 just disables prefetching */
+  pthread_mutex_lock(&ident_pool.mtx);
+  ident_pool.nwanted = n < 0 ? 0 : n;
+  pthread_mutex_unlock(&ident_pool.mtx);
+}
+
+int
+ident_get_resolvers(void) {
+  int n;
+
+  pthread_mutex_lock(&ident_pool.mtx);
+  n = ident_pool.nwanted;
+  pthread_mutex_unlock(&ident_pool.mtx);
+  
+  return n;
+}
+
+
+int
+ident_prefetch_uid(uid_t uid) {
+  return _ident_prefetch(IDENT_BY_UID, NULL, uid);
+}
+
+int
+ident_prefetch_gid(gid_t gid) {
+  return _ident_prefetch(IDENT_BY_GID, NULL, gid);
+}
+
+int
+ident_prefetch_user(const char *name) {
+  return name ? _ident_prefetch(IDENT_BY_USERNAME, name, 0) : 0;
+}
+
+int
+ident_prefetch_group(const char *name) {
+  return name ? _ident_prefetch(IDENT_BY_GROUPNAME, name, 0) : 0;
+}
+
+
+void
+ident_cache_set_ttl(int ttl,
+		    int negative_ttl) {
+  if (ttl >= 0)
+    __atomic_store_n(&ident_cache_ttl, ttl, __ATOMIC_RELAXED);
+  if (negative_ttl >= 0)
+    __atomic_store_n(&ident_cache_negative_ttl, negative_ttl, __ATOMIC_RELAXED);
+}
+
+void
+ident_cache_get_ttl(int *ttlp,
+		    int *negative_ttlp) {
+  if (ttlp)
+    *ttlp = __atomic_load_n(&ident_cache_ttl, __ATOMIC_RELAXED);
+  if (negative_ttlp)
+    *negative_ttlp = __atomic_load_n(&ident_cache_negative_ttl, __ATOMIC_RELAXED);
+}
+
+void
+ident_cache_get_stats(IDENT_CACHE_STATS *sp) {
+  int i;
+
+  
+  pthread_once(&ident_cache_once, _ident_cache_init);
+  
+  sp->hits          = __atomic_load_n(&ident_cache_stats.hits, __ATOMIC_RELAXED);
+  sp->misses        = __atomic_load_n(&ident_cache_stats.misses, __ATOMIC_RELAXED);
+  sp->negative_hits = __atomic_load_n(&ident_cache_stats.negative_hits, __ATOMIC_RELAXED);
+  sp->expired       = __atomic_load_n(&ident_cache_stats.expired, __ATOMIC_RELAXED);
+  sp->waits         = __atomic_load_n(&ident_cache_stats.waits, __ATOMIC_RELAXED);
+  sp->prefetches    = __atomic_load_n(&ident_cache_stats.prefetches, __ATOMIC_RELAXED);
+  
+  sp->entries = 0;
+  for (i = 0; i < IDENT_CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&ident_cache[i].mtx);
+    sp->entries += ident_cache[i].n;
+    pthread_mutex_unlock(&ident_cache[i].mtx);
+  }
+}
+
+void
+ident_cache_flush(void) {
+  int i;
+
+  
+  pthread_once(&ident_cache_once, _ident_cache_init);
+  
+  for (i = 0; i < IDENT_CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&ident_cache[i].mtx);
+    _ident_shard_purge(&ident_cache[i], 0);
+    pthread_mutex_unlock(&ident_cache[i].mtx);
+  }
+}
+
+
+int
+ident_uid_to_name(uid_t uid,
+		  char *buf,
+		  size_t bufsize) {
+  return _ident_get(IDENT_BY_UID, NULL, uid, buf, bufsize, NULL);
+}
+
+int
+ident_gid_to_name(gid_t gid,
+		  char *buf,
+		  size_t bufsize) {
+  return _ident_get(IDENT_BY_GID, NULL, gid, buf, bufsize, NULL);
+}
+
+int
+ident_name_to_uid(const char *name,
+		  uid_t *uidp) {
+  id_t id;
+  int rc;
+
+  
+  if (!name) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  rc = _ident_get(IDENT_BY_USERNAME, name, 0, NULL, 0, &id);
+  if (rc > 0 && uidp)
+    *uidp = (uid_t) id;
+  
+  return rc;
+}
+
+int
+ident_name_to_gid(const char *name,
+		  gid_t *gidp) {
+  id_t id;
+  int rc;
+
+  
+  if (!name) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  rc = _ident_get(IDENT_BY_GROUPNAME, name, 0, NULL, 0, &id);
+  if (rc > 0 && gidp)
+    *gidp = (gid_t) id;
+  
+  return rc;
+}
@@ -0,0 +1,149 @@
+/*
+ * ident.h - User & group identity lookups
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef IDENT_H
+#define IDENT_H 1
+
+#include <sys/types.h>
+
+/*
+ * Reentrant user & group lookups.
+ *
+ * All functions return 1 if found, 0 if not found and -1 (with errno set)
+ * if the lookup failed.
+ */
+
+extern int
+ident_uid_to_name(uid_t uid,
+		  char *buf,
+		  size_t bufsize);
+
+extern int
+ident_gid_to_name(gid_t gid,
+		  char *buf,
+		  size_t bufsize);
+
+extern int
+ident_name_to_uid(const char *name,
+		  uid_t *uidp);
+
+extern int
+ident_name_to_gid(const char *name,
+		  gid_t *gidp);
+
+
+/*
+ * All lookups are cached (positive and negative answers)
+ */
+#define IDENT_CACHE_TTL_DEFAULT          600
+#define IDENT_CACHE_NEGATIVE_TTL_DEFAULT 60
+
+typedef struct ident_cache_stats {
+  unsigned long long hits;
+  unsigned long long negative_hits;
+  unsigned long long misses;
+  unsigned long long expired;
+  unsigned long long waits;         /* Waited for another thread's lookup */
+  unsigned long long prefetches;    /* Queued to the resolver threads */
+  unsigned long long entries;
+} IDENT_CACHE_STATS;
+
+/* A TTL of 0 disables caching, < 0 leaves it unchanged */
+extern void
+ident_cache_set_ttl(int ttl,
+		    int negative_ttl);
+
+extern void
+ident_cache_get_ttl(int *ttlp,
+		    int *negative_ttlp);
+
+extern void
+ident_cache_get_stats(IDENT_CACHE_STATS *sp);
+
+extern void
+ident_cache_flush(void);
+
+/*
+ * Load the cache from (and append new answers to) a file that may be
+ * shared with other processes. Returns the number of entries loaded.
+ */
+extern int
+ident_cache_file_open(const char *path);
+
+extern void
+ident_cache_file_close(void);
+
+
+/*
+ * Background resolvers. The prefetch functions queue a lookup (if not
+ * already cached) and return immediately; a later lookup of the same
+ * key waits for the answer if it is still in progress.
+ */
+#define IDENT_RESOLVERS_DEFAULT 4
+
+extern void
+ident_set_resolvers(int n);
+
+extern int
+ident_get_resolvers(void);
+
+extern int
+ident_prefetch_uid(uid_t uid);
+
+extern int
+ident_prefetch_gid(gid_t gid);
+
+extern int
+ident_prefetch_user(const char *name);
+
+extern int
+ident_prefetch_group(const char *name);
+
+
+/*
+ * Load the complete user & group databases into memory, either from
+ * "getent passwd"/"getent group" style files or (for a NULL path) by
+ * enumerating them via NSS. After this all lookups are served from
+ * the loaded tables only.
+ */
+extern int
+ident_preload(const char *passwd_path,
+	      const char *group_path);
+
+/* Returns 1 if preloaded, 0 if not */
+extern int
+ident_preload_get_counts(size_t *usersp,
+			 size_t *groupsp);
+
+#endif
@@ -47,6 +47,8 @@
 #include <termios.h>
 
 #include "acltool.h"
+#include "ident.h"
+#include "progress.h"
 
 #define NEW(vp) ((vp) = malloc(sizeof(*(vp))))
 
@@ -190,7 +192,7 @@ char *
 permset2str(gacl_permset_t psp,
 	    char *buf,
 	    size_t bufsize) {
-  static char sbuf[64];
+  static THREAD_LOCAL char sbuf[64];
   int i, a;
 
   
@@ -217,7 +219,7 @@ static char *
 permset2str_samba(gacl_permset_t psp,
 		  char *buf,
 		  size_t bufsize) {
-  static char sbuf[64];
+  static THREAD_LOCAL char sbuf[64];
   int i, a, n;
 
   
@@ -249,7 +251,7 @@ static char *
 permset2str_icacls(gacl_permset_t psp,
 		   char *buf,
 		   size_t bufsize) {
-  static char sbuf[64];
+  static THREAD_LOCAL char sbuf[64];
   int i, a, n;
 
   
@@ -284,7 +286,7 @@ char *
 flagset2str(gacl_flagset_t fsp,
 	    char *buf,
 	    size_t bufsize) {
-  static char sbuf[64];
+  static THREAD_LOCAL char sbuf[64];
   int i, a;
 
   
@@ -312,7 +314,7 @@ static char *
 flagset2str_samba(gacl_flagset_t fsp,
 		  char *buf,
 		  size_t bufsize) {
-  static char sbuf[64];
+  static THREAD_LOCAL char sbuf[64];
   int i, a, n;
 
   
@@ -344,7 +346,7 @@ static char *
 flagset2str_icacls(gacl_flagset_t fsp,
 		   char *buf,
 		   size_t bufsize) {
-  static char sbuf[64];
+  static THREAD_LOCAL char sbuf[64];
   int i, a;
 
   
@@ -400,15 +402,14 @@ ace2str_samba(gacl_entry_t ae,
 	      char *rbuf,
 	      size_t rsize,
 	      const struct stat *sp) {
-  static char buf[256];
+  static THREAD_LOCAL char buf[256];
   char *res;
   gacl_tag_t at;
   gacl_permset_t aps;
   gacl_flagset_t afs;
   gacl_entry_type_t aet;
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  char nbuf[256];
   int rc;
   
 
@@ -428,13 +429,12 @@ ace2str_samba(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp) {
-      gp = getgrnam(pp->pw_name);
-      rc = snprintf(res, rsize, "ACL:%s%s:", pp->pw_name, gp ? "(user)" : "");
+    if (ident_uid_to_name(*(uid_t *) qp, nbuf, sizeof(nbuf)) > 0) {
+      int gf = (ident_name_to_gid(nbuf, NULL) > 0);
+      rc = snprintf(res, rsize, "ACL:%s%s:", nbuf, gf ? "(user)" : "");
     } else {
-      gp = getgrgid(*(gid_t *) qp);
-      rc = snprintf(res, rsize, "ACL:%u%s:", * (uid_t *) qp, gp ? "(user)" : "");
+      int gf = (ident_gid_to_name(*(gid_t *) qp, NULL, 0) > 0);
+      rc = snprintf(res, rsize, "ACL:%u%s:", * (uid_t *) qp, gf ? "(user)" : "");
     }
     gacl_free(qp);
     break;
@@ -444,32 +444,29 @@ ace2str_samba(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp) { 
-      pp = getpwnam(gp->gr_name);
-      rc = snprintf(res, rsize, "ACL:%s%s:", gp->gr_name, pp ? "(group)" : "");
+    if (ident_gid_to_name(*(gid_t *) qp, nbuf, sizeof(nbuf)) > 0) { 
+      int pf = (ident_name_to_uid(nbuf, NULL) > 0);
+      rc = snprintf(res, rsize, "ACL:%s%s:", nbuf, pf ? "(group)" : "");
     } else {
-      pp = getpwuid(*(uid_t *) qp);
-      rc = snprintf(res, rsize, "ACL:%u%s:", * (gid_t *) qp, pp ? "(group)" : "");
+      int pf = (ident_uid_to_name(*(uid_t *) qp, NULL, 0) > 0);
+      rc = snprintf(res, rsize, "ACL:%u%s:", * (gid_t *) qp, pf ? "(group)" : "");
     }
     gacl_free(qp);
     break;
     
   case GACL_TAG_TYPE_USER_OBJ:
-    pp = getpwuid(sp->st_uid);
-    if (pp)
-      rc = snprintf(res, rsize, "ACL:%s:", pp->pw_name);
+    if (ident_uid_to_name(sp->st_uid, nbuf, sizeof(nbuf)) > 0)
+      rc = snprintf(res, rsize, "ACL:%s:", nbuf);
     else
       rc = snprintf(res, rsize, "ACL:%u:", sp->st_uid);
     break;
     
   case GACL_TAG_TYPE_GROUP_OBJ:
-    gp = getgrgid(sp->st_gid);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "ACL:GROUP=%s:", gp->gr_name);
+    if (ident_gid_to_name(sp->st_gid, nbuf, sizeof(nbuf)) > 0) {
+      if (ident_name_to_uid(nbuf, NULL) > 0)
+	rc = snprintf(res, rsize, "ACL:GROUP=%s:", nbuf);
       else
-	rc = snprintf(res, rsize, "ACL:%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "ACL:%s:", nbuf);
     } else
       rc = snprintf(res, rsize, "ACL:GID=%u:", sp->st_gid);
     break;
@@ -561,7 +558,7 @@ ace2str_icacls(gacl_entry_t ae,
 	      char *rbuf,
 	      size_t rsize,
 	      const struct stat *sp) {
-  static char buf[256];
+  static THREAD_LOCAL char buf[256];
   char *res;
   gacl_tag_t at;
   gacl_permset_t aps;
@@ -570,8 +567,7 @@ ace2str_icacls(gacl_entry_t ae,
   gacl_entry_type_t aet;
 #endif
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  char nbuf[256];
   int rc;
   
 
@@ -591,9 +587,8 @@ ace2str_icacls(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp)
-      rc = snprintf(res, rsize, "%s:", pp->pw_name);
+    if (ident_uid_to_name(*(uid_t *) qp, nbuf, sizeof(nbuf)) > 0)
+      rc = snprintf(res, rsize, "%s:", nbuf);
     else
       rc = snprintf(res, rsize, "%u:", * (uid_t *) qp);
     gacl_free(qp);
@@ -604,32 +599,29 @@ ace2str_icacls(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "GROUP=%s:", gp->gr_name);
+    if (ident_gid_to_name(*(gid_t *) qp, nbuf, sizeof(nbuf)) > 0) {
+      if (ident_name_to_uid(nbuf, NULL) > 0)
+	rc = snprintf(res, rsize, "GROUP=%s:", nbuf);
       else
-	rc = snprintf(res, rsize, "%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "%s:", nbuf);
     } else
       rc = snprintf(res, rsize, "GID=%u:", * (gid_t *) qp);
     gacl_free(qp);
     break;
     
   case GACL_TAG_TYPE_USER_OBJ:
-    pp = getpwuid(sp->st_uid);
-    if (pp)
-      rc = snprintf(res, rsize, "%s:", pp->pw_name);
+    if (ident_uid_to_name(sp->st_uid, nbuf, sizeof(nbuf)) > 0)
+      rc = snprintf(res, rsize, "%s:", nbuf);
     else
       rc = snprintf(res, rsize, "%u:", sp->st_uid);
     break;
     
   case GACL_TAG_TYPE_GROUP_OBJ:
-    gp = getgrgid(sp->st_gid);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "GROUP=%s:", gp->gr_name);
+    if (ident_gid_to_name(sp->st_gid, nbuf, sizeof(nbuf)) > 0) {
+      if (ident_name_to_uid(nbuf, NULL) > 0)
+	rc = snprintf(res, rsize, "GROUP=%s:", nbuf);
       else
-	rc = snprintf(res, rsize, "%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "%s:", nbuf);
     } else
       rc = snprintf(res, rsize, "GID=%u:", sp->st_gid);
     break;
@@ -709,15 +701,14 @@ char *
 ace2str(gacl_entry_t ae,
 	char *rbuf,
 	size_t rsize) {
-  static char buf[256];
+  static THREAD_LOCAL char buf[256];
   char *res;
   gacl_tag_t at;
   gacl_permset_t aps;
   gacl_flagset_t afs;
   gacl_entry_type_t aet;
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  char nbuf[256];
   int rc;
   
 
@@ -737,9 +728,8 @@ ace2str(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp)
-      rc = snprintf(res, rsize, "u:%s", pp->pw_name);
+    if (ident_uid_to_name(*(uid_t *) qp, nbuf, sizeof(nbuf)) > 0)
+      rc = snprintf(res, rsize, "u:%s", nbuf);
     else
       rc = snprintf(res, rsize, "u:%u", * (uid_t *) qp);
     gacl_free(qp);
@@ -750,9 +740,8 @@ ace2str(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp)
-      rc = snprintf(res, rsize, "g:%s", gp->gr_name);
+    if (ident_gid_to_name(*(gid_t *) qp, nbuf, sizeof(nbuf)) > 0)
+      rc = snprintf(res, rsize, "g:%s", nbuf);
     else
       rc = snprintf(res, rsize, "g:%u", * (gid_t *) qp);
     gacl_free(qp);
@@ -885,6 +874,10 @@ _ft_foreach(const char *path,
   size_t plen;
 
   
+  progress_add(PROGRESS_VISITED, 1);
+  if (S_ISREG(stat->st_mode))
+    progress_add(PROGRESS_BYTES, stat->st_size);
+  
   if (!filetypes || (stat->st_mode & filetypes))
     rc = walker(path, stat, 0, curlevel, vp);
   else
@@ -904,6 +897,10 @@ _ft_foreach(const char *path,
   if (!dp)
     return -1;
   
+  progress_add(PROGRESS_DIRS_READ, 1);
+  if (curlevel > 1)
+    progress_add(PROGRESS_SUBDIRS_READ, 1);
+  
   while ((dep = vfs_readdir(dp)) != NULL) {
     char *fpath;
 
@@ -924,10 +921,15 @@ _ft_foreach(const char *path,
       goto End;
     }
 
+    progress_add(PROGRESS_FOUND, 1);
+    
     /* Add to queue if directory */
     if (S_ISDIR(sb.st_mode)) {
       FTDCB *ftdcb;
 
+      /* Only those that will be read count towards the estimated size */
+      if (curlevel != maxlevel)
+	progress_add(PROGRESS_DIRS_FOUND, 1);
 
       if (NEW(ftdcb) == NULL) {
 	rc = -1;
@@ -943,6 +945,10 @@ _ft_foreach(const char *path,
       ftcb.lastp = &ftdcb->next;
     }
     else {
+      progress_add(PROGRESS_VISITED, 1);
+      if (S_ISREG(sb.st_mode))
+	progress_add(PROGRESS_BYTES, sb.st_size);
+      
       if (!filetypes || (sb.st_mode & filetypes))
 	rc = walker(fpath, &sb, 0, curlevel, vp);
       else
@@ -985,6 +991,7 @@ ft_foreach(const char *path,
   if (vfs_lstat(path, &stat) < 0)
     return -1;
   
+  progress_add(PROGRESS_ROOTS, 1);
   return _ft_foreach(path, &stat, walker, vp, 0, maxlevel, filetypes);
 }
 
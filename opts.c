@@ -32,6 +32,8 @@
  */
 
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -58,11 +60,17 @@ opts_print(FILE *fp,
   optlist = opts;
   while (optlist) {
     for (i = 0; optlist[i].name; i++)
-      fprintf(fp, "  -%c / --%-10s\t%s\t%s\n",
-	      optlist[i].flag,
-	      optlist[i].name,
-	      "-",
-	      optlist[i].help);
+      if (optlist[i].flag)
+	fprintf(fp, "  -%c / --%-10s\t%s\t%s\n",
+		optlist[i].flag,
+		optlist[i].name,
+		"-",
+		optlist[i].help);
+      else
+	fprintf(fp, "       --%-10s\t%s\t%s\n",
+		optlist[i].name,
+		"-",
+		optlist[i].help);
     optlist = va_arg(ap, OPTION *);
   }
   va_end(ap);
@@ -181,24 +189,38 @@ opts_parse_argv(int argc,
       optlist = opts;
       while (optlist) {
 	for (k = 0; optlist[k].name; k++) {
+	  if (optlist[k].name && strcmp(name, optlist[k].name) == 0) {
+	    /* Exact match - always wins over abbreviations */
+	    op = &optlist[k];
+	    nm = 1;
+	    break;
+	  }
 	  if (optlist[k].name && s_match(name, optlist[k].name)) {
 	    op = &optlist[k];
 	    ++nm;
 	  }
 	}
 
+	if (optlist[k].name)
+	  break;
+	
 	optlist = va_arg(ap, OPTION *);
       }
       va_end(ap);
-      free(name);
 
-      if (nm < 1 || !op)
+      if (nm < 1 || !op) {
+	free(name);
 	return error(1, 0, "%s: Invalid option", argv[i]);
+      }
 
-      if (nm > 1)
+      if (nm > 1) {
+	free(name);
 	return error(-1, 0, "%s: Multiple options matches", argv[i]);
+      }
 
+      /* 'value' points into 'name' */
       rc = opts_set_value(op, value, argv[0]);
+      free(name);
       if (rc != 0)
 	return rc;
 	
@@ -303,7 +325,13 @@ opts_set2(OPTION *opts,
   nm = 0;
   op = NULL;
   for (k = 0; opts[k].name; k++) {
-    if (opts[k].name && s_match(name, opts[k].name)) {
+    if (strcmp(name, opts[k].name) == 0) {
+      /* Exact match wins over abbreviations */
+      op = &opts[k];
+      nm = 1;
+      break;
+    }
+    if (s_match(name, opts[k].name)) {
       op = &opts[k];
       ++nm;
     }
@@ -0,0 +1,347 @@
+/*
+ * progress.c - Progress & throughput reporting
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "progress.h"
+
+
+THREAD_LOCAL PROGRESS_BLOCK *progress_tb = NULL;
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  pthread_once_t once;
+  pthread_key_t key;
+  PROGRESS_BLOCK *blocks;
+  unsigned long long retired[PROGRESS_NCOUNTERS];
+  
+  pthread_t tid;
+  int running;
+  int stop;
+  int interval;
+  char *argv0;			/* error_argv0 is per thread */
+  struct timespec t0;		/* Start of this run */
+  struct timespec tl;		/* Last report */
+  unsigned long long v0[PROGRESS_NCOUNTERS];
+  unsigned long long vl[PROGRESS_NCOUNTERS];
+  struct sigaction osa_usr1;
+#ifdef SIGINFO
+  struct sigaction osa_info;
+#endif
+} progress = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_ONCE_INIT,
+};
+
+static volatile sig_atomic_t progress_signalled = 0;
+
+
+
+/* Thread exit - keep the counts but make the block available for reuse */
+static void
+_progress_release(void *vp) {
+  PROGRESS_BLOCK *pb = (PROGRESS_BLOCK *) vp;
+  int i;
+
+  
+  pthread_mutex_lock(&progress.mtx);
+  for (i = 0; i < PROGRESS_NCOUNTERS; i++) {
+    progress.retired[i] += pb->v[i];
+    pb->v[i] = 0;
+  }
+  pb->inuse = 0;
+  pthread_mutex_unlock(&progress.mtx);
+}
+
+static void
+_progress_init(void) {
+  pthread_key_create(&progress.key, _progress_release);
+}
+
+
+PROGRESS_BLOCK *
+progress_self(void) {
+  PROGRESS_BLOCK *pb;
+  
+
+  pthread_once(&progress.once, _progress_init);
+  
+  pthread_mutex_lock(&progress.mtx);
+  for (pb = progress.blocks; pb && pb->inuse; pb = pb->next)
+    ;
+  if (!pb) {
+    pb = calloc(1, sizeof(*pb));
+    if (pb) {
+      pb->next = progress.blocks;
+      progress.blocks = pb;
+    }
+  }
+  if (pb)
+    pb->inuse = 1;
+  pthread_mutex_unlock(&progress.mtx);
+
+  if (pb)
+    pthread_setspecific(progress.key, pb);
+  
+  progress_tb = pb;
+  return pb;
+}
+
+
+/* Sum up the counters of all threads. Called with the mutex held */
+static void
+_progress_get(unsigned long long *v) {
+  PROGRESS_BLOCK *pb;
+  int i;
+
+  
+  for (i = 0; i < PROGRESS_NCOUNTERS; i++)
+    v[i] = progress.retired[i];
+  
+  for (pb = progress.blocks; pb; pb = pb->next)
+    for (i = 0; i < PROGRESS_NCOUNTERS; i++)
+      v[i] += __atomic_load_n(&pb->v[i], __ATOMIC_RELAXED);
+}
+
+void
+progress_get(unsigned long long *v) {
+  pthread_mutex_lock(&progress.mtx);
+  _progress_get(v);
+  pthread_mutex_unlock(&progress.mtx);
+}
+
+
+static double
+_ts_diff(const struct timespec *a,
+	 const struct timespec *b) {
+  return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1000000000.0;
+}
+
+static const char *
+_size2str(unsigned long long b,
+	  char *buf,
+	  size_t bufsize) {
+  static const char *unit[] = { "B", "KB", "MB", "GB", "TB", "PB", NULL };
+  double d = b;
+  int i;
+
+  
+  for (i = 0; d >= 1024 && unit[i+1]; i++)
+    d /= 1024;
+
+  if (i == 0)
+    snprintf(buf, bufsize, "%llu B", b);
+  else
+    snprintf(buf, bufsize, "%.1f %s", d, unit[i]);
+  return buf;
+}
+
+
+/*
+ * Print one report line. The ETA extrapolates the size of the parts of
+ * the tree not read yet from the average number of entries in the
+ * directories read so far. Called with the mutex held.
+ */
+static void
+_progress_report(int final) {
+  unsigned long long v[PROGRESS_NCOUNTERS], d[PROGRESS_NCOUNTERS];
+  struct timespec now;
+  double t, tl, rate, avg, left;
+  unsigned long long pdirs;
+  char sbuf[32], ebuf[64];
+  int i;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  _progress_get(v);
+  for (i = 0; i < PROGRESS_NCOUNTERS; i++)
+    d[i] = v[i] - progress.v0[i];
+
+  t = _ts_diff(&now, &progress.t0);
+  tl = _ts_diff(&now, &progress.tl);
+
+  if (final)
+    rate = t > 0 ? d[PROGRESS_VISITED] / t : 0;
+  else
+    rate = tl > 0 ? (v[PROGRESS_VISITED] - progress.vl[PROGRESS_VISITED]) / tl : 0;
+
+  ebuf[0] = '\0';
+  if (final)
+    snprintf(ebuf, sizeof(ebuf), " in %.1fs", t);
+  else if (d[PROGRESS_DIRS_READ] > 0 && d[PROGRESS_VISITED] > 0 && t > 0) {
+    avg = (double) d[PROGRESS_FOUND] / d[PROGRESS_DIRS_READ];
+    pdirs = d[PROGRESS_DIRS_FOUND] > d[PROGRESS_SUBDIRS_READ] ?
+      d[PROGRESS_DIRS_FOUND] - d[PROGRESS_SUBDIRS_READ] : 0;
+    left = d[PROGRESS_ROOTS] + d[PROGRESS_FOUND];
+    left = (left > d[PROGRESS_VISITED] ? left - d[PROGRESS_VISITED] : 0) + pdirs * avg;
+    
+    i = (int) (left * t / d[PROGRESS_VISITED]);
+    snprintf(ebuf, sizeof(ebuf), ", ~%d%% done, ETA %d:%02d:%02d",
+	     (int) (100 * d[PROGRESS_VISITED] / (d[PROGRESS_VISITED] + left)),
+	     i / 3600, (i / 60) % 60, i % 60);
+  }
+
+  fprintf(stderr, "%s%s%llu objects (%.0f/s), %llu ACLs read, %llu written, %llu unchanged, %s, %llu errors%s\n",
+	  progress.argv0 ? progress.argv0 : "",
+	  progress.argv0 ? ": " : "",
+	  d[PROGRESS_VISITED], rate,
+	  d[PROGRESS_READ], d[PROGRESS_WRITTEN], d[PROGRESS_SKIPPED],
+	  _size2str(d[PROGRESS_BYTES], sbuf, sizeof(sbuf)),
+	  d[PROGRESS_ERRORS],
+	  ebuf);
+
+  progress.tl = now;
+  memcpy(progress.vl, v, sizeof(v));
+}
+
+
+static void
+_progress_signal(int sig) {
+  progress_signalled = 1;
+}
+
+/* Reporter thread - wakes up a few times per second to check for signals */
+static void *
+_progress_reporter(void *vp) {
+  struct timespec now, next, wake;
+
+  
+  pthread_mutex_lock(&progress.mtx);
+  clock_gettime(CLOCK_REALTIME, &next);
+  next.tv_sec += progress.interval;
+  
+  while (!progress.stop) {
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_nsec += 250000000;
+    if (wake.tv_nsec >= 1000000000) {
+      wake.tv_sec++;
+      wake.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&progress.cv, &progress.mtx, &wake);
+    if (progress.stop)
+      break;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (progress_signalled ||
+	(progress.interval > 0 && _ts_diff(&now, &next) >= 0)) {
+      progress_signalled = 0;
+      _progress_report(0);
+      next = now;
+      next.tv_sec += progress.interval;
+    }
+  }
+  
+  pthread_mutex_unlock(&progress.mtx);
+  return NULL;
+}
+
+
+int
+progress_start(int interval) {
+  struct sigaction sa;
+  
+
+  pthread_mutex_lock(&progress.mtx);
+  if (progress.running) {
+    pthread_mutex_unlock(&progress.mtx);
+    errno = EBUSY;
+    return -1;
+  }
+  
+  progress.interval = interval;
+  progress.argv0 = error_argv0;
+  progress.stop = 0;
+  clock_gettime(CLOCK_MONOTONIC, &progress.t0);
+  progress.tl = progress.t0;
+  _progress_get(progress.v0);
+  memcpy(progress.vl, progress.v0, sizeof(progress.v0));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = _progress_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, &progress.osa_usr1);
+#ifdef SIGINFO
+  sigaction(SIGINFO, &sa, &progress.osa_info);
+#endif
+  
+  if (pthread_create(&progress.tid, NULL, _progress_reporter, NULL) != 0) {
+    sigaction(SIGUSR1, &progress.osa_usr1, NULL);
+#ifdef SIGINFO
+    sigaction(SIGINFO, &progress.osa_info, NULL);
+#endif
+    pthread_mutex_unlock(&progress.mtx);
+    return -1;
+  }
+  
+  progress.running = 1;
+  pthread_mutex_unlock(&progress.mtx);
+  return 0;
+}
+
+
+void
+progress_stop(void) {
+  pthread_mutex_lock(&progress.mtx);
+  if (!progress.running) {
+    pthread_mutex_unlock(&progress.mtx);
+    return;
+  }
+  
+  progress.stop = 1;
+  pthread_cond_signal(&progress.cv);
+  pthread_mutex_unlock(&progress.mtx);
+  
+  pthread_join(progress.tid, NULL);
+
+  pthread_mutex_lock(&progress.mtx);
+  sigaction(SIGUSR1, &progress.osa_usr1, NULL);
+#ifdef SIGINFO
+  sigaction(SIGINFO, &progress.osa_info, NULL);
+#endif
+  progress.running = 0;
+  _progress_report(1);
+  pthread_mutex_unlock(&progress.mtx);
+}
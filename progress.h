@@ -0,0 +1,91 @@
+/*
+ * progress.h - Progress & throughput reporting
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H 1
+
+/*
+ * Counters are kept per thread (so updating them is just an add to
+ * thread-local memory) and summed up by the reporter when needed.
+ */
+#define PROGRESS_INTERVAL_DEFAULT 10
+
+typedef enum progress_counter {
+  PROGRESS_ROOTS = 0,		/* Objects given on the command line */
+  PROGRESS_FOUND,		/* Directory entries seen */
+  PROGRESS_DIRS_FOUND,		/* Subdirectories seen */
+  PROGRESS_DIRS_READ,		/* Directories read */
+  PROGRESS_SUBDIRS_READ,	/* Subdirectories read */
+  PROGRESS_VISITED,		/* Objects visited */
+  PROGRESS_BYTES,		/* Size of files visited */
+  PROGRESS_READ,		/* ACLs read */
+  PROGRESS_WRITTEN,		/* ACLs written */
+  PROGRESS_SKIPPED,		/* ACLs not written (unchanged) */
+  PROGRESS_ERRORS,
+  PROGRESS_NCOUNTERS
+} PROGRESS_COUNTER;
+
+typedef struct progress_block {
+  struct progress_block *next;
+  int inuse;
+  unsigned long long v[PROGRESS_NCOUNTERS];
+} PROGRESS_BLOCK;
+
+extern THREAD_LOCAL PROGRESS_BLOCK *progress_tb;
+
+extern PROGRESS_BLOCK *
+progress_self(void);
+
+/* Only the owning thread writes, the reporter just reads */
+#define progress_add(c, n)						\
+  do {									\
+    PROGRESS_BLOCK *_pb = progress_tb ? progress_tb : progress_self();	\
+    if (_pb)								\
+      __atomic_store_n(&_pb->v[c], _pb->v[c] + (n), __ATOMIC_RELAXED);	\
+  } while (0)
+
+extern void
+progress_get(unsigned long long *v);
+
+/*
+ * Start reporting to stderr every 'interval' seconds (and on
+ * SIGUSR1/SIGINFO). An interval of 0 reports on signals only.
+ */
+extern int
+progress_start(int interval);
+
+/* Stop reporting and print a summary */
+extern void
+progress_stop(void);
+
+#endif
@@ -64,10 +64,189 @@ _alloc_range(int p1,
   }
 
   rp->next = NULL;
+  rp->nw = 0;
   return rp;
 }
 
 
+/* Allocate an (empty) bitset range node */
+static RANGE *
+_alloc_bits(int nw) {
+  RANGE *rp = malloc(sizeof(*rp) + nw*sizeof(rp->bv[0]));
+
+  if (!rp)
+    return NULL;
+
+#if RANGE_DEBUG
+  rp->magic = RANGE_MAGIC;
+#endif
+  
+  rp->min = RANGE_NONE;
+  rp->max = RANGE_NONE;
+  rp->next = NULL;
+  rp->nw = nw;
+  memset(rp->bv, 0, nw*sizeof(rp->bv[0]));
+  return rp;
+}
+
+
+static int
+_bits_count(uint64_t w) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(w);
+#else
+  int n = 0;
+
+  while (w) {
+    w &= w-1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+/* Lowest set bit in a (non-zero) word */
+static int
+_bits_lowest(uint64_t w) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(w);
+#else
+  int b = 0;
+
+  while (!(w & 1)) {
+    w >>= 1;
+    ++b;
+  }
+  return b;
+#endif
+}
+
+/* Highest set bit in a (non-zero) word */
+static int
+_bits_highest(uint64_t w) {
+#if defined(__GNUC__)
+  return 63-__builtin_clzll(w);
+#else
+  int b = 63;
+
+  while (!(w >> 63)) {
+    w <<= 1;
+    --b;
+  }
+  return b;
+#endif
+}
+
+/* Set bits lo..hi (inclusive), a word at a time */
+static void
+_bits_set_range(uint64_t *bv,
+		int lo,
+		int hi) {
+  while (lo <= hi) {
+    int i = lo/64;
+    int b = lo%64;
+    int e = (hi/64 == i ? hi%64 : 63);
+
+    if (e-b == 63)
+      bv[i] = ~(uint64_t) 0;
+    else
+      bv[i] |= (((uint64_t) 1 << (e-b+1))-1) << b;
+    lo = i*64+e+1;
+  }
+}
+
+/* Return the next set bit after 'p' (-1 if none) */
+int
+range_bits_next(const uint64_t *bv,
+		int n,
+		int p) {
+  int i, nw = RANGE_BITS_WORDS(n);
+  uint64_t w;
+
+  
+  if (p < 0)
+    p = 0;
+  else if (p >= n-1)
+    return -1;
+  else
+    ++p;
+  
+  i = p/64;
+  w = bv[i] & (~(uint64_t) 0 << (p%64));
+  for (;;) {
+    if (w) {
+      p = i*64 + _bits_lowest(w);
+      return p < n ? p : -1;
+    }
+    if (++i >= nw)
+      return -1;
+    w = bv[i];
+  }
+}
+
+/* Return the previous set bit before 'p' (-1 if none) */
+static int
+_bits_prev(const uint64_t *bv,
+	   int n,
+	   int p) {
+  int i;
+  uint64_t w;
+
+  
+  if (p <= 0)
+    return -1;
+  if (p > n)
+    p = n;
+  --p;
+  
+  i = p/64;
+  w = bv[i];
+  if (p%64 != 63)
+    w &= ((uint64_t) 1 << (p%64+1))-1;
+  for (;;) {
+    if (w)
+      return i*64 + _bits_highest(w);
+    if (--i < 0)
+      return -1;
+    w = bv[i];
+  }
+}
+
+/* Recalculate min & max of a bitset node. Returns 0 if empty */
+static int
+_bits_minmax(RANGE *rp) {
+  rp->min = range_bits_next(rp->bv, rp->nw*64, -1);
+  if (rp->min < 0) {
+    rp->min = rp->max = RANGE_NONE;
+    return 0;
+  }
+  rp->max = _bits_prev(rp->bv, rp->nw*64, rp->nw*64);
+  return 1;
+}
+
+/* Convert a bitset node into a segment list */
+static RANGE *
+_bits_to_list(RANGE *rp) {
+  RANGE *nrp = NULL;
+  int p, q, n = rp->nw*64;
+
+  
+  p = -1;
+  while ((p = range_bits_next(rp->bv, n, p)) >= 0) {
+    for (q = p; q+1 < n && RANGE_BITS_ISSET(rp->bv, q+1); q++)
+      ;
+    if (range_add(&nrp, p, q) < 0) {
+      if (nrp)
+	range_free(&nrp);
+      return NULL;
+    }
+    p = q;
+  }
+
+  return nrp;
+}
+
+
 /* Check in a value is inside a range segment */
 static int
 _in_range(RANGE *rp,
@@ -131,6 +310,12 @@ range_len(RANGE *rp) {
 #endif
   
   n = 0;
+  if (rp->nw) {
+    for (d = 0; d < rp->nw; d++)
+      n += _bits_count(rp->bv[d]);
+    return n;
+  }
+  
   while (rp) {
     if (rp->max == RANGE_END && rp->min == RANGE_END)
       d = 1;
@@ -210,6 +395,19 @@ range_next(RANGE *rp,
   }
 #endif
   
+  if (rp->nw) {
+    if (*pp >= 0 && *pp < rp->nw*64 && RANGE_BITS_ISSET(rp->bv, *pp)) {
+      int p = range_bits_next(rp->bv, rp->nw*64, *pp);
+
+      if (p < 0)
+	return 0;
+      *pp = p;
+      return 1;
+    }
+    *pp = rp->min;
+    return 1;
+  }
+  
   while (rp) {
     if (_in_range(rp, *pp)) {
       if (*pp+1 <= rp->max) {
@@ -246,6 +444,19 @@ range_prev(RANGE *rp,
   }
 #endif
   
+  if (rp->nw) {
+    if (*pp >= 0 && *pp < rp->nw*64 && RANGE_BITS_ISSET(rp->bv, *pp)) {
+      int p = _bits_prev(rp->bv, rp->nw*64, *pp);
+
+      if (p < 0)
+	return 0;
+      *pp = p;
+      return 1;
+    }
+    *pp = rp->max;
+    return 1;
+  }
+  
   prp = NULL;
   while (rp) {
     if (_in_range(rp, *pp)) {
@@ -287,6 +498,26 @@ range_add(RANGE **rpp,
     p1 = t;
   }
   
+  if ((rp = *rpp) != NULL && rp->nw) {
+    RANGE *nrp;
+    
+    if (p1 >= 0 && p2 < rp->nw*64) {
+      _bits_set_range(rp->bv, p1, p2);
+      if (p1 < rp->min)
+	rp->min = p1;
+      if (p2 > rp->max)
+	rp->max = p2;
+      return 0;
+    }
+
+    /* Doesn't fit in the bitset - switch to segments */
+    nrp = _bits_to_list(rp);
+    if (!nrp)
+      return -1;
+    range_free(rpp);
+    *rpp = nrp;
+  }
+
 
   /* Locate where to insert/append */
   for (rp = *rpp; rp; rp = rp->next) {
@@ -435,6 +666,186 @@ range_adds(RANGE **rpp,
 
 
 
+/* Add all members of 'rp' to '*rpp' */
+int
+range_union(RANGE **rpp,
+	    RANGE *rp) {
+  RANGE *drp;
+  int i;
+
+
+  if (!rpp) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!rp)
+    return 0;
+
+  if (rp->nw) {
+    if (*rpp && !(*rpp)->nw) {
+      RANGE *lrp = _bits_to_list(rp);
+
+      if (!lrp)
+	return -1;
+      i = range_union(rpp, lrp);
+      range_free(&lrp);
+      return i;
+    }
+    
+    drp = *rpp;
+    if (!drp || drp->nw < rp->nw) {
+      RANGE *nrp = _alloc_bits(rp->nw);
+
+      if (!nrp)
+	return -1;
+      if (drp) {
+	memcpy(nrp->bv, drp->bv, drp->nw*sizeof(drp->bv[0]));
+	range_free(rpp);
+      }
+      *rpp = drp = nrp;
+    }
+    
+    for (i = 0; i < rp->nw; i++)
+      drp->bv[i] |= rp->bv[i];
+    _bits_minmax(drp);
+    return 0;
+  }
+
+  for (; rp; rp = rp->next)
+    if (range_add(rpp, rp->min, rp->max) < 0)
+      return -1;
+
+  return 0;
+}
+
+
+/* Remove all members of '*rpp' that are not in 'rp' */
+int
+range_intersect(RANGE **rpp,
+		RANGE *rp) {
+  RANGE *drp, *arp, *brp, *nrp = NULL;
+  RANGE *tap = NULL, *tbp = NULL;
+  int i, rc = 0;
+
+  
+  if (!rpp) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!*rpp)
+    return 0;
+  if (!rp) {
+    range_free(rpp);
+    return 0;
+  }
+
+  drp = *rpp;
+  if (drp->nw && rp->nw) {
+    for (i = 0; i < drp->nw; i++)
+      drp->bv[i] &= (i < rp->nw ? rp->bv[i] : 0);
+    if (!_bits_minmax(drp))
+      range_free(rpp);
+    return 0;
+  }
+
+  if (drp->nw && (drp = tap = _bits_to_list(drp)) == NULL)
+    return -1;
+  if (rp->nw && (rp = tbp = _bits_to_list(rp)) == NULL) {
+    rc = -1;
+    goto End;
+  }
+  
+  for (arp = drp; arp; arp = arp->next)
+    for (brp = rp; brp; brp = brp->next) {
+      int lo = (arp->min > brp->min ? arp->min : brp->min);
+      int hi = (arp->max < brp->max ? arp->max : brp->max);
+
+      if (lo <= hi && range_add(&nrp, lo, hi) < 0) {
+	if (nrp)
+	  range_free(&nrp);
+	rc = -1;
+	goto End;
+      }
+    }
+  
+  range_free(rpp);
+  *rpp = nrp;
+
+ End:
+  if (tap)
+    range_free(&tap);
+  if (tbp)
+    range_free(&tbp);
+  return rc;
+}
+
+
+/*
+ * Get the members of a range below 'n' as a bitset, with '$' being n-1.
+ * Returns the number of members
+ */
+int
+range_to_bits(RANGE *rp,
+	      uint64_t *bv,
+	      int n) {
+  int i, lo, hi, nw = RANGE_BITS_WORDS(n), c;
+
+  
+  if (n <= 0)
+    return 0;
+  
+  memset(bv, 0, nw*sizeof(bv[0]));
+  for (; rp; rp = rp->next) {
+    if (rp->nw) {
+      for (i = 0; i < nw && i < rp->nw; i++)
+	bv[i] |= rp->bv[i];
+      continue;
+    }
+    
+    lo = (rp->min == RANGE_END ? n-1 : rp->min);
+    hi = (rp->max == RANGE_END ? n-1 : rp->max);
+    if (lo < 0)
+      lo = 0;
+    if (hi > n-1)
+      hi = n-1;
+    if (lo <= hi)
+      _bits_set_range(bv, lo, hi);
+  }
+  
+  if (n%64)
+    bv[nw-1] &= ((uint64_t) 1 << (n%64))-1;
+
+  for (c = 0, i = 0; i < nw; i++)
+    c += _bits_count(bv[i]);
+  return c;
+}
+
+
+/* Create a bitset range from 'n' bits. Returns NULL if empty */
+RANGE *
+range_from_bits(const uint64_t *bv,
+		int n) {
+  RANGE *rp;
+  int i, nw = RANGE_BITS_WORDS(n);
+
+  
+  for (i = 0; i < nw && !bv[i]; i++)
+    ;
+  if (i >= nw) {
+    errno = 0;
+    return NULL;
+  }
+  
+  rp = _alloc_bits(nw);
+  if (!rp)
+    return NULL;
+
+  memcpy(rp->bv, bv, nw*sizeof(bv[0]));
+  _bits_minmax(rp);
+  return rp;
+}
+
+
 static int
 _print_value(int v,
 	     FILE *fp) {
@@ -453,6 +864,17 @@ range_print(RANGE *rp, FILE *fp) {
   }
 #endif
   
+  if (rp->nw) {
+    RANGE *lrp = _bits_to_list(rp);
+    int rc;
+
+    if (!lrp)
+      return -1;
+    rc = range_print(lrp, fp);
+    range_free(&lrp);
+    return rc;
+  }
+  
   while (rp) {
     if (_print_value(rp->min, fp) < 0)
       return -1;
@@ -499,6 +921,20 @@ main(int argc,
   range_print(rp, stdout);
   putchar('\n');
 
+  if (max < RANGE_BITS_MAX || (max == RANGE_END && len < RANGE_BITS_MAX)) {
+    uint64_t bv[RANGE_BITS_WORDS(RANGE_BITS_MAX)];
+    RANGE *brp;
+
+    range_to_bits(rp, bv, RANGE_BITS_MAX);
+    brp = range_from_bits(bv, RANGE_BITS_MAX);
+    if (brp) {
+      printf("Bitset (len=%d, min=%d, max=%d):\n", range_len(brp), brp->min, brp->max);
+      range_print(brp, stdout);
+      putchar('\n');
+      range_free(&brp);
+    }
+  }
+  
   if (len < 100) {
     puts("Forward:");
     p = RANGE_NONE;
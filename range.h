@@ -35,6 +35,7 @@
 #define RANGE_H 1
 
 #include <stdio.h>
+#include <stdint.h>
 #include <limits.h>
 
 #define RANGE_MAGIC       0x7b4a34f1
@@ -42,6 +43,11 @@
 
 #define RANGE_DEBUG 1
 
+/*
+ * A range is either a sorted list of segments or (for small position
+ * sets, like ACE positions) a single node with an inline bitset where
+ * min/max are the lowest/highest member.
+ */
 typedef struct range {
 #if RANGE_DEBUG
   unsigned int magic;
@@ -49,12 +55,19 @@ typedef struct range {
   int min;
   int max;
   struct range *next;
+  int nw;           /* Number of bitset words (0 = segment) */
+  uint64_t bv[];
 } RANGE;
 
 #define RANGE_NONE (INT_MIN)
 #define RANGE_MAX  (INT_MAX-1)
 #define RANGE_END  (INT_MAX)
 
+#define RANGE_BITS_MAX       256
+#define RANGE_BITS_WORDS(n)  (((n)+63)/64)
+#define RANGE_BITS_SET(bv,p) ((bv)[(p)/64] |= ((uint64_t) 1 << ((p)%64)))
+#define RANGE_BITS_ISSET(bv,p) (((bv)[(p)/64] >> ((p)%64)) & 1)
+
 extern int
 range_len(RANGE *rp);
 
@@ -85,4 +98,19 @@ range_print(RANGE *rp, FILE *fp);
 extern void
 range_free(RANGE **rpp);
 
+extern int
+range_union(RANGE **rpp, RANGE *rp);
+
+extern int
+range_intersect(RANGE **rpp, RANGE *rp);
+
+extern int
+range_to_bits(RANGE *rp, uint64_t *bv, int n);
+
+extern RANGE *
+range_from_bits(const uint64_t *bv, int n);
+
+extern int
+range_bits_next(const uint64_t *bv, int n, int p);
+
 #endif
@@ -45,6 +45,7 @@
 #include "vfs.h"
 #include "smb.h"
 #include "strings.h"
+#include "ident.h"
 
 #if HAVE_LIBSMBCLIENT
 #include <libsmbclient.h>
@@ -127,103 +128,90 @@ _smb_init(void) {
 static int
 _smb_name_to_uid(const char *name,
 		 uid_t *uidp) {
-  struct passwd *pp;
   const char *dp;
+  char *cp, *nbuf;
+  int fixflag = 0, rc;
 
 
-  pp = getpwnam(name);
-  if (!pp) {
-    dp = strchr(name, '\\');
-    if (dp) {
-      /* XXX: Verify that WORKGROUP is "our" */
-      name = dp+1;
-      pp = getpwnam(name);
-    }
+  if (ident_name_to_uid(name, uidp) > 0)
+    return 0;
+  
+  dp = strchr(name, '\\');
+  if (dp) {
+    /* XXX: Verify that WORKGROUP is "our" */
+    name = dp+1;
+    if (ident_name_to_uid(name, uidp) > 0)
+      return 0;
+  }
 
-    if (!pp) {
-      char *cp, *nbuf;
-      int fixflag = 0;
-      
-      nbuf = s_dup(name);
-      if (!nbuf)
-	return -1;
+  nbuf = s_dup(name);
+  if (!nbuf)
+    return -1;
       
-      for (cp = nbuf; *cp; cp++)
-	if (isspace(*cp)) {
-	  fixflag = 1;
-	  *cp = '_';
-	}
+  for (cp = nbuf; *cp; cp++)
+    if (isspace(*cp)) {
+      fixflag = 1;
+      *cp = '_';
+    }
       
-      if (fixflag)
-	pp = getpwnam(nbuf);
+  if (fixflag && ident_name_to_uid(nbuf, uidp) > 0) {
+    free(nbuf);
+    return 0;
+  }
       
-      if (!pp) {
-	for (cp = nbuf; *cp; cp++)
-	  if (isupper(*cp))
-	    *cp = tolower(*cp);
+  for (cp = nbuf; *cp; cp++)
+    if (isupper(*cp))
+      *cp = tolower(*cp);
 	
-	pp = getpwnam(nbuf);
-	if (!pp) {
-	  free(nbuf);
-	  return -1;
-	}
-      }
-    }
-  }
+  rc = ident_name_to_uid(nbuf, uidp);
+  free(nbuf);
   
-  *uidp = pp->pw_uid;
-  return 0;
+  return rc > 0 ? 0 : -1;
 }
 
 
 static int
 _smb_name_to_gid(const char *name,
 		 gid_t *gidp) {
-  struct group *gp;
   const char *dp;
+  char *cp, *nbuf;
+  int fixflag = 0, rc;
 
   
-  gp = getgrnam(name);
-  if (!gp) {
-    dp = strchr(name, '\\');
-    if (dp) {
-      /* XXX: Verify that WORKGROUP is "our" */
-      name = dp+1;
-      gp = getgrnam(name);
-    }
-    if (!gp) {
-      char *cp, *nbuf;
-      int fixflag = 0;
-      
-      nbuf = s_dup(name);
-      if (!nbuf)
-	return -1;
-      
-      for (cp = nbuf; *cp; cp++)
-	if (isspace(*cp)) {
-	  fixflag = 1;
-	  *cp = '_';
-	}
-
-      if (fixflag)
-	gp = getgrnam(nbuf);
+  if (ident_name_to_gid(name, gidp) > 0)
+    return 0;
+  
+  dp = strchr(name, '\\');
+  if (dp) {
+    /* XXX: Verify that WORKGROUP is "our" */
+    name = dp+1;
+    if (ident_name_to_gid(name, gidp) > 0)
+      return 0;
+  }
+  
+  nbuf = s_dup(name);
+  if (!nbuf)
+    return -1;
       
-      if (!gp) {
-	for (cp = nbuf; *cp; cp++)
-	  if (isupper(*cp))
-	    *cp = tolower(*cp);
-	
-	gp = getgrnam(nbuf);
-	if (!gp) {
-	  free(nbuf);
-	  return -1;
-	}
-      }
+  for (cp = nbuf; *cp; cp++)
+    if (isspace(*cp)) {
+      fixflag = 1;
+      *cp = '_';
     }
-  }
 
-  *gidp = gp->gr_gid;
-  return 0;
+  if (fixflag && ident_name_to_gid(nbuf, gidp) > 0) {
+    free(nbuf);
+    return 0;
+  }
+      
+  for (cp = nbuf; *cp; cp++)
+    if (isupper(*cp))
+      *cp = tolower(*cp);
+	
+  rc = ident_name_to_gid(nbuf, gidp);
+  free(nbuf);
+  
+  return rc > 0 ? 0 : -1;
 }
 
 
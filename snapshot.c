@@ -0,0 +1,1176 @@
+/*
+ * snapshot.c - Binary ACL snapshots
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "buffer.h"
+#include "strings.h"
+#include "snapshot.h"
+
+
+#define SNAPSHOT_ORDER        0x01020304U
+#define SNAPSHOT_VERSION      1
+#define SNAPSHOT_BLOCK_MAGIC  0x534e4231U
+#define SNAPSHOT_BLOCK_SIZE   (64*1024)
+
+typedef struct snapshot_fhdr {
+  uint32_t order;    /* SNAPSHOT_ORDER, to detect foreign byte order */
+  uint32_t version;
+  int64_t created;
+} SNAPSHOT_FHDR;
+
+typedef struct snapshot_bhdr {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t count;    /* Records in the block */
+  uint32_t len;      /* Bytes of payload following the header */
+  uint32_t sum;      /* FNV-1a of the payload */
+  uint32_t pad;
+} SNAPSHOT_BHDR;
+
+/* Principal record, followed by the NUL terminated name */
+typedef struct snapshot_prec {
+  uint32_t ugid;
+  uint16_t type;
+  uint16_t nlen;
+} SNAPSHOT_PREC;
+
+/* ACL record, followed by 'ac' entry records */
+typedef struct snapshot_arec {
+  uint32_t type;
+  uint32_t ac;
+} SNAPSHOT_AREC;
+
+typedef struct snapshot_erec {
+  uint32_t principal;
+  uint32_t perms;
+  uint16_t flags;
+  uint16_t type;
+} SNAPSHOT_EREC;
+
+typedef struct snapshot_end {
+  uint64_t files;
+  uint32_t principals;
+  uint32_t acls;
+} SNAPSHOT_END;
+
+
+/* Dictionary entries - 'data' is the record as written to the file */
+typedef struct snapshot_dent {
+  struct snapshot_dent *next;
+  uint64_t h;
+  uint32_t id;
+  uint32_t len;
+  char data[0];
+} SNAPSHOT_DENT;
+
+typedef struct snapshot_dict {
+  SNAPSHOT_DENT **bv;
+  size_t bs;
+  uint32_t n;
+} SNAPSHOT_DICT;
+
+/* (id, value) pairs for an index block, sorted when written */
+typedef struct snapshot_post {
+  uint32_t id;
+  uint32_t v;
+} SNAPSHOT_POST;
+
+typedef struct snapshot_posts {
+  SNAPSHOT_POST *v;
+  size_t n;
+  size_t size;
+} SNAPSHOT_POSTS;
+
+struct snapshot_writer {
+  FILE *fp;
+  SNAPSHOT_DICT principals;
+  SNAPSHOT_DICT acls;
+  BUFFER pb, ab, fb;         /* Pending principal, ACL & file blocks */
+  uint32_t pbc, abc, fbc;
+  BUFFER rb;                 /* Record being built */
+  char *last;                /* Previous path in the current file block */
+  size_t lastlen, lastsize;
+  uint64_t files;
+  uint32_t fblocks;          /* File blocks written */
+  SNAPSHOT_POSTS pindex;     /* Principal -> ACL */
+  SNAPSHOT_POSTS aindex;     /* ACL -> file block */
+  uint32_t *alast;           /* Last file block (+1) seen per ACL */
+  size_t alastsize;
+};
+
+
+
+static uint64_t
+_snapshot_hash(const char *buf,
+	       size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) buf[i];
+    h *= 1099511628211ULL;
+  }
+  
+  return h;
+}
+
+static uint32_t
+_snapshot_sum(const char *buf,
+	      size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) buf[i];
+    h *= 16777619U;
+  }
+  
+  return h;
+}
+
+
+static int
+_snapshot_put_varint(BUFFER *bp,
+		     uint64_t v) {
+  char tmp[10];
+  int n = 0;
+
+  
+  while (v >= 0x80) {
+    tmp[n++] = (char) (v | 0x80);
+    v >>= 7;
+  }
+  tmp[n++] = (char) v;
+  
+  return buf_putn(bp, tmp, n);
+}
+
+static int
+_snapshot_get_varint(const char **cpp,
+		     const char *end,
+		     uint64_t *vp) {
+  const unsigned char *cp = (const unsigned char *) *cpp;
+  uint64_t v = 0;
+  int s;
+
+  
+  for (s = 0; s < 64 && (const char *) cp < end; s += 7) {
+    v |= (uint64_t) (*cp & 0x7f) << s;
+    if ((*cp++ & 0x80) == 0) {
+      *cpp = (const char *) cp;
+      *vp = v;
+      return 0;
+    }
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+
+/*
+ * Look up a record in a dictionary, adding it if not found.
+ * Returns the id of the record, 1 in *newp if it was added
+ */
+static int64_t
+_snapshot_dict_intern(SNAPSHOT_DICT *dp,
+		      const char *data,
+		      size_t len,
+		      int *newp) {
+  SNAPSHOT_DENT *ep, **nbv;
+  uint64_t h;
+  size_t i, j, ns;
+
+  
+  h = _snapshot_hash(data, len);
+  *newp = 0;
+  
+  if (dp->bs) {
+    for (ep = dp->bv[h & (dp->bs-1)]; ep; ep = ep->next)
+      if (ep->h == h && ep->len == len && memcmp(ep->data, data, len) == 0)
+	return ep->id;
+  }
+
+  if (dp->n == SNAPSHOT_NOACL) {
+    errno = E2BIG;
+    return -1;
+  }
+  
+  if (dp->n >= dp->bs) {
+    ns = dp->bs ? dp->bs*2 : 1024;
+    nbv = calloc(ns, sizeof(*nbv));
+    if (!nbv)
+      return -1;
+    
+    for (i = 0; i < dp->bs; i++)
+      while ((ep = dp->bv[i]) != NULL) {
+	dp->bv[i] = ep->next;
+	j = ep->h & (ns-1);
+	ep->next = nbv[j];
+	nbv[j] = ep;
+      }
+    free(dp->bv);
+    dp->bv = nbv;
+    dp->bs = ns;
+  }
+
+  ep = malloc(sizeof(*ep) + len);
+  if (!ep)
+    return -1;
+  
+  ep->h = h;
+  ep->id = dp->n++;
+  ep->len = (uint32_t) len;
+  memcpy(ep->data, data, len);
+  
+  i = h & (dp->bs-1);
+  ep->next = dp->bv[i];
+  dp->bv[i] = ep;
+  
+  *newp = 1;
+  return ep->id;
+}
+
+static void
+_snapshot_dict_free(SNAPSHOT_DICT *dp) {
+  SNAPSHOT_DENT *ep;
+  size_t i;
+
+  
+  for (i = 0; i < dp->bs; i++)
+    while ((ep = dp->bv[i]) != NULL) {
+      dp->bv[i] = ep->next;
+      free(ep);
+    }
+  free(dp->bv);
+  dp->bv = NULL;
+  dp->bs = 0;
+  dp->n = 0;
+}
+
+
+static int
+_snapshot_posts_add(SNAPSHOT_POSTS *pp,
+		    uint32_t id,
+		    uint32_t v) {
+  SNAPSHOT_POST *nv;
+  size_t ns;
+
+  
+  if (pp->n >= pp->size) {
+    ns = pp->size ? pp->size*2 : 1024;
+    nv = realloc(pp->v, ns * sizeof(*nv));
+    if (!nv)
+      return -1;
+    pp->v = nv;
+    pp->size = ns;
+  }
+
+  pp->v[pp->n].id = id;
+  pp->v[pp->n].v = v;
+  pp->n++;
+  return 0;
+}
+
+static int
+_snapshot_posts_cmp(const void *a,
+		    const void *b) {
+  const SNAPSHOT_POST *pa = (const SNAPSHOT_POST *) a;
+  const SNAPSHOT_POST *pb = (const SNAPSHOT_POST *) b;
+
+  
+  if (pa->id != pb->id)
+    return pa->id < pb->id ? -1 : 1;
+  if (pa->v != pb->v)
+    return pa->v < pb->v ? -1 : 1;
+  return 0;
+}
+
+
+
+static int
+_snapshot_write_block(SNAPSHOT_WRITER *wp,
+		      SNAPSHOT_BLOCK_TYPE type,
+		      BUFFER *bp,
+		      uint32_t *countp) {
+  SNAPSHOT_BHDR h;
+
+  
+  if (!*countp && type != SNAPSHOT_BLOCK_END)
+    return 0;
+
+  memset(&h, 0, sizeof(h));
+  h.magic = SNAPSHOT_BLOCK_MAGIC;
+  h.type = type;
+  h.count = *countp;
+  h.len = bp->len;
+  h.sum = _snapshot_sum(bp->buf, bp->len);
+
+  if (fwrite(&h, sizeof(h), 1, wp->fp) != 1 ||
+      (bp->len && fwrite(bp->buf, bp->len, 1, wp->fp) != 1))
+    return -1;
+
+  bp->len = 0;
+  *countp = 0;
+  return 0;
+}
+
+/* Dictionary blocks go out before the file records referring to them */
+static int
+_snapshot_flush(SNAPSHOT_WRITER *wp,
+		int files) {
+  if (_snapshot_write_block(wp, SNAPSHOT_BLOCK_PRINCIPALS, &wp->pb, &wp->pbc) < 0 ||
+      _snapshot_write_block(wp, SNAPSHOT_BLOCK_ACLS, &wp->ab, &wp->abc) < 0)
+    return -1;
+  
+  if (!files)
+    return 0;
+  
+  if (!wp->fbc)
+    return 0;
+  
+  if (_snapshot_write_block(wp, SNAPSHOT_BLOCK_FILES, &wp->fb, &wp->fbc) < 0)
+    return -1;
+
+  /* Each file block starts with a full path */
+  wp->fblocks++;
+  wp->lastlen = 0;
+  return 0;
+}
+
+
+SNAPSHOT_WRITER *
+snapshot_writer_open(FILE *fp) {
+  SNAPSHOT_WRITER *wp;
+  SNAPSHOT_FHDR h;
+
+
+  wp = calloc(1, sizeof(*wp));
+  if (!wp)
+    return NULL;
+
+  wp->fp = fp;
+  buf_init(&wp->pb);
+  buf_init(&wp->ab);
+  buf_init(&wp->fb);
+  buf_init(&wp->rb);
+
+  memset(&h, 0, sizeof(h));
+  h.order = SNAPSHOT_ORDER;
+  h.version = SNAPSHOT_VERSION;
+  h.created = (int64_t) time(NULL);
+
+  if (fwrite(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)-1, 1, fp) != 1 ||
+      fwrite(&h, sizeof(h), 1, fp) != 1) {
+    free(wp);
+    return NULL;
+  }
+  
+  return wp;
+}
+
+
+static int64_t
+_snapshot_add_principal(SNAPSHOT_WRITER *wp,
+			GACL_TAG *tp) {
+  SNAPSHOT_PREC r;
+  size_t nlen;
+  int64_t id;
+  int f_new;
+  
+
+  nlen = strlen(tp->name);
+  
+  memset(&r, 0, sizeof(r));
+  r.ugid = (uint32_t) tp->ugid;
+  r.type = (uint16_t) tp->type;
+  r.nlen = (uint16_t) nlen;
+
+  wp->rb.len = 0;
+  if (buf_putn(&wp->rb, (char *) &r, sizeof(r)) < 0 ||
+      buf_putn(&wp->rb, tp->name, nlen+1) < 0)
+    return -1;
+
+  id = _snapshot_dict_intern(&wp->principals, wp->rb.buf, wp->rb.len, &f_new);
+  if (id >= 0 && f_new) {
+    if (buf_putn(&wp->pb, wp->rb.buf, wp->rb.len) < 0)
+      return -1;
+    wp->pbc++;
+  }
+
+  return id;
+}
+
+static int64_t
+_snapshot_add_acl(SNAPSHOT_WRITER *wp,
+		  GACL *ap) {
+  SNAPSHOT_AREC r;
+  SNAPSHOT_EREC *ev;
+  GACL_ENTRY *ep;
+  int64_t pid, id;
+  int i, f_new;
+  
+
+  /* Intern the principals first, they use the same record buffer */
+  ev = malloc((ap->ac ? ap->ac : 1) * sizeof(*ev));
+  if (!ev)
+    return -1;
+  
+  memset(ev, 0, (ap->ac ? ap->ac : 1) * sizeof(*ev));
+  for (i = 0; _gacl_peek_entry(ap, i, &ep) == 1; i++) {
+    pid = _snapshot_add_principal(wp, &ep->tag);
+    if (pid < 0) {
+      free(ev);
+      return -1;
+    }
+    ev[i].principal = (uint32_t) pid;
+    ev[i].perms = ep->perms;
+    ev[i].flags = ep->flags;
+    ev[i].type = (uint16_t) ep->type;
+  }
+  
+  memset(&r, 0, sizeof(r));
+  r.type = ap->type;
+  r.ac = i;
+
+  wp->rb.len = 0;
+  if (buf_putn(&wp->rb, (char *) &r, sizeof(r)) < 0 ||
+      buf_putn(&wp->rb, (char *) ev, i * sizeof(*ev)) < 0) {
+    free(ev);
+    return -1;
+  }
+  free(ev);
+  
+  id = _snapshot_dict_intern(&wp->acls, wp->rb.buf, wp->rb.len, &f_new);
+  if (id >= 0 && f_new) {
+    if (buf_putn(&wp->ab, wp->rb.buf, wp->rb.len) < 0)
+      return -1;
+    wp->abc++;
+
+    /* The entries are still in the record buffer */
+    ev = (SNAPSHOT_EREC *) (wp->rb.buf + sizeof(r));
+    for (i = 0; i < r.ac; i++)
+      if (_snapshot_posts_add(&wp->pindex, ev[i].principal, (uint32_t) id) < 0)
+	return -1;
+  }
+  
+  return id;
+}
+
+
+int
+snapshot_writer_add(SNAPSHOT_WRITER *wp,
+		    const char *path,
+		    const struct stat *sp,
+		    GACL *ap) {
+  size_t plen, len;
+  int64_t id = SNAPSHOT_NOACL;
+  int64_t ct;
+
+
+  if (ap) {
+    id = _snapshot_add_acl(wp, ap);
+    if (id < 0)
+      return -1;
+
+    if (id >= wp->alastsize) {
+      size_t ns = wp->alastsize ? wp->alastsize*2 : 1024;
+      uint32_t *nv = realloc(wp->alast, ns * sizeof(*nv));
+
+      if (!nv)
+	return -1;
+      memset(nv + wp->alastsize, 0, (ns - wp->alastsize) * sizeof(*nv));
+      wp->alast = nv;
+      wp->alastsize = ns;
+    }
+    
+    if (wp->alast[id] != wp->fblocks+1) {
+      wp->alast[id] = wp->fblocks+1;
+      if (_snapshot_posts_add(&wp->aindex, (uint32_t) id, wp->fblocks) < 0)
+	return -1;
+    }
+  }
+
+  len = strlen(path);
+  for (plen = 0; plen < wp->lastlen && plen < len && path[plen] == wp->last[plen]; plen++)
+    ;
+
+  ct = (int64_t) sp->st_ctime;
+  if (_snapshot_put_varint(&wp->fb, plen) < 0 ||
+      _snapshot_put_varint(&wp->fb, len-plen) < 0 ||
+      buf_putn(&wp->fb, path+plen, len-plen) < 0 ||
+      _snapshot_put_varint(&wp->fb, (uint64_t) sp->st_ino) < 0 ||
+      _snapshot_put_varint(&wp->fb, (uint32_t) sp->st_uid) < 0 ||
+      _snapshot_put_varint(&wp->fb, (uint32_t) sp->st_gid) < 0 ||
+      _snapshot_put_varint(&wp->fb, (uint32_t) sp->st_mode) < 0 ||
+      _snapshot_put_varint(&wp->fb, ((uint64_t) ct << 1) ^ (uint64_t) (ct >> 63)) < 0 ||
+      _snapshot_put_varint(&wp->fb, (uint32_t) (id+1)) < 0)
+    return -1;
+  wp->fbc++;
+  wp->files++;
+
+  if (len+1 > wp->lastsize) {
+    char *nlast = realloc(wp->last, len+1);
+
+    if (!nlast)
+      return -1;
+    wp->last = nlast;
+    wp->lastsize = len+1;
+  }
+  memcpy(wp->last, path, len+1);
+  wp->lastlen = len;
+
+  if (wp->fb.len >= SNAPSHOT_BLOCK_SIZE)
+    return _snapshot_flush(wp, 1);
+  
+  /* Lots of distinct ACLs - no need to keep them all until the next file block */
+  if (wp->ab.len >= SNAPSHOT_BLOCK_SIZE)
+    return _snapshot_flush(wp, 0);
+
+  return 0;
+}
+
+
+/* Sort the pairs and write them as an index block with 'count' lists */
+static int
+_snapshot_write_index(SNAPSHOT_WRITER *wp,
+		      SNAPSHOT_BLOCK_TYPE type,
+		      SNAPSHOT_POSTS *pp,
+		      uint32_t count) {
+  uint32_t id, off, prev;
+  size_t i, base;
+
+  
+  qsort(pp->v, pp->n, sizeof(*pp->v), _snapshot_posts_cmp);
+
+  wp->rb.len = 0;
+  if (buf_reserve(&wp->rb, ((size_t) count+1) * sizeof(uint32_t)) < 0)
+    return -1;
+  wp->rb.len = base = ((size_t) count+1) * sizeof(uint32_t);
+  
+  for (i = 0, id = 0; id < count; id++) {
+    off = (uint32_t) (wp->rb.len - base);
+    memcpy(wp->rb.buf + id * sizeof(off), &off, sizeof(off));
+    
+    for (prev = 0; i < pp->n && pp->v[i].id == id; i++) {
+      /* Duplicates (a principal in more than one entry of an ACL) are dropped */
+      if (prev && pp->v[i].v+1 == prev)
+	continue;
+      if (_snapshot_put_varint(&wp->rb, pp->v[i].v+1 - prev) < 0)
+	return -1;
+      prev = pp->v[i].v+1;
+    }
+  }
+  off = (uint32_t) (wp->rb.len - base);
+  memcpy(wp->rb.buf + count * sizeof(off), &off, sizeof(off));
+
+  return _snapshot_write_block(wp, type, &wp->rb, &count);
+}
+
+
+int
+snapshot_writer_close(SNAPSHOT_WRITER *wp) {
+  SNAPSHOT_END e;
+  uint32_t one = 1;
+  int rc;
+
+
+  rc = _snapshot_flush(wp, 1);
+  if (rc == 0 &&
+      (_snapshot_write_index(wp, SNAPSHOT_BLOCK_PINDEX, &wp->pindex, wp->principals.n) < 0 ||
+       _snapshot_write_index(wp, SNAPSHOT_BLOCK_AINDEX, &wp->aindex, wp->acls.n) < 0))
+    rc = -1;
+  
+  if (rc == 0) {
+    memset(&e, 0, sizeof(e));
+    e.files = wp->files;
+    e.principals = wp->principals.n;
+    e.acls = wp->acls.n;
+    
+    wp->rb.len = 0;
+    if (buf_putn(&wp->rb, (char *) &e, sizeof(e)) < 0 ||
+	_snapshot_write_block(wp, SNAPSHOT_BLOCK_END, &wp->rb, &one) < 0)
+      rc = -1;
+  }
+  
+  if (rc == 0 && fflush(wp->fp) != 0)
+    rc = -1;
+  
+  snapshot_writer_abort(wp);
+  return rc;
+}
+
+
+void
+snapshot_writer_abort(SNAPSHOT_WRITER *wp) {
+  if (!wp)
+    return;
+  
+  _snapshot_dict_free(&wp->principals);
+  _snapshot_dict_free(&wp->acls);
+  buf_clear(&wp->pb);
+  buf_clear(&wp->ab);
+  buf_clear(&wp->fb);
+  buf_clear(&wp->rb);
+  free(wp->last);
+  free(wp->pindex.v);
+  free(wp->aindex.v);
+  free(wp->alast);
+  free(wp);
+}
+
+
+
+static int
+_snapshot_index_add(const char ***vp,
+		    size_t n,
+		    const char *p) {
+  const char **nv;
+
+  
+  /* Grow at powers of two */
+  if ((n & (n-1)) == 0) {
+    nv = realloc(*vp, (n ? n*2 : 256) * sizeof(*nv));
+    if (!nv)
+      return -1;
+    *vp = nv;
+  }
+  
+  (*vp)[n] = p;
+  return 0;
+}
+
+/* Index the records of a dictionary block */
+static int
+_snapshot_load_block(SNAPSHOT *snap,
+		     const SNAPSHOT_BHDR *hp,
+		     const char *cp) {
+  const char *end = cp + hp->len;
+  SNAPSHOT_PREC pr;
+  SNAPSHOT_AREC ar;
+  uint32_t i;
+  size_t n;
+
+  
+  for (i = 0; i < hp->count; i++) {
+    switch (hp->type) {
+    case SNAPSHOT_BLOCK_PRINCIPALS:
+      if (cp + sizeof(pr) > end)
+	goto Fail;
+      memcpy(&pr, cp, sizeof(pr));
+      n = sizeof(pr) + pr.nlen + 1;
+      if (cp + n > end || cp[n-1] != '\0')
+	goto Fail;
+      if (_snapshot_index_add(&snap->pv, snap->pc, cp) < 0)
+	return -1;
+      snap->pc++;
+      break;
+
+    case SNAPSHOT_BLOCK_ACLS:
+      if (cp + sizeof(ar) > end)
+	goto Fail;
+      memcpy(&ar, cp, sizeof(ar));
+      n = sizeof(ar) + (size_t) ar.ac * sizeof(SNAPSHOT_EREC);
+      if (cp + n > end)
+	goto Fail;
+      if (_snapshot_index_add(&snap->av, snap->ac, cp) < 0)
+	return -1;
+      snap->ac++;
+      break;
+
+    default:
+      goto Fail;
+    }
+    cp += n;
+  }
+
+  if (cp == end)
+    return 0;
+  
+ Fail:
+  errno = EINVAL;
+  return -1;
+}
+
+
+/* Verify the offset table of an index block with 'count' lists */
+static int
+_snapshot_check_index(const SNAPSHOT_BHDR *hp,
+		      const char *cp,
+		      uint32_t count) {
+  uint32_t i, off, prev = 0;
+  size_t base;
+
+  
+  base = ((size_t) count+1) * sizeof(off);
+  if (hp->count != count || hp->len < base)
+    return -1;
+
+  for (i = 0; i <= count; i++) {
+    memcpy(&off, cp + i * sizeof(off), sizeof(off));
+    if (off < prev)
+      return -1;
+    prev = off;
+  }
+  
+  return (prev == hp->len - base) ? 0 : -1;
+}
+
+/* Get the list of 'id' from an index block */
+static void
+_snapshot_index_list(const char *ix,
+		     uint32_t id,
+		     const char **cpp,
+		     const char **endp) {
+  SNAPSHOT_BHDR bh;
+  uint32_t off[2];
+  const char *cp;
+
+  
+  memcpy(&bh, ix, sizeof(bh));
+  cp = ix + sizeof(bh);
+  memcpy(off, cp + id * sizeof(uint32_t), sizeof(off));
+  cp += ((size_t) bh.count+1) * sizeof(uint32_t);
+  
+  *cpp = cp + off[0];
+  *endp = cp + off[1];
+}
+
+
+SNAPSHOT *
+snapshot_open(const char *path) {
+  SNAPSHOT *snap = NULL;
+  SNAPSHOT_FHDR fh;
+  SNAPSHOT_BHDR bh;
+  SNAPSHOT_END e;
+  struct stat sb;
+  size_t off;
+  int fd, f_end = 0;
+  void *buf;
+
+  
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  off = sizeof(SNAPSHOT_MAGIC)-1 + sizeof(fh);
+  if (sb.st_size < (off_t) off) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    return NULL;
+
+  snap = calloc(1, sizeof(*snap));
+  if (!snap) {
+    munmap(buf, sb.st_size);
+    return NULL;
+  }
+  
+  snap->buf = buf;
+  snap->size = sb.st_size;
+
+  memcpy(&fh, snap->buf + sizeof(SNAPSHOT_MAGIC)-1, sizeof(fh));
+  if (memcmp(snap->buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)-1) != 0 ||
+      fh.order != SNAPSHOT_ORDER ||
+      fh.version != SNAPSHOT_VERSION)
+    goto Invalid;
+
+  while (!f_end && off + sizeof(bh) <= snap->size) {
+    memcpy(&bh, snap->buf + off, sizeof(bh));
+    if (bh.magic != SNAPSHOT_BLOCK_MAGIC ||
+	bh.len > snap->size - off - sizeof(bh) ||
+	_snapshot_sum(snap->buf + off + sizeof(bh), bh.len) != bh.sum)
+      goto Invalid;
+
+    switch (bh.type) {
+    case SNAPSHOT_BLOCK_PRINCIPALS:
+    case SNAPSHOT_BLOCK_ACLS:
+      if (_snapshot_load_block(snap, &bh, snap->buf + off + sizeof(bh)) < 0)
+	goto Fail;
+      break;
+      
+    case SNAPSHOT_BLOCK_FILES:
+      if (_snapshot_index_add(&snap->bv, snap->bc, snap->buf + off) < 0)
+	goto Fail;
+      snap->bc++;
+      break;
+
+    case SNAPSHOT_BLOCK_PINDEX:
+      if (_snapshot_check_index(&bh, snap->buf + off + sizeof(bh), snap->pc) < 0)
+	goto Invalid;
+      snap->pix = snap->buf + off;
+      break;
+      
+    case SNAPSHOT_BLOCK_AINDEX:
+      if (_snapshot_check_index(&bh, snap->buf + off + sizeof(bh), snap->ac) < 0)
+	goto Invalid;
+      snap->aix = snap->buf + off;
+      break;
+
+    case SNAPSHOT_BLOCK_END:
+      if (bh.len != sizeof(e))
+	goto Invalid;
+      memcpy(&e, snap->buf + off + sizeof(bh), sizeof(e));
+      if (e.principals != snap->pc || e.acls != snap->ac)
+	goto Invalid;
+      snap->files = e.files;
+      f_end = 1;
+      break;
+      
+    default:
+      /* Unknown block types are skipped */
+      break;
+    }
+    
+    off += sizeof(bh) + bh.len;
+  }
+
+  /* Truncated (no END block) */
+  if (!f_end)
+    goto Invalid;
+  
+  return snap;
+
+ Invalid:
+  errno = EINVAL;
+ Fail:
+  snapshot_close(snap);
+  return NULL;
+}
+
+
+void
+snapshot_close(SNAPSHOT *snap) {
+  if (!snap)
+    return;
+  
+  free(snap->pv);
+  free(snap->av);
+  free(snap->bv);
+  munmap((void *) snap->buf, snap->size);
+  free(snap);
+}
+
+
+int
+snapshot_get_principal(SNAPSHOT *snap,
+		       uint32_t id,
+		       SNAPSHOT_PRINCIPAL *pp) {
+  SNAPSHOT_PREC r;
+
+  
+  if (id >= snap->pc) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memcpy(&r, snap->pv[id], sizeof(r));
+  pp->type = (GACL_TAG_TYPE) r.type;
+  pp->ugid = r.ugid;
+  pp->name = snap->pv[id] + sizeof(r);
+  return 0;
+}
+
+
+GACL *
+snapshot_get_acl(SNAPSHOT *snap,
+		 uint32_t id) {
+  SNAPSHOT_PRINCIPAL p;
+  SNAPSHOT_AREC r;
+  SNAPSHOT_EREC e;
+  GACL_ENTRY *ep;
+  const char *cp;
+  GACL *ap;
+  uint32_t i;
+
+  
+  if (id >= snap->ac) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  cp = snap->av[id];
+  memcpy(&r, cp, sizeof(r));
+  cp += sizeof(r);
+  
+  ap = gacl_init(r.ac);
+  if (!ap)
+    return NULL;
+  
+  ap->type = (GACL_TYPE) r.type;
+  for (i = 0; i < r.ac; i++, cp += sizeof(e)) {
+    memcpy(&e, cp, sizeof(e));
+    if (snapshot_get_principal(snap, e.principal, &p) < 0)
+      goto Fail;
+
+    ep = &ap->av[i];
+    memset(ep, 0, sizeof(*ep));
+    ep->tag.type = p.type;
+    ep->tag.ugid = (uid_t) p.ugid;
+    if (s_cpy(ep->tag.name, sizeof(ep->tag.name), p.name) < 0)
+      goto Fail;
+    ep->perms = e.perms;
+    ep->flags = e.flags;
+    ep->type = (GACL_ENTRY_TYPE) (int16_t) e.type;
+  }
+  ap->ac = r.ac;
+  
+  return ap;
+
+ Fail:
+  gacl_free(ap);
+  errno = EINVAL;
+  return NULL;
+}
+
+
+/* Call 'fun' for the files in block 'b' with an ACL in 'aclset' (all if NULL) */
+static int
+_snapshot_foreach_block(SNAPSHOT *snap,
+			size_t b,
+			const unsigned char *aclset,
+			int (*fun)(const SNAPSHOT_FILE *fp, void *vp),
+			void *vp,
+			char **pathp,
+			size_t *psp) {
+  SNAPSHOT_BHDR bh;
+  SNAPSHOT_FILE f;
+  const char *cp, *end;
+  uint64_t v[8];
+  size_t plen = 0;
+  uint32_t i;
+  int j, rc = 0;
+
+
+  memcpy(&bh, snap->bv[b], sizeof(bh));
+  cp = snap->bv[b] + sizeof(bh);
+  end = cp + bh.len;
+
+  for (i = 0; rc == 0 && i < bh.count; i++) {
+    /* Prefix and suffix length, then the suffix */
+    if (_snapshot_get_varint(&cp, end, &v[0]) < 0 ||
+	_snapshot_get_varint(&cp, end, &v[1]) < 0 ||
+	v[0] > (i ? plen : 0) ||
+	v[1] > (uint64_t) (end-cp))
+      goto Invalid;
+    
+    if (v[0]+v[1]+1 > *psp) {
+      char *npath;
+      size_t ns;
+
+      ns = v[0]+v[1]+1 < 1024 ? 1024 : v[0]+v[1]+1;
+      npath = realloc(*pathp, ns);
+      if (!npath)
+	return -1;
+      *pathp = npath;
+      *psp = ns;
+    }
+    memcpy(*pathp+v[0], cp, v[1]);
+    plen = v[0]+v[1];
+    (*pathp)[plen] = '\0';
+    cp += v[1];
+
+    /* Inode, uid, gid, mode, ctime & ACL id */
+    for (j = 2; j < 8; j++)
+      if (_snapshot_get_varint(&cp, end, &v[j]) < 0)
+	goto Invalid;
+
+    f.path = *pathp;
+    f.ino = v[2];
+    f.uid = (uint32_t) v[3];
+    f.gid = (uint32_t) v[4];
+    f.mode = (uint32_t) v[5];
+    f.ctime = (int64_t) ((v[6] >> 1) ^ -(v[6] & 1));
+    f.acl = (uint32_t) v[7] - 1;
+    if (f.acl != SNAPSHOT_NOACL && f.acl >= snap->ac)
+      goto Invalid;
+
+    if (aclset && (f.acl == SNAPSHOT_NOACL || !aclset[f.acl]))
+      continue;
+    
+    rc = (*fun)(&f, vp);
+  }
+
+  return rc;
+
+ Invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+
+int
+snapshot_foreach_file(SNAPSHOT *snap,
+		      int (*fun)(const SNAPSHOT_FILE *fp, void *vp),
+		      void *vp) {
+  char *path = NULL;
+  size_t ps = 0, b;
+  int rc = 0;
+
+
+  for (b = 0; rc == 0 && b < snap->bc; b++)
+    rc = _snapshot_foreach_block(snap, b, NULL, fun, vp, &path, &ps);
+
+  free(path);
+  return rc;
+}
+
+
+int64_t
+snapshot_principal_acls(SNAPSHOT *snap,
+			uint32_t pid,
+			unsigned char *aclset) {
+  SNAPSHOT_AREC r;
+  SNAPSHOT_EREC e;
+  const char *cp, *end;
+  uint64_t v, id = 0;
+  int64_t n = 0;
+  uint32_t a, i;
+
+
+  if (pid >= snap->pc) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (snap->pix) {
+    _snapshot_index_list(snap->pix, pid, &cp, &end);
+    while (cp < end) {
+      if (_snapshot_get_varint(&cp, end, &v) < 0 || v == 0)
+	goto Invalid;
+      id += v;
+      if (id > snap->ac)
+	goto Invalid;
+      aclset[id-1] = 1;
+      n++;
+    }
+    return n;
+  }
+
+  /* No index - look at all the ACLs */
+  for (a = 0; a < snap->ac; a++) {
+    cp = snap->av[a];
+    memcpy(&r, cp, sizeof(r));
+    cp += sizeof(r);
+    
+    for (i = 0; i < r.ac; i++, cp += sizeof(e)) {
+      memcpy(&e, cp, sizeof(e));
+      if (e.principal == pid) {
+	aclset[a] = 1;
+	n++;
+	break;
+      }
+    }
+  }
+  
+  return n;
+
+ Invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+
+int
+snapshot_foreach_file_in(SNAPSHOT *snap,
+			 const unsigned char *aclset,
+			 int (*fun)(const SNAPSHOT_FILE *fp, void *vp),
+			 void *vp) {
+  unsigned char *blocks = NULL;
+  const char *cp, *end;
+  char *path = NULL;
+  size_t ps = 0, b;
+  uint64_t v, bn;
+  uint32_t a;
+  int rc = 0;
+
+
+  if (snap->aix && aclset) {
+    /* Only the file blocks that refer to the ACLs */
+    blocks = calloc(snap->bc ? snap->bc : 1, 1);
+    if (!blocks)
+      return -1;
+    
+    for (a = 0; a < snap->ac; a++) {
+      if (!aclset[a])
+	continue;
+      
+      _snapshot_index_list(snap->aix, a, &cp, &end);
+      for (bn = 0; cp < end; ) {
+	if (_snapshot_get_varint(&cp, end, &v) < 0 || v == 0)
+	  goto Invalid;
+	bn += v;
+	if (bn > snap->bc)
+	  goto Invalid;
+	blocks[bn-1] = 1;
+      }
+    }
+  }
+  
+  for (b = 0; rc == 0 && b < snap->bc; b++)
+    if (!blocks || blocks[b])
+      rc = _snapshot_foreach_block(snap, b, aclset, fun, vp, &path, &ps);
+
+  free(blocks);
+  free(path);
+  return rc;
+
+ Invalid:
+  free(blocks);
+  errno = EINVAL;
+  return -1;
+}
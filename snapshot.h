@@ -0,0 +1,176 @@
+/*
+ * snapshot.h - Binary ACL snapshots
+ *
+ * Copyright (c) 2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gacl.h"
+
+/*
+ * Binary snapshot of the ACLs (and some metadata) of a file tree.
+ *
+ * An 8 byte magic and a file header followed by a stream of blocks,
+ * each with a fixed header (type, record count, payload length and
+ * checksum). Every distinct ACL is stored once in an ACL block, with
+ * its user & group principals stored once in a principal block. File
+ * blocks hold prefix compressed paths plus varint encoded inode, uid,
+ * gid, mode, ctime and ACL id. Dictionary blocks are always written
+ * before the first file block that refers to them, so the file can be
+ * both produced and consumed as a stream. The last block is an END
+ * block with the totals.
+ *
+ * Just before the END block come two index blocks: principal -> ACLs
+ * that refer to it, and ACL -> file blocks that refer to it. Each starts
+ * with a table of 'count'+1 offsets into the varint (delta) encoded
+ * lists that follow, so the list of any one id can be found directly.
+ *
+ * Numbers are stored in host byte order, like the identity cache file.
+ */
+#define SNAPSHOT_MAGIC    "ACLSNAP1"
+#define SNAPSHOT_NOACL    0xFFFFFFFFU
+
+typedef enum snapshot_block_type {
+  SNAPSHOT_BLOCK_PRINCIPALS = 1,
+  SNAPSHOT_BLOCK_ACLS       = 2,
+  SNAPSHOT_BLOCK_FILES      = 3,
+  SNAPSHOT_BLOCK_END        = 4,
+  SNAPSHOT_BLOCK_PINDEX     = 5,  /* Principal -> ACLs */
+  SNAPSHOT_BLOCK_AINDEX     = 6,  /* ACL -> file blocks */
+} SNAPSHOT_BLOCK_TYPE;
+
+/* A file record, as returned by the reader */
+typedef struct snapshot_file {
+  const char *path;
+  uint64_t ino;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t mode;
+  int64_t ctime;
+  uint32_t acl;      /* ACL id or SNAPSHOT_NOACL */
+} SNAPSHOT_FILE;
+
+/* A principal (the tag of an entry), as stored in the dictionary */
+typedef struct snapshot_principal {
+  GACL_TAG_TYPE type;
+  uint32_t ugid;
+  const char *name;  /* Points into the mapped file */
+} SNAPSHOT_PRINCIPAL;
+
+
+typedef struct snapshot_writer SNAPSHOT_WRITER;
+
+extern SNAPSHOT_WRITER *
+snapshot_writer_open(FILE *fp);
+
+extern int
+snapshot_writer_add(SNAPSHOT_WRITER *wp,
+		    const char *path,
+		    const struct stat *sp,
+		    GACL *ap);
+
+/* Flush everything, write the END block and free the writer */
+extern int
+snapshot_writer_close(SNAPSHOT_WRITER *wp);
+
+/* Free the writer without finishing the snapshot (it has no END block) */
+extern void
+snapshot_writer_abort(SNAPSHOT_WRITER *wp);
+
+
+/* A memory mapped snapshot */
+typedef struct snapshot {
+  const char *buf;
+  size_t size;
+
+  uint32_t pc;                /* Principals */
+  const char **pv;
+  
+  uint32_t ac;                /* ACLs */
+  const char **av;
+
+  size_t bc;                  /* File blocks */
+  const char **bv;
+
+  const char *pix;            /* Index blocks (NULL if missing) */
+  const char *aix;
+  
+  uint64_t files;
+} SNAPSHOT;
+
+extern SNAPSHOT *
+snapshot_open(const char *path);
+
+extern void
+snapshot_close(SNAPSHOT *snap);
+
+extern int
+snapshot_get_principal(SNAPSHOT *snap,
+		       uint32_t id,
+		       SNAPSHOT_PRINCIPAL *pp);
+
+/* Rebuild an ACL from the dictionary. Free with gacl_free() */
+extern GACL *
+snapshot_get_acl(SNAPSHOT *snap,
+		 uint32_t id);
+
+/* Call 'fun' for every file record, in the order they were written */
+extern int
+snapshot_foreach_file(SNAPSHOT *snap,
+		      int (*fun)(const SNAPSHOT_FILE *fp, void *vp),
+		      void *vp);
+
+/*
+ * Set aclset[id] for every ACL that refers to principal 'pid'. 'aclset'
+ * has room for snap->ac ids. Returns the number of ACLs found
+ */
+extern int64_t
+snapshot_principal_acls(SNAPSHOT *snap,
+			uint32_t pid,
+			unsigned char *aclset);
+
+/*
+ * Like snapshot_foreach_file(), but only for files with an ACL set in
+ * 'aclset'. Only the file blocks that refer to them are decoded.
+ */
+extern int
+snapshot_foreach_file_in(SNAPSHOT *snap,
+			 const unsigned char *aclset,
+			 int (*fun)(const SNAPSHOT_FILE *fp, void *vp),
+			 void *vp);
+
+#endif
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# snapshot.sh - Check dump-access, restore-access and --snapshot queries
+#
+# Usage: tests/snapshot.sh <acltool> <work dir>
+#
+# Builds a small tree with ACLs in <work dir>, round trips it through
+# list-access/restore-access, compares snapshot queries with the same
+# queries against the tree and checks some error cases.
+#
+
+ACLTOOL="$1"
+W="$2"
+
+if [ -z "$ACLTOOL" -o -z "$W" ]; then
+    echo "Usage: $0 <acltool> <work dir>" >&2
+    exit 1
+fi
+
+case "$ACLTOOL" in
+    /*) ;;
+    *) ACLTOOL="`pwd`/$ACLTOOL" ;;
+esac
+
+ME="`id -un`"
+MYGROUP="`id -gn`"
+
+fail() {
+    echo "*** $*" >&2
+    exit 1
+}
+
+# Same output from both commands?
+same() {
+    A="$1"
+    B="$2"
+    sh -c "$A" >"$W/a.out" 2>&1 || fail "$A: Failed"
+    sh -c "$B" >"$W/b.out" 2>&1 || fail "$B: Failed"
+    cmp -s "$W/a.out" "$W/b.out" || fail "$A: Differs from: $B"
+}
+
+# Command must fail
+fails() {
+    sh -c "$1" >"$W/a.out" 2>&1 && fail "$1: Did not fail"
+    return 0
+}
+
+
+rm -rf "$W" && mkdir -p "$W/tree/a/b" "$W/tree/c" || exit 1
+W="`cd "$W" && pwd`"
+T="$W/tree"
+
+for F in a/f1 a/f2 a/b/f3 c/f4 c/f5 f6; do
+    echo "$F" >"$T/$F"
+done
+
+if ! "$ACLTOOL" sac "owner@:rwx" "$T" >/dev/null 2>&1; then
+    echo "*** $W: No ACL support - snapshot tests skipped" >&2
+    exit 0
+fi
+
+(
+    set -e
+    "$ACLTOOL" sac -r "owner@:rwx,group@:rx,everyone@:r" "$T"
+    "$ACLTOOL" sac "owner@:rwx,user:$ME:rw,everyone@:r" "$T/a/f1" "$T/c/f4"
+    "$ACLTOOL" sac "owner@:rwx,group:$MYGROUP:r::deny,everyone@:r" "$T/a/b/f3"
+    "$ACLTOOL" sac "owner@:rwx,user:$ME:rwx:fd,everyone@:r" "$T/c"
+) >/dev/null || fail "$T: Setting ACLs"
+
+
+# --- Round trip through list-access & restore-access
+"$ACLTOOL" list-access -r "$T" >"$W/acls.txt" || fail "list-access -r: Failed"
+"$ACLTOOL" sac -r "owner@:rwx" "$T" >/dev/null || fail "$T: Resetting ACLs"
+"$ACLTOOL" restore-access "$W/acls.txt" >"$W/restore.out" || fail "restore-access: Failed"
+same "cat '$W/acls.txt'" "'$ACLTOOL' list-access -r '$T'"
+"$ACLTOOL" restore-access "$W/acls.txt" >"$W/restore.out" || fail "restore-access: Failed (second run)"
+grep -q " 0 updated" "$W/restore.out" || fail "restore-access: Rewrote unchanged ACLs"
+
+# The same through the csv style, which writes the compact form (the deny must stay a deny)
+"$ACLTOOL" list-access -r -S csv "$T" >"$W/acls.csv" || fail "list-access -r -S csv: Failed"
+grep -q ':deny' "$W/acls.csv" || fail "list-access -S csv: Lost the deny entry"
+"$ACLTOOL" sac -r "owner@:rwx" "$T" >/dev/null || fail "$T: Resetting ACLs"
+"$ACLTOOL" restore-access "$W/acls.csv" >"$W/restore.out" || fail "restore-access (csv): Failed"
+same "cat '$W/acls.txt'" "'$ACLTOOL' list-access -r '$T'"
+
+# An ACL naming an unknown user is invalid - the rest is restored, but it fails
+sed -e "s/user:$ME\(@[^:]*\)\{0,1\}:/user:no-such-user-4711:/" "$W/acls.txt" >"$W/bad.txt"
+fails "'$ACLTOOL' restore-access '$W/bad.txt'"
+grep -q "invalid" "$W/a.out" || fail "restore-access: Invalid ACLs not reported"
+
+
+# --- Snapshot queries vs the same queries on the tree
+"$ACLTOOL" dump-access -r -o "$W/tree.snap" "$T" || fail "dump-access: Failed"
+
+same "'$ACLTOOL' list-access -r '$T'" "'$ACLTOOL' list-access -r --snapshot='$W/tree.snap' '$T'"
+# (A snapshot is read in the order it was written, not in argument order)
+same "'$ACLTOOL' list-access -S fingerprint '$T/c/f4' '$T/a' | sort" "'$ACLTOOL' list-access -S fingerprint --snapshot='$W/tree.snap' '$T/c/f4' '$T/a' | sort"
+same "'$ACLTOOL' list-access -d1 '$T/a'" "'$ACLTOOL' list-access -d1 --snapshot='$W/tree.snap' '$T/a'"
+same "'$ACLTOOL' list-access -r -S fingerprint '$T'" "'$ACLTOOL' list-access -r -S fingerprint --snapshot='$W/tree.snap' '$T'"
+same "'$ACLTOOL' list-access -r -S json '$T'" "'$ACLTOOL' list-access -r -S json --snapshot='$W/tree.snap' '$T'"
+same "'$ACLTOOL' find-access -r 'user:$ME:w' '$T'" "'$ACLTOOL' find-access -r --snapshot='$W/tree.snap' 'user:$ME:w' '$T'"
+same "'$ACLTOOL' who-access -r 'user:$ME' '$T'" "'$ACLTOOL' who-access -r --snapshot='$W/tree.snap' 'user:$ME' '$T'"
+same "'$ACLTOOL' who-access -r 'group:$MYGROUP' '$T'" "'$ACLTOOL' who-access -r --snapshot='$W/tree.snap' 'group:$MYGROUP' '$T'"
+same "'$ACLTOOL' who-access -r 'user:$ME' '$T'" "'$ACLTOOL' who-access -r '$ME' '$T'"
+
+# Relative and unclean paths select the same records
+same "'$ACLTOOL' list-access -r --snapshot='$W/tree.snap' '$T'" "cd '$W' && '$ACLTOOL' list-access -r --snapshot='$W/tree.snap' ./tree/"
+same "'$ACLTOOL' list-access -r --snapshot='$W/tree.snap' '$T/a'" "cd '$T/c' && '$ACLTOOL' list-access -r --snapshot='$W/tree.snap' ..//a"
+
+
+# --- Edge cases
+fails "'$ACLTOOL' list-access --snapshot='$W/tree.snap' '$T/no-such-file'"
+fails "'$ACLTOOL' who-access -r --snapshot='$W/tree.snap' 'user:$ME' '$T/no-such-file'"
+fails "'$ACLTOOL' who-access -r 'user:no-such-user-4711' '$T'"
+fails "'$ACLTOOL' who-access -r 'no-such-user-4711' '$T'"
+fails "'$ACLTOOL' find-access 'user:$ME:rw ' '$T'"
+fails "'$ACLTOOL' find-access 'user:$ME:rw,' '$T'"
+
+# One line per object, no blank lines in between
+"$ACLTOOL" list-access -r -S fingerprint "$T" >"$W/fp.out" || fail "list-access -S fingerprint: Failed"
+grep -q '^$' "$W/fp.out" && fail "list-access -S fingerprint: Blank lines in output"
+
+# File names that are not valid UTF-8 are escaped per byte in JSON
+printf 'x' >"$T/`printf 'bad\377name'`"
+"$ACLTOOL" sac "owner@:rwx" "$T/`printf 'bad\377name'`" >/dev/null || fail "Setting ACL on non-UTF-8 file name"
+"$ACLTOOL" list-access -S json "$T/`printf 'bad\377name'`" >"$W/json.out" || fail "list-access -S json: Failed"
+grep -q 'bad\\u00ffname' "$W/json.out" || fail "list-access -S json: Invalid UTF-8 not escaped"
+
+exit 0
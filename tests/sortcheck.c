@@ -0,0 +1,198 @@
+/*
+ * sortcheck.c - Compare gacl_sort() with the original qsort() based sort
+ *
+ * Copyright (c) 2019-2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gacl.h"
+
+
+/*
+ * The entry comparator gacl_sort() used with qsort() before it switched
+ * to sort keys. Inherit-only entries compare equal to every entry of the
+ * same class, so the result depends on the sort algorithm. gacl_sort()
+ * follows glibc's qsort() - with glibc the check is against the real
+ * qsort(), elsewhere against old_msort(), a copy of glibc's merge sort.
+ */
+static int
+old_compare(const GACL_ENTRY *a,
+	    const GACL_ENTRY *b) {
+  int v;
+
+
+  v = ((a->flags & GACL_FLAG_INHERITED) ? 1 : 0) - ((b->flags & GACL_FLAG_INHERITED) ? 1 : 0);
+  if (v)
+    return v;
+
+  if ((a->flags & GACL_FLAG_INHERIT_ONLY) || (b->flags & GACL_FLAG_INHERIT_ONLY))
+    return 0;
+
+  v = a->tag.type - b->tag.type;
+  if (v)
+    return v;
+
+  if (a->tag.type == GACL_TAG_TYPE_USER || a->tag.type == GACL_TAG_TYPE_GROUP) {
+    v = (int) (a->tag.ugid - b->tag.ugid);
+    if (v)
+      return v;
+  }
+
+  return b->type - a->type;
+}
+
+#ifdef __GLIBC__
+static int
+old_qsort_compare(const void *a,
+		  const void *b) {
+  return old_compare((const GACL_ENTRY *) a, (const GACL_ENTRY *) b);
+}
+#endif
+
+#ifndef __GLIBC__
+static void
+old_msort(GACL_ENTRY *b,
+	  size_t n,
+	  GACL_ENTRY *t) {
+  GACL_ENTRY *b1, *b2, *tp;
+  size_t n1, n2;
+
+
+  if (n <= 1)
+    return;
+
+  n1 = n/2;
+  n2 = n-n1;
+  b1 = b;
+  b2 = b+n1;
+  old_msort(b1, n1, t);
+  old_msort(b2, n2, t);
+
+  tp = t;
+  while (n1 > 0 && n2 > 0) {
+    if (old_compare(b1, b2) <= 0) {
+      *tp++ = *b1++;
+      --n1;
+    } else {
+      *tp++ = *b2++;
+      --n2;
+    }
+  }
+  if (n1 > 0)
+    memcpy(tp, b1, n1 * sizeof(*tp));
+  memcpy(b, t, (n-n2) * sizeof(*b));
+}
+#endif
+
+
+static void
+random_entry(GACL_ENTRY *ep) {
+  static const GACL_TAG_TYPE tags[] = {
+    GACL_TAG_TYPE_USER_OBJ, GACL_TAG_TYPE_USER, GACL_TAG_TYPE_GROUP_OBJ,
+    GACL_TAG_TYPE_GROUP, GACL_TAG_TYPE_EVERYONE,
+  };
+  static const uid_t ids[] = { 0, 1, 2, 5, 100, 1000, 65534 };
+  static const GACL_ENTRY_TYPE types[] = {
+    GACL_ENTRY_TYPE_ALLOW, GACL_ENTRY_TYPE_ALLOW, GACL_ENTRY_TYPE_DENY, GACL_ENTRY_TYPE_AUDIT,
+  };
+  
+
+  memset(ep, 0, sizeof(*ep));
+  ep->tag.type = tags[random() % 5];
+  if (ep->tag.type == GACL_TAG_TYPE_USER || ep->tag.type == GACL_TAG_TYPE_GROUP) {
+    ep->tag.ugid = ids[random() % 7];
+    snprintf(ep->tag.name, sizeof(ep->tag.name), "%d", (int) ep->tag.ugid);
+  } else
+    ep->tag.ugid = -1;
+
+  ep->perms = random() & GACL_PERM_FULL_SET;
+  if (random() % 4 == 0)
+    ep->flags |= GACL_FLAG_INHERITED;
+  if (random() % 4 == 0)
+    ep->flags |= GACL_FLAG_INHERIT_ONLY|GACL_FLAG_FILE_INHERIT|GACL_FLAG_DIRECTORY_INHERIT;
+  ep->type = types[random() % 4];
+}
+
+
+int
+main(int argc,
+     char **argv) {
+  GACL_ENTRY ev[64];
+#ifndef __GLIBC__
+  GACL_ENTRY tv[64];
+#endif
+  GACL *ap;
+  int i, j, n, rounds = 100000;
+
+
+  if (argc > 1)
+    rounds = atoi(argv[1]);
+  srandom(argc > 2 ? atoi(argv[2]) : 4711);
+
+  for (i = 0; i < rounds; i++) {
+    n = random() % 40;
+    
+    ap = gacl_init(n);
+    if (!ap) {
+      perror("gacl_init");
+      exit(1);
+    }
+    for (j = 0; j < n; j++) {
+      random_entry(&ev[j]);
+      ap->av[j] = ev[j];
+    }
+    ap->ac = n;
+
+#ifdef __GLIBC__
+    qsort(ev, n, sizeof(ev[0]), old_qsort_compare);
+#else
+    old_msort(ev, n, tv);
+#endif
+    if (gacl_sort_inplace_np(ap) < 0) {
+      perror("gacl_sort_inplace_np");
+      exit(1);
+    }
+
+    for (j = 0; j < n; j++)
+      if (memcmp(&ev[j], &ap->av[j], sizeof(ev[j])) != 0) {
+	fprintf(stderr, "sortcheck: Round %d: Entry %d of %d differs\n", i, j, n);
+	exit(1);
+      }
+    
+    gacl_free(ap);
+  }
+
+  return 0;
+}
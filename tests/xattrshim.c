@@ -0,0 +1,78 @@
+/*
+ * xattrshim.c - Keep NFSv4 ACLs in a user xattr, for tests on local Linux filesystems
+ *
+ * Copyright (c) 2019-2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Linux only has NFSv4 ACLs on NFS mounts. Preloading this maps the
+ * "system.nfs4_acl" attribute to "user.nfs4_acl", so that the ACL
+ * code paths can be exercised on any filesystem with user xattrs.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <string.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+
+static const char *
+shim_name(const char *name) {
+  return (name && strcmp(name, "system.nfs4_acl") == 0) ? "user.nfs4_acl" : name;
+}
+
+
+#define SHIM_GET(fun, type)						\
+  ssize_t								\
+  fun(type o, const char *name, void *value, size_t size) {		\
+    static ssize_t (*next)(type, const char *, void *, size_t) = NULL;	\
+    if (!next)								\
+      next = (ssize_t (*)(type, const char *, void *, size_t)) dlsym(RTLD_NEXT, #fun); \
+    return next(o, shim_name(name), value, size);			\
+  }
+
+#define SHIM_SET(fun, type)						\
+  int									\
+  fun(type o, const char *name, const void *value, size_t size, int flags) { \
+    static int (*next)(type, const char *, const void *, size_t, int) = NULL; \
+    if (!next)								\
+      next = (int (*)(type, const char *, const void *, size_t, int)) dlsym(RTLD_NEXT, #fun); \
+    return next(o, shim_name(name), value, size, flags);		\
+  }
+
+SHIM_GET(getxattr, const char *)
+SHIM_GET(lgetxattr, const char *)
+SHIM_GET(fgetxattr, int)
+
+SHIM_SET(setxattr, const char *)
+SHIM_SET(lsetxattr, const char *)
+SHIM_SET(fsetxattr, int)